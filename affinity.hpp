@@ -0,0 +1,78 @@
+#pragma once
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace zodiactest {
+
+/* CPU and NUMA placement of threads.
+   Linux only, elsewhere pinning is a no-op that returns false */
+
+/* "0-3,8,10-11" (format of /sys cpulist files) -> 0,1,2,3,8,10,11;
+   malformed parts are skipped */
+inline std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        int first, last;
+        char dash;
+        std::stringstream range_stream(range);
+        if (!(range_stream >> first))
+            continue;
+        last = first;
+        if (range_stream >> dash && dash == '-' && !(range_stream >> last))
+            continue;
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+/* CPUs of NUMA node, empty if node doesn't exist
+   or system has no NUMA information */
+inline std::vector<int> numaNodeCpus(int node) {
+    std::ifstream file("/sys/devices/system/node/node" +
+                       std::to_string(node) + "/cpulist");
+    std::string list;
+    if (!std::getline(file, list))
+        return {};
+    return parseCpuList(list);
+}
+
+/* restricts calling thread to cpus, false if not supported
+   or none of cpus is available to the process */
+inline bool pinCurrentThread(const std::vector<int>& cpus) {
+#if defined(__linux__)
+    if (cpus.empty())
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+/* CPU calling thread runs on now, -1 if unknown */
+inline int currentCpu() {
+#if defined(__linux__)
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+} // namespace zodiactest
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <cassert>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "messagequeue.hpp"
+
+namespace zodiactest {
+
+/* IMessageQueueEvents adapter that takes wrapped handlers off
+   put/get path.
+   *
+   Queue's thread only records transition under a short lock and
+   wakes dispatcher, handlers run on dispatcher thread or as tasks
+   of caller-supplied executor, one at a time and in order of
+   transitions.
+   *
+   Transitions not dispatched yet are coalesced: on_hwm() repeated
+   by every put above hwm is delivered once, on_hwm() followed by
+   on_lwm() (or on_stop() by on_start()) cancel each other.
+   *
+   Handlers must not throw. With executor adapter has to be owned
+   by std::shared_ptr - scheduled tasks keep it alive */
+class AsyncEvents : public IMessageQueueEvents,
+                    public std::enable_shared_from_this<AsyncEvents> {
+public:
+    using Task = std::function<void()>;
+    /* must not block - it is called on queue's thread */
+    using Executor = std::function<void(Task)>;
+
+    /* dispatches on own thread */
+    explicit AsyncEvents(std::shared_ptr<IMessageQueueEvents> events);
+    /* at most one dispatch task is scheduled at a time */
+    AsyncEvents(std::shared_ptr<IMessageQueueEvents> events,
+                Executor executor);
+
+    AsyncEvents(const AsyncEvents&) = delete;
+    AsyncEvents& operator=(const AsyncEvents&) = delete;
+
+    /* delivers pending transitions before return */
+    ~AsyncEvents() override;
+
+    void on_start() override;
+    void on_hwm() override;
+    void on_lwm() override;
+    void on_stop() override;
+
+    /* waits until every transition posted so far is handled */
+    void flush();
+
+private:
+    enum class Event : int {
+        NONE = 0,
+        START,
+        STOP,
+        HWM,
+        LWM
+    };
+
+    void _post(Event event, Event opposite, Event& last);
+    void _dispatchLoop();
+    void _dispatch(std::unique_lock<std::mutex>& lock);
+    void _deliver(Event event);
+
+    std::shared_ptr<IMessageQueueEvents> _events;
+    Executor _executor;
+    std::mutex _mtx;
+    std::condition_variable _notify;
+    std::condition_variable _idle_notify;
+    std::vector<Event> _pending;
+    std::vector<Event> _dispatched;
+    /* last posted transition of each kind -
+       pending or already delivered */
+    Event _run_state;
+    Event _watermark;
+    bool _dispatching;
+    bool _shutdown;
+    std::thread _thread;
+};
+
+inline AsyncEvents::AsyncEvents(std::shared_ptr<IMessageQueueEvents> events)
+    : AsyncEvents(std::move(events), nullptr) {
+    _thread = std::thread(&AsyncEvents::_dispatchLoop, this);
+}
+
+inline AsyncEvents::AsyncEvents(std::shared_ptr<IMessageQueueEvents> events,
+                                Executor executor)
+    : _events(std::move(events)),
+      _executor(std::move(executor)),
+      _run_state{Event::NONE},
+      _watermark{Event::NONE},
+      _dispatching{false},
+      _shutdown{false} {
+    assert(_events != nullptr);
+    /* coalescing keeps a few transitions at most */
+    _pending.reserve(8);
+    _dispatched.reserve(8);
+}
+
+inline AsyncEvents::~AsyncEvents() {
+    if (_thread.joinable()) {
+        {
+            std::unique_lock<std::mutex> lock(_mtx);
+            _shutdown = true;
+        }
+        _notify.notify_one();
+        _thread.join();
+    }
+}
+
+inline void AsyncEvents::on_start() {
+    _post(Event::START, Event::STOP, _run_state);
+}
+
+inline void AsyncEvents::on_hwm() {
+    _post(Event::HWM, Event::LWM, _watermark);
+}
+
+inline void AsyncEvents::on_lwm() {
+    _post(Event::LWM, Event::HWM, _watermark);
+}
+
+inline void AsyncEvents::on_stop() {
+    _post(Event::STOP, Event::START, _run_state);
+}
+
+inline void AsyncEvents::flush() {
+    std::unique_lock<std::mutex> lock(_mtx);
+    _idle_notify.wait(lock, [this] {
+            return _pending.empty() && !_dispatching;
+        });
+}
+
+inline void AsyncEvents::_post(Event event, Event opposite, Event& last) {
+    std::unique_lock<std::mutex> lock(_mtx);
+    if (last == event) {
+        /* nothing changed since last posted transition */
+        return;
+    }
+    last = event;
+    if (!_pending.empty() && _pending.back() == opposite) {
+        /* undoes transition nobody has seen yet */
+        _pending.pop_back();
+        return;
+    }
+    _pending.push_back(event);
+    if (_dispatching) {
+        /* dispatcher picks it up before going idle */
+        return;
+    }
+    if (!_executor) {
+        lock.unlock();
+        _notify.notify_one();
+        return;
+    }
+    _dispatching = true;
+    lock.unlock();
+    _executor([self = shared_from_this()] {
+            std::unique_lock<std::mutex> lock(self->_mtx);
+            self->_dispatch(lock);
+        });
+}
+
+inline void AsyncEvents::_dispatchLoop() {
+    std::unique_lock<std::mutex> lock(_mtx);
+    while (true) {
+        _notify.wait(lock, [this] {
+                return _shutdown || !_pending.empty();
+            });
+        if (_pending.empty()) {
+            /* shutdown with nothing left */
+            return;
+        }
+        _dispatching = true;
+        _dispatch(lock);
+    }
+}
+
+/* called locked with _dispatching set, delivers
+   until nothing is pending and clears _dispatching */
+inline void AsyncEvents::_dispatch(std::unique_lock<std::mutex>& lock) {
+    while (!_pending.empty()) {
+        _dispatched.swap(_pending);
+        lock.unlock();
+        for (auto event : _dispatched) {
+            _deliver(event);
+        }
+        _dispatched.clear();
+        lock.lock();
+    }
+    _dispatching = false;
+    _idle_notify.notify_all();
+}
+
+inline void AsyncEvents::_deliver(Event event) {
+    switch (event) {
+    case Event::START:
+        _events->on_start();
+        break;
+    case Event::STOP:
+        _events->on_stop();
+        break;
+    case Event::HWM:
+        _events->on_hwm();
+        break;
+    case Event::LWM:
+        _events->on_lwm();
+        break;
+    case Event::NONE:
+        break;
+    }
+}
+
+} // namespace zodiactest
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace zodiactest {
+namespace bench {
+
+using Clock = std::chrono::steady_clock;
+
+class Stopwatch {
+public:
+    Stopwatch() : _start(Clock::now()) {}
+
+    double seconds() const {
+        return std::chrono::duration<double>(Clock::now() - _start).count();
+    }
+    
+private:
+    Clock::time_point _start;
+};
+
+inline void printRow(const std::string& name, long long messages,
+                     double seconds) {
+    std::printf("%-32s %12lld msgs %10.3f s %14.0f msgs/s\n",
+                name.c_str(), messages, seconds,
+                static_cast<double>(messages) / seconds);
+}
+
+/* nearest-rank percentile, sorts samples */
+inline long long percentile(std::vector<long long>& samples, double p) {
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    auto rank = static_cast<size_t>(p / 100.0 *
+                                    static_cast<double>(samples.size()));
+    return samples[std::min(rank, samples.size() - 1)];
+}
+
+inline long long nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count();
+}
+
+} // namespace bench
+} // namespace zodiactest
@@ -0,0 +1,87 @@
+/* Heap allocations per message for put(const&), put(&&) and emplace().
+   Payload is longer than std::string SSO buffer, so every string
+   construction or copy costs exactly one allocation */
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#include "bench.hpp"
+#include "messagequeue.hpp"
+
+namespace {
+
+std::atomic<long long> g_allocs{0};
+
+} // namespace
+
+void* operator new(std::size_t size) {
+    ++g_allocs;
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr int ROUNDS = 1000;
+constexpr size_t PAYLOAD = 64;
+
+template<typename PutFunc>
+void run(const char* name, PutFunc putFunc) {
+    MessageQueue<std::string> q(QUEUE_SIZE, 0, QUEUE_SIZE);
+    q.run();
+    std::string out;
+    out.reserve(PAYLOAD);
+    /* warm up deque chunks and map node */
+    for (int i = 0; i != QUEUE_SIZE; i++)
+        putFunc(q);
+    for (int i = 0; i != QUEUE_SIZE; i++)
+        q.get(&out);
+
+    auto before = g_allocs.load();
+    bench::Stopwatch sw;
+    for (int r = 0; r != ROUNDS; r++) {
+        for (int i = 0; i != QUEUE_SIZE; i++)
+            putFunc(q);
+        for (int i = 0; i != QUEUE_SIZE; i++)
+            q.get(&out);
+    }
+    auto seconds = sw.seconds();
+    long long messages = static_cast<long long>(ROUNDS) * QUEUE_SIZE;
+    char row[64];
+    std::snprintf(row, sizeof(row), "%-12s %5.2f allocs/msg", name,
+                  static_cast<double>(g_allocs - before) /
+                  static_cast<double>(messages));
+    bench::printRow(row, messages, seconds);
+}
+
+} // namespace
+
+int main() {
+    run("put(const&)", [](MessageQueue<std::string>& q) {
+            std::string msg(PAYLOAD, 'x');
+            q.put(msg, 0);
+        });
+    run("put(&&)", [](MessageQueue<std::string>& q) {
+            std::string msg(PAYLOAD, 'x');
+            q.put(std::move(msg), 0);
+        });
+    run("emplace()", [](MessageQueue<std::string>& q) {
+            q.emplace(0, PAYLOAD, 'x');
+        });
+    return 0;
+}
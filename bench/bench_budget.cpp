@@ -0,0 +1,91 @@
+/* Bursty traffic of std::string messages from 16 B to 1 MB
+   (log-uniform): 1 writer puts bursts of 256 messages with pauses,
+   1 reader checksums payloads slower than the burst rate.
+   Queue of 256 messages vs ByteBudget of 16 MB on elastic
+   storage - peak payload bytes held by the queue and throughput */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_MESSAGES = 1024;
+constexpr int BUDGET = 8 << 20;
+constexpr int BURSTS = 16;
+constexpr int BURST = 256;
+constexpr auto PAUSE = std::chrono::milliseconds(20);
+
+std::vector<size_t> messageSizes() {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> exponent(4, 20);
+    std::vector<size_t> sizes;
+    for (int i = 0; i != BURSTS * BURST; i++)
+        sizes.push_back(static_cast<size_t>(std::exp2(exponent(rng))));
+    return sizes;
+}
+
+template<typename Queue>
+void run(const char* name, Queue& q, const std::vector<size_t>& sizes) {
+    q.run();
+    std::atomic<long long> held{0};
+    std::atomic<long long> peak{0};
+    std::thread reader([&] {
+            std::string message;
+            unsigned checksum = 0;
+            while (q.get(&message) == RetCode::OK) {
+                for (size_t i = 0; i < message.size(); i += 16)
+                    checksum += static_cast<unsigned char>(message[i]);
+                held -= static_cast<long long>(message.size());
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+            std::printf("%32s checksum %u\n", "", checksum);
+        });
+    bench::Stopwatch sw;
+    for (int burst = 0; burst != BURSTS; burst++) {
+        for (int i = 0; i != BURST; i++) {
+            auto size = sizes[static_cast<size_t>(burst * BURST + i)];
+            auto now = held += static_cast<long long>(size);
+            long long seen = peak.load();
+            while (now > seen && !peak.compare_exchange_weak(seen, now)) {}
+            q.put(std::string(size, static_cast<char>('a' + i % 26)), 0);
+        }
+        std::this_thread::sleep_for(PAUSE);
+    }
+    while (q.size())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    auto seconds = sw.seconds();
+    q.stop();
+    reader.join();
+    bench::printRow(name, BURSTS * BURST, seconds);
+    /* counted before put - includes one message the writer holds */
+    std::printf("%32s peak payload in flight %8.1f MB\n", "",
+                static_cast<double>(peak.load()) / (1 << 20));
+}
+
+} // namespace
+
+int main() {
+    auto sizes = messageSizes();
+    {
+        MessageQueue<std::string, PriorityLevels<1>>
+            q(QUEUE_MESSAGES, 0, QUEUE_MESSAGES);
+        run("1024 messages", q, sizes);
+    }
+    {
+        MessageQueue<std::string, ByteBudget<ElasticLevels<1>>>
+            q(BUDGET, 0, BUDGET, std::chrono::milliseconds(100));
+        run("ByteBudget 8 MB, elastic", q, sizes);
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+/* Multi-kilobyte payloads through the queue: std::string copied
+   in, std::string moved in, and MessageBuffer handles over pooled
+   slab. One writer fills payload, one reader looks at it */
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+
+#include "bench.hpp"
+#include "message_buffer.hpp"
+#include "messagequeue.hpp"
+
+namespace {
+
+std::atomic<long long> g_allocs{0};
+
+} // namespace
+
+void* operator new(std::size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr long long MESSAGES = 1 << 18;
+
+/* reader reads first and last byte */
+long long touch(const char* data, size_t size) {
+    return data[0] + data[size - 1];
+}
+
+template<typename Message, typename Make, typename View>
+void run(const char* name, size_t payload, Make make, View view) {
+    MessageQueue<Message, PooledPriorityMap> q(QUEUE_SIZE, 0, QUEUE_SIZE);
+    q.run();
+    long long sum = 0;
+    std::thread reader([&q, &sum, view] {
+            Message msg;
+            for (long long i = 0; i != MESSAGES; i++) {
+                q.get(&msg);
+                auto bytes = view(msg);
+                sum += touch(bytes.data(), bytes.size());
+            }
+        });
+
+    auto allocs = g_allocs.load();
+    bench::Stopwatch sw;
+    for (long long i = 0; i != MESSAGES; i++)
+        make(q, static_cast<char>('a' + i % 26));
+    reader.join();
+    auto seconds = sw.seconds();
+    allocs = g_allocs.load() - allocs;
+
+    char row[64];
+    std::snprintf(row, sizeof(row), "%-9s %5zuB %4.2f allocs/msg", name,
+                  payload, static_cast<double>(allocs) /
+                  static_cast<double>(MESSAGES));
+    bench::printRow(row, MESSAGES, seconds);
+    if (sum == 0)
+        std::printf("unexpected checksum\n");
+}
+
+void compare(size_t payload) {
+    using StringQueue = MessageQueue<std::string, PooledPriorityMap>;
+    using BufferQueue = MessageQueue<MessageBuffer, PooledPriorityMap>;
+    auto string_bytes = [](const std::string& msg) {
+        return std::string_view(msg);
+    };
+    run<std::string>("copy", payload, [payload](StringQueue& q, char c) {
+            std::string msg(payload, c);
+            q.put(msg, 0);
+        }, string_bytes);
+    run<std::string>("move", payload, [payload](StringQueue& q, char c) {
+            q.put(std::string(payload, c), 0);
+        }, string_bytes);
+
+    /* queue, one buffer held by writer, one by reader */
+    BufferPool pool(payload, QUEUE_SIZE + 2);
+    run<MessageBuffer>("buffer", payload, [&pool, payload](BufferQueue& q,
+                                                          char c) {
+            auto msg = pool.acquire();
+            std::memset(msg.data(), c, payload);
+            msg.resize(payload);
+            q.put(std::move(msg), 0);
+        }, [](const MessageBuffer& msg) {
+            return msg.view();
+        });
+}
+
+} // namespace
+
+int main() {
+    compare(256);
+    compare(4096);
+    compare(16384);
+    return 0;
+}
@@ -0,0 +1,63 @@
+/* Single-message put/get vs put_bulk/get_bulk throughput,
+   one writer and one reader, batch sizes 1..1024 */
+
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 4096;
+constexpr long long MESSAGES = 1 << 21;
+
+double runSingle() {
+    MessageQueue<int> q(QUEUE_SIZE, 0, QUEUE_SIZE);
+    q.run();
+    bench::Stopwatch sw;
+    std::thread reader([&q] {
+            int val;
+            for (long long i = 0; i != MESSAGES; i++)
+                q.get(&val);
+        });
+    for (long long i = 0; i != MESSAGES; i++)
+        q.put(static_cast<int>(i), 0);
+    reader.join();
+    return sw.seconds();
+}
+
+double runBulk(int batch) {
+    MessageQueue<int> q(QUEUE_SIZE, 0, QUEUE_SIZE);
+    q.run();
+    std::vector<int> in(static_cast<size_t>(batch));
+    bench::Stopwatch sw;
+    std::thread reader([&q, batch] {
+            std::vector<int> out(static_cast<size_t>(batch));
+            long long got = 0;
+            while (got != MESSAGES) {
+                int got_num;
+                q.get_bulk(out.begin(), batch, &got_num);
+                got += got_num;
+            }
+        });
+    for (long long i = 0; i < MESSAGES; i += batch)
+        q.put_bulk(in.begin(), in.end(), 0);
+    reader.join();
+    return sw.seconds();
+}
+
+} // namespace
+
+int main() {
+    bench::printRow("put/get", MESSAGES, runSingle());
+    for (int batch = 1; batch <= 1024; batch *= 2) {
+        bench::printRow("put_bulk/get_bulk batch=" + std::to_string(batch),
+                        MESSAGES, runBulk(batch));
+    }
+    return 0;
+}
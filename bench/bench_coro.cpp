@@ -0,0 +1,93 @@
+/* 100k consumer coroutines parked in async_get on a pool of 4
+   threads vs 4 reader threads blocking in get, 2 writer threads
+   put in both cases. Built as C++20, see Makefile */
+
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "coroutine.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr int POOL_THREADS = 4;
+constexpr int CONSUMERS = 100000;
+constexpr int WRITERS = 2;
+constexpr int MESSAGES = 1 << 21;
+
+using Queue = MessageQueue<int, PriorityLevels<4>>;
+
+Task consume(Queue& q, CoroutinePool& pool, std::atomic<int>& got,
+             std::atomic<int>& finished) {
+    co_await pool.schedule();
+    int val;
+    while (co_await q.async_get(&val, pool) == RetCode::OK)
+        got.fetch_add(1, std::memory_order_relaxed);
+    finished.fetch_add(1, std::memory_order_relaxed);
+}
+
+template<typename StartReaders>
+double run(Queue& q, std::atomic<int>& got, StartReaders start_readers) {
+    q.run();
+    start_readers();
+    bench::Stopwatch sw;
+    std::vector<std::thread> writers;
+    for (int t = 0; t != WRITERS; t++) {
+        writers.emplace_back([&q] {
+                for (int i = 0; i != MESSAGES / WRITERS; i++)
+                    q.put(i, i % 4);
+            });
+    }
+    for (auto& writer : writers)
+        writer.join();
+    while (got.load(std::memory_order_relaxed) != MESSAGES)
+        std::this_thread::yield();
+    return sw.seconds();
+}
+
+} // namespace
+
+int main() {
+    {
+        Queue q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        std::atomic<int> got{0};
+        std::atomic<int> finished{0};
+        CoroutinePool pool(POOL_THREADS);
+        auto seconds = run(q, got, [&] {
+                for (int i = 0; i != CONSUMERS; i++)
+                    consume(q, pool, got, finished);
+            });
+        bench::printRow("100k coroutines, 4 threads", MESSAGES, seconds);
+        bench::Stopwatch sw;
+        q.stop();
+        while (finished.load(std::memory_order_relaxed) != CONSUMERS)
+            std::this_thread::yield();
+        std::printf("%32s stop resumed %d consumers in %.3f s\n", "",
+                    CONSUMERS, sw.seconds());
+    }
+    {
+        Queue q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        std::atomic<int> got{0};
+        std::vector<std::thread> readers;
+        auto seconds = run(q, got, [&] {
+                for (int t = 0; t != POOL_THREADS; t++) {
+                    readers.emplace_back([&] {
+                            int val;
+                            while (q.get(&val) == RetCode::OK)
+                                got.fetch_add(1, std::memory_order_relaxed);
+                        });
+                }
+            });
+        bench::printRow("4 blocking reader threads", MESSAGES, seconds);
+        q.stop();
+        for (auto& reader : readers)
+            reader.join();
+    }
+    return 0;
+}
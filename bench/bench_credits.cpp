@@ -0,0 +1,179 @@
+/* Stop-the-world watermarks (on_hwm blocks writer until on_lwm,
+   as Writer::suspendAll() used to) vs per-producer credit windows.
+   4 writers, 1 slower reader. Prints put latency (credit wait
+   included) and reader throughput per 5 ms interval - its
+   coefficient of variation shows the oscillation */
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "flow_control.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr int LWM = QUEUE_SIZE / 4;
+constexpr int HWM = QUEUE_SIZE * 3 / 4;
+constexpr int MAX_GRANT = 64;
+constexpr int WRITERS = 4;
+constexpr int MESSAGES = 1 << 19;
+constexpr long long INTERVAL_NS = 5 * 1000 * 1000;
+
+class StopTheWorldEvents : public IMessageQueueEvents {
+public:
+    explicit StopTheWorldEvents(MessageQueue<int>* q) : _q{q} {}
+
+    void on_start() override {
+        _resume();
+    }
+    void on_stop() override {
+        _resume();
+    }
+    void on_hwm() override {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _suspended = true;
+        /* on_lwm() may come before this writer gets here
+           and it would sleep forever - recheck queue size */
+        while (!_notify.wait_for(lock, std::chrono::milliseconds(1), [this] {
+                    return !_suspended;
+                })) {
+            if (_q->size() <= LWM)
+                break;
+        }
+    }
+    void on_lwm() override {
+        _resume();
+    }
+
+private:
+    void _resume() {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _suspended = false;
+        _notify.notify_all();
+    }
+
+    MessageQueue<int>* _q;
+    std::mutex _mtx;
+    std::condition_variable _notify;
+    bool _suspended = false;
+};
+
+class CreditEvents : public IMessageQueueEvents {
+public:
+    explicit CreditEvents(std::shared_ptr<CreditGate> gate)
+        : _gate(std::move(gate)) {}
+
+    void on_start() override {
+        _gate->open();
+    }
+    void on_stop() override {
+        _gate->close();
+    }
+    void on_hwm() override {
+        _gate->shrink();
+    }
+    void on_lwm() override {
+        _gate->restore();
+    }
+
+private:
+    std::shared_ptr<CreditGate> _gate;
+};
+
+/* reader's work per message */
+void work() {
+    for (volatile int i = 0; i != 50; i = i + 1) {}
+}
+
+void run(const char* name, std::shared_ptr<CreditGate> gate) {
+    MessageQueue<int> q(QUEUE_SIZE, LWM, HWM);
+    if (gate)
+        q.setEvents(std::make_shared<CreditEvents>(gate));
+    else
+        q.setEvents(std::make_shared<StopTheWorldEvents>(&q));
+    q.run();
+
+    auto start = bench::nowNs();
+    std::vector<long long> intervals;
+    std::thread reader([&q, &gate, &intervals, start] {
+            int val;
+            for (int i = 0; i != MESSAGES; i++) {
+                q.get(&val);
+                if (gate)
+                    gate->release(1);
+                work();
+                auto interval = static_cast<size_t>(
+                    (bench::nowNs() - start) / INTERVAL_NS);
+                if (interval >= intervals.size())
+                    intervals.resize(interval + 1);
+                ++intervals[interval];
+            }
+        });
+
+    std::vector<std::vector<long long>> latencies(WRITERS);
+    std::vector<std::thread> writers;
+    for (int w = 0; w != WRITERS; w++) {
+        writers.emplace_back([&q, &gate, &latencies, w] {
+                auto& lat = latencies[static_cast<size_t>(w)];
+                lat.reserve(MESSAGES / WRITERS);
+                std::unique_ptr<CreditWindow> credits;
+                if (gate)
+                    credits.reset(new CreditWindow(gate));
+                for (int i = 0; i != MESSAGES / WRITERS; i++) {
+                    auto t = bench::nowNs();
+                    if (credits)
+                        credits->take();
+                    q.put(i, 0);
+                    lat.push_back(bench::nowNs() - t);
+                }
+            });
+    }
+    for (auto& writer : writers)
+        writer.join();
+    reader.join();
+    auto seconds = static_cast<double>(bench::nowNs() - start) / 1e9;
+    q.stop();
+
+    std::vector<long long> all;
+    for (auto& lat : latencies)
+        all.insert(all.end(), lat.begin(), lat.end());
+    /* last interval is partial */
+    if (intervals.size() > 1)
+        intervals.pop_back();
+    double mean = 0;
+    for (auto n : intervals)
+        mean += static_cast<double>(n);
+    mean /= static_cast<double>(intervals.size());
+    double var = 0;
+    for (auto n : intervals)
+        var += (static_cast<double>(n) - mean) *
+            (static_cast<double>(n) - mean);
+    var /= static_cast<double>(intervals.size());
+
+    bench::printRow(name, MESSAGES, seconds);
+    std::printf("  put ns p50 %lld p99 %lld p99.9 %lld max %lld\n",
+                bench::percentile(all, 50), bench::percentile(all, 99),
+                bench::percentile(all, 99.9), bench::percentile(all, 100));
+    std::printf("  msgs per 5 ms: mean %.0f min %lld max %lld cv %.2f\n",
+                mean, bench::percentile(intervals, 0),
+                bench::percentile(intervals, 100), std::sqrt(var) / mean);
+}
+
+} // namespace
+
+int main() {
+    run("stop-the-world", nullptr);
+    run("credits", std::make_shared<CreditGate>(QUEUE_SIZE, MAX_GRANT));
+    return 0;
+}
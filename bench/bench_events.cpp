@@ -0,0 +1,89 @@
+/* put latency with slow on_hwm handler (1 ms) called inline vs
+   dispatched by AsyncEvents. Queue oscillates between watermarks,
+   inline handler stalls writer on every put above hwm */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_events.hpp"
+#include "bench.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr int MESSAGES = 1 << 17;
+
+class SlowEvents : public IMessageQueueEvents {
+public:
+    void on_start() override {}
+    void on_stop() override {}
+    void on_hwm() override {
+        ++hwm_num;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    void on_lwm() override {}
+
+    std::atomic<int> hwm_num{0};
+};
+
+void run(const char* name, bool async) {
+    MessageQueue<int> q(QUEUE_SIZE, QUEUE_SIZE / 4, QUEUE_SIZE * 3 / 4);
+    auto handlers = std::make_shared<SlowEvents>();
+    std::shared_ptr<AsyncEvents> async_events;
+    if (async) {
+        async_events = std::make_shared<AsyncEvents>(handlers);
+        q.setEvents(async_events);
+    } else {
+        q.setEvents(handlers);
+    }
+    q.run();
+
+    std::thread reader([&q] {
+            int val;
+            for (int i = 0; i != MESSAGES; i++) {
+                q.get(&val);
+                /* reader is slower - queue reaches hwm */
+                if (i % 256 == 0)
+                    std::this_thread::sleep_for(
+                        std::chrono::microseconds(50));
+            }
+        });
+
+    std::vector<long long> latencies;
+    latencies.reserve(MESSAGES);
+    bench::Stopwatch sw;
+    for (int i = 0; i != MESSAGES; i++) {
+        auto start = bench::nowNs();
+        q.put(i, 0);
+        latencies.push_back(bench::nowNs() - start);
+    }
+    reader.join();
+    auto seconds = sw.seconds();
+    if (async_events)
+        async_events->flush();
+
+    std::printf("%-8s hwm calls %6d  put ns p50 %6lld p99 %8lld "
+                "p99.9 %8lld max %8lld\n", name, handlers->hwm_num.load(),
+                bench::percentile(latencies, 50),
+                bench::percentile(latencies, 99),
+                bench::percentile(latencies, 99.9),
+                bench::percentile(latencies, 100));
+    bench::printRow(name, MESSAGES, seconds);
+    q.stop();
+}
+
+} // namespace
+
+int main() {
+    run("inline", false);
+    run("async", true);
+    return 0;
+}
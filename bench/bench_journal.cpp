@@ -0,0 +1,102 @@
+/* Cost of the journal: put/get throughput of 2 writers and
+   2 readers with 64 byte string messages in memory, journaled
+   with page cache only, with background group commit every
+   10 ms, and with sync() after every put (writers share msyncs).
+   Journal lives in a temporary directory under $TMPDIR or /tmp */
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "journal.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr int THREADS = 2;
+constexpr int MESSAGES = 1 << 20;
+/* every one waits for the disk */
+constexpr int SYNCED_MESSAGES = 1 << 12;
+constexpr size_t MESSAGE_SIZE = 64;
+
+using Durable = MessageQueue<std::string, Journaled<PriorityMap>>;
+
+template<typename Queue, typename AfterPut>
+double run(Queue& q, int messages, AfterPut after_put) {
+    q.run();
+    const std::string message(MESSAGE_SIZE, 'x');
+    bench::Stopwatch sw;
+    std::vector<std::thread> threads;
+    for (int t = 0; t != THREADS; t++) {
+        threads.emplace_back([&, t] {
+                for (int i = 0; i != messages / THREADS; i++) {
+                    q.put(message, (i + t) % 4);
+                    after_put();
+                }
+            });
+        threads.emplace_back([&q, messages] {
+                std::string val;
+                for (int i = 0; i != messages / THREADS; i++)
+                    q.get(&val);
+            });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    return sw.seconds();
+}
+
+std::string tempDir() {
+    auto tmp = std::getenv("TMPDIR");
+    std::string dir = std::string(tmp ? tmp : "/tmp") + "/bench_journal_XXXXXX";
+    if (!mkdtemp(&dir[0])) {
+        std::perror("mkdtemp");
+        std::exit(1);
+    }
+    return dir;
+}
+
+template<typename AfterPut>
+double runDurable(std::chrono::milliseconds sync_interval, int messages,
+                  AfterPut after_put) {
+    JournalConfig config;
+    config.dir = tempDir();
+    config.sync_interval = sync_interval;
+    double seconds;
+    {
+        auto journal = std::make_shared<Journal>(config);
+        Durable q(QUEUE_SIZE, 0, QUEUE_SIZE, journal);
+        seconds = run(q, messages, [&] { after_put(*journal); });
+    }
+    std::filesystem::remove_all(config.dir);
+    return seconds;
+}
+
+} // namespace
+
+int main() {
+    using std::chrono::milliseconds;
+
+    MessageQueue<std::string> plain(QUEUE_SIZE, 0, QUEUE_SIZE);
+    auto memory = run(plain, MESSAGES, [] {});
+    bench::printRow("in memory", MESSAGES, memory);
+
+    auto cached = runDurable(milliseconds(0), MESSAGES, [](Journal&) {});
+    bench::printRow("journal, page cache", MESSAGES, cached);
+    auto interval = runDurable(milliseconds(10), MESSAGES, [](Journal&) {});
+    bench::printRow("journal, sync every 10 ms", MESSAGES, interval);
+    auto synced = runDurable(milliseconds(0), SYNCED_MESSAGES,
+                             [](Journal& journal) { journal.sync(); });
+    bench::printRow("journal, sync every put", SYNCED_MESSAGES, synced);
+
+    std::printf("slowdown: page cache %.2fx, 10 ms group commit %.2fx\n",
+                cached / memory, interval / memory);
+    return 0;
+}
@@ -0,0 +1,76 @@
+/* MessageQueue vs lock-free SPSC/MPMC queues, N writers and
+   N readers, throughput and put-to-get latency percentiles */
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "lockfree_queue.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr long long MESSAGES = 1 << 21;
+constexpr int SAMPLE_EVERY = 64;
+
+template<typename Queue>
+void run(const std::string& name, int threads) {
+    Queue q(QUEUE_SIZE, 0, QUEUE_SIZE);
+    q.run();
+    std::atomic<long long> got{0};
+    std::mutex samples_mtx;
+    std::vector<long long> samples;
+    std::vector<std::thread> workers;
+
+    bench::Stopwatch sw;
+    for (int t = 0; t != threads; t++) {
+        workers.emplace_back([&q, threads] {
+                for (long long i = 0; i < MESSAGES / threads; i++)
+                    q.put(bench::nowNs(), 0);
+            });
+        workers.emplace_back([&] {
+                std::vector<long long> local;
+                long long sent;
+                long long n = 0;
+                while (q.get(&sent) == RetCode::OK) {
+                    if (n++ % SAMPLE_EVERY == 0)
+                        local.push_back(bench::nowNs() - sent);
+                    ++got;
+                }
+                std::lock_guard<std::mutex> lock(samples_mtx);
+                samples.insert(samples.end(), local.begin(), local.end());
+            });
+    }
+    long long total = MESSAGES / threads * threads;
+    while (got != total)
+        std::this_thread::yield();
+    auto seconds = sw.seconds();
+    q.stop();
+    for (auto& worker : workers)
+        worker.join();
+
+    bench::printRow(name + " threads=" + std::to_string(threads),
+                    total, seconds);
+    std::printf("%32s p50 %8lld ns  p99 %8lld ns  p99.9 %8lld ns\n", "",
+                bench::percentile(samples, 50),
+                bench::percentile(samples, 99),
+                bench::percentile(samples, 99.9));
+}
+
+} // namespace
+
+int main() {
+    run<SpscMessageQueue<long long>>("SpscMessageQueue", 1);
+    for (int threads = 1; threads <= 16; threads *= 2) {
+        run<MessageQueue<long long, PriorityLevels<1>>>("MessageQueue",
+                                                        threads);
+        run<MpmcMessageQueue<long long>>("MpmcMessageQueue", threads);
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+/* Cost of a per-message trace call: std::clog with string
+   concatenation (what logConsole() did) vs Logger::log(),
+   enabled and filtered out. Both write to /dev/null.
+   Prints ns per call of every round of every caller thread */
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "logger.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int THREADS = 2;
+/* below ring capacity - nothing is dropped
+   even if flusher doesn't get CPU */
+constexpr int CALLS = 4000;
+constexpr int ROUNDS = 50;
+
+const std::string NAME = "Reader";
+constexpr std::string_view MESSAGE = "Writer0 string #123456";
+
+template<typename Call>
+void run(const char* name, Call call) {
+    std::vector<std::vector<long long>> ns(THREADS);
+    std::vector<std::thread> threads;
+    for (int t = 0; t != THREADS; t++) {
+        threads.emplace_back([&call, &ns, t] {
+                for (int round = 0; round != ROUNDS; round++) {
+                    auto start = bench::nowNs();
+                    for (int i = 0; i != CALLS; i++)
+                        call(i);
+                    ns[static_cast<size_t>(t)].push_back(
+                        (bench::nowNs() - start) / CALLS);
+                    /* room for the next round */
+                    Logger::instance().flush();
+                }
+            });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    std::vector<long long> per_call;
+    for (auto& n : ns)
+        per_call.insert(per_call.end(), n.begin(), n.end());
+    std::printf("%-20s ns per call p50 %5lld p90 %5lld max %5lld\n", name,
+                bench::percentile(per_call, 50),
+                bench::percentile(per_call, 90),
+                bench::percentile(per_call, 100));
+}
+
+} // namespace
+
+int main() {
+    std::ofstream null_stream("/dev/null");
+    auto clog_buf = std::clog.rdbuf(null_stream.rdbuf());
+    run("clog", [](int) {
+            std::clog << NAME + " read >>> " + std::string(MESSAGE) + "\n";
+        });
+    std::clog.rdbuf(clog_buf);
+
+    FILE* null_file = std::fopen("/dev/null", "w");
+    auto& logger = Logger::instance();
+    logger.setSink(null_file);
+    logger.setLevel(LogLevel::Trace);
+    run("logger", [](int i) {
+            logTrace("{} read >>> {} {}", NAME, MESSAGE, i);
+        });
+    logger.setLevel(LogLevel::Info);
+    run("logger filtered", [](int i) {
+            logTrace("{} read >>> {} {}", NAME, MESSAGE, i);
+        });
+    std::printf("dropped %llu\n",
+                static_cast<unsigned long long>(logger.dropped()));
+    logger.flush();
+    std::fclose(null_file);
+    return 0;
+}
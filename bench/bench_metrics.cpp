@@ -0,0 +1,70 @@
+/* Cost of QueueMetrics: put/get throughput of 2 writers and
+   2 readers with metrics on and compiled out, then the snapshot
+   of the instrumented run */
+
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr int THREADS = 2;
+constexpr int MESSAGES = 1 << 20;
+
+template<typename Queue>
+double run(Queue& q) {
+    q.run();
+    bench::Stopwatch sw;
+    std::vector<std::thread> threads;
+    for (int t = 0; t != THREADS; t++) {
+        threads.emplace_back([&q, t] {
+                for (int i = 0; i != MESSAGES / THREADS; i++)
+                    q.put(i, (i + t) % 4);
+            });
+        threads.emplace_back([&q] {
+                int val;
+                for (int i = 0; i != MESSAGES / THREADS; i++)
+                    q.get(&val);
+            });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    return sw.seconds();
+}
+
+} // namespace
+
+int main() {
+    MessageQueue<int, PriorityMap, NoMetrics> plain(QUEUE_SIZE, 0,
+                                                    QUEUE_SIZE);
+    bench::printRow("NoMetrics", MESSAGES, run(plain));
+    MessageQueue<int, PriorityMap, QueueMetrics> q(QUEUE_SIZE, 0,
+                                                   QUEUE_SIZE);
+    bench::printRow("QueueMetrics", MESSAGES, run(q));
+
+    auto snap = q.metrics().snapshot();
+    for (int p = 0; p != 4; p++) {
+        std::printf("  priority %d enqueued %llu dequeued %llu\n", p,
+                    static_cast<unsigned long long>(
+                        snap.enqueued[static_cast<size_t>(p)]),
+                    static_cast<unsigned long long>(
+                        snap.dequeued[static_cast<size_t>(p)]));
+    }
+    std::printf("  put waits %llu (%.1f ms), get waits %llu (%.1f ms), "
+                "lock contentions %llu\n",
+                static_cast<unsigned long long>(snap.put_waits),
+                snap.put_blocked_ns / 1e6,
+                static_cast<unsigned long long>(snap.get_waits),
+                snap.get_blocked_ns / 1e6,
+                static_cast<unsigned long long>(snap.lock_contentions));
+    std::printf("  latency ns p50 %.0f p99 %.0f p99.9 %.0f max %.0f\n",
+                snap.latency.percentile(50), snap.latency.percentile(99),
+                snap.latency.percentile(99.9), snap.latency.max());
+    return 0;
+}
@@ -0,0 +1,81 @@
+/* Pipelined ReaderPool workers: 2 writers put 256 byte
+   MessageBuffers from a pool much larger than cache, 1 reader
+   sums every payload. Plain get_bulk worker vs fetch/handle
+   pipeline without and with payload prefetch */
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "message_buffer.hpp"
+#include "messagequeue.hpp"
+#include "reader_pool.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 4096;
+constexpr size_t MESSAGE_SIZE = 256;
+/* 64 MB of payloads */
+constexpr size_t BUFFERS = 1 << 18;
+constexpr int WRITERS = 2;
+constexpr int MESSAGES = 1 << 21;
+constexpr int CHUNK = 32;
+
+using Queue = MessageQueue<MessageBuffer, PriorityLevels<1>>;
+
+struct Handler {
+    void operator()(const MessageBuffer& msg) {
+        unsigned sum = 0;
+        for (char c : msg.view())
+            sum += static_cast<unsigned char>(c);
+        checksum->fetch_add(sum, std::memory_order_relaxed);
+        handled->fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::atomic<unsigned>* checksum;
+    std::atomic<int>* handled;
+};
+
+void run(const char* name, int chunk_size, int prefetch_distance) {
+    auto pool = std::make_shared<BufferPool>(MESSAGE_SIZE, BUFFERS);
+    auto q = std::make_shared<Queue>(QUEUE_SIZE, 0, QUEUE_SIZE);
+    q->run();
+    std::atomic<unsigned> checksum{0};
+    std::atomic<int> handled{0};
+    ReaderPool<Queue, Handler> readers(q, Handler{&checksum, &handled},
+                                       1, CHUNK);
+    readers.setPipeline(chunk_size, prefetch_distance);
+    bench::Stopwatch sw;
+    readers.run();
+    std::vector<std::thread> writers;
+    for (int t = 0; t != WRITERS; t++) {
+        writers.emplace_back([&, t] {
+                for (int i = 0; i != MESSAGES / WRITERS; i++) {
+                    auto msg = pool->acquire();
+                    msg.resize(MESSAGE_SIZE);
+                    msg.data()[0] = static_cast<char>(i + t);
+                    q->put(std::move(msg), 0);
+                }
+            });
+    }
+    for (auto& writer : writers)
+        writer.join();
+    while (handled.load() != MESSAGES)
+        std::this_thread::yield();
+    bench::printRow(name, MESSAGES, sw.seconds());
+    readers.stop();
+}
+
+} // namespace
+
+int main() {
+    run("get_bulk 32", 0, 0);
+    run("pipeline 32, no prefetch", CHUNK, 0);
+    run("pipeline 32, prefetch 4", CHUNK, 4);
+    return 0;
+}
@@ -0,0 +1,155 @@
+/* Compile-time policies: one thread puts 64 ints, then gets them,
+   over and over. Hand-rolled ring and bare storage vs MessageQueue
+   with everything compiled away (NoMetrics, NoLock, NoEvents) and
+   with each policy brought back - what every one of them costs
+   per message. NoLock NoEvents queue is storage behind state
+   and room checks - runs as fast as the storage alone */
+
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "bench.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 256;
+constexpr int BURST = 64;
+constexpr int MESSAGES = 1 << 25;
+
+/* what one would write instead of the queue:
+   bounded, so full/empty are checked */
+class Ring {
+public:
+    bool push(int message) {
+        if (_tail - _head == QUEUE_SIZE)
+            return false;
+        _slots[_tail++ & (QUEUE_SIZE - 1)] = message;
+        return true;
+    }
+    bool pop(int* message) {
+        if (_tail == _head)
+            return false;
+        *message = _slots[_head++ & (QUEUE_SIZE - 1)];
+        return true;
+    }
+
+private:
+    int _slots[QUEUE_SIZE];
+    unsigned _head = 0;
+    unsigned _tail = 0;
+};
+
+struct Events : NoopEvents {
+    void on_hwm() {
+        ++calls;
+    }
+    long long calls = 0;
+};
+
+class VirtualHandler : public IMessageQueueEvents {
+public:
+    void on_start() override {}
+    void on_hwm() override {
+        ++calls;
+    }
+    void on_lwm() override {}
+    void on_stop() override {}
+
+    long long calls = 0;
+};
+
+template<typename Put, typename Get>
+void run(const char* name, Put put, Get get) {
+    long long checksum = 0;
+    bench::Stopwatch sw;
+    for (int i = 0; i != MESSAGES; i += BURST) {
+        for (int j = 0; j != BURST; j++)
+            put(i + j);
+        for (int j = 0; j != BURST; j++)
+            checksum += get();
+    }
+    bench::printRow(name, MESSAGES, sw.seconds());
+    if (checksum != static_cast<long long>(MESSAGES) * (MESSAGES - 1) / 2)
+        std::printf("%32s wrong checksum %lld\n", "", checksum);
+}
+
+template<typename Queue>
+void runQueue(const char* name, Queue& q) {
+    q.run();
+    run(name,
+        [&q](int message) {
+            q.put(message, 0);
+        },
+        [&q] {
+            int message = 0;
+            q.get(&message);
+            return message;
+        });
+}
+
+} // namespace
+
+int main() {
+    {
+        Ring ring;
+        run("hand-rolled ring",
+            [&ring](int message) { ring.push(message); },
+            [&ring] {
+                int message = 0;
+                ring.pop(&message);
+                return message;
+            });
+    }
+    {
+        /* storage alone, no queue around it */
+        PriorityLevels<1>::Storage<int> storage(QUEUE_SIZE);
+        run("PriorityLevels<1> storage",
+            [&storage](int message) { storage.push(0, message); },
+            [&storage] {
+                int message = 0;
+                storage.pop(&message);
+                return message;
+            });
+    }
+    {
+        MessageQueue<int, PriorityLevels<1>, NoMetrics, NoLock, NoEvents>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        runQueue("NoLock NoEvents", q);
+    }
+    {
+        MessageQueue<int, PriorityLevels<1>, NoMetrics, SpinLock, NoEvents>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        runQueue("SpinLock NoEvents", q);
+    }
+    {
+        MessageQueue<int, PriorityLevels<1>, NoMetrics, StdLock, NoEvents>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        runQueue("StdLock NoEvents", q);
+    }
+    {
+        /* hwm crossed once per burst */
+        MessageQueue<int, PriorityLevels<1>, NoMetrics, StdLock,
+                     StaticEvents<Events>> q(QUEUE_SIZE, 0, BURST);
+        Events events;
+        q.setEvents(&events);
+        runQueue("StdLock StaticEvents", q);
+        q.setEvents(nullptr);
+    }
+    {
+        MessageQueue<int, PriorityLevels<1>, NoMetrics, StdLock,
+                     VirtualEvents> q(QUEUE_SIZE, 0, BURST);
+        q.setEvents(std::make_shared<VirtualHandler>());
+        runQueue("StdLock VirtualEvents", q);
+    }
+    {
+        MessageQueue<int, PriorityLevels<1>, QueueMetrics, StdLock,
+                     VirtualEvents> q(QUEUE_SIZE, 0, BURST);
+        q.setEvents(std::make_shared<VirtualHandler>());
+        runQueue("QueueMetrics StdLock Virtual", q);
+    }
+    return 0;
+}
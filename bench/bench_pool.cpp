@@ -0,0 +1,123 @@
+/* Storage policies under a contended allocator: writers and
+   readers move messages through the queue while noise threads
+   hammer malloc/free, as other subsystems of a real process do.
+   Prints heap allocations per message next to throughput */
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "messagequeue.hpp"
+
+namespace {
+
+std::atomic<long long> g_allocs{0};
+
+} // namespace
+
+void* operator new(std::size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 4096;
+constexpr long long MESSAGES = 1 << 20;
+constexpr int PRIORITIES = 8;
+
+/* trivially copyable, so allocations
+   come from storage only */
+struct Payload {
+    long long seq;
+    char data[56];
+};
+
+template<typename StoragePolicy>
+void run(const std::string& name, int threads, int noise_threads) {
+    MessageQueue<Payload, StoragePolicy> q(QUEUE_SIZE, 0, QUEUE_SIZE);
+    q.run();
+    std::atomic<bool> done{false};
+    std::atomic<long long> got{0};
+    std::vector<std::thread> workers;
+
+    /* malloc/free of mixed sizes, bypassing
+       operator new so they aren't counted */
+    for (int t = 0; t != noise_threads; t++) {
+        workers.emplace_back([&done, t] {
+                void* blocks[64] = {};
+                for (size_t i = 0; !done; i++) {
+                    auto& block = blocks[i % 64];
+                    std::free(block);
+                    block = std::malloc(16 + (i * 37 + t) % 512);
+                }
+                for (auto block : blocks)
+                    std::free(block);
+            });
+    }
+
+    long long allocs = g_allocs.load();
+    bench::Stopwatch sw;
+    std::vector<std::thread> queue_workers;
+    for (int t = 0; t != threads; t++) {
+        queue_workers.emplace_back([&q, threads, t] {
+                Payload msg{};
+                for (long long i = 0; i < MESSAGES / threads; i++) {
+                    msg.seq = i;
+                    q.put(msg, (t + static_cast<int>(i)) % PRIORITIES);
+                }
+            });
+        queue_workers.emplace_back([&q, &got] {
+                Payload msg;
+                while (q.get(&msg) == RetCode::OK)
+                    ++got;
+            });
+    }
+    long long total = MESSAGES / threads * threads;
+    while (got != total)
+        std::this_thread::yield();
+    auto seconds = sw.seconds();
+    allocs = g_allocs.load() - allocs;
+    q.stop();
+    done = true;
+    for (auto& worker : queue_workers)
+        worker.join();
+    for (auto& worker : workers)
+        worker.join();
+
+    char row[96];
+    std::snprintf(row, sizeof(row), "%s thr=%d noise=%d %.2f allocs/msg",
+                  name.c_str(), threads, noise_threads,
+                  static_cast<double>(allocs) / static_cast<double>(total));
+    bench::printRow(row, total, seconds);
+}
+
+} // namespace
+
+int main() {
+    for (int noise : {0, 4}) {
+        for (int threads : {1, 4}) {
+            run<PriorityMap>("PriorityMap", threads, noise);
+            run<PooledPriorityMap>("PooledPriorityMap", threads, noise);
+            run<PriorityLevels<PRIORITIES>>("PriorityLevels", threads, noise);
+        }
+    }
+    return 0;
+}
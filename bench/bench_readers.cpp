@@ -0,0 +1,66 @@
+/* ReaderPool throughput: batch size and pinning. 1 writer, 2 readers
+   with handler doing a bit of work per message. Pinned run puts
+   every worker on a CPU of its own (or of NUMA node 0 if known);
+   on a single CPU machine pinning can only cost */
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "affinity.hpp"
+#include "bench.hpp"
+#include "messagequeue.hpp"
+#include "reader_pool.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr int READERS = 2;
+constexpr int MESSAGES = 1 << 20;
+
+struct Handler {
+    void operator()(const int&) {
+        for (volatile int i = 0; i != 20; i = i + 1) {}
+        handled->fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::atomic<int>* handled;
+};
+
+void run(const char* name, int batch_size, bool pinned) {
+    auto q = std::make_shared<MessageQueue<int>>(QUEUE_SIZE, 0, QUEUE_SIZE);
+    q->run();
+    std::atomic<int> handled{0};
+    ReaderPool<MessageQueue<int>, Handler> pool(q, Handler{&handled},
+                                                READERS, batch_size);
+    if (pinned) {
+        auto cpus = numaNodeCpus(0);
+        if (cpus.empty())
+            cpus.push_back(0);
+        std::vector<std::vector<int>> sets;
+        for (int cpu : cpus)
+            sets.push_back({cpu});
+        pool.setAffinity(sets);
+    }
+    bench::Stopwatch sw;
+    pool.run();
+    for (int i = 0; i != MESSAGES; i++)
+        q->put(i, 0);
+    while (handled.load() != MESSAGES)
+        std::this_thread::yield();
+    bench::printRow(name, MESSAGES, sw.seconds());
+    pool.stop();
+}
+
+} // namespace
+
+int main() {
+    run("batch 1", 1, false);
+    run("batch 32", 32, false);
+    run("batch 32 pinned", 32, true);
+    return 0;
+}
@@ -0,0 +1,115 @@
+/* Scheduling policies of PriorityLevels under skewed overload:
+   2 writers put as fast as they can for 1 s, 70% of messages at
+   priority 3, 15% at 2, 10% at 1, 5% at 0; 1 reader does a bit of
+   work per message, so the queue stays full. Then the queue is
+   drained. Per priority put-to-get latency - strict priority
+   starves low levels until the drain */
+
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr int LEVELS = 4;
+constexpr int WRITERS = 2;
+constexpr auto DURATION = std::chrono::seconds(1);
+
+struct Message {
+    long long sent;
+    int priority;
+};
+
+/* 14, 3, 2 and 1 of every 20 */
+int skewedPriority(unsigned i) {
+    auto slot = i % 20;
+    if (slot < 14)
+        return 3;
+    if (slot < 17)
+        return 2;
+    if (slot < 19)
+        return 1;
+    return 0;
+}
+
+template<typename Queue>
+void run(const std::string& name, Queue& q) {
+    q.run();
+    std::atomic<bool> writing{true};
+    std::atomic<long long> put{0};
+    std::vector<std::thread> writers;
+    for (int t = 0; t != WRITERS; t++) {
+        writers.emplace_back([&, t] {
+                unsigned i = static_cast<unsigned>(t) * 7;
+                long long local = 0;
+                while (writing.load(std::memory_order_relaxed)) {
+                    int priority = skewedPriority(i++);
+                    if (q.put(Message{bench::nowNs(), priority},
+                              priority) != RetCode::OK)
+                        break;
+                    ++local;
+                }
+                put += local;
+            });
+    }
+    std::vector<long long> samples[LEVELS];
+    long long got = 0;
+    std::thread reader([&] {
+            Message message;
+            while (q.get(&message) == RetCode::OK) {
+                for (volatile int i = 0; i != 2000; i = i + 1) {}
+                samples[message.priority].push_back(
+                    bench::nowNs() - message.sent);
+                ++got;
+            }
+        });
+    std::this_thread::sleep_for(DURATION);
+    writing = false;
+    for (auto& writer : writers)
+        writer.join();
+    while (q.size())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    q.stop();
+    reader.join();
+
+    std::printf("%s: %lld messages\n", name.c_str(), got);
+    for (int priority = LEVELS - 1; priority >= 0; priority--) {
+        auto& level = samples[priority];
+        auto count = level.size();
+        std::printf("  priority %d %9zu msgs  p50 %10.3f ms  p99 %10.3f ms"
+                    "  max %10.3f ms\n", priority, count,
+                    static_cast<double>(bench::percentile(level, 50)) / 1e6,
+                    static_cast<double>(bench::percentile(level, 99)) / 1e6,
+                    static_cast<double>(bench::percentile(level, 100)) / 1e6);
+    }
+}
+
+} // namespace
+
+int main() {
+    {
+        MessageQueue<Message, PriorityLevels<LEVELS, StrictPriority>>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        run("StrictPriority", q);
+    }
+    {
+        MessageQueue<Message, PriorityLevels<LEVELS, WeightedFair>>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        run("WeightedFair (weights 1..4)", q);
+    }
+    {
+        MessageQueue<Message, PriorityLevels<LEVELS, Aging>>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE, std::chrono::milliseconds(1));
+        run("Aging (1 ms per level)", q);
+    }
+    return 0;
+}
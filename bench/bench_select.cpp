@@ -0,0 +1,126 @@
+/* 16 queues with a writer each at a fixed rate: 16 reader threads
+   blocking in get vs one thread on a QueueSet over all 16.
+   Throughput, put-to-get latency and reader CPU time */
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <time.h>
+
+#include "bench.hpp"
+#include "messagequeue.hpp"
+#include "queue_set.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUES = 16;
+constexpr int QUEUE_SIZE = 1024;
+constexpr int MESSAGES = 1 << 16;
+/* per writer, roughly 16 * 100k msg/s */
+constexpr auto INTERVAL = std::chrono::microseconds(10);
+constexpr int SAMPLE_EVERY = 16;
+
+using Queue = MessageQueue<long long, PriorityLevels<1>>;
+
+double processCpuSeconds() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return static_cast<double>(ts.tv_sec) +
+        static_cast<double>(ts.tv_nsec) / 1e9;
+}
+
+template<typename StartReaders, typename JoinReaders>
+void run(const std::string& name, std::vector<long long>& samples,
+         StartReaders start_readers, JoinReaders join_readers) {
+    std::vector<std::shared_ptr<Queue>> queues;
+    for (int i = 0; i != QUEUES; i++) {
+        queues.push_back(std::make_shared<Queue>(QUEUE_SIZE, 0, QUEUE_SIZE));
+        queues.back()->run();
+    }
+    start_readers(queues);
+    auto cpu = processCpuSeconds();
+    bench::Stopwatch sw;
+    std::vector<std::thread> writers;
+    for (auto& q : queues) {
+        writers.emplace_back([q] {
+                auto next = std::chrono::steady_clock::now();
+                for (int i = 0; i != MESSAGES; i++) {
+                    next += INTERVAL;
+                    std::this_thread::sleep_until(next);
+                    q->put(bench::nowNs(), 0);
+                }
+            });
+    }
+    for (auto& writer : writers)
+        writer.join();
+    for (auto& q : queues) {
+        while (q->size())
+            std::this_thread::yield();
+        q->stop();
+    }
+    join_readers();
+    auto seconds = sw.seconds();
+    cpu = processCpuSeconds() - cpu;
+    bench::printRow(name, static_cast<long long>(QUEUES) * MESSAGES, seconds);
+    std::printf("%32s p50 %8lld ns  p99 %8lld ns  cpu %.2f s"
+                " (writers included)\n", "",
+                bench::percentile(samples, 50),
+                bench::percentile(samples, 99), cpu);
+}
+
+} // namespace
+
+int main() {
+    {
+        std::vector<std::thread> readers;
+        std::vector<std::vector<long long>> per_reader(QUEUES);
+        std::vector<long long> samples;
+        run("16 reader threads", samples,
+            [&](std::vector<std::shared_ptr<Queue>>& queues) {
+                for (int i = 0; i != QUEUES; i++) {
+                    readers.emplace_back([q = queues[i], &mine = per_reader[i]] {
+                            long long sent;
+                            long long n = 0;
+                            while (q->get(&sent) == RetCode::OK) {
+                                if (n++ % SAMPLE_EVERY == 0)
+                                    mine.push_back(bench::nowNs() - sent);
+                            }
+                        });
+                }
+            },
+            [&] {
+                for (auto& reader : readers)
+                    reader.join();
+                for (auto& mine : per_reader)
+                    samples.insert(samples.end(), mine.begin(), mine.end());
+            });
+    }
+    {
+        std::thread reader;
+        std::vector<long long> samples;
+        run("1 QueueSet thread", samples,
+            [&](std::vector<std::shared_ptr<Queue>>& queues) {
+                reader = std::thread([queues, &samples] {
+                        QueueSet<Queue> set;
+                        for (auto& q : queues)
+                            set.add(q);
+                        long long sent;
+                        long long n = 0;
+                        while (set.get(&sent) == RetCode::OK) {
+                            if (n++ % SAMPLE_EVERY == 0)
+                                samples.push_back(bench::nowNs() - sent);
+                        }
+                    });
+            },
+            [&] {
+                reader.join();
+            });
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+/* MessageQueue vs ShardedMessageQueue scaling,
+   N writers and N readers, one shard per reader */
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "messagequeue.hpp"
+#include "sharded_messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 4096;
+constexpr long long MESSAGES = 1 << 20;
+
+template<typename Queue>
+void run(const std::string& name, Queue& q, int threads) {
+    q.run();
+    std::atomic<long long> got{0};
+    std::vector<std::thread> workers;
+
+    bench::Stopwatch sw;
+    for (int t = 0; t != threads; t++) {
+        workers.emplace_back([&q, threads, t] {
+                for (long long i = 0; i < MESSAGES / threads; i++)
+                    q.put(static_cast<int>(i), (t + static_cast<int>(i)) % 8);
+            });
+        workers.emplace_back([&q, &got] {
+                int val;
+                while (q.get(&val) == RetCode::OK)
+                    ++got;
+            });
+    }
+    long long total = MESSAGES / threads * threads;
+    while (got != total)
+        std::this_thread::yield();
+    auto seconds = sw.seconds();
+    q.stop();
+    for (auto& worker : workers)
+        worker.join();
+
+    bench::printRow(name + " threads=" + std::to_string(threads),
+                    total, seconds);
+}
+
+} // namespace
+
+int main() {
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        {
+            MessageQueue<int, PriorityLevels<8>> q(QUEUE_SIZE, 0, QUEUE_SIZE);
+            run("MessageQueue", q, threads);
+        }
+        {
+            ShardedMessageQueue<int, PriorityLevels<8>> q(
+                threads, QUEUE_SIZE, 0, QUEUE_SIZE);
+            run("ShardedMessageQueue", q, threads);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+/* Two processes: forked writer puts 64 byte messages, parent
+   reads them - ShmMessageQueue vs Unix stream socket with one
+   write()/read() per message. Throughput and put-to-get latency,
+   steady clock is system wide so stamps compare across processes */
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.hpp"
+#include "shm_messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr long long MESSAGES = 1 << 21;
+constexpr int SAMPLE_EVERY = 64;
+
+struct Message {
+    long long sent;
+    char payload[56];
+};
+static_assert(sizeof(Message) == 64, "64 byte messages");
+
+void report(const std::string& name, double seconds,
+            std::vector<long long>& samples) {
+    bench::printRow(name, MESSAGES, seconds);
+    std::printf("%32s p50 %8lld ns  p99 %8lld ns  p99.9 %8lld ns\n", "",
+                bench::percentile(samples, 50),
+                bench::percentile(samples, 99),
+                bench::percentile(samples, 99.9));
+}
+
+void runShm() {
+    std::string name = "/bench_shm_" + std::to_string(getpid());
+    ShmMessageQueue<Message> q(name, QUEUE_SIZE, 0, QUEUE_SIZE);
+    q.run();
+    bench::Stopwatch sw;
+    pid_t child = fork();
+    if (!child) {
+        ShmMessageQueue<Message> writer(name);
+        Message message{};
+        for (long long i = 0; i != MESSAGES; i++) {
+            message.sent = bench::nowNs();
+            writer.put(message, 0);
+        }
+        _exit(0);
+    }
+    std::vector<long long> samples;
+    Message message;
+    for (long long i = 0; i != MESSAGES; i++) {
+        if (q.get(&message) != RetCode::OK) {
+            std::fprintf(stderr, "shm queue: writer lost\n");
+            break;
+        }
+        if (i % SAMPLE_EVERY == 0)
+            samples.push_back(bench::nowNs() - message.sent);
+    }
+    auto seconds = sw.seconds();
+    waitpid(child, nullptr, 0);
+    report("ShmMessageQueue", seconds, samples);
+}
+
+bool readFull(int fd, char* data, size_t size) {
+    while (size) {
+        auto got = read(fd, data, size);
+        if (got <= 0)
+            return false;
+        data += got;
+        size -= static_cast<size_t>(got);
+    }
+    return true;
+}
+
+void runSocket() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+        std::perror("socketpair");
+        return;
+    }
+    /* roughly QUEUE_SIZE messages in flight */
+    int buf_size = QUEUE_SIZE * static_cast<int>(sizeof(Message));
+    setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+    bench::Stopwatch sw;
+    pid_t child = fork();
+    if (!child) {
+        close(fds[0]);
+        Message message{};
+        for (long long i = 0; i != MESSAGES; i++) {
+            message.sent = bench::nowNs();
+            if (write(fds[1], &message, sizeof(message)) !=
+                static_cast<ssize_t>(sizeof(message)))
+                _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    std::vector<long long> samples;
+    Message message;
+    for (long long i = 0; i != MESSAGES; i++) {
+        if (!readFull(fds[0], reinterpret_cast<char*>(&message),
+                      sizeof(message))) {
+            std::fprintf(stderr, "socket: writer lost\n");
+            break;
+        }
+        if (i % SAMPLE_EVERY == 0)
+            samples.push_back(bench::nowNs() - message.sent);
+    }
+    auto seconds = sw.seconds();
+    close(fds[0]);
+    waitpid(child, nullptr, 0);
+    report("unix socket", seconds, samples);
+}
+
+} // namespace
+
+int main() {
+    runShm();
+    runSocket();
+    return 0;
+}
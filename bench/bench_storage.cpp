@@ -0,0 +1,48 @@
+/* PriorityMap vs PriorityLevels<N> storage, single thread so that
+   only storage cost is measured: fill queue with priorities spread
+   over all levels, then drain it */
+
+#include <string>
+
+#include "bench.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 4096;
+constexpr int ROUNDS = 500;
+
+template<typename StoragePolicy>
+void run(const std::string& name, int levels) {
+    MessageQueue<int, StoragePolicy> q(QUEUE_SIZE, 0, QUEUE_SIZE);
+    q.run();
+    int val;
+    bench::Stopwatch sw;
+    for (int r = 0; r != ROUNDS; r++) {
+        for (int i = 0; i != QUEUE_SIZE; i++)
+            q.put(i, (i * 7919) % levels);
+        for (int i = 0; i != QUEUE_SIZE; i++)
+            q.get(&val);
+    }
+    bench::printRow(name + " levels=" + std::to_string(levels),
+                    static_cast<long long>(ROUNDS) * QUEUE_SIZE,
+                    sw.seconds());
+}
+
+template<int Levels>
+void compare() {
+    run<PriorityMap>("PriorityMap", Levels);
+    run<PriorityLevels<Levels>>("PriorityLevels", Levels);
+}
+
+} // namespace
+
+int main() {
+    compare<1>();
+    compare<8>();
+    compare<64>();
+    compare<1024>();
+    return 0;
+}
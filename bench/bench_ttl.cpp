@@ -0,0 +1,85 @@
+/* Overload with deadlines: 1 writer puts twice as fast as 1
+   reader handles (20 us of work per message) for 1 s, every
+   message is useful for 2 ms. Plain queue delivers everything,
+   mostly stale; Expiring drops what is past its deadline, so
+   the reader works only on fresh messages */
+
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#include "bench.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr auto TTL = std::chrono::milliseconds(2);
+constexpr auto DURATION = std::chrono::seconds(1);
+constexpr auto PUT_INTERVAL = std::chrono::microseconds(10);
+constexpr auto WORK = std::chrono::microseconds(20);
+
+struct Message {
+    long long sent;
+};
+
+void busy(std::chrono::microseconds duration) {
+    auto until = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < until) {}
+}
+
+template<typename Queue, typename Put>
+void run(const std::string& name, Queue& q, Put put) {
+    q.run();
+    long long fresh = 0;
+    long long stale = 0;
+    std::thread reader([&] {
+            Message message;
+            auto ttl_ns = std::chrono::duration_cast<
+                std::chrono::nanoseconds>(TTL).count();
+            while (q.get(&message) == RetCode::OK) {
+                if (bench::nowNs() - message.sent > ttl_ns) {
+                    ++stale;
+                } else {
+                    ++fresh;
+                }
+                busy(WORK);
+            }
+        });
+    auto end = std::chrono::steady_clock::now() + DURATION;
+    auto next = std::chrono::steady_clock::now();
+    long long sent = 0;
+    while (next < end) {
+        next += PUT_INTERVAL;
+        std::this_thread::sleep_until(next);
+        put(q, Message{bench::nowNs()});
+        ++sent;
+    }
+    q.stop();
+    reader.join();
+    /* not handled: expired, or left in queue at stop */
+    std::printf("%-32s sent %7lld  handled fresh %7lld  stale %7lld"
+                "  dropped %7lld\n", name.c_str(), sent, fresh, stale,
+                sent - fresh - stale);
+}
+
+} // namespace
+
+int main() {
+    {
+        MessageQueue<Message, PriorityLevels<1>> q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        run("plain queue", q, [](auto& queue, Message message) {
+                queue.put(message, 0);
+            });
+    }
+    {
+        MessageQueue<Message, Expiring<PriorityLevels<1>>>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        run("Expiring, 2 ms TTL", q, [](auto& queue, Message message) {
+                queue.put(message, 0, std::chrono::steady_clock::now() + TTL);
+            });
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+/* Handoff latency with parking vs spin-then-park waiting.
+   Writer puts timestamps at a steady pace so that reader mostly
+   finds queue empty and has to wait for every message */
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "lockfree_queue.hpp"
+#include "messagequeue.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int QUEUE_SIZE = 1024;
+constexpr int MESSAGES = 200000;
+constexpr long long PACE_NS = 2000;
+
+template<typename Queue>
+void run(const std::string& name, const WaitStrategy& strategy) {
+    Queue q(QUEUE_SIZE, 0, QUEUE_SIZE);
+    q.setWaitStrategy(strategy);
+    q.run();
+    std::vector<long long> samples;
+    samples.reserve(MESSAGES);
+    std::thread reader([&q, &samples] {
+            long long sent = 0;
+            for (int i = 0; i != MESSAGES; i++) {
+                q.get(&sent);
+                samples.push_back(bench::nowNs() - sent);
+            }
+        });
+    auto next = bench::nowNs();
+    for (int i = 0; i != MESSAGES; i++) {
+        while (bench::nowNs() < next)
+            ;
+        next += PACE_NS;
+        q.put(bench::nowNs(), 0);
+    }
+    reader.join();
+    std::printf("%-40s p50 %8lld ns  p99 %8lld ns  p99.9 %8lld ns\n",
+                name.c_str(),
+                bench::percentile(samples, 50),
+                bench::percentile(samples, 99),
+                bench::percentile(samples, 99.9));
+}
+
+template<typename Queue>
+void compare(const std::string& name) {
+    run<Queue>(name + " park", WaitStrategy::park());
+    run<Queue>(name + " spin(200)+yield(10)",
+               WaitStrategy::spinThenPark(200, 10));
+    run<Queue>(name + " spin(5000)+yield(100)",
+               WaitStrategy::spinThenPark(5000, 100));
+}
+
+} // namespace
+
+int main() {
+    compare<MessageQueue<long long, PriorityLevels<1>>>("MessageQueue");
+    compare<MpmcMessageQueue<long long>>("MpmcMessageQueue");
+    return 0;
+}
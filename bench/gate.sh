@@ -0,0 +1,103 @@
+#!/bin/sh
+# Throughput regression gate over bench rows (bench::printRow).
+#
+#   gate.sh record BASELINE RUNS BENCH...
+#       best msgs/s of every row over RUNS runs -> BASELINE
+#   gate.sh check BASELINE RUNS THRESHOLD BENCH...
+#       fails if best msgs/s of a row is more than THRESHOLD
+#       percent under its BASELINE one, or if a BASELINE row is
+#       missing from the run
+#
+# A bench exiting non-zero fails both.
+#
+# Best of several runs, single runs are too noisy on a busy machine.
+# Baseline is only meaningful on the machine and build it came from.
+
+set -e
+
+usage() {
+    echo "usage: $0 record BASELINE RUNS BENCH..." >&2
+    echo "       $0 check BASELINE RUNS THRESHOLD BENCH..." >&2
+    exit 2
+}
+
+[ $# -ge 4 ] || usage
+mode=$1
+baseline=$2
+runs=$3
+shift 3
+case $mode in
+    record) ;;
+    check) threshold=$1; shift; [ $# -ge 1 ] || usage ;;
+    *) usage ;;
+esac
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# "bench<TAB>row<TAB>best msgs/s" lines
+measure() {
+    : > "$tmp/rows"
+    for bench in "$@"; do
+        i=0
+        while [ $i -lt "$runs" ]; do
+            ./"$bench" > "$tmp/out" || {
+                echo "$bench exited with status $?" >&2
+                exit 1
+            }
+            awk -v bench="$bench" '
+                $NF == "msgs/s" && NF > 6 {
+                    row = $1
+                    for (i = 2; i <= NF - 6; i++)
+                        row = row " " $i
+                    print bench "\t" row "\t" $(NF - 1)
+                }' "$tmp/out" >> "$tmp/rows"
+            i=$((i + 1))
+        done
+    done
+    awk -F '\t' '
+        !(($1 FS $2) in best) { order[++n] = $1 FS $2 }
+        !(($1 FS $2) in best) || $3 > best[$1 FS $2] { best[$1 FS $2] = $3 }
+        END { for (i = 1; i <= n; i++) print order[i] "\t" best[order[i]] }' \
+        "$tmp/rows"
+}
+
+if [ "$mode" = record ]; then
+    measure "$@" > "$tmp/current"
+    mv "$tmp/current" "$baseline"
+    echo "recorded $(wc -l < "$baseline") rows to $baseline"
+    exit 0
+fi
+
+[ -f "$baseline" ] || { echo "no baseline $baseline, make baseline" >&2; exit 2; }
+measure "$@" > "$tmp/current"
+awk -F '\t' -v threshold="$threshold" '
+    NR == FNR { base[$1 FS $2] = $3; order[++n] = $1 FS $2; next }
+    {
+        key = $1 FS $2
+        seen[key] = 1
+        if (!(key in base)) {
+            printf "%-16s %-32s %14s %14.0f   new\n", $1, $2, "-", $3
+            next
+        }
+        change = ($3 - base[key]) / base[key] * 100
+        bad = change < -threshold
+        failed += bad
+        printf "%-16s %-32s %14.0f %14.0f %+6.1f%% %s\n", $1, $2,
+               base[key], $3, change, bad ? "REGRESSED" : "ok"
+    }
+    END {
+        for (i = 1; i <= n; i++) {
+            if (order[i] in seen)
+                continue
+            split(order[i], row, FS)
+            printf "%-16s %-32s %14.0f %14s   MISSING\n", row[1], row[2],
+                   base[order[i]], "-"
+            failed++
+        }
+        if (failed) {
+            printf "%d rows missing or more than %s%% slower than baseline\n",
+                   failed, threshold
+            exit 1
+        }
+    }' "$baseline" "$tmp/current"
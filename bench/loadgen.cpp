@@ -0,0 +1,309 @@
+/* Load generator for MessageQueue.
+   *
+   Writers put MessageBuffers of --payload bytes with priorities
+   drawn from --priorities weights for --duration seconds, readers
+   get them; then the queue is drained. Prints one JSON object:
+   config, throughput, put-to-get latency percentiles overall and
+   per priority, and queue metrics - zeros unless built with
+   make EXTRA_FLAGS=-DMQ_METRICS.
+   *
+   $ ./loadgen --readers 2 --writers 4 --priorities 8,1,1 \
+               --duration 5 > run.json */
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "message_buffer.hpp"
+#include "messagequeue.hpp"
+#include "metrics.hpp"
+#include "platform.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+struct Config {
+    int readers = 1;
+    int writers = 1;
+    size_t payload = 64;
+    /* weight of priority i */
+    std::vector<int> priorities = {1};
+    int queue_size = 1024;
+    int lwm = 256;
+    int hwm = 768;
+    double duration = 1;
+    std::string storage = "pooled";
+};
+
+void usage() {
+    std::fprintf(stderr,
+                 "usage: loadgen [options]\n"
+                 "  --readers N        reader threads (1)\n"
+                 "  --writers N        writer threads (1)\n"
+                 "  --payload BYTES    message size, at least 9 (64)\n"
+                 "  --priorities W,... weight of priority 0, 1, ... (1)\n"
+                 "  --queue-size N     (1024)\n"
+                 "  --lwm N            (256)\n"
+                 "  --hwm N            (768)\n"
+                 "  --duration SEC     writing time (1)\n"
+                 "  --storage map|pooled\n");
+}
+
+std::vector<int> parseWeights(const char* list) {
+    std::vector<int> weights;
+    std::stringstream stream(list);
+    std::string weight;
+    while (std::getline(stream, weight, ','))
+        weights.push_back(std::atoi(weight.c_str()));
+    return weights;
+}
+
+bool parseArgs(int argc, char** argv, Config* config) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) {
+            return false;
+        }
+        const char* val = argv[++i];
+        if (arg == "--readers") {
+            config->readers = std::atoi(val);
+        } else if (arg == "--writers") {
+            config->writers = std::atoi(val);
+        } else if (arg == "--payload") {
+            config->payload = static_cast<size_t>(std::atol(val));
+        } else if (arg == "--priorities") {
+            config->priorities = parseWeights(val);
+        } else if (arg == "--queue-size") {
+            config->queue_size = std::atoi(val);
+        } else if (arg == "--lwm") {
+            config->lwm = std::atoi(val);
+        } else if (arg == "--hwm") {
+            config->hwm = std::atoi(val);
+        } else if (arg == "--duration") {
+            config->duration = std::atof(val);
+        } else if (arg == "--storage") {
+            config->storage = val;
+        } else {
+            return false;
+        }
+    }
+    int weights = 0;
+    for (int weight : config->priorities) {
+        if (weight < 0)
+            return false;
+        weights += weight;
+    }
+    return config->readers > 0 && config->writers > 0 &&
+        config->payload > sizeof(long long) && weights > 0 &&
+        config->priorities.size() <=
+            static_cast<size_t>(QueueMetrics::PRIORITY_SLOTS) &&
+        config->queue_size > 0 && config->lwm >= 0 &&
+        config->lwm < config->hwm && config->hwm <= config->queue_size &&
+        config->duration > 0 &&
+        (config->storage == "map" || config->storage == "pooled");
+}
+
+/* without events queue doesn't check watermarks -
+   metrics count on_hwm/on_lwm calls */
+class NopEvents : public IMessageQueueEvents {
+public:
+    void on_start() override {}
+    void on_stop() override {}
+    void on_hwm() override {}
+    void on_lwm() override {}
+};
+
+/* priority -> latency histogram in ns */
+using Histograms = std::vector<LatencyHistogram>;
+
+/* xorshift - rand() takes a lock */
+class Random {
+public:
+    explicit Random(uint64_t seed) : _state{seed * 2654435761u + 1} {}
+
+    uint64_t next() noexcept {
+        _state ^= _state << 13;
+        _state ^= _state >> 7;
+        _state ^= _state << 17;
+        return _state;
+    }
+
+private:
+    uint64_t _state;
+};
+
+struct Result {
+    long long messages = 0;
+    double seconds = 0;
+    Histograms latency;
+    QueueMetricsSnapshot metrics;
+};
+
+template<typename Queue>
+Result run(const Config& config) {
+    auto pool = std::make_shared<BufferPool>(
+        config.payload, static_cast<size_t>(config.queue_size +
+                                            config.readers +
+                                            config.writers + 1));
+    Queue q(config.queue_size, config.lwm, config.hwm);
+    q.setEvents(std::make_shared<NopEvents>());
+    q.run();
+
+    /* priority of a draw - O(1) pick */
+    std::vector<int> table;
+    for (size_t p = 0; p != config.priorities.size(); p++)
+        table.insert(table.end(), static_cast<size_t>(config.priorities[p]),
+                     static_cast<int>(p));
+
+    auto levels = config.priorities.size();
+    std::vector<Histograms> reader_latency(
+        static_cast<size_t>(config.readers), Histograms(levels));
+    std::atomic<long long> written{0};
+    std::atomic<long long> read{0};
+    std::vector<std::thread> readers;
+    for (int r = 0; r != config.readers; r++) {
+        readers.emplace_back([&q, &read, &latency = reader_latency[
+                                  static_cast<size_t>(r)]] {
+                MessageBuffer msg;
+                while (q.get(&msg) == RetCode::OK) {
+                    long long put_ns;
+                    std::memcpy(&put_ns, msg.data(), sizeof(put_ns));
+                    auto ns = steadyNowNs() - put_ns;
+                    int priority = static_cast<unsigned char>(
+                        msg.data()[sizeof(put_ns)]);
+                    latency[static_cast<size_t>(priority)].add(
+                        LatencyHistogram::bucket(
+                            static_cast<uint64_t>(std::max(0LL, ns))), 1);
+                    msg.reset();
+                    read.fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+    }
+
+    auto start = steadyNowNs();
+    auto end = start + static_cast<long long>(config.duration * 1e9);
+    std::vector<std::thread> writers;
+    for (int w = 0; w != config.writers; w++) {
+        writers.emplace_back([&, w] {
+                Random random(static_cast<uint64_t>(w));
+                std::string filler(config.payload, 'x');
+                long long num = 0;
+                while (steadyNowNs() < end) {
+                    int priority = table[random.next() % table.size()];
+                    auto msg = pool->acquire();
+                    msg.append(filler);
+                    long long now = steadyNowNs();
+                    std::memcpy(msg.data(), &now, sizeof(now));
+                    msg.data()[sizeof(now)] = static_cast<char>(priority);
+                    if (q.put(std::move(msg), priority) != RetCode::OK)
+                        break;
+                    ++num;
+                }
+                written.fetch_add(num, std::memory_order_relaxed);
+            });
+    }
+    for (auto& writer : writers)
+        writer.join();
+    /* drain - every message written gets its latency */
+    while (read.load(std::memory_order_relaxed) != written.load())
+        std::this_thread::yield();
+    auto stop = steadyNowNs();
+    q.stop();
+    for (auto& reader : readers)
+        reader.join();
+
+    Result result;
+    result.messages = written.load();
+    result.seconds = static_cast<double>(stop - start) / 1e9;
+    result.latency.resize(levels);
+    for (auto& latency : reader_latency) {
+        for (size_t p = 0; p != levels; p++)
+            result.latency[p].merge(latency[p]);
+    }
+    if constexpr (std::is_same<decltype(q.metrics()),
+                               const QueueMetrics&>::value) {
+        result.metrics = q.metrics().snapshot();
+    }
+    return result;
+}
+
+void printPercentiles(const LatencyHistogram& latency) {
+    std::printf("{\"count\": %llu, \"p50\": %.0f, \"p90\": %.0f, "
+                "\"p99\": %.0f, \"p99.9\": %.0f, \"max\": %.0f}",
+                static_cast<unsigned long long>(latency.count()),
+                latency.percentile(50), latency.percentile(90),
+                latency.percentile(99), latency.percentile(99.9),
+                latency.max());
+}
+
+void printJson(const Config& config, const Result& result) {
+    std::printf("{\n  \"config\": {\"readers\": %d, \"writers\": %d, "
+                "\"payload\": %zu, \"priorities\": [",
+                config.readers, config.writers, config.payload);
+    for (size_t p = 0; p != config.priorities.size(); p++)
+        std::printf("%s%d", p ? ", " : "", config.priorities[p]);
+    std::printf("], \"queue_size\": %d, \"lwm\": %d, \"hwm\": %d, "
+                "\"duration\": %g, \"storage\": \"%s\", "
+                "\"metrics\": %s},\n",
+                config.queue_size, config.lwm, config.hwm, config.duration,
+                config.storage.c_str(),
+                DefaultMetrics::enabled ? "true" : "false");
+
+    auto seconds = result.seconds;
+    std::printf("  \"messages\": %lld,\n  \"seconds\": %.6f,\n"
+                "  \"throughput\": %.0f,\n  \"bytes_per_second\": %.0f,\n",
+                result.messages, seconds,
+                static_cast<double>(result.messages) / seconds,
+                static_cast<double>(result.messages) *
+                static_cast<double>(config.payload) / seconds);
+
+    LatencyHistogram total;
+    for (const auto& latency : result.latency)
+        total.merge(latency);
+    std::printf("  \"latency_ns\": ");
+    printPercentiles(total);
+    std::printf(",\n  \"latency_ns_by_priority\": [");
+    for (size_t p = 0; p != result.latency.size(); p++) {
+        std::printf("%s\n    ", p ? "," : "");
+        printPercentiles(result.latency[p]);
+    }
+
+    const auto& m = result.metrics;
+    std::printf("\n  ],\n  \"queue\": {\"put_waits\": %llu, "
+                "\"put_blocked_ns\": %.0f, \"get_waits\": %llu, "
+                "\"get_blocked_ns\": %.0f, \"hwm_events\": %llu, "
+                "\"lwm_events\": %llu, \"lock_contentions\": %llu}\n}\n",
+                static_cast<unsigned long long>(m.put_waits),
+                m.put_blocked_ns,
+                static_cast<unsigned long long>(m.get_waits),
+                m.get_blocked_ns,
+                static_cast<unsigned long long>(m.hwm_events),
+                static_cast<unsigned long long>(m.lwm_events),
+                static_cast<unsigned long long>(m.lock_contentions));
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Config config;
+    if (!parseArgs(argc, argv, &config)) {
+        usage();
+        return 1;
+    }
+    Result result;
+    if (config.storage == "map")
+        result = run<MessageQueue<MessageBuffer, PriorityMap>>(config);
+    else
+        result = run<MessageQueue<MessageBuffer, PooledPriorityMap>>(config);
+    printJson(config, result);
+    return 0;
+}
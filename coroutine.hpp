@@ -0,0 +1,124 @@
+#pragma once
+
+#if !defined(__cpp_impl_coroutine)
+#error "coroutine.hpp needs C++20 coroutines"
+#endif
+
+#include <cassert>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace zodiactest {
+
+/* Minimal coroutine runtime for MessageQueue::async_get/async_put.
+   *
+   CoroutinePool is an executor - fixed set of threads resuming
+   scheduled coroutine handles in FIFO order. co_await
+   pool.schedule() moves the coroutine onto the pool.
+   *
+   Task is fire-and-forget coroutine type: starts right away,
+   frame is freed when it finishes, exceptions terminate */
+class CoroutinePool {
+public:
+    explicit CoroutinePool(int threads);
+
+    CoroutinePool(const CoroutinePool&) = delete;
+    CoroutinePool& operator=(const CoroutinePool&) = delete;
+
+    /* resumes everything scheduled so far, then joins -
+       coroutines still parked elsewhere are not owned by pool */
+    ~CoroutinePool();
+
+    /* executor interface - doesn't block */
+    void operator()(std::coroutine_handle<> handle);
+
+    auto schedule() noexcept {
+        struct Awaiter {
+            CoroutinePool* pool;
+
+            bool await_ready() const noexcept {
+                return false;
+            }
+            void await_suspend(std::coroutine_handle<> handle) {
+                (*pool)(handle);
+            }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{this};
+    }
+
+private:
+    void _mainFunc();
+
+    std::mutex _mtx;
+    std::condition_variable _notify;
+    std::deque<std::coroutine_handle<>> _ready;
+    bool _stopping;
+    std::vector<std::thread> _threads;
+};
+
+struct Task {
+    struct promise_type {
+        Task get_return_object() noexcept {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {
+            std::terminate();
+        }
+    };
+};
+
+inline CoroutinePool::CoroutinePool(int threads)
+    : _stopping{false} {
+    assert(threads > 0);
+    for (int i = 0; i != threads; i++)
+        _threads.emplace_back(&CoroutinePool::_mainFunc, this);
+}
+
+inline CoroutinePool::~CoroutinePool() {
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _stopping = true;
+    }
+    _notify.notify_all();
+    for (auto& thread : _threads)
+        thread.join();
+}
+
+inline void CoroutinePool::operator()(std::coroutine_handle<> handle) {
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _ready.push_back(handle);
+    }
+    _notify.notify_one();
+}
+
+inline void CoroutinePool::_mainFunc() {
+    std::unique_lock<std::mutex> lock(_mtx);
+    while (true) {
+        _notify.wait(lock, [this] {
+                return _stopping || !_ready.empty();
+            });
+        if (_ready.empty())
+            return;
+        auto handle = _ready.front();
+        _ready.pop_front();
+        lock.unlock();
+        handle.resume();
+        lock.lock();
+    }
+}
+
+} // namespace zodiactest
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace zodiactest {
+
+class IMessageQueueEvents {
+public:
+    IMessageQueueEvents() {}
+    virtual ~IMessageQueueEvents() {}
+
+    virtual void on_start() = 0;
+    virtual void on_hwm() = 0;
+    virtual void on_lwm() = 0;
+    virtual void on_stop() = 0;
+};
+
+/* handlers called without lock by many threads (LockFreeMessageQueue,
+   ShardedMessageQueue). Every call is made under a Guard counted in
+   the current one of two epoch counters, set() releases replaced
+   handlers once nobody can be calling them - so it must not be
+   called from a handler */
+class EpochEvents {
+public:
+    class Guard {
+    public:
+        explicit Guard(EpochEvents& events) noexcept
+            : _users{&events._users[events._epoch.load() & 1]} {
+            _users->fetch_add(1);
+            _handle = events._handle.load();
+        }
+        ~Guard() {
+            _users->fetch_sub(1, std::memory_order_release);
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        explicit operator bool() const noexcept {
+            return _handle != nullptr;
+        }
+        IMessageQueueEvents* operator->() const noexcept {
+            return _handle;
+        }
+
+    private:
+        std::atomic<int>* _users;
+        IMessageQueueEvents* _handle;
+    };
+
+    void set(std::shared_ptr<IMessageQueueEvents> handle) {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _handle.store(handle.get());
+        _owner.swap(handle);
+        /* guard that saw old handlers counted itself in the epoch
+           it read before the store above. Each flip moves new guards
+           to the other counter, so after two flips both counters
+           drained of guards that could hold old handlers */
+        for (int i = 0; i != 2; i++) {
+            auto epoch = _epoch.fetch_add(1);
+            while (_users[epoch & 1].load() != 0) {
+                std::this_thread::yield();
+            }
+        }
+        /* old handlers are released with handle */
+    }
+
+private:
+    std::atomic<IMessageQueueEvents*> _handle{nullptr};
+    std::shared_ptr<IMessageQueueEvents> _owner;
+    std::atomic<unsigned> _epoch{0};
+    std::atomic<int> _users[2]{};
+    std::mutex _mtx;
+};
+
+/* Event policies for MessageQueue - how on_start/on_hwm/on_lwm/on_stop
+   handlers are held and called.
+   Policy is a class the queue holds, providing
+     static constexpr bool enabled;
+     using Handle = ...;         // what setEvents() takes
+     bool active() const;        // handlers are set
+     Handle acquire() const;     // handlers to call after unlock
+     void swap(Handle& handle);  // installs handle, old one is returned
+   Queue uses them under its lock and calls handlers without it.
+   Disabled policy needs only enabled and Handle. */
+
+/* virtual handlers owned together with user, kept alive by
+   each call even if replaced meanwhile - every event copies
+   shared_ptr under queue lock */
+class VirtualEvents {
+public:
+    static constexpr bool enabled = true;
+    using Handle = std::shared_ptr<IMessageQueueEvents>;
+
+    bool active() const noexcept {
+        return _handle != nullptr;
+    }
+    Handle acquire() const noexcept {
+        return _handle;
+    }
+    void swap(Handle& handle) noexcept {
+        _handle.swap(handle);
+    }
+
+private:
+    Handle _handle;
+};
+
+/* Handler's on_start()/on_hwm()/on_lwm()/on_stop() are called
+   directly - no virtual call, no reference counting, may be
+   inlined. Handler isn't owned: it must outlive the queue (stop()
+   in destructor calls on_stop()) or be replaced by nullptr first.
+   Derive handler from NoopEvents to skip events it doesn't need */
+template<typename Handler>
+class StaticEvents {
+public:
+    static constexpr bool enabled = true;
+    using Handle = Handler*;
+
+    bool active() const noexcept {
+        return _handle != nullptr;
+    }
+    Handle acquire() const noexcept {
+        return _handle;
+    }
+    void swap(Handle& handle) noexcept {
+        std::swap(_handle, handle);
+    }
+
+private:
+    Handle _handle = nullptr;
+};
+
+struct NoopEvents {
+    void on_start() {}
+    void on_hwm() {}
+    void on_lwm() {}
+    void on_stop() {}
+};
+
+/* no events - watermark checks compile away,
+   setEvents() doesn't compile */
+struct NoEvents {
+    static constexpr bool enabled = false;
+    using Handle = std::nullptr_t;
+};
+
+} // namespace zodiactest
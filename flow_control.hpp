@@ -0,0 +1,180 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <utility>
+
+#include "wait_strategy.hpp"
+
+namespace zodiactest {
+
+/* Credit based flow control for producers of one queue.
+   *
+   Gate holds credits - messages allowed in flight. Producer takes
+   a credit before put, consumer gives it back after get, so put
+   never has to wait on full queue. Producers take credits in
+   batches of up to grant() through CreditWindow, on_hwm() should
+   shrink() the grant (halves it) and on_lwm() restore() it: near
+   watermark every producer refills in small steps and waits its
+   turn instead of all of them stopping and restarting at once.
+   *
+   Producer that found gate empty sleeps until max_grant credits
+   (but at most half of all) are back, not until the first one:
+   consumer doesn't wake a producer per message and producers
+   resume with a full window - the same hysteresis watermarks give.
+   So producer shouldn't sit idle on a non-empty window for long.
+   *
+   close() wakes and refuses waiting producers (queue stopped),
+   open() lets them in again. Gate starts open. */
+class CreditGate {
+public:
+    CreditGate(int credits, int max_grant);
+
+    CreditGate(const CreditGate&) = delete;
+    CreditGate& operator=(const CreditGate&) = delete;
+
+    /* waits for at least one credit, takes up to want
+       but not more than grant(); 0 if gate is closed */
+    int acquire(int want);
+    void release(int credits);
+
+    void shrink() noexcept;
+    void restore() noexcept;
+    void close();
+    void open();
+
+    int grant() const noexcept {
+        return _grant.load(std::memory_order_relaxed);
+    }
+    int available() const noexcept {
+        return _available.load(std::memory_order_relaxed);
+    }
+    /* not synchronized - set before producers start */
+    void setWaitStrategy(const WaitStrategy& strategy);
+
+private:
+    const int _max_grant;
+    const int _wake_level;
+    std::atomic<int> _available;
+    std::atomic<int> _grant;
+    std::atomic<bool> _closed;
+    WaitStrategy _wait_strategy;
+    Parking _producers;
+};
+
+/* Producer's credits taken from gate and not used yet.
+   Belongs to one producer thread, gives unused credits
+   back on destruction */
+class CreditWindow {
+public:
+    explicit CreditWindow(std::shared_ptr<CreditGate> gate)
+        : _gate(std::move(gate)), _credits{0} {
+        assert(_gate != nullptr);
+    }
+
+    CreditWindow(const CreditWindow&) = delete;
+    CreditWindow& operator=(const CreditWindow&) = delete;
+
+    ~CreditWindow() {
+        if (_credits)
+            _gate->release(_credits);
+    }
+
+    /* up to want credits, refills window from gate
+       when empty; 0 if gate is closed */
+    int take(int want = 1) {
+        assert(want > 0);
+        if (!_credits) {
+            _credits = _gate->acquire(std::max(want, _gate->grant()));
+            if (!_credits)
+                return 0;
+        }
+        int taken = std::min(want, _credits);
+        _credits -= taken;
+        return taken;
+    }
+    /* credits taken but not used, e.g. put failed */
+    void giveBack(int credits) noexcept {
+        _credits += credits;
+    }
+
+private:
+    std::shared_ptr<CreditGate> _gate;
+    int _credits;
+};
+
+inline CreditGate::CreditGate(int credits, int max_grant)
+    : _max_grant{max_grant},
+      _wake_level{std::max(1, std::min(max_grant, credits / 2))},
+      _available{credits},
+      _grant{max_grant},
+      _closed{false},
+      _wait_strategy(WaitStrategy::defaultStrategy()) {
+    assert(credits > 0);
+    assert(max_grant > 0 && max_grant <= credits);
+}
+
+inline int CreditGate::acquire(int want) {
+    assert(want > 0);
+    while (true) {
+        if (_closed.load(std::memory_order_acquire)) {
+            return 0;
+        }
+        int available = _available.load(std::memory_order_relaxed);
+        while (available > 0) {
+            int taken = std::min({want, grant(), available});
+            if (_available.compare_exchange_weak(
+                    available, available - taken,
+                    std::memory_order_acquire,
+                    std::memory_order_relaxed)) {
+                if (available - taken >= _wake_level) {
+                    /* pass the rest on to next waiter */
+                    _producers.wakeOne();
+                }
+                return taken;
+            }
+        }
+        _producers.wait(_wait_strategy, [this] {
+                return _closed.load(std::memory_order_acquire) ||
+                    _available.load(std::memory_order_relaxed) >=
+                    _wake_level;
+            });
+    }
+}
+
+inline void CreditGate::release(int credits) {
+    assert(credits > 0);
+    int available = _available.fetch_add(
+        credits, std::memory_order_release) + credits;
+    if (available >= _wake_level && available - credits < _wake_level) {
+        /* woken producer wakes the next one if credits remain */
+        _producers.wakeOne();
+    }
+}
+
+inline void CreditGate::shrink() noexcept {
+    int grant = _grant.load(std::memory_order_relaxed);
+    _grant.store(std::max(1, grant / 2), std::memory_order_relaxed);
+}
+
+inline void CreditGate::restore() noexcept {
+    _grant.store(_max_grant, std::memory_order_relaxed);
+}
+
+inline void CreditGate::close() {
+    _closed.store(true, std::memory_order_release);
+    _producers.wake();
+}
+
+inline void CreditGate::open() {
+    _closed.store(false, std::memory_order_release);
+    _producers.wake();
+}
+
+inline void CreditGate::setWaitStrategy(const WaitStrategy& strategy) {
+    _wait_strategy = strategy;
+}
+
+} // namespace zodiactest
@@ -0,0 +1,842 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "metrics.hpp"
+#include "platform.hpp"
+#include "priority_storage.hpp"
+
+namespace zodiactest {
+
+/* Append-only journal of queue messages in memory mapped
+   segment files (POSIX).
+   *
+   Every put appends a record {priority, seq, payload} with a
+   checksum, every get stores the record's seq as consumer offset
+   of its priority - inside a priority messages leave in seq order,
+   so all records of priority p with seq <= offset[p] are consumed.
+   Offsets live in a mapped file too. On open journal rebuilds the
+   live records from segments and offsets, torn tail records fail
+   the checksum and are dropped.
+   *
+   Durability: records are in page cache as soon as append returns,
+   so they survive process crash. Against power loss they are
+   msync()ed by group commit - background syncer every
+   sync_interval, or sync() that waits until everything appended
+   before it is on disk; concurrent sync() calls share one msync.
+   Shorter interval - smaller loss window, more flushes.
+   *
+   Full segment is rotated. Syncer deletes segments whose records
+   are all consumed and compacts sparse ones - copies their few
+   live records (same seq) to the active segment, so that one old
+   low priority message doesn't pin a whole segment. */
+
+struct JournalConfig {
+    /* created if it doesn't exist */
+    std::string dir;
+    size_t segment_size = 64 << 20;
+    /* background group commit period, 0 - never in background */
+    std::chrono::milliseconds sync_interval{10};
+    /* non-active segment holding less live bytes than this part
+       of it is compacted */
+    double compact_ratio = 0.25;
+};
+
+class Journal {
+public:
+    /* opens journal in config.dir and recovers it,
+       throws std::system_error on I/O errors */
+    explicit Journal(const JournalConfig& config);
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    /* syncs everything - clean shutdown loses nothing */
+    ~Journal();
+
+    /* encode(char* dst) writes size bytes of payload,
+       returns record's seq */
+    template<typename Encode>
+    uint64_t append(int priority, size_t size, Encode encode);
+    /* record seq of priority is taken out of queue */
+    void consume(int priority, uint64_t seq);
+
+    /* group commit - returns when everything appended
+       before the call is on disk. msync failure of background
+       syncer is thrown by next sync() or append() */
+    void sync();
+    /* deletes consumed segments, compacts sparse ones;
+       syncer calls it after rotations */
+    void compact();
+
+    /* live records found on open, valid until first compact() -
+       f(priority, seq, const char* data, size_t size) in seq order */
+    template<typename F>
+    void replay(F f) const;
+    size_t recovered() const noexcept {
+        return _recovered.size();
+    }
+    size_t segments() const;
+
+private:
+    static constexpr uint64_t SEGMENT_MAGIC = 0x31304c4e524a514dULL;
+    static constexpr uint64_t OFFSETS_MAGIC = 0x31305346464f514dULL;
+    static constexpr size_t SEGMENT_HEADER = 16;
+    static constexpr uint32_t ROTATED = 0xffffffffu;
+    static constexpr size_t OFFSET_SLOTS = 4096;
+
+    struct RecordHeader {
+        /* 0 - end of records, ROTATED - continued in next segment,
+           stored last */
+        uint32_t size;
+        uint32_t checksum;
+        int32_t priority;
+        uint32_t reserved;
+        uint64_t seq;
+    };
+    struct OffsetSlot {
+        int32_t priority;
+        uint32_t used;
+        uint64_t seq;
+    };
+    struct Segment {
+        uint64_t index;
+        int fd;
+        char* data;
+        size_t pos;
+        /* [0, synced) is on disk */
+        size_t synced;
+        /* newest record of each priority - segment is consumed
+           when offsets passed all of them */
+        std::unordered_map<int, uint64_t> max_seq;
+    };
+    struct Record {
+        uint64_t seq;
+        int priority;
+        const char* data;
+        size_t size;
+    };
+    struct SyncRange {
+        Segment* segment;
+        size_t from;
+        size_t to;
+    };
+
+    static size_t _recordSize(size_t payload) noexcept {
+        return (sizeof(RecordHeader) + payload + 7) & ~size_t{7};
+    }
+    static uint32_t _checksum(const RecordHeader& header,
+                              const char* payload) noexcept;
+    std::string _segmentPath(uint64_t index) const;
+    std::unique_ptr<Segment> _openSegment(uint64_t index, bool create);
+    void _closeSegment(Segment& segment, bool remove);
+    void _openOffsets();
+    void _recover();
+    void _clearTail(Segment& segment);
+    /* msync()s what _mtx snapshot found unsynced */
+    void _syncRanges(const std::vector<SyncRange>& ranges);
+    void _sync();
+    /* _mtx held */
+    void _throwSyncError();
+    char* _reserve(size_t record_size);
+    void _rotate();
+    uint64_t& _offset(int priority);
+    bool _consumed(const Segment& segment);
+    void _mainFunc();
+
+    const JournalConfig _config;
+    const size_t _page_size;
+    /* appends, consumes, segment list */
+    mutable std::mutex _mtx;
+    std::vector<std::unique_ptr<Segment>> _segments;
+    uint64_t _next_seq;
+    int _offsets_fd;
+    OffsetSlot* _offsets;
+    std::unordered_map<int, OffsetSlot*> _offset_slots;
+    bool _offsets_dirty;
+    std::vector<Record> _recovered;
+    /* one msync or compaction at a time, later
+       sync() callers ride on it */
+    std::mutex _sync_mtx;
+    uint64_t _durable_seq;
+    /* syncer failure, thrown to next caller */
+    std::error_code _sync_error;
+    int _rotations;
+    bool _stopping;
+    std::condition_variable _syncer_cv;
+    std::thread _syncer;
+};
+
+/* How Journaled storage turns messages into journal bytes:
+     static size_t size(const T&);
+     static void encode(const T&, char* dst);
+     static T decode(const char* data, size_t size); */
+template<typename T, typename = void>
+struct JournalCodec;
+
+namespace detail {
+
+template<typename T>
+struct IsMetricsEntry : std::false_type {};
+template<typename MessageType>
+struct IsMetricsEntry<QueueMetrics::Entry<MessageType>> : std::true_type {};
+
+} // namespace detail
+
+template<typename T>
+struct JournalCodec<T, std::enable_if_t<std::is_trivially_copyable<T>::value &&
+                                        !detail::IsMetricsEntry<T>::value>> {
+    static size_t size(const T&) noexcept {
+        return sizeof(T);
+    }
+    static void encode(const T& message, char* dst) noexcept {
+        std::memcpy(dst, &message, sizeof(T));
+    }
+    static T decode(const char* data, size_t size) noexcept {
+        assert(size == sizeof(T));
+        (void)size;
+        T message;
+        std::memcpy(&message, data, sizeof(T));
+        return message;
+    }
+};
+
+template<>
+struct JournalCodec<std::string> {
+    static size_t size(const std::string& message) noexcept {
+        return message.size();
+    }
+    static void encode(const std::string& message, char* dst) noexcept {
+        std::memcpy(dst, message.data(), message.size());
+    }
+    static std::string decode(const char* data, size_t size) {
+        return std::string(data, size);
+    }
+};
+
+/* message wrapped by metrics - put time is not journaled,
+   recovered messages count as put on recovery */
+template<typename MessageType>
+struct JournalCodec<QueueMetrics::Entry<MessageType>> {
+    using Codec = JournalCodec<MessageType>;
+
+    static size_t size(const QueueMetrics::Entry<MessageType>& entry) {
+        return Codec::size(entry.message);
+    }
+    static void encode(const QueueMetrics::Entry<MessageType>& entry,
+                       char* dst) {
+        Codec::encode(entry.message, dst);
+    }
+    static QueueMetrics::Entry<MessageType> decode(const char* data,
+                                                   size_t size) {
+        return QueueMetrics::Entry<MessageType>(cpuTicks(),
+                                                Codec::decode(data, size));
+    }
+};
+
+/* Storage policy decorator: StoragePolicy's storage holds the
+   messages, journal gets a copy of each put and offset of each
+   get. Queue is constructed with the journal:
+     MessageQueue<std::string, Journaled<PooledPriorityMap>>
+         q(size, lwm, hwm, journal_sp);
+   and starts with the journal's live messages - maybe more than
+   queue_size, writers wait until readers drain them */
+template<typename StoragePolicy>
+struct Journaled {
+    template<typename MessageType>
+    class Storage {
+    public:
+        using Codec = JournalCodec<MessageType>;
+
+        Storage(int capacity, std::shared_ptr<Journal> journal);
+
+        template<typename... Args>
+        void push(int priority, Args&&... args);
+        int pop(MessageType* message);
+        int top() const {
+            return _inner.top();
+        }
+        int recovered() const noexcept {
+            return _recovered;
+        }
+        void trim() {
+            detail::trimStorage(_inner);
+        }
+        std::chrono::nanoseconds trimPeriod() const {
+            return detail::trimPeriod(_inner);
+        }
+
+    private:
+        struct Entry {
+            Entry() = default;
+            template<typename Message>
+            Entry(uint64_t seq_, Message&& message_)
+                : seq{seq_}, message(std::forward<Message>(message_)) {}
+
+            uint64_t seq;
+            MessageType message;
+        };
+
+    public:
+        /* after Entry, journal keeps priorities inner one does */
+        static constexpr int levels = detail::LevelCount<
+            typename StoragePolicy::template Storage<Entry>>::value;
+        static constexpr bool trims = detail::Trims<
+            typename StoragePolicy::template Storage<Entry>>::value;
+
+    private:
+        std::shared_ptr<Journal> _journal;
+        typename StoragePolicy::template Storage<Entry> _inner;
+        int _recovered;
+    };
+};
+
+inline Journal::Journal(const JournalConfig& config)
+    : _config(config),
+      _page_size{static_cast<size_t>(sysconf(_SC_PAGESIZE))},
+      _next_seq{1},
+      _offsets_fd{-1},
+      _offsets{nullptr},
+      _offsets_dirty{false},
+      _durable_seq{0},
+      _rotations{0},
+      _stopping{false} {
+    assert(!_config.dir.empty());
+    assert(_config.segment_size >= _page_size);
+    assert(_config.compact_ratio >= 0 && _config.compact_ratio < 1);
+    if (mkdir(_config.dir.c_str(), 0755) && errno != EEXIST)
+        throw std::system_error(errno, std::generic_category(), _config.dir);
+    _openOffsets();
+    _recover();
+    _durable_seq = _next_seq - 1;
+    _syncer = std::thread(&Journal::_mainFunc, this);
+}
+
+inline Journal::~Journal() {
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _stopping = true;
+    }
+    _syncer_cv.notify_one();
+    _syncer.join();
+    try {
+        _sync();
+    } catch (const std::system_error&) {
+        /* nobody left to tell, destructor must not throw */
+    }
+    for (auto& segment : _segments)
+        _closeSegment(*segment, false);
+    munmap(_offsets, OFFSET_SLOTS * sizeof(OffsetSlot));
+    close(_offsets_fd);
+}
+
+template<typename Encode>
+uint64_t Journal::append(int priority, size_t size, Encode encode) {
+    assert(size < ROTATED);
+    std::lock_guard<std::mutex> lock(_mtx);
+    _throwSyncError();
+    auto record = _reserve(_recordSize(size));
+    RecordHeader header;
+    header.size = static_cast<uint32_t>(size);
+    header.priority = priority;
+    header.reserved = 0;
+    header.seq = _next_seq++;
+    char* payload = record + sizeof(RecordHeader);
+    encode(payload);
+    header.checksum = _checksum(header, payload);
+    /* size goes last - zero size ends records */
+    auto size_field = header.size;
+    header.size = 0;
+    std::memcpy(record, &header, sizeof(header));
+    std::memcpy(record, &size_field, sizeof(size_field));
+
+    auto& segment = *_segments.back();
+    auto& max_seq = segment.max_seq[priority];
+    max_seq = std::max(max_seq, header.seq);
+    return header.seq;
+}
+
+inline void Journal::consume(int priority, uint64_t seq) {
+    std::lock_guard<std::mutex> lock(_mtx);
+    _offset(priority) = seq;
+    _offsets_dirty = true;
+}
+
+inline void Journal::sync() {
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        _throwSyncError();
+    }
+    _sync();
+}
+
+inline void Journal::_sync() {
+    std::unique_lock<std::mutex> sync_lock(_sync_mtx);
+    std::vector<SyncRange> ranges;
+    uint64_t target;
+    bool offsets;
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+        target = _next_seq - 1;
+        offsets = _offsets_dirty;
+        if (_durable_seq >= target && !offsets) {
+            /* covered by sync of whoever held _sync_mtx */
+            return;
+        }
+        _offsets_dirty = false;
+        for (auto& segment : _segments) {
+            if (segment->synced != segment->pos)
+                ranges.push_back({segment.get(), segment->synced,
+                                  segment->pos});
+        }
+    }
+    _syncRanges(ranges);
+    if (offsets &&
+        msync(_offsets, OFFSET_SLOTS * sizeof(OffsetSlot), MS_SYNC))
+        throw std::system_error(errno, std::generic_category(), "msync");
+
+    std::lock_guard<std::mutex> lock(_mtx);
+    _durable_seq = std::max(_durable_seq, target);
+}
+
+inline void Journal::_syncRanges(const std::vector<SyncRange>& ranges) {
+    /* appends go on meanwhile, mappings stay - only
+       compaction unmaps and it holds _sync_mtx too */
+    for (const auto& range : ranges) {
+        auto from = range.from & ~(_page_size - 1);
+        if (msync(range.segment->data + from, range.to - from, MS_SYNC))
+            throw std::system_error(errno, std::generic_category(), "msync");
+    }
+    /* bytes appended after the snapshot are not synced yet */
+    std::lock_guard<std::mutex> lock(_mtx);
+    for (const auto& range : ranges)
+        range.segment->synced = std::max(range.segment->synced, range.to);
+}
+
+inline void Journal::compact() {
+    std::lock_guard<std::mutex> sync_lock(_sync_mtx);
+    std::unique_lock<std::mutex> lock(_mtx);
+    /* recovered records point into segments */
+    _recovered.clear();
+    _recovered.shrink_to_fit();
+
+    bool relocated = false;
+    std::vector<std::unique_ptr<Segment>> removed;
+    for (size_t i = 0; i + 1 < _segments.size();) {
+        auto& segment = *_segments[i];
+        if (!_consumed(segment)) {
+            /* live bytes of segment */
+            size_t live = 0;
+            size_t pos = SEGMENT_HEADER;
+            while (true) {
+                RecordHeader header;
+                std::memcpy(&header, segment.data + pos, sizeof(header));
+                if (!header.size || header.size == ROTATED)
+                    break;
+                if (header.seq > _offset(header.priority))
+                    live += _recordSize(header.size);
+                pos += _recordSize(header.size);
+            }
+            if (static_cast<double>(live) >=
+                _config.compact_ratio * static_cast<double>(segment.pos)) {
+                ++i;
+                continue;
+            }
+            /* copy live records to active segment, same seq */
+            pos = SEGMENT_HEADER;
+            while (true) {
+                RecordHeader header;
+                std::memcpy(&header, segment.data + pos, sizeof(header));
+                if (!header.size || header.size == ROTATED)
+                    break;
+                auto record_size = _recordSize(header.size);
+                if (header.seq > _offset(header.priority)) {
+                    /* may rotate - segment stays in _segments */
+                    char* record = _reserve(record_size);
+                    std::memcpy(record + sizeof(header),
+                                segment.data + pos + sizeof(header),
+                                header.size);
+                    RecordHeader copy = header;
+                    copy.size = 0;
+                    std::memcpy(record, &copy, sizeof(copy));
+                    std::memcpy(record, &header.size, sizeof(header.size));
+                    auto& max_seq =
+                        _segments.back()->max_seq[header.priority];
+                    max_seq = std::max(max_seq, header.seq);
+                }
+                pos += record_size;
+            }
+            relocated = true;
+        }
+        removed.push_back(std::move(_segments[i]));
+        _segments.erase(_segments.begin() +
+                        static_cast<std::ptrdiff_t>(i));
+    }
+    if (removed.empty())
+        return;
+    /* appends and rotations go on once unlocked -
+       snapshot what copies need synced */
+    std::vector<SyncRange> ranges;
+    if (relocated) {
+        for (auto& segment : _segments) {
+            if (segment->synced != segment->pos)
+                ranges.push_back({segment.get(), segment->synced,
+                                  segment->pos});
+        }
+    }
+    lock.unlock();
+
+    try {
+        /* copies are on disk before originals go away */
+        _syncRanges(ranges);
+    } catch (const std::system_error&) {
+        /* originals stay on disk, recovery drops duplicates */
+        for (auto& segment : removed)
+            _closeSegment(*segment, false);
+        throw;
+    }
+    for (auto& segment : removed)
+        _closeSegment(*segment, true);
+}
+
+template<typename F>
+void Journal::replay(F f) const {
+    for (const auto& record : _recovered)
+        f(record.priority, record.seq, record.data, record.size);
+}
+
+inline size_t Journal::segments() const {
+    std::lock_guard<std::mutex> lock(_mtx);
+    return _segments.size();
+}
+
+inline uint32_t Journal::_checksum(const RecordHeader& header,
+                                   const char* payload) noexcept {
+    /* FNV-1a over seq, priority, size and payload */
+    uint32_t hash = 2166136261u;
+    auto mix = [&hash](const void* data, size_t size) {
+        auto bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i != size; i++) {
+            hash ^= bytes[i];
+            hash *= 16777619u;
+        }
+    };
+    mix(&header.seq, sizeof(header.seq));
+    mix(&header.priority, sizeof(header.priority));
+    mix(&header.size, sizeof(header.size));
+    mix(payload, header.size);
+    return hash;
+}
+
+inline std::string Journal::_segmentPath(uint64_t index) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llx.seg",
+                  static_cast<unsigned long long>(index));
+    return _config.dir + name;
+}
+
+inline std::unique_ptr<Journal::Segment> Journal::_openSegment(uint64_t index,
+                                                               bool create) {
+    auto path = _segmentPath(index);
+    int fd = open(path.c_str(), O_RDWR | (create ? O_CREAT | O_EXCL : 0),
+                  0644);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), path);
+    if (create &&
+        ftruncate(fd, static_cast<off_t>(_config.segment_size))) {
+        auto err = errno;
+        close(fd);
+        unlink(path.c_str());
+        throw std::system_error(err, std::generic_category(), path);
+    }
+    void* data = mmap(nullptr, _config.segment_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        auto err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(), path);
+    }
+    auto segment = std::make_unique<Segment>();
+    segment->index = index;
+    segment->fd = fd;
+    segment->data = static_cast<char*>(data);
+    segment->pos = SEGMENT_HEADER;
+    segment->synced = 0;
+    if (create) {
+        std::memcpy(segment->data, &SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+        std::memcpy(segment->data + sizeof(SEGMENT_MAGIC), &index,
+                    sizeof(index));
+    }
+    return segment;
+}
+
+inline void Journal::_closeSegment(Segment& segment, bool remove) {
+    munmap(segment.data, _config.segment_size);
+    close(segment.fd);
+    if (remove)
+        unlink(_segmentPath(segment.index).c_str());
+}
+
+inline void Journal::_openOffsets() {
+    auto path = _config.dir + "/offsets";
+    _offsets_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (_offsets_fd < 0)
+        throw std::system_error(errno, std::generic_category(), path);
+    /* first slot holds magic */
+    size_t size = OFFSET_SLOTS * sizeof(OffsetSlot);
+    struct stat st;
+    if (fstat(_offsets_fd, &st) ||
+        (static_cast<size_t>(st.st_size) != size &&
+         ftruncate(_offsets_fd, static_cast<off_t>(size)))) {
+        auto err = errno;
+        close(_offsets_fd);
+        throw std::system_error(err, std::generic_category(), path);
+    }
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      _offsets_fd, 0);
+    if (data == MAP_FAILED) {
+        auto err = errno;
+        close(_offsets_fd);
+        throw std::system_error(err, std::generic_category(), path);
+    }
+    _offsets = static_cast<OffsetSlot*>(data);
+    std::memcpy(&_offsets[0], &OFFSETS_MAGIC, sizeof(OFFSETS_MAGIC));
+    for (size_t i = 1; i != OFFSET_SLOTS; i++) {
+        if (_offsets[i].used)
+            _offset_slots[_offsets[i].priority] = &_offsets[i];
+    }
+}
+
+inline void Journal::_recover() {
+    std::vector<uint64_t> indexes;
+    DIR* dir = opendir(_config.dir.c_str());
+    if (!dir)
+        throw std::system_error(errno, std::generic_category(), _config.dir);
+    while (auto entry = readdir(dir)) {
+        unsigned long long index;
+        char tail;
+        if (std::sscanf(entry->d_name, "%16llx.se%c", &index, &tail) == 2 &&
+            std::strlen(entry->d_name) == 20)
+            indexes.push_back(index);
+    }
+    closedir(dir);
+    std::sort(indexes.begin(), indexes.end());
+
+    for (auto index : indexes) {
+        auto segment = _openSegment(index, false);
+        uint64_t magic;
+        std::memcpy(&magic, segment->data, sizeof(magic));
+        if (magic != SEGMENT_MAGIC) {
+            /* crashed right after creation */
+            _closeSegment(*segment, true);
+            continue;
+        }
+        auto& pos = segment->pos;
+        while (pos + sizeof(RecordHeader) <= _config.segment_size) {
+            RecordHeader header;
+            std::memcpy(&header, segment->data + pos, sizeof(header));
+            if (!header.size || header.size == ROTATED ||
+                pos + _recordSize(header.size) > _config.segment_size ||
+                header.checksum !=
+                _checksum(header, segment->data + pos + sizeof(header)))
+                break;
+            _next_seq = std::max(_next_seq, header.seq + 1);
+            auto& max_seq = segment->max_seq[header.priority];
+            max_seq = std::max(max_seq, header.seq);
+            if (header.seq > _offset(header.priority)) {
+                _recovered.push_back({header.seq, header.priority,
+                                      segment->data + pos + sizeof(header),
+                                      header.size});
+            }
+            pos += _recordSize(header.size);
+        }
+        segment->synced = 0;
+        _segments.push_back(std::move(segment));
+    }
+    if (!_segments.empty())
+        _clearTail(*_segments.back());
+    /* compaction crash may leave a record in two segments */
+    std::sort(_recovered.begin(), _recovered.end(),
+              [](const Record& a, const Record& b) {
+                  return a.seq < b.seq;
+              });
+    _recovered.erase(std::unique(_recovered.begin(), _recovered.end(),
+                                 [](const Record& a, const Record& b) {
+                                     return a.seq == b.seq;
+                                 }),
+                     _recovered.end());
+    if (_segments.empty())
+        _segments.push_back(_openSegment(1, true));
+}
+
+inline void Journal::_clearTail(Segment& segment) {
+    /* records are written one after another, so past a torn record
+       segment is zero - clear the torn one, its size may be garbage,
+       then the pages until a zero one */
+    if (segment.pos + sizeof(RecordHeader) > _config.segment_size)
+        return;
+    RecordHeader header;
+    std::memcpy(&header, segment.data + segment.pos, sizeof(header));
+    size_t end = segment.pos;
+    if (header.size && header.size != ROTATED &&
+        _recordSize(header.size) <= _config.segment_size - segment.pos)
+        end += _recordSize(header.size);
+    auto zero = [this, &segment](size_t page) {
+        for (size_t i = page; i != page + _page_size; i++) {
+            if (segment.data[i])
+                return false;
+        }
+        return true;
+    };
+    size_t page = (segment.pos + _page_size - 1) & ~(_page_size - 1);
+    while (page < _config.segment_size && (page < end || !zero(page)))
+        page += _page_size;
+    end = std::max(end, std::min(page, _config.segment_size));
+    std::memset(segment.data + segment.pos, 0, end - segment.pos);
+}
+
+inline void Journal::_throwSyncError() {
+    if (_sync_error) {
+        auto error = _sync_error;
+        _sync_error.clear();
+        throw std::system_error(error, "journal syncer");
+    }
+}
+
+inline char* Journal::_reserve(size_t record_size) {
+    if (record_size + SEGMENT_HEADER + sizeof(RecordHeader) >
+        _config.segment_size)
+        throw std::length_error("journal record doesn't fit segment");
+    auto& segment = *_segments.back();
+    /* room for the record and for end marker after it */
+    if (segment.pos + record_size + sizeof(RecordHeader) >
+        _config.segment_size)
+        _rotate();
+    auto& active = *_segments.back();
+    char* record = active.data + active.pos;
+    active.pos += record_size;
+    return record;
+}
+
+inline void Journal::_rotate() {
+    auto& segment = *_segments.back();
+    _segments.push_back(_openSegment(segment.index + 1, true));
+    std::memcpy(segment.data + segment.pos, &ROTATED, sizeof(ROTATED));
+    segment.pos += sizeof(RecordHeader);
+    ++_rotations;
+    _syncer_cv.notify_one();
+}
+
+inline uint64_t& Journal::_offset(int priority) {
+    auto it = _offset_slots.find(priority);
+    if (it != _offset_slots.end())
+        return it->second->seq;
+    if (_offset_slots.size() + 1 == OFFSET_SLOTS)
+        throw std::length_error("journal priorities exhausted");
+    auto slot = &_offsets[_offset_slots.size() + 1];
+    slot->priority = priority;
+    slot->seq = 0;
+    slot->used = 1;
+    _offset_slots.emplace(priority, slot);
+    return slot->seq;
+}
+
+inline bool Journal::_consumed(const Segment& segment) {
+    for (const auto& max_seq : segment.max_seq) {
+        if (max_seq.second > _offset(max_seq.first))
+            return false;
+    }
+    return true;
+}
+
+inline void Journal::_mainFunc() {
+    auto interval = _config.sync_interval.count() ?
+        _config.sync_interval : std::chrono::milliseconds(100);
+    std::unique_lock<std::mutex> lock(_mtx);
+    while (!_stopping) {
+        _syncer_cv.wait_for(lock, interval);
+        if (_stopping)
+            break;
+        int rotations = _rotations;
+        _rotations = 0;
+        lock.unlock();
+        std::error_code error;
+        try {
+            if (_config.sync_interval.count())
+                _sync();
+            if (rotations)
+                compact();
+        } catch (const std::system_error& e) {
+            error = e.code();
+        }
+        lock.lock();
+        if (error) {
+            /* thrown by next sync() or append() */
+            _sync_error = error;
+        }
+    }
+}
+
+template<typename StoragePolicy>
+template<typename MessageType>
+Journaled<StoragePolicy>::Storage<MessageType>::Storage(
+    int capacity, std::shared_ptr<Journal> journal)
+    : _journal(std::move(journal)),
+      _inner(std::max(capacity,
+                      static_cast<int>(_journal->recovered()))),
+      _recovered{static_cast<int>(_journal->recovered())} {
+    _journal->replay([this](int priority, uint64_t seq,
+                            const char* data, size_t size) {
+            _inner.push(priority, seq, Codec::decode(data, size));
+        });
+}
+
+template<typename StoragePolicy>
+template<typename MessageType>
+template<typename... Args>
+void Journaled<StoragePolicy>::Storage<MessageType>::push(int priority,
+                                                          Args&&... args) {
+    MessageType message(std::forward<Args>(args)...);
+    auto seq = _journal->append(priority, Codec::size(message),
+                                [&message](char* dst) {
+                                    Codec::encode(message, dst);
+                                });
+    _inner.push(priority, seq, std::move(message));
+}
+
+template<typename StoragePolicy>
+template<typename MessageType>
+int Journaled<StoragePolicy>::Storage<MessageType>::pop(
+    MessageType* message) {
+    assert(message != nullptr);
+    Entry entry;
+    int priority = _inner.pop(&entry);
+    _journal->consume(priority, entry.seq);
+    *message = std::move(entry.message);
+    return priority;
+}
+
+} // namespace zodiactest
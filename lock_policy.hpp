@@ -0,0 +1,90 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "platform.hpp"
+
+namespace zodiactest {
+
+/* Lock policies for MessageQueue.
+   Policy is a tag providing
+     using Mutex = ...;      // lock(), try_lock(), unlock()
+     using Condition = ...;  // waits with std::unique_lock<Mutex>
+     static constexpr bool threaded;
+   Queue that is not threaded belongs to one thread: nothing is
+   locked and calls never wait - put/get on full/empty queue return
+   TIMEOUT like timed calls whose time ran out, nobody else could
+   make room or bring a message.
+   *
+   One writer and one reader thread: LockFreeMessageQueue with
+   SpscRing (lockfree_ring.hpp) has no lock at all. */
+
+struct StdLock {
+    using Mutex = std::mutex;
+    using Condition = std::condition_variable;
+    static constexpr bool threaded = true;
+};
+
+/* test-and-test-and-set lock, yields after a while so a
+   preempted holder gets CPU back. Cheaper than std::mutex
+   for short critical sections when threads have CPUs of
+   their own, no futex call on release */
+class SpinMutex {
+public:
+    void lock() noexcept {
+        int spins = 0;
+        while (_locked.exchange(true, std::memory_order_acquire)) {
+            while (_locked.load(std::memory_order_relaxed)) {
+                if (++spins < SPINS_BEFORE_YIELD) {
+                    cpuRelax();
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+    bool try_lock() noexcept {
+        return !_locked.load(std::memory_order_relaxed) &&
+            !_locked.exchange(true, std::memory_order_acquire);
+    }
+    void unlock() noexcept {
+        _locked.store(false, std::memory_order_release);
+    }
+
+private:
+    static constexpr int SPINS_BEFORE_YIELD = 128;
+
+    std::atomic<bool> _locked{false};
+};
+
+struct SpinLock {
+    using Mutex = SpinMutex;
+    using Condition = std::condition_variable_any;
+    static constexpr bool threaded = true;
+};
+
+struct NullMutex {
+    void lock() noexcept {}
+    bool try_lock() noexcept {
+        return true;
+    }
+    void unlock() noexcept {}
+};
+
+/* never waited on, see NoLock */
+struct NullCondition {
+    void notify_one() noexcept {}
+    void notify_all() noexcept {}
+};
+
+/* single thread queue - locking compiles away */
+struct NoLock {
+    using Mutex = NullMutex;
+    using Condition = NullCondition;
+    static constexpr bool threaded = false;
+};
+
+} // namespace zodiactest
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "lockfree_ring.hpp"
+#include "messagequeue.hpp"
+#include "platform.hpp"
+#include "wait_strategy.hpp"
+
+namespace zodiactest {
+
+/* Same put/get/run/stop/watermarks contract as MessageQueue, but
+   without mutex on the fast path. Every priority level in [0, Levels)
+   has its own ring of queue_size messages, get() takes the highest
+   non-empty level; priorities out of range are clamped. queue_size
+   bounds all levels together - put() claims room in the queue
+   before it goes to a ring.
+   *
+   Threads park on condition variable only when queue is really
+   full (writers) or all rings are empty (readers), waiter counters
+   let the other side skip notification when nobody is parked.
+   *
+   SpscRing allows one writer and one reader thread per queue. */
+template<typename MessageType,
+         template<typename> class Ring = MpmcRing,
+         int Levels = 1>
+class LockFreeMessageQueue {
+    static_assert(Levels > 0, "at least one priority level");
+public:
+    LockFreeMessageQueue(int queue_size, int lwm, int hwm);
+
+    LockFreeMessageQueue(const LockFreeMessageQueue&) = delete;
+    LockFreeMessageQueue& operator=(const LockFreeMessageQueue&) = delete;
+
+    ~LockFreeMessageQueue();
+
+    RetCode put(const MessageType& message, int priority);
+    RetCode put(MessageType&& message, int priority);
+    template<typename... Args>
+    RetCode emplace(int priority, Args&&... args);
+    RetCode get(MessageType* message);
+    /* returns once replaced events are called by nobody and
+       releases them, so it must not be called from a handler */
+    void setEvents(std::shared_ptr<IMessageQueueEvents> events);
+    /* not synchronized - set before run() */
+    void setWaitStrategy(const WaitStrategy& strategy);
+
+    void stop();
+    void run();
+    int size() const noexcept;
+
+private:
+    enum class QueueState : int {
+        RUNNING = 0,
+        STOPPED
+    };
+
+    template<typename... Args>
+    RetCode _put(int priority, Args&&... args);
+    bool _claim() noexcept;
+    bool _tryPop(MessageType* message);
+    bool _empty() const noexcept;
+    bool _stopped() const noexcept {
+        return _queue_state.load(std::memory_order_acquire) ==
+            QueueState::STOPPED;
+    }
+
+    const int _capacity;
+    const int _lwm;
+    const int _hwm;
+    std::atomic<QueueState> _queue_state;
+    std::atomic<bool> _hwm_flag;
+    WaitStrategy _wait_strategy;
+    EpochEvents _events;
+    std::vector<std::unique_ptr<Ring<MessageType>>> _levels;
+    /* messages queued and being put */
+    alignas(CACHE_LINE_SIZE) std::atomic<int> _current_size;
+    Parking _readers;
+    Parking _writers;
+};
+
+template<typename MessageType>
+using SpscMessageQueue = LockFreeMessageQueue<MessageType, SpscRing>;
+
+template<typename MessageType>
+using MpmcMessageQueue = LockFreeMessageQueue<MessageType, MpmcRing>;
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+LockFreeMessageQueue<MessageType, Ring, Levels>::LockFreeMessageQueue(
+    int queue_size, int lwm, int hwm)
+    : _capacity{queue_size},
+      _lwm{lwm},
+      _hwm{hwm},
+      _queue_state{QueueState::STOPPED},
+      _hwm_flag{false},
+      _wait_strategy(WaitStrategy::defaultStrategy()),
+      _current_size{0} {
+    assert(queue_size > 0);
+    assert(lwm >= 0 && lwm < queue_size);
+    assert(hwm >= 0 && hwm <= queue_size);
+    assert(lwm  < hwm);
+    _levels.reserve(Levels);
+    for (int i = 0; i != Levels; i++)
+        _levels.emplace_back(new Ring<MessageType>(
+                                 static_cast<size_t>(queue_size)));
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+LockFreeMessageQueue<MessageType, Ring, Levels>::~LockFreeMessageQueue() {
+    stop();
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+RetCode LockFreeMessageQueue<MessageType, Ring, Levels>::put(
+    const MessageType& message, int priority) {
+    return _put(priority, message);
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+RetCode LockFreeMessageQueue<MessageType, Ring, Levels>::put(
+    MessageType&& message, int priority) {
+    return _put(priority, std::move(message));
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+template<typename... Args>
+RetCode LockFreeMessageQueue<MessageType, Ring, Levels>::emplace(
+    int priority, Args&&... args) {
+    return _put(priority, std::forward<Args>(args)...);
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+template<typename... Args>
+RetCode LockFreeMessageQueue<MessageType, Ring, Levels>::_put(
+    int priority, Args&&... args) {
+    priority = detail::clampLevel(priority, Levels);
+    if (_stopped()) {
+        return RetCode::STOPPED;
+    }
+
+    if (_current_size.load(std::memory_order_relaxed) >= _hwm) {
+        EpochEvents::Guard events(_events);
+        if (events) {
+            _hwm_flag.store(true, std::memory_order_relaxed);
+            events->on_hwm();
+            /* anything could happen - recheck */
+            if (_stopped()) {
+                return RetCode::STOPPED;
+            }
+        }
+    }
+
+    while (!_claim()) {
+        /* no free space - wait readers */
+        _writers.wait(_wait_strategy, [this] {
+                return _stopped() ||
+                    _current_size.load(std::memory_order_relaxed) <
+                    _capacity;
+            });
+        if (_stopped()) {
+            return RetCode::STOPPED;
+        }
+    }
+    auto& ring = *_levels[static_cast<size_t>(priority)];
+    while (!ring.try_push(std::forward<Args>(args)...)) {
+        /* ring holds queue_size, only a pop of its last lap
+           still in progress takes the slot - wait reader */
+        _writers.wait(_wait_strategy, [this, &ring] {
+                return _stopped() || !ring.full();
+            });
+        if (_stopped()) {
+            _current_size.fetch_sub(1, std::memory_order_relaxed);
+            return RetCode::STOPPED;
+        }
+    }
+
+    _readers.wake();
+    return RetCode::OK;
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+RetCode LockFreeMessageQueue<MessageType, Ring, Levels>::get(
+    MessageType* message) {
+    while (true) {
+        if (_stopped()) {
+            return RetCode::STOPPED;
+        }
+        if (_tryPop(message)) {
+            break;
+        }
+        /* empty queue - wait writers */
+        _readers.wait(_wait_strategy, [this] {
+                return _stopped() || !_empty();
+            });
+    }
+    auto size = _current_size.fetch_sub(1, std::memory_order_relaxed) - 1;
+
+    if (size <= _lwm && _hwm_flag.load(std::memory_order_relaxed)) {
+        EpochEvents::Guard events(_events);
+        if (events &&
+            _hwm_flag.exchange(false, std::memory_order_relaxed)) {
+            events->on_lwm();
+        }
+    }
+    _writers.wake();
+    return RetCode::OK;
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+void LockFreeMessageQueue<MessageType, Ring, Levels>::run() {
+    _queue_state.store(QueueState::RUNNING, std::memory_order_release);
+    {
+        EpochEvents::Guard events(_events);
+        if (events) {
+            events->on_start();
+        }
+    }
+    _writers.wake();
+    _readers.wake();
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+void LockFreeMessageQueue<MessageType, Ring, Levels>::stop() {
+    _queue_state.store(QueueState::STOPPED, std::memory_order_release);
+    {
+        EpochEvents::Guard events(_events);
+        if (events) {
+            events->on_stop();
+        }
+    }
+    _writers.wake();
+    _readers.wake();
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+void LockFreeMessageQueue<MessageType, Ring, Levels>::setEvents(
+    std::shared_ptr<IMessageQueueEvents> events) {
+    _events.set(std::move(events));
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+void LockFreeMessageQueue<MessageType, Ring, Levels>::setWaitStrategy(
+    const WaitStrategy& strategy) {
+    _wait_strategy = strategy;
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+int LockFreeMessageQueue<MessageType, Ring, Levels>::size() const noexcept {
+    return _current_size.load(std::memory_order_relaxed);
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+bool LockFreeMessageQueue<MessageType, Ring, Levels>::_claim() noexcept {
+    auto size = _current_size.load(std::memory_order_relaxed);
+    while (size < _capacity) {
+        if (_current_size.compare_exchange_weak(
+                size, size + 1, std::memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+bool LockFreeMessageQueue<MessageType, Ring, Levels>::_tryPop(
+    MessageType* message) {
+    for (int level = Levels - 1; level >= 0; level--) {
+        if (_levels[static_cast<size_t>(level)]->try_pop(message))
+            return true;
+    }
+    return false;
+}
+
+template<typename MessageType, template<typename> class Ring, int Levels>
+bool LockFreeMessageQueue<MessageType, Ring, Levels>::_empty() const noexcept {
+    for (auto& ring : _levels) {
+        if (!ring->empty())
+            return false;
+    }
+    return true;
+}
+
+} // namespace zodiactest
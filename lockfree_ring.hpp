@@ -0,0 +1,250 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "platform.hpp"
+
+namespace zodiactest {
+
+/* Bounded rings for LockFreeMessageQueue, MessageBuffer
+   free lists and Logger. Capacity is rounded up to power of two, try_push() constructs
+   message only on success so arguments may be forwarded again */
+
+/* single producer, single consumer - Lamport ring,
+   each side caches other side's index to not touch
+   its cache line on every operation */
+template<typename MessageType>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity);
+    ~SpscRing();
+
+    SpscRing(const SpscRing&) = delete;
+    SpscRing& operator=(const SpscRing&) = delete;
+
+    template<typename... Args>
+    bool try_push(Args&&... args);
+    bool try_pop(MessageType* message);
+    bool empty() const noexcept;
+    bool full() const noexcept;
+
+private:
+    using Slot = typename std::aligned_storage<sizeof(MessageType),
+                                               alignof(MessageType)>::type;
+
+    MessageType* _at(size_t pos) noexcept {
+        return std::launder(reinterpret_cast<MessageType*>(
+                                &_slots[pos & _mask]));
+    }
+
+    const size_t _mask;
+    std::unique_ptr<Slot[]> _slots;
+    /* consumer side */
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> _head;
+    size_t _tail_cache;
+    /* producer side */
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> _tail;
+    size_t _head_cache;
+};
+
+/* multiple producers, multiple consumers - every slot carries
+   sequence number telling whether it's ready for push or for pop,
+   so producers and consumers only contend on their own position */
+template<typename MessageType>
+class MpmcRing {
+public:
+    explicit MpmcRing(size_t capacity);
+    ~MpmcRing();
+
+    MpmcRing(const MpmcRing&) = delete;
+    MpmcRing& operator=(const MpmcRing&) = delete;
+
+    template<typename... Args>
+    bool try_push(Args&&... args);
+    bool try_pop(MessageType* message);
+    /* false already when push is claimed but not yet published */
+    bool empty() const noexcept;
+    bool full() const noexcept;
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        typename std::aligned_storage<sizeof(MessageType),
+                                      alignof(MessageType)>::type storage;
+
+        MessageType* message() noexcept {
+            return std::launder(reinterpret_cast<MessageType*>(&storage));
+        }
+    };
+
+    const size_t _mask;
+    std::unique_ptr<Cell[]> _cells;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> _enqueue_pos;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> _dequeue_pos;
+};
+
+namespace detail {
+
+inline size_t ringCapacity(size_t capacity) {
+    assert(capacity > 0);
+    size_t pow2 = 1;
+    while (pow2 < capacity)
+        pow2 *= 2;
+    return pow2;
+}
+
+} // namespace detail
+
+template<typename MessageType>
+SpscRing<MessageType>::SpscRing(size_t capacity)
+    : _mask{detail::ringCapacity(capacity) - 1},
+      _slots{new Slot[_mask + 1]},
+      _head{0},
+      _tail_cache{0},
+      _tail{0},
+      _head_cache{0} {
+}
+
+template<typename MessageType>
+SpscRing<MessageType>::~SpscRing() {
+    auto tail = _tail.load(std::memory_order_relaxed);
+    for (auto pos = _head.load(std::memory_order_relaxed); pos != tail; pos++)
+        _at(pos)->~MessageType();
+}
+
+template<typename MessageType>
+template<typename... Args>
+bool SpscRing<MessageType>::try_push(Args&&... args) {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    if (tail - _head_cache == _mask + 1) {
+        _head_cache = _head.load(std::memory_order_acquire);
+        if (tail - _head_cache == _mask + 1)
+            return false;
+    }
+    new (&_slots[tail & _mask]) MessageType(std::forward<Args>(args)...);
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename MessageType>
+bool SpscRing<MessageType>::try_pop(MessageType* message) {
+    assert(message != nullptr);
+    size_t head = _head.load(std::memory_order_relaxed);
+    if (head == _tail_cache) {
+        _tail_cache = _tail.load(std::memory_order_acquire);
+        if (head == _tail_cache)
+            return false;
+    }
+    auto stored = _at(head);
+    *message = std::move(*stored);
+    stored->~MessageType();
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename MessageType>
+bool SpscRing<MessageType>::empty() const noexcept {
+    return _head.load(std::memory_order_acquire) ==
+        _tail.load(std::memory_order_acquire);
+}
+
+template<typename MessageType>
+bool SpscRing<MessageType>::full() const noexcept {
+    return _tail.load(std::memory_order_acquire) -
+        _head.load(std::memory_order_acquire) == _mask + 1;
+}
+
+template<typename MessageType>
+MpmcRing<MessageType>::MpmcRing(size_t capacity)
+    : _mask{detail::ringCapacity(capacity) - 1},
+      _cells{new Cell[_mask + 1]},
+      _enqueue_pos{0},
+      _dequeue_pos{0} {
+    for (size_t i = 0; i != _mask + 1; i++)
+        _cells[i].seq.store(i, std::memory_order_relaxed);
+}
+
+template<typename MessageType>
+MpmcRing<MessageType>::~MpmcRing() {
+    auto enqueue_pos = _enqueue_pos.load(std::memory_order_relaxed);
+    for (auto pos = _dequeue_pos.load(std::memory_order_relaxed);
+         pos != enqueue_pos; pos++)
+        _cells[pos & _mask].message()->~MessageType();
+}
+
+template<typename MessageType>
+template<typename... Args>
+bool MpmcRing<MessageType>::try_push(Args&&... args) {
+    Cell* cell;
+    size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        cell = &_cells[pos & _mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            /* slot is free - claim it */
+            if (_enqueue_pos.compare_exchange_weak(
+                    pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* slot still holds message from previous lap */
+            return false;
+        } else {
+            /* other producer claimed it */
+            pos = _enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    new (&cell->storage) MessageType(std::forward<Args>(args)...);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename MessageType>
+bool MpmcRing<MessageType>::try_pop(MessageType* message) {
+    assert(message != nullptr);
+    Cell* cell;
+    size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+    while (true) {
+        cell = &_cells[pos & _mask];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        auto diff = static_cast<intptr_t>(seq) -
+            static_cast<intptr_t>(pos + 1);
+        if (diff == 0) {
+            if (_dequeue_pos.compare_exchange_weak(
+                    pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* nothing published yet */
+            return false;
+        } else {
+            pos = _dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    auto stored = cell->message();
+    *message = std::move(*stored);
+    stored->~MessageType();
+    /* ready for push on next lap */
+    cell->seq.store(pos + _mask + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename MessageType>
+bool MpmcRing<MessageType>::empty() const noexcept {
+    return _dequeue_pos.load(std::memory_order_acquire) >=
+        _enqueue_pos.load(std::memory_order_acquire);
+}
+
+template<typename MessageType>
+bool MpmcRing<MessageType>::full() const noexcept {
+    auto dequeue_pos = _dequeue_pos.load(std::memory_order_acquire);
+    return _enqueue_pos.load(std::memory_order_acquire) - dequeue_pos >=
+        _mask + 1;
+}
+
+} // namespace zodiactest
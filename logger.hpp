@@ -0,0 +1,534 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "lockfree_ring.hpp"
+#include "platform.hpp"
+
+namespace zodiactest {
+
+/* Asynchronous logger.
+   *
+   log() doesn't format anything: it copies format string pointer,
+   timestamp and raw argument bytes into a fixed size record of
+   calling thread's own SpscRing - no lock, no allocation, no
+   stream. Flusher thread drains all rings every few ms, merges
+   records by time, formats them and writes them to sink with
+   one fwrite().
+   *
+   Timestamps are TSC ticks (see cpuTicks()).
+   *
+   Format is a string literal (only pointer is kept) with "{}" for
+   every argument. Arguments are numbers, bool, char or anything
+   convertible to std::string_view - strings are copied at the
+   call, record holds about 100 bytes of arguments, the rest is
+   cut off. If thread's ring is full record is dropped, not
+   waited for - flusher reports number of dropped records.
+   *
+   Level check is one relaxed load, disabled calls cost nothing
+   but argument evaluation. */
+
+/* not upper case - DEBUG is a build macro */
+enum class LogLevel : int {
+    Trace = 0,
+    Debug,
+    Info,
+    Warning,
+    Error,
+    Off
+};
+
+constexpr size_t LOG_RECORD_SIZE = 128;
+
+namespace detail {
+
+/* type argument is stored as */
+template<typename T, typename = void>
+struct LogStored {
+    static_assert(std::is_convertible<const T&, std::string_view>::value,
+                  "log argument is neither number nor string");
+    using type = std::string_view;
+};
+
+template<typename T>
+struct LogStored<T, std::enable_if_t<std::is_arithmetic<T>::value>> {
+    using type = T;
+};
+
+template<typename T>
+using LogStoredT = typename LogStored<std::decay_t<T>>::type;
+
+/* serializes arguments into record, reader below walks them
+   in the same order with the same bounds checks */
+class LogArgWriter {
+public:
+    LogArgWriter(char* buf, size_t size) : _buf{buf}, _size{size}, _pos{0} {}
+
+    template<typename T>
+    void write(T val) {
+        if (_pos + sizeof(T) > _size)
+            return;
+        std::memcpy(_buf + _pos, &val, sizeof(T));
+        _pos += sizeof(T);
+    }
+    void write(std::string_view str) {
+        if (_pos + sizeof(uint16_t) > _size)
+            return;
+        auto len = static_cast<uint16_t>(
+            std::min(str.size(), _size - _pos - sizeof(uint16_t)));
+        write(len);
+        std::memcpy(_buf + _pos, str.data(), len);
+        _pos += len;
+    }
+
+private:
+    char* _buf;
+    const size_t _size;
+    size_t _pos;
+};
+
+class LogArgReader {
+public:
+    LogArgReader(const char* buf, size_t size)
+        : _buf{buf}, _size{size}, _pos{0} {}
+
+    /* false if argument didn't fit in record */
+    template<typename T>
+    bool read(T* val) {
+        if (_pos + sizeof(T) > _size)
+            return false;
+        std::memcpy(val, _buf + _pos, sizeof(T));
+        _pos += sizeof(T);
+        return true;
+    }
+    bool read(std::string_view* str) {
+        uint16_t len;
+        if (!read(&len))
+            return false;
+        *str = std::string_view(_buf + _pos, len);
+        _pos += len;
+        return true;
+    }
+
+private:
+    const char* _buf;
+    const size_t _size;
+    size_t _pos;
+};
+
+inline void appendLogValue(std::string& out, std::string_view str) {
+    out += str;
+}
+
+inline void appendLogValue(std::string& out, bool val) {
+    out += val ? "true" : "false";
+}
+
+inline void appendLogValue(std::string& out, char val) {
+    out += val;
+}
+
+template<typename T>
+std::enable_if_t<std::is_integral<T>::value> appendLogValue(std::string& out,
+                                                            T val) {
+    char digits[24];
+    auto res = std::to_chars(digits, digits + sizeof(digits), val);
+    out.append(digits, res.ptr);
+}
+
+template<typename T>
+std::enable_if_t<std::is_floating_point<T>::value>
+appendLogValue(std::string& out, T val) {
+    char digits[32];
+    int len = std::snprintf(digits, sizeof(digits), "%g",
+                            static_cast<double>(val));
+    out.append(digits, static_cast<size_t>(len));
+}
+
+/* text up to next "{}" of fmt, then argument in its place */
+template<typename T>
+void formatLogArg(std::string& out, const char** fmt, LogArgReader& reader) {
+    const char* placeholder = std::strstr(*fmt, "{}");
+    if (!placeholder) {
+        /* more arguments than placeholders */
+        return;
+    }
+    out.append(*fmt, placeholder);
+    *fmt = placeholder + 2;
+    T val;
+    if (reader.read(&val))
+        appendLogValue(out, val);
+    else
+        out += "...";
+}
+
+using LogFormatFn = void (*)(std::string& out, const char* fmt,
+                             const char* args, size_t size);
+
+template<typename... Stored>
+void formatLogRecord(std::string& out, const char* fmt,
+                     const char* args, size_t size) {
+    LogArgReader reader(args, size);
+    (formatLogArg<Stored>(out, &fmt, reader), ...);
+    out += fmt;
+}
+
+struct LogRecord {
+    static constexpr size_t ARGS_SIZE = LOG_RECORD_SIZE -
+        sizeof(long long) - sizeof(const char*) - sizeof(LogFormatFn) -
+        sizeof(LogLevel);
+
+    LogRecord() = default;
+
+    template<typename... Args>
+    LogRecord(LogLevel level_, const char* fmt_, const Args&... args_)
+        : ticks{cpuTicks()},
+          fmt{fmt_},
+          format{&formatLogRecord<LogStoredT<Args>...>},
+          level{level_} {
+        LogArgWriter writer(args, ARGS_SIZE);
+        (writer.write(static_cast<LogStoredT<Args>>(args_)), ...);
+    }
+
+    long long ticks;
+    const char* fmt;
+    LogFormatFn format;
+    LogLevel level;
+    char args[ARGS_SIZE];
+};
+
+static_assert(sizeof(LogRecord) == LOG_RECORD_SIZE, "record is padded");
+
+/* ring of one thread; detached when thread exits,
+   flusher drops it once it's empty */
+struct LogThreadBuffer {
+    explicit LogThreadBuffer(size_t capacity)
+        : ring(capacity), dropped{0}, detached{false} {}
+
+    SpscRing<LogRecord> ring;
+    std::atomic<uint64_t> dropped;
+    std::atomic<bool> detached;
+};
+
+} // namespace detail
+
+class Logger {
+public:
+    /* records a thread can have in flight by default */
+    static constexpr size_t RING_CAPACITY = 4096;
+
+    /* flusher thread starts right away, sink is stderr */
+    Logger();
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    /* writes everything logged so far; threads must not log
+       into logger being destroyed */
+    ~Logger();
+
+    /* process wide logger */
+    static Logger& instance();
+
+    bool enabled(LogLevel level) const noexcept {
+        return level != LogLevel::Off &&
+            level >= _level.load(std::memory_order_relaxed);
+    }
+    template<typename... Args>
+    void log(LogLevel level, const char* fmt, const Args&... args);
+
+    /* writes everything logged before the call */
+    void flush();
+
+    void setLevel(LogLevel level) noexcept {
+        _level.store(level, std::memory_order_relaxed);
+    }
+    LogLevel level() const noexcept {
+        return _level.load(std::memory_order_relaxed);
+    }
+    /* sink is not closed by logger */
+    void setSink(FILE* sink);
+    /* rings of threads logging for the first time */
+    void setRingCapacity(size_t capacity);
+    /* records dropped on full rings and reported so far */
+    uint64_t dropped() const noexcept {
+        return _dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    /* flusher's wake up period */
+    static constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(2);
+
+    detail::LogThreadBuffer& _threadBuffer();
+    detail::LogThreadBuffer& _addThreadBuffer();
+    void _mainFunc();
+    /* true if anything was written */
+    bool _drain();
+
+    const uint64_t _id;
+    const TickClock _clock;
+    std::atomic<LogLevel> _level;
+    std::atomic<uint64_t> _dropped;
+    size_t _ring_capacity;
+    std::vector<std::shared_ptr<detail::LogThreadBuffer>> _buffers;
+    std::mutex _buffers_mtx;
+    /* one consumer of rings at a time - flusher or flush() */
+    std::mutex _drain_mtx;
+    FILE* _sink;
+    std::vector<detail::LogRecord> _records;
+    std::string _text;
+    bool _stopping;
+    std::mutex _stop_mtx;
+    std::condition_variable _stop_cv;
+    std::thread _flusher;
+};
+
+namespace detail {
+
+/* thread's rings, one per logger it logged to */
+class LogThreadHolder {
+public:
+    ~LogThreadHolder() {
+        for (auto& entry : _entries)
+            entry.second->detached.store(true, std::memory_order_release);
+    }
+
+    LogThreadBuffer* find(uint64_t logger_id) noexcept {
+        if (_last && _last_id == logger_id)
+            return _last;
+        for (auto& entry : _entries) {
+            if (entry.first == logger_id) {
+                _last_id = logger_id;
+                _last = entry.second.get();
+                return _last;
+            }
+        }
+        return nullptr;
+    }
+    void add(uint64_t logger_id, std::shared_ptr<LogThreadBuffer> buffer) {
+        _last_id = logger_id;
+        _last = buffer.get();
+        _entries.emplace_back(logger_id, std::move(buffer));
+    }
+
+    static LogThreadHolder& local() {
+        thread_local LogThreadHolder holder;
+        return holder;
+    }
+
+private:
+    std::vector<std::pair<uint64_t,
+                          std::shared_ptr<LogThreadBuffer>>> _entries;
+    uint64_t _last_id = 0;
+    LogThreadBuffer* _last = nullptr;
+};
+
+inline uint64_t nextLoggerId() {
+    static std::atomic<uint64_t> id{0};
+    return ++id;
+}
+
+} // namespace detail
+
+inline Logger::Logger()
+    : _id{detail::nextLoggerId()},
+      _level{LogLevel::Info},
+      _dropped{0},
+      _ring_capacity{RING_CAPACITY},
+      _sink{stderr},
+      _stopping{false} {
+    _flusher = std::thread(&Logger::_mainFunc, this);
+}
+
+inline Logger::~Logger() {
+    {
+        std::lock_guard<std::mutex> lock(_stop_mtx);
+        _stopping = true;
+    }
+    _stop_cv.notify_one();
+    _flusher.join();
+    flush();
+}
+
+inline Logger& Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+template<typename... Args>
+void Logger::log(LogLevel level, const char* fmt, const Args&... args) {
+    if (!enabled(level))
+        return;
+    auto& buffer = _threadBuffer();
+    if (!buffer.ring.try_push(level, fmt, args...))
+        buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void Logger::flush() {
+    _drain();
+    std::lock_guard<std::mutex> lock(_drain_mtx);
+    std::fflush(_sink);
+}
+
+inline void Logger::setSink(FILE* sink) {
+    assert(sink != nullptr);
+    std::lock_guard<std::mutex> lock(_drain_mtx);
+    _sink = sink;
+}
+
+inline void Logger::setRingCapacity(size_t capacity) {
+    assert(capacity > 0);
+    std::lock_guard<std::mutex> lock(_buffers_mtx);
+    _ring_capacity = capacity;
+}
+
+inline detail::LogThreadBuffer& Logger::_threadBuffer() {
+    auto buffer = detail::LogThreadHolder::local().find(_id);
+    if (buffer)
+        return *buffer;
+    return _addThreadBuffer();
+}
+
+inline detail::LogThreadBuffer& Logger::_addThreadBuffer() {
+    std::lock_guard<std::mutex> lock(_buffers_mtx);
+    auto buffer = std::make_shared<detail::LogThreadBuffer>(_ring_capacity);
+    _buffers.push_back(buffer);
+    detail::LogThreadHolder::local().add(_id, buffer);
+    return *buffer;
+}
+
+inline void Logger::_mainFunc() {
+    std::unique_lock<std::mutex> lock(_stop_mtx);
+    while (!_stopping) {
+        lock.unlock();
+        bool written = _drain();
+        lock.lock();
+        if (!written) {
+            _stop_cv.wait_for(lock, FLUSH_INTERVAL,
+                              [this] { return _stopping; });
+        }
+    }
+}
+
+inline bool Logger::_drain() {
+    std::lock_guard<std::mutex> lock(_drain_mtx);
+    std::vector<std::shared_ptr<detail::LogThreadBuffer>> buffers;
+    {
+        std::lock_guard<std::mutex> buffers_lock(_buffers_mtx);
+        buffers = _buffers;
+    }
+
+    _records.clear();
+    uint64_t dropped = 0;
+    bool detached_empty = false;
+    for (auto& buffer : buffers) {
+        /* flag first - records pushed before detach are seen below */
+        bool detached = buffer->detached.load(std::memory_order_acquire);
+        detail::LogRecord record;
+        while (buffer->ring.try_pop(&record))
+            _records.push_back(record);
+        dropped += buffer->dropped.exchange(0, std::memory_order_relaxed);
+        detached_empty = detached_empty || detached;
+    }
+    if (detached_empty) {
+        std::lock_guard<std::mutex> buffers_lock(_buffers_mtx);
+        _buffers.erase(std::remove_if(
+                           _buffers.begin(), _buffers.end(),
+                           [](const auto& buffer) {
+                               return buffer->detached.load(
+                                   std::memory_order_acquire) &&
+                                   buffer->ring.empty();
+                           }),
+                       _buffers.end());
+    }
+    if (_records.empty() && !dropped)
+        return false;
+
+    /* every ring is in time order already */
+    std::stable_sort(_records.begin(), _records.end(),
+                     [](const auto& a, const auto& b) {
+                         return a.ticks < b.ticks;
+                     });
+    /* rate measured over logger's whole life */
+    double ns_per_tick = _clock.nsPerTick();
+    static const char* const level_names[] = {
+        "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR"
+    };
+    _text.clear();
+    for (const auto& record : _records) {
+        char prefix[48];
+        int len = std::snprintf(
+            prefix, sizeof(prefix), "%12.6f %s ",
+            static_cast<double>(record.ticks - _clock.startTicks()) *
+            ns_per_tick / 1e9,
+            level_names[static_cast<int>(record.level)]);
+        _text.append(prefix, static_cast<size_t>(len));
+        record.format(_text, record.fmt, record.args,
+                      detail::LogRecord::ARGS_SIZE);
+        _text += '\n';
+    }
+    if (dropped) {
+        _text += "logger: " + std::to_string(dropped) +
+            " records dropped on full ring\n";
+        _dropped.fetch_add(dropped, std::memory_order_relaxed);
+    }
+    std::fwrite(_text.data(), 1, _text.size(), _sink);
+    return true;
+}
+
+template<typename... Args>
+void logTrace(const char* fmt, const Args&... args) {
+    Logger::instance().log(LogLevel::Trace, fmt, args...);
+}
+
+template<typename... Args>
+void logDebug(const char* fmt, const Args&... args) {
+    Logger::instance().log(LogLevel::Debug, fmt, args...);
+}
+
+template<typename... Args>
+void logInfo(const char* fmt, const Args&... args) {
+    Logger::instance().log(LogLevel::Info, fmt, args...);
+}
+
+template<typename... Args>
+void logWarning(const char* fmt, const Args&... args) {
+    Logger::instance().log(LogLevel::Warning, fmt, args...);
+}
+
+template<typename... Args>
+void logError(const char* fmt, const Args&... args) {
+    Logger::instance().log(LogLevel::Error, fmt, args...);
+}
+
+/* "trace", "debug", "info", "warning", "error", "off";
+   fallback if name is null or unknown */
+inline LogLevel parseLogLevel(const char* name, LogLevel fallback) {
+    if (!name)
+        return fallback;
+    static const char* const names[] = {
+        "trace", "debug", "info", "warning", "error", "off"
+    };
+    for (int i = 0; i != static_cast<int>(LogLevel::Off) + 1; i++) {
+        if (std::strcmp(name, names[i]) == 0)
+            return static_cast<LogLevel>(i);
+    }
+    return fallback;
+}
+
+} // namespace zodiactest
@@ -1,49 +1,65 @@
 
 #include "main.hpp"
 
+#include <cassert>
 #include <chrono>
+#include <cstdlib>
 #include <iostream>
 
-#include "console.hpp"
+#include "logger.hpp"
 
 namespace zodiactest {
 
+QueueEvents::QueueEvents(std::shared_ptr<CreditGate> gate_sp)
+    : _gate_sp(gate_sp) {
+    assert(gate_sp != nullptr);
+}
+
 void QueueEvents::on_start() {
-    Writer::wakeAll();
+    _gate_sp->open();
 }
 
 void QueueEvents::on_stop() noexcept {
-    Writer::wakeAll();
+    _gate_sp->close();
 }
 
 void QueueEvents::on_hwm() {
-    logConsole("***Queue high watermark reached!\n");
-    Writer::suspendAll();
+    logInfo("***Queue high watermark reached!");
+    /* writers of this queue refill in smaller steps */
+    _gate_sp->shrink();
 }
 
 void QueueEvents::on_lwm() {
-    logConsole("***Queue low watermark reached!\n");
-    Writer::wakeAll();
+    logInfo("***Queue low watermark reached!");
+    _gate_sp->restore();
 }
 
 Main::Main(size_t rnum, size_t wnum)
-    : _mqueue_sp(std::make_shared<MessageQueue<std::string>>(10, 0, 10)) {
-    _mqueue_sp->setEvents(std::make_shared<QueueEvents>());
-
-    for(size_t i = 0; i != rnum; i++)
-        _readers.emplace_back(Reader("Reader" + std::to_string(i),
-                                     _mqueue_sp));
-
+    /* every queued message, one held by each reader and writer,
+       and one for the flushing reader - writers never wait for
+       a buffer that only a stopped queue holds */
+    : _pool_sp(std::make_shared<BufferPool>(MESSAGE_SIZE,
+                                            QUEUE_SIZE + rnum + wnum + 1)),
+      _mqueue_sp(std::make_shared<Queue>(QUEUE_SIZE, LWM, HWM)),
+      /* one credit per queue slot - puts never wait for space */
+      _gate_sp(std::make_shared<CreditGate>(QUEUE_SIZE, MAX_GRANT)),
+      _readers(_mqueue_sp, Reader("Reader", _gate_sp),
+               static_cast<int>(rnum)) {
+    /* handlers run on dispatcher thread, not in put/get */
+    _mqueue_sp->setEvents(std::make_shared<AsyncEvents>(
+                              std::make_shared<QueueEvents>(_gate_sp)));
+
+    /* writer i puts with priority i */
+    assert(wnum <= Writer::PRIORITIES);
     for(size_t i = 0; i != wnum; i++)
         _writers.emplace_back(Writer(static_cast<int>(i), /* increasing priority */
                                      "Writer" + std::to_string(i),
-                                     _mqueue_sp));
+                                     _mqueue_sp, _pool_sp, _gate_sp));
 }
 
 void Main::main() {
     _mqueue_sp->run();
-    for(auto & reader : _readers)
-        reader.run();
+    _readers.run();
 
     for(auto & writer : _writers)
         writer.run();
@@ -53,25 +69,32 @@ void Main::stop() noexcept
 {
     _mqueue_sp->stop();
     /* join all threads */
-    _readers.clear();
+    _readers.stop();
     _writers.clear();
 }
 
 void Main::flush()
 {
-    auto queueFlush = Reader("LastReader", _mqueue_sp);
+    ReaderPool<Queue, Reader> queueFlush(_mqueue_sp,
+                                         Reader("LastReader", _gate_sp), 1);
 
     /* notifiers not needed */
     _mqueue_sp->setEvents(nullptr);
 
+    Logger::instance().flush();
     std::clog << "Let's flush queue\n";
     
     _mqueue_sp->run(); // runnable state again
     queueFlush.run();
     
-    /* hope this is enough for cleanup */
-    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    /* writers are gone - empty queue stays empty */
+    while (_mqueue_sp->size())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
     _mqueue_sp->stop();
+    /* last message is handled before join */
+    queueFlush.stop();
+    /* readers' records go before totals */
+    Logger::instance().flush();
 
     std::clog << ("Writers wrote " +
                   std::to_string(Writer::gmsg_num) +
@@ -92,6 +115,15 @@ Main::~Main()
 
 int main(int argc, char ** argv)
 {
+    /* MQ_LOG_LEVEL=trace logs every message */
+#ifdef DEBUG
+    auto level = zodiactest::LogLevel::Trace;
+#else
+    auto level = zodiactest::LogLevel::Info;
+#endif
+    zodiactest::Logger::instance().setLevel(
+        zodiactest::parseLogLevel(std::getenv("MQ_LOG_LEVEL"), level));
+
     zodiactest::Main app(1/*readers*/, 2/*writers*/);
 
     std::clog << "Press enter to start\n";
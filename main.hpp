@@ -5,8 +5,12 @@
 #include <thread>
 #include <vector>
 
+#include "async_events.hpp"
+#include "flow_control.hpp"
+#include "message_buffer.hpp"
 #include "messagequeue.hpp"
 #include "reader.hpp"
+#include "reader_pool.hpp"
 #include "writer.hpp"
 
 namespace zodiactest {
@@ -14,13 +18,17 @@ namespace zodiactest {
 class QueueEvents : public IMessageQueueEvents
 {
 public:
-    QueueEvents() {}
+    /* watermarks tune credit grant of the queue's writers */
+    explicit QueueEvents(std::shared_ptr<CreditGate> gate_sp);
     ~QueueEvents() final {}
     
     void on_start() final;
     void on_stop() noexcept final;
     void on_hwm() final;
     void on_lwm() final;
+
+private:
+    std::shared_ptr<CreditGate> _gate_sp;
 };
 
 class Main
@@ -34,8 +42,19 @@ public:
     void flush();
 
 private:
-    std::shared_ptr<MessageQueue<std::string>> _mqueue_sp;
-    std::vector<Reader> _readers;
+    using Queue = Writer::Queue;
+
+    static constexpr int QUEUE_SIZE = 10;
+    static constexpr int LWM = 2;
+    static constexpr int HWM = 8;
+    static constexpr int MAX_GRANT = 4;
+    static constexpr size_t MESSAGE_SIZE = 64;
+
+    /* outlives queue holding its buffers */
+    std::shared_ptr<BufferPool> _pool_sp;
+    std::shared_ptr<Queue> _mqueue_sp;
+    std::shared_ptr<CreditGate> _gate_sp;
+    ReaderPool<Queue, Reader> _readers;
     std::vector<Writer> _writers;
 };
 
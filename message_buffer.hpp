@@ -0,0 +1,270 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <utility>
+
+#include "lockfree_ring.hpp"
+#include "platform.hpp"
+#include "wait_strategy.hpp"
+
+namespace zodiactest {
+
+class BufferPool;
+
+/* Pointer sized handle to a buffer of BufferPool.
+   *
+   Copies share the bytes and bump reference count, the last
+   reference returns buffer to its pool, so queue moves only
+   the handle and never the payload. Writer fills bytes through
+   data()/append() before the buffer is shared, readers take
+   view(). Bytes are never copied on put/get */
+class MessageBuffer {
+public:
+    MessageBuffer() noexcept : _header{nullptr} {}
+
+    MessageBuffer(const MessageBuffer& other) noexcept;
+    MessageBuffer(MessageBuffer&& other) noexcept;
+    MessageBuffer& operator=(const MessageBuffer& other) noexcept;
+    MessageBuffer& operator=(MessageBuffer&& other) noexcept;
+
+    ~MessageBuffer();
+
+    explicit operator bool() const noexcept {
+        return _header != nullptr;
+    }
+    char* data() noexcept {
+        assert(_header);
+        return reinterpret_cast<char*>(_header + 1);
+    }
+    const char* data() const noexcept {
+        assert(_header);
+        return reinterpret_cast<const char*>(_header + 1);
+    }
+    size_t size() const noexcept {
+        assert(_header);
+        return _header->size;
+    }
+    size_t capacity() const noexcept;
+    /* after writing through data(), size <= capacity() */
+    void resize(size_t size) noexcept;
+    /* copies as much of bytes as fits, returns number copied */
+    size_t append(std::string_view bytes) noexcept;
+    std::string_view view() const noexcept {
+        return std::string_view(data(), size());
+    }
+    int useCount() const noexcept;
+    /* drops this reference */
+    void reset() noexcept;
+
+private:
+    friend class BufferPool;
+
+    struct Header {
+        std::atomic<int> refs;
+        uint32_t size;
+        BufferPool* pool;
+    };
+
+    explicit MessageBuffer(Header* header) noexcept
+        : _header{header} {}
+
+    Header* _header;
+};
+
+/* for ByteBudget queues - payload lives in the pool,
+   but it's what queue holds on to */
+inline size_t messageBytes(const MessageBuffer& msg) noexcept {
+    return sizeof(msg) + (msg ? msg.size() : 0);
+}
+
+/* payload prefetch hook of pipelined ReaderPool workers -
+   header and first bytes share the buffer's first line */
+inline void prefetchMessage(const MessageBuffer& msg) noexcept {
+    if (msg)
+        prefetchRead(msg.data());
+}
+
+/* Fixed number of buffers carved from one slab allocated up
+   front, free buffers are kept in lock-free ring so that
+   writers and readers acquire and release from any thread.
+   *
+   Every buffer starts on its own cache line. Pool has to
+   outlive all its buffers - size it for queue capacity plus
+   buffers held by writers and readers, or acquire() waits
+   for a reader to drop one */
+class BufferPool {
+public:
+    BufferPool(size_t buffer_size, size_t buffers);
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    ~BufferPool();
+
+    /* empty buffer if all are in use */
+    MessageBuffer tryAcquire();
+    /* waits for a buffer to be released */
+    MessageBuffer acquire();
+    /* how acquire() waits on exhausted pool,
+       not synchronized - set before use */
+    void setWaitStrategy(const WaitStrategy& strategy);
+
+    size_t bufferSize() const noexcept {
+        return _buffer_size;
+    }
+    size_t buffers() const noexcept {
+        return _buffers;
+    }
+
+private:
+    friend class MessageBuffer;
+    using Header = MessageBuffer::Header;
+
+    void _release(Header* header) noexcept;
+
+    const size_t _buffer_size;
+    const size_t _stride;
+    const size_t _buffers;
+    char* _slab;
+    MpmcRing<Header*> _free;
+    WaitStrategy _wait_strategy;
+    Parking _waiting;
+};
+
+inline MessageBuffer::MessageBuffer(const MessageBuffer& other) noexcept
+    : _header{other._header} {
+    if (_header)
+        _header->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline MessageBuffer::MessageBuffer(MessageBuffer&& other) noexcept
+    : _header{other._header} {
+    other._header = nullptr;
+}
+
+inline MessageBuffer& MessageBuffer::operator=(
+    const MessageBuffer& other) noexcept {
+    if (_header != other._header) {
+        if (other._header)
+            other._header->refs.fetch_add(1, std::memory_order_relaxed);
+        reset();
+        _header = other._header;
+    }
+    return *this;
+}
+
+inline MessageBuffer& MessageBuffer::operator=(
+    MessageBuffer&& other) noexcept {
+    if (this != &other) {
+        reset();
+        _header = other._header;
+        other._header = nullptr;
+    }
+    return *this;
+}
+
+inline MessageBuffer::~MessageBuffer() {
+    reset();
+}
+
+inline size_t MessageBuffer::capacity() const noexcept {
+    assert(_header);
+    return _header->pool->bufferSize();
+}
+
+inline void MessageBuffer::resize(size_t size) noexcept {
+    assert(size <= capacity());
+    _header->size = static_cast<uint32_t>(size);
+}
+
+inline size_t MessageBuffer::append(std::string_view bytes) noexcept {
+    size_t len = std::min(bytes.size(), capacity() - size());
+    std::memcpy(data() + size(), bytes.data(), len);
+    _header->size += static_cast<uint32_t>(len);
+    return len;
+}
+
+inline int MessageBuffer::useCount() const noexcept {
+    return _header ? _header->refs.load(std::memory_order_relaxed) : 0;
+}
+
+inline void MessageBuffer::reset() noexcept {
+    if (!_header)
+        return;
+    /* acq_rel - last owner sees every write of
+       other owners before buffer is reused */
+    if (_header->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        _header->pool->_release(_header);
+    _header = nullptr;
+}
+
+inline BufferPool::BufferPool(size_t buffer_size, size_t buffers)
+    : _buffer_size{buffer_size},
+      _stride{(sizeof(Header) + buffer_size + CACHE_LINE_SIZE - 1) /
+              CACHE_LINE_SIZE * CACHE_LINE_SIZE},
+      _buffers{buffers},
+      _slab{nullptr},
+      _free(buffers),
+      _wait_strategy(WaitStrategy::defaultStrategy()) {
+    assert(buffer_size > 0 && buffer_size <= UINT32_MAX);
+    assert(buffers > 0);
+    _slab = static_cast<char*>(::operator new(
+        _stride * _buffers, std::align_val_t{CACHE_LINE_SIZE}));
+    for (size_t i = 0; i != _buffers; i++) {
+        auto header = new (_slab + i * _stride) Header{{0}, 0, this};
+        _free.try_push(header);
+    }
+}
+
+inline BufferPool::~BufferPool() {
+    size_t released = 0;
+    Header* header;
+    while (_free.try_pop(&header)) {
+        header->~Header();
+        ++released;
+    }
+    /* buffers outliving their pool would point to freed slab */
+    assert(released == _buffers);
+    (void)released;
+    ::operator delete(_slab, std::align_val_t{CACHE_LINE_SIZE});
+}
+
+inline MessageBuffer BufferPool::tryAcquire() {
+    Header* header;
+    if (!_free.try_pop(&header))
+        return MessageBuffer();
+    header->refs.store(1, std::memory_order_relaxed);
+    header->size = 0;
+    return MessageBuffer(header);
+}
+
+inline MessageBuffer BufferPool::acquire() {
+    while (true) {
+        auto buffer = tryAcquire();
+        if (buffer)
+            return buffer;
+        _waiting.wait(_wait_strategy, [this] {
+                return !_free.empty();
+            });
+    }
+}
+
+inline void BufferPool::setWaitStrategy(const WaitStrategy& strategy) {
+    _wait_strategy = strategy;
+}
+
+inline void BufferPool::_release(Header* header) noexcept {
+    /* ring holds every buffer of the pool - can't be full */
+    bool pushed = _free.try_push(header);
+    assert(pushed);
+    (void)pushed;
+    _waiting.wakeOne();
+}
+
+} // namespace zodiactest
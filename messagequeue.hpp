@@ -1,12 +1,25 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cassert>
-#include <condition_variable>
-#include <map>
-#include <queue>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+#include "event_policy.hpp"
+#include "lock_policy.hpp"
+#include "metrics.hpp"
+#include "priority_storage.hpp"
+#include "wait_strategy.hpp"
 
 namespace zodiactest {
     
@@ -14,24 +27,139 @@ enum class RetCode : int {
     OK = 0,
     HWM = -1,
     NO_SPACE = -2,
-    STOPPED = -3
+    STOPPED = -3,
+    TIMEOUT = -4,
+    WOULD_BLOCK = -5,
+    /* process sharing the queue died, see shm_messagequeue.hpp */
+    PEER_DEAD = -6
 };
 
-class IMessageQueueEvents {
+/* Told that a reader waiting outside the queue may proceed:
+   queue became non-empty, was run or stopped. Called under
+   queue lock - must not block or call the queue, see QueueSet
+   and QueueEventFd in queue_set.hpp */
+class IReadyListener {
 public:
-    IMessageQueueEvents() {}
-    virtual ~IMessageQueueEvents() {}
-    
-    virtual void on_start() = 0;
-    virtual void on_hwm() = 0;
-    virtual void on_lwm() = 0;
-    virtual void on_stop() = 0;
+    virtual ~IReadyListener() {}
+
+    virtual void on_ready() noexcept = 0;
+};
+
+namespace detail {
+
+/* async_get()/async_put() parked on queue - queue completes
+   the operation for it, sets ret and calls wake() */
+struct AsyncWaiter {
+    AsyncWaiter* next = nullptr;
+    RetCode ret = RetCode::OK;
+    void (*wake)(AsyncWaiter*) = nullptr;
+};
+
+template<typename MessageType>
+struct AsyncGetWaiter : AsyncWaiter {
+    explicit AsyncGetWaiter(MessageType* message_) : message{message_} {}
+
+    MessageType* message;
+};
+
+template<typename MessageType>
+struct AsyncPutWaiter : AsyncWaiter {
+    AsyncPutWaiter(MessageType&& message_, int priority_)
+        : priority{priority_}, message(std::move(message_)) {}
+
+    int priority;
+    MessageType message;
+};
+
+/* intrusive FIFO, waiters live in coroutine frames */
+template<typename Waiter>
+class AsyncWaiters {
+public:
+    bool empty() const noexcept {
+        return !_head;
+    }
+    void push(Waiter* waiter) noexcept {
+        waiter->next = nullptr;
+        if (_tail)
+            _tail->next = waiter;
+        else
+            _head = waiter;
+        _tail = waiter;
+    }
+    Waiter* front() const noexcept {
+        return _head;
+    }
+    Waiter* pop() noexcept {
+        auto waiter = _head;
+        _head = static_cast<Waiter*>(waiter->next);
+        if (!_head)
+            _tail = nullptr;
+        return waiter;
+    }
+
+private:
+    Waiter* _head = nullptr;
+    Waiter* _tail = nullptr;
+};
+
+/* std::atomic stand-in for a queue of one thread (NoLock):
+   nobody polls it, so it needn't hold back the optimizer */
+template<typename T>
+class Unshared {
+public:
+    constexpr Unshared(T value) noexcept : _value{value} {}
+
+    T load(std::memory_order = std::memory_order_seq_cst) const noexcept {
+        return _value;
+    }
+    void store(T value,
+               std::memory_order = std::memory_order_seq_cst) noexcept {
+        _value = value;
+    }
+    operator T() const noexcept {
+        return _value;
+    }
+    Unshared& operator=(T value) noexcept {
+        _value = value;
+        return *this;
+    }
+
+private:
+    T _value;
 };
 
-template <typename MessageType>
+template<typename T, bool Threaded>
+using MaybeAtomic = std::conditional_t<Threaded, std::atomic<T>, Unshared<T>>;
+
+template<typename MessageType, typename... Args>
+struct IsMessage : std::false_type {};
+template<typename MessageType, typename Arg>
+struct IsMessage<MessageType, Arg>
+    : std::is_same<std::decay_t<Arg>, MessageType> {};
+
+} // namespace detail
+
+/* Bounded priority queue, behaviour picked at compile time:
+   StoragePolicy (priority_storage.hpp) - how messages are kept,
+   MetricsPolicy (metrics.hpp) - what is counted: messages, waits,
+     watermark events and lock contention, see metrics().snapshot(),
+   LockPolicy (lock_policy.hpp) - how threads are excluded, if at all,
+   EventPolicy (event_policy.hpp) - how watermark events are called.
+   NoMetrics and NoEvents compile away. NoLock with NoEvents is a
+   bare queue: put/get are storage calls behind state and room
+   checks, nobody to wake - so no async_get/async_put, no listeners */
+template <typename MessageType, typename StoragePolicy = PriorityMap,
+          typename MetricsPolicy = DefaultMetrics,
+          typename LockPolicy = StdLock,
+          typename EventPolicy = VirtualEvents>
 class MessageQueue {
 public:
-    MessageQueue(int queue_size, int lwm, int hwm);
+    using value_type = MessageType;
+
+    /* storage_args follow queue_size to storage constructor */
+    template<typename... StorageArgs>
+    MessageQueue(int queue_size, int lwm, int hwm,
+                 StorageArgs&&... storage_args);
     
     MessageQueue(const MessageQueue&) = delete;
     MessageQueue& operator=(const MessageQueue&) = delete;
@@ -41,51 +169,282 @@ public:
     ~MessageQueue();
 
     RetCode put(const MessageType& message, int priority);
+    RetCode put(MessageType&& message, int priority);
+    /* message is dropped instead of delivered once steady
+       clock passes expires_at, needs Expiring storage */
+    RetCode put(const MessageType& message, int priority,
+                std::chrono::steady_clock::time_point expires_at);
+    RetCode put(MessageType&& message, int priority,
+                std::chrono::steady_clock::time_point expires_at);
+    /* constructs message right in queue storage */
+    template<typename... Args>
+    RetCode emplace(int priority, Args&&... args);
     RetCode get(MessageType* message);
-    void setEvents(std::shared_ptr<IMessageQueueEvents> events);
+    /* doesn't wait - empty optional if queue is empty or stopped */
+    std::optional<MessageType> try_get();
+
+    /* Non-blocking and timed versions of put/get.
+       try_put() returns NO_SPACE on full queue, try_get()
+       returns WOULD_BLOCK on empty one, timed calls return TIMEOUT.
+       *
+       Events are still called on caller's thread, so
+       on_hwm() that blocks will block these calls too */
+    template<typename Message>
+    RetCode try_put(Message&& message, int priority);
+    template<typename Message, typename Rep, typename Period>
+    RetCode put_for(Message&& message, int priority,
+                    const std::chrono::duration<Rep, Period>& timeout);
+    template<typename Message, typename Clock, typename Duration>
+    RetCode put_until(Message&& message, int priority,
+                      const std::chrono::time_point<Clock, Duration>& deadline);
+    RetCode try_get(MessageType* message);
+    template<typename Rep, typename Period>
+    RetCode get_for(MessageType* message,
+                    const std::chrono::duration<Rep, Period>& timeout);
+    template<typename Clock, typename Duration>
+    RetCode get_until(MessageType* message,
+                      const std::chrono::time_point<Clock, Duration>& deadline);
+
+    /* whole range goes in under one lock acquisition,
+       waits for space only when queue gets full in the middle;
+       number of messages actually put is stored to put_num;
+       wrap iterators with std::make_move_iterator to move messages in */
+    template<typename InputIt>
+    RetCode put_bulk(InputIt first, InputIt last, int priority,
+                     int* put_num = nullptr);
+    /* waits for at least one message, then takes up to
+       max_count messages without releasing the lock */
+    template<typename OutputIt>
+    RetCode get_bulk(OutputIt out, int max_count,
+                     int* got_num = nullptr);
+
+#if defined(__cpp_impl_coroutine)
+    /* C++20 awaitables: co_await q.async_get(&message, executor)
+       and co_await q.async_put(message, priority, executor) give
+       RetCode like get/put, but suspend the coroutine instead of
+       blocking the thread. Parked coroutines are served before
+       threads blocked in get/put: put hands its message straight
+       to the oldest parked async_get, get moves the oldest parked
+       async_put's message in. stop() resumes them with STOPPED.
+       *
+       Coroutine is resumed by executor(std::coroutine_handle<>),
+       called under queue lock - it must only schedule the handle,
+       see CoroutinePool in coroutine.hpp. Watermark events are
+       called on the thread that starts the co_await */
+    template<typename Executor>
+    class GetAwaiter;
+    template<typename Executor>
+    class PutAwaiter;
+
+    template<typename Executor>
+    GetAwaiter<Executor> async_get(MessageType* message, Executor& executor);
+    template<typename Executor>
+    PutAwaiter<Executor> async_put(MessageType message, int priority,
+                                   Executor& executor);
+#endif
+
+    /* shared_ptr<IMessageQueueEvents> with VirtualEvents,
+       Handler* with StaticEvents<Handler> */
+    void setEvents(typename EventPolicy::Handle events);
+    /* no calls to listener after removeListener() returns */
+    void addListener(IReadyListener* listener);
+    void removeListener(IReadyListener* listener);
+    /* how readers wait on empty and writers on full queue */
+    void setWaitStrategy(const WaitStrategy& strategy);
 
     void stop();
     void run();
     int size() const noexcept;
+    /* part of queue_size in use - number of messages,
+       or their bytes with ByteBudget storage */
+    int used() const noexcept;
+    /* highest priority in queue or NO_PRIORITY if it's empty,
+       read without lock - may be stale by the time it's used */
+    int topPriority() const noexcept;
+    /* returns memory storage kept for load that is gone
+       (ElasticLevels). Readers parked in get() do it every
+       storage trim period, call it from a timer when queue
+       is read by try_get(), async_get() or listeners only */
+    void trim();
+
+    const MetricsPolicy& metrics() const noexcept {
+        return _metrics;
+    }
+
+    static constexpr int NO_PRIORITY = std::numeric_limits<int>::min();
+    static constexpr long long NEVER_EXPIRES =
+        std::numeric_limits<long long>::max();
     
 private:
+    using Mutex = typename LockPolicy::Mutex;
+    using Condition = typename LockPolicy::Condition;
     using MessageTypePrior = std::pair<int, MessageType>;
+    /* max() - wait forever, min() - don't wait at all */
+    using Deadline = std::chrono::steady_clock::time_point;
     enum class QueueState : int {
         RUNNING = 0,
         STOPPED
     };
 
-    void _notifyReaders() const noexcept;
-    void _notifyWriters() const noexcept;
-    void _push(const MessageType& message, int priority);
-    void _pop(MessageType* message);
+    /* counts contention when metrics are on */
+    std::unique_lock<Mutex> _lock();
+    /* serve parked async_get/async_put first, then wake
+       parked threads - a queue of one thread has none */
+    inline void _notifyReaders() {
+        if constexpr (!BARE) {
+            if (!_rd_async.empty()) {
+                _serveAsyncReaders();
+            }
+        }
+        if constexpr (LockPolicy::threaded) {
+            if (_rd_waiters) {
+                _rd_notify.notify_all();
+            }
+        }
+    }
+    inline void _notifyWriters() {
+        if constexpr (!BARE) {
+            bool pushed = !_wr_async.empty() && _serveAsyncWriters();
+            if constexpr (LockPolicy::threaded) {
+                if (_wr_waiters) {
+                    _wr_notify.notify_all();
+                }
+                if (pushed && _rd_waiters) {
+                    _rd_notify.notify_all();
+                }
+            } else {
+                (void)pushed;
+            }
+        }
+    }
+    void _serveAsyncReaders();
+    /* true if a parked async_put got its message in */
+    bool _serveAsyncWriters();
+    void _cancelAsync();
+    void _notifyListeners() const noexcept;
+    RetCode _checkHwm(std::unique_lock<Mutex>& lock);
+    void _checkLwm(std::unique_lock<Mutex>& lock);
+    RetCode _waitWritable(std::unique_lock<Mutex>& lock,
+                          Deadline deadline, int units);
+    RetCode _waitReadable(std::unique_lock<Mutex>& lock,
+                          Deadline deadline);
+    template<typename Pred>
+    bool _wait(std::unique_lock<Mutex>& lock,
+               Condition& notify, int& waiters,
+               Deadline deadline, WaitKind kind, Pred ready);
+    template<typename... Args>
+    RetCode _put(Deadline deadline, long long expires_ns, int priority,
+                 Args&&... args);
+    RetCode _get(Deadline deadline, MessageType* message);
+    template<typename Clock, typename Duration>
+    static Deadline _toDeadline(
+        const std::chrono::time_point<Clock, Duration>& deadline);
+    template<typename... Args>
+    void _push(int priority, int units, long long expires_ns,
+               Args&&... args);
+    /* false if every message it took had expired */
+    bool _pop(MessageType* message);
+    /* lazy purge - only when expired messages may be in the way */
+    void _purgeExpired(int units);
     
+    /* what message takes of queue_size */
+    template<typename... Args>
+    static int _units(const Args&... args) {
+        if constexpr (!COUNTS_BYTES) {
+            return 1;
+        } else {
+            static_assert(sizeof...(Args) == 1, "message is built");
+            return static_cast<int>(
+                messageBytes(static_cast<const MessageType&>(args)...));
+        }
+    }
+    inline int _used() const noexcept {
+        if constexpr (COUNTS_BYTES) {
+            return _used_bytes.load(std::memory_order_relaxed);
+        } else {
+            return _size();
+        }
+    }
+    /* oversized message still goes into empty queue
+       or it could never be put */
+    inline bool _fits(int units) const noexcept {
+        return _used() + units <= _queue_size || _size() == 0;
+    }
+
+    /* atomic only to be polled by spinning threads,
+       written under _mtx */
     inline int _size() const noexcept {
-        return _current_size;
+        return _current_size.load(std::memory_order_relaxed);
+    }
+    inline void _addSize(int delta) noexcept {
+        _current_size.store(_size() + delta, std::memory_order_relaxed);
+    }
+    inline bool _stopped() const noexcept {
+        return _queue_state.load(std::memory_order_relaxed) ==
+            QueueState::STOPPED;
     }
     
-    int _current_size;
+    using Storage = typename StoragePolicy::template Storage<
+        typename MetricsPolicy::template Entry<MessageType>>;
+    static constexpr bool COUNTS_BYTES = detail::CountsBytes<Storage>::value;
+    static constexpr bool EXPIRES = detail::Expires<Storage>::value;
+    static constexpr bool TRIMS = detail::Trims<Storage>::value;
+    /* _top_priority is for threads that read it without lock,
+       a queue of one thread asks storage instead */
+    static constexpr bool TRACKS_TOP = LockPolicy::threaded;
+    /* one thread and no events - put/get skip the queue machinery */
+    static constexpr bool BARE =
+        !LockPolicy::threaded && !EventPolicy::enabled;
+
+    detail::MaybeAtomic<int, LockPolicy::threaded> _current_size;
+    /* ByteBudget storage only */
+    detail::MaybeAtomic<int, LockPolicy::threaded> _used_bytes;
+    detail::MaybeAtomic<int, LockPolicy::threaded> _top_priority;
     int _queue_size;
     int _lwm;
     int _hwm;
-    QueueState _queue_state;
+    detail::MaybeAtomic<QueueState, LockPolicy::threaded> _queue_state;
     bool _hwm_flag; // solves multiple LWM notification problem
-    /* would be effective when number of priorities is not high */
-    std::map<int, std::queue<MessageType>> _map_of_queue;
-    std::shared_ptr<IMessageQueueEvents> _events;
-    mutable std::mutex _mtx;
-    mutable std::condition_variable _rd_notify;
-    mutable std::condition_variable _wr_notify;
+    WaitStrategy _wait_strategy;
+    /* threads parked on _rd_notify/_wr_notify -
+       no notify if nobody sleeps */
+    int _rd_waiters;
+    int _wr_waiters;
+    MetricsPolicy _metrics;
+    Storage _storage;
+    EventPolicy _events;
+    mutable Mutex _mtx;
+    mutable Condition _rd_notify;
+    mutable Condition _wr_notify;
+    detail::AsyncWaiters<detail::AsyncGetWaiter<MessageType>> _rd_async;
+    detail::AsyncWaiters<detail::AsyncPutWaiter<MessageType>> _wr_async;
+    std::vector<IReadyListener*> _listeners;
 };
 
-template<typename MessageType>
-MessageQueue<MessageType>::MessageQueue(int queue_size,
-                                        int lwm, int hwm)
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename... StorageArgs>
+MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+             EventPolicy>::MessageQueue(
+    int queue_size, int lwm, int hwm, StorageArgs&&... storage_args)
     : _current_size{0},
+      _used_bytes{0},
+      _top_priority{NO_PRIORITY},
       _queue_state{QueueState::STOPPED},
-      _hwm_flag{false} {
+      _hwm_flag{false},
+      _wait_strategy(WaitStrategy::defaultStrategy()),
+      _rd_waiters{0},
+      _wr_waiters{0},
+      _storage(queue_size, std::forward<StorageArgs>(storage_args)...) {
     assert(queue_size > 0);
     _queue_size = queue_size;
+    /* persistent storage starts with messages,
+       maybe more than queue_size */
+    int recovered = detail::recoveredMessages(_storage);
+    if (recovered) {
+        _current_size = recovered;
+        _top_priority = _storage.top();
+    }
 
     assert(lwm >= 0 && lwm < _queue_size);
     assert(hwm >= 0 && hwm <= _queue_size);
@@ -94,172 +453,956 @@ MessageQueue<MessageType>::MessageQueue(int queue_size,
     _hwm = hwm;
 }
 
-template<typename MessageType>
-MessageQueue<MessageType>::~MessageQueue() {
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+             EventPolicy>::~MessageQueue() {
     stop();
 }
 
-template<typename MessageType>
-RetCode MessageQueue<MessageType>::put(const MessageType& message,
-                                       int priority) {
-    std::unique_lock<std::mutex> lock(_mtx);
-    
-    if (_queue_state == QueueState::STOPPED) {
-        return RetCode::STOPPED;
-    }
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::put(
+    const MessageType& message, int priority) {
+    return _put(Deadline::max(), NEVER_EXPIRES, priority, message);
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::put(
+    MessageType&& message, int priority) {
+    return _put(Deadline::max(), NEVER_EXPIRES, priority, std::move(message));
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::put(
+    const MessageType& message, int priority,
+    std::chrono::steady_clock::time_point expires_at) {
+    static_assert(EXPIRES, "expiry needs Expiring storage");
+    return _put(Deadline::max(), steadyNs(expires_at), priority, message);
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::put(
+    MessageType&& message, int priority,
+    std::chrono::steady_clock::time_point expires_at) {
+    static_assert(EXPIRES, "expiry needs Expiring storage");
+    return _put(Deadline::max(), steadyNs(expires_at), priority,
+                std::move(message));
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename... Args>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::emplace(int priority,
+                                                         Args&&... args) {
+    return _put(Deadline::max(), NEVER_EXPIRES, priority,
+                std::forward<Args>(args)...);
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename... Args>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::_put(Deadline deadline,
+                                                      long long expires_ns,
+                                                      int priority,
+                                                      Args&&... args) {
+    if constexpr (COUNTS_BYTES &&
+                  !detail::IsMessage<MessageType, Args...>::value) {
+        /* bytes are known once message is built */
+        return _put(deadline, expires_ns, priority,
+                    MessageType(std::forward<Args>(args)...));
+    } else if constexpr (BARE) {
+        (void)deadline;
+        int units = _units(args...);
+        if (_stopped()) {
+            return RetCode::STOPPED;
+        }
+        _purgeExpired(units);
+        /* nobody else could make room */
+        if (!_fits(units)) {
+            return RetCode::TIMEOUT;
+        }
+        _push(priority, units, expires_ns, std::forward<Args>(args)...);
+        return RetCode::OK;
+    } else {
+        int units = _units(args...);
+        auto lock = _lock();
     
-    /* hwm condition and events mechanism active */
-    if (_events && _size() >= _hwm) {
-        _hwm_flag = true;
-        /* increment use count since need to access
-           _events in unlocked context */
-        auto events = _events;
-        lock.unlock();
-        events->on_hwm();
-        lock.lock();
-        /* after unlock/lock */
-        /* anything could happen - recheck */
         if (_queue_state == QueueState::STOPPED) {
             return RetCode::STOPPED;
         }
-        /* here I intentionally don't check
-           that HWM condition is not true
-           because that would inject high level logic 
-           into queue, assuming on_hwm() is blocking all writers
-           *
-           HENCE - writers have ability to race
-           for writing higher than HWM level*/
-    }
-    if (_size() == _queue_size) {
-        /* no free space -
-           wait writers notification */
-        _wr_notify.wait(lock, [this] {
-                return _queue_state == QueueState::STOPPED ||
-                    _size() != _queue_size;
-            });
-        /* anything could happen - recheck */
-        if (_queue_state == QueueState::STOPPED) {
+    
+        _purgeExpired(units);
+        if (_checkHwm(lock) == RetCode::STOPPED) {
             return RetCode::STOPPED;
         }
+        auto ret = _waitWritable(lock, deadline, units);
+        if (ret != RetCode::OK) {
+            return ret;
+        }
+
+        _push(priority, units, expires_ns, std::forward<Args>(args)...);
+    
+        _notifyReaders();
+        return RetCode::OK;
     }
+}
 
-    _push(message, priority);
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::get(MessageType* message) {
+    return _get(Deadline::max(), message);
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::_get(Deadline deadline,
+                                                      MessageType* message) {
+    if constexpr (BARE) {
+        (void)deadline;
+        if (_stopped()) {
+            return RetCode::STOPPED;
+        }
+        /* nobody else could bring a message */
+        while (_size()) {
+            if (_pop(message)) {
+                return RetCode::OK;
+            }
+        }
+        return RetCode::TIMEOUT;
+    }
+    auto lock = _lock();
     
-    _notifyReaders();
+    if (_queue_state == QueueState::STOPPED) {
+        return RetCode::STOPPED;
+    }
+    
+    while (true) {
+        auto ret = _waitReadable(lock, deadline);
+        if (ret != RetCode::OK) {
+            return ret;
+        }
+        if (_pop(message)) {
+            break;
+        }
+        /* only expired messages were left */
+        _notifyWriters();
+    }
+    
+    _notifyWriters();
+    _checkLwm(lock);
     return RetCode::OK;
 }
 
-template<typename MessageType>
-RetCode MessageQueue<MessageType>::get(MessageType* message) {
-    std::unique_lock<std::mutex> lock(_mtx);
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+std::optional<MessageType> MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                                        EventPolicy>::try_get() {
+    auto lock = _lock();
+    
+    if (_queue_state == QueueState::STOPPED || _size() == 0) {
+        return std::nullopt;
+    }
+    
+    std::optional<MessageType> message{std::in_place};
+    if (!_pop(&*message)) {
+        message.reset();
+    }
+    
+    _notifyWriters();
+    _checkLwm(lock);
+    return message;
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename Message>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::try_put(Message&& message,
+                                                         int priority) {
+    auto ret = _put(Deadline::min(), NEVER_EXPIRES, priority,
+                    std::forward<Message>(message));
+    return ret == RetCode::TIMEOUT ? RetCode::NO_SPACE : ret;
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename Message, typename Rep, typename Period>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::put_for(
+    Message&& message, int priority,
+    const std::chrono::duration<Rep, Period>& timeout) {
+    return _put(_toDeadline(std::chrono::steady_clock::now() + timeout),
+                NEVER_EXPIRES, priority, std::forward<Message>(message));
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename Message, typename Clock, typename Duration>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::put_until(
+    Message&& message, int priority,
+    const std::chrono::time_point<Clock, Duration>& deadline) {
+    return _put(_toDeadline(deadline), NEVER_EXPIRES, priority,
+                std::forward<Message>(message));
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::try_get(
+    MessageType* message) {
+    auto ret = _get(Deadline::min(), message);
+    return ret == RetCode::TIMEOUT ? RetCode::WOULD_BLOCK : ret;
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename Rep, typename Period>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::get_for(
+    MessageType* message,
+    const std::chrono::duration<Rep, Period>& timeout) {
+    return _get(_toDeadline(std::chrono::steady_clock::now() + timeout),
+                message);
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename Clock, typename Duration>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::get_until(
+    MessageType* message,
+    const std::chrono::time_point<Clock, Duration>& deadline) {
+    return _get(_toDeadline(deadline), message);
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename InputIt>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::put_bulk(
+    InputIt first, InputIt last, int priority, int* put_num) {
+    int num = 0;
+    if (put_num) {
+        *put_num = 0;
+    }
+    auto lock = _lock();
     
     if (_queue_state == QueueState::STOPPED) {
         return RetCode::STOPPED;
     }
+    if (first == last) {
+        return RetCode::OK;
+    }
     
-    if (_size() == 0) {
-        /* emty queue - wait notififcation from writers */
-        _rd_notify.wait(lock, [this] {
-                return _queue_state == QueueState::STOPPED ||
-                    _size() != 0;
-            });
+    /* watermark is checked once per batch */
+    _purgeExpired(_units(*first));
+    if (_checkHwm(lock) == RetCode::STOPPED) {
+        return RetCode::STOPPED;
+    }
+    /* TIMEOUT when nobody else could make room (NoLock) */
+    auto ret = RetCode::OK;
+    while (first != last) {
+        int units = _units(*first);
+        if (!_fits(units)) {
+            /* readers have to drain what is already
+               pushed or we'd wait forever */
+            _notifyReaders();
+        }
+        ret = _waitWritable(lock, Deadline::max(), units);
+        if (ret != RetCode::OK) {
+            break;
+        }
+        do {
+            _push(priority, units, NEVER_EXPIRES, *first);
+            ++first;
+            ++num;
+        } while (first != last && _fits(units = _units(*first)));
     }
+    if (put_num) {
+        *put_num = num;
+    }
+    
+    _notifyReaders();
+    return ret;
+}
 
-    /* anything could happen - recheck */
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename OutputIt>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::get_bulk(
+    OutputIt out, int max_count, int* got_num) {
+    assert(max_count > 0);
+    if (got_num) {
+        *got_num = 0;
+    }
+    auto lock = _lock();
+    
     if (_queue_state == QueueState::STOPPED) {
         return RetCode::STOPPED;
     }
     
-    _pop(message);
-    
-    if (_events && _hwm_flag && _size() == _lwm) {
-        _hwm_flag = false;
-        /* increment use count since need to access
-           _events in unlocked context */
-        auto events = _events;
-        lock.unlock();
-        events->on_lwm();
+    int num = 0;
+    while (!num) {
+        /* TIMEOUT when nobody else could put (NoLock) */
+        auto ret = _waitReadable(lock, Deadline::max());
+        if (ret != RetCode::OK) {
+            return ret;
+        }
+        while (num != max_count && _size()) {
+            MessageType message;
+            if (_pop(&message)) {
+                *out = std::move(message);
+                ++out;
+                ++num;
+            }
+        }
+        if (!num) {
+            /* only expired messages were left */
+            _notifyWriters();
+        }
     }
+    if (got_num) {
+        *got_num = num;
+    }
+    
     _notifyWriters();
+    _checkLwm(lock);
     return RetCode::OK;
 }
 
-template<typename MessageType>
-void MessageQueue<MessageType>::run() {
-    std::unique_lock<std::mutex> lock(_mtx);
-    _queue_state = QueueState::RUNNING; // make atomic?
-    if (_events) {
-        /* increment use count since need to access
-           _events in unlocked context */
-        auto events = _events;
-        lock.unlock();
-        events->on_start();
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::run() {
+    std::unique_lock<Mutex> lock(_mtx);
+    _queue_state = QueueState::RUNNING;
+    _notifyListeners();
+    if constexpr (EventPolicy::enabled) {
+        if (_events.active()) {
+            /* keeps handlers alive in unlocked context */
+            auto events = _events.acquire();
+            lock.unlock();
+            events->on_start();
+        }
     }
-    _notifyWriters();
-    _notifyReaders();
+    /* lock may be released here - waiter
+       counters can't be trusted, wake everyone */
+    _wr_notify.notify_all();
+    _rd_notify.notify_all();
 }
 
-template<typename MessageType>
-void MessageQueue<MessageType>::stop() {
-    std::unique_lock<std::mutex> lock(_mtx);
-    _queue_state = QueueState::STOPPED;  // make atomic?
-    if (_events) {
-        /* increment use count since need to access
-           _events in unlocked context */
-        auto events = _events;
-        lock.unlock();
-        events->on_stop();
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::stop() {
+    std::unique_lock<Mutex> lock(_mtx);
+    _queue_state = QueueState::STOPPED;
+    _notifyListeners();
+    _cancelAsync();
+    if constexpr (EventPolicy::enabled) {
+        if (_events.active()) {
+            /* keeps handlers alive in unlocked context */
+            auto events = _events.acquire();
+            lock.unlock();
+            events->on_stop();
+        }
     }
-    _notifyWriters();
-    _notifyReaders();
+    /* lock may be released here - waiter
+       counters can't be trusted, wake everyone */
+    _wr_notify.notify_all();
+    _rd_notify.notify_all();
 }
 
-template<typename MessageType>
-void MessageQueue<MessageType>::_notifyReaders() const noexcept {
-    _rd_notify.notify_all();
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+std::unique_lock<typename LockPolicy::Mutex>
+MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+             EventPolicy>::_lock() {
+    if constexpr (MetricsPolicy::enabled) {
+        std::unique_lock<Mutex> lock(_mtx, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            _metrics.onContention();
+            lock.lock();
+        }
+        return lock;
+    } else {
+        return std::unique_lock<Mutex>(_mtx);
+    }
 }
 
-template<typename MessageType>
-void MessageQueue<MessageType>::_notifyWriters() const noexcept {
-    _wr_notify.notify_all();
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::_serveAsyncReaders() {
+    /* called under _mtx */
+    while (!_rd_async.empty() && _size()) {
+        if (!_pop(_rd_async.front()->message)) {
+            break;
+        }
+        auto waiter = _rd_async.pop();
+        waiter->ret = RetCode::OK;
+        waiter->wake(waiter);
+    }
 }
 
-template<typename MessageType>
-void MessageQueue<MessageType>::setEvents(
-    std::shared_ptr<IMessageQueueEvents> events) {
-    std::unique_lock<std::mutex> lock(_mtx);
-    _events = events;
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+bool MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::_serveAsyncWriters() {
+    /* called under _mtx */
+    bool pushed = false;
+    while (!_wr_async.empty()) {
+        int units = _units(_wr_async.front()->message);
+        if (!_fits(units)) {
+            break;
+        }
+        auto waiter = _wr_async.pop();
+        _push(waiter->priority, units, NEVER_EXPIRES,
+              std::move(waiter->message));
+        waiter->ret = RetCode::OK;
+        waiter->wake(waiter);
+        pushed = true;
+    }
+    return pushed;
 }
 
-template<typename MessageType>
-int MessageQueue<MessageType>::size() const noexcept {
-    std::unique_lock<std::mutex> lock(_mtx);
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::_cancelAsync() {
+    /* called under _mtx */
+    while (!_rd_async.empty()) {
+        auto waiter = _rd_async.pop();
+        waiter->ret = RetCode::STOPPED;
+        waiter->wake(waiter);
+    }
+    while (!_wr_async.empty()) {
+        auto waiter = _wr_async.pop();
+        waiter->ret = RetCode::STOPPED;
+        waiter->wake(waiter);
+    }
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::_checkHwm(
+    std::unique_lock<Mutex>& lock) {
+    if constexpr (EventPolicy::enabled) {
+        /* hwm condition and events mechanism active */
+        if (_events.active() && _used() >= _hwm) {
+            _hwm_flag = true;
+            /* keeps handlers alive in unlocked context */
+            auto events = _events.acquire();
+            lock.unlock();
+            _metrics.onHwm();
+            events->on_hwm();
+            lock.lock();
+            /* after unlock/lock */
+            /* anything could happen - recheck */
+            if (_queue_state == QueueState::STOPPED) {
+                return RetCode::STOPPED;
+            }
+            /* here I intentionally don't check
+               that HWM condition is not true
+               because that would inject high level logic 
+               into queue, assuming on_hwm() is blocking all writers
+               *
+               HENCE - writers have ability to race
+               for writing higher than HWM level*/
+        }
+    } else {
+        (void)lock;
+    }
+    return RetCode::OK;
+}
+
+/* leaves lock released if on_lwm() was called */
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::_checkLwm(
+    std::unique_lock<Mutex>& lock) {
+    if constexpr (EventPolicy::enabled) {
+        /* bulk get may jump over lwm, hence <= */
+        if (_events.active() && _hwm_flag && _used() <= _lwm) {
+            _hwm_flag = false;
+            /* keeps handlers alive in unlocked context */
+            auto events = _events.acquire();
+            lock.unlock();
+            _metrics.onLwm();
+            events->on_lwm();
+        }
+    } else {
+        (void)lock;
+    }
+}
+
+/* returns STOPPED if queue was stopped while waiting,
+   TIMEOUT if deadline passed */
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::_waitWritable(
+    std::unique_lock<Mutex>& lock, Deadline deadline, int units) {
+    if (!_fits(units)) {
+        /* no free space -
+           wait writers notification */
+        if (!_wait(lock, _wr_notify, _wr_waiters, deadline,
+                   WaitKind::PUT, [this, units] {
+                       return _stopped() || _fits(units);
+                   })) {
+            return RetCode::TIMEOUT;
+        }
+    }
+    /* anything could happen - recheck */
+    return _stopped() ? RetCode::STOPPED : RetCode::OK;
+}
+
+/* returns STOPPED if queue was stopped while waiting,
+   TIMEOUT if deadline passed */
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+RetCode MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                     EventPolicy>::_waitReadable(
+    std::unique_lock<Mutex>& lock, Deadline deadline) {
+    if (_size() == 0) {
+        /* emty queue - wait notififcation from writers */
+        if (!_wait(lock, _rd_notify, _rd_waiters, deadline,
+                   WaitKind::GET, [this] {
+                       return _stopped() || _size() != 0;
+                   })) {
+            return RetCode::TIMEOUT;
+        }
+    }
+    /* anything could happen - recheck */
+    return _stopped() ? RetCode::STOPPED : RetCode::OK;
+}
+
+/* spins according to wait strategy, then parks until
+   ready() or deadline, returns ready() */
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename Pred>
+bool MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::_wait(
+    std::unique_lock<Mutex>& lock,
+    Condition& notify, int& waiters,
+    Deadline deadline, WaitKind kind, Pred ready) {
+    if constexpr (!LockPolicy::threaded) {
+        /* nobody else could make it ready */
+        return ready();
+    } else {
+        if (deadline == Deadline::min()) {
+            return ready();
+        }
+        long long start = 0;
+        if constexpr (MetricsPolicy::enabled) {
+            start = cpuTicks();
+        }
+        if (_wait_strategy.spins()) {
+            auto strategy = _wait_strategy;
+            lock.unlock();
+            spinWait(strategy, ready);
+            lock.lock();
+        }
+        bool is_ready;
+        ++waiters;
+        if constexpr (TRIMS) {
+            /* reader parked on idle queue returns memory
+               storage kept for load that is gone */
+            auto period = std::chrono::duration_cast<Deadline::duration>(
+                _storage.trimPeriod());
+            while (kind == WaitKind::GET && period.count() > 0) {
+                auto slice = std::chrono::steady_clock::now() + period;
+                if (slice >= deadline ||
+                    notify.wait_until(lock, slice, ready)) {
+                    break;
+                }
+                _storage.trim();
+            }
+        }
+        if (deadline == Deadline::max()) {
+            notify.wait(lock, ready);
+            is_ready = true;
+        } else {
+            is_ready = notify.wait_until(lock, deadline, ready);
+        }
+        --waiters;
+        if constexpr (MetricsPolicy::enabled) {
+            _metrics.onWait(kind, cpuTicks() - start);
+        }
+        return is_ready;
+    }
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename Clock, typename Duration>
+typename MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                      EventPolicy>::Deadline
+MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+             EventPolicy>::_toDeadline(
+    const std::chrono::time_point<Clock, Duration>& deadline) {
+    auto now = Clock::now();
+    if (deadline <= now) {
+        /* already passed - still make a single try */
+        return Deadline::min();
+    }
+    return std::chrono::steady_clock::now() +
+        std::chrono::ceil<std::chrono::steady_clock::duration>(
+            deadline - now);
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::setEvents(
+    typename EventPolicy::Handle events) {
+    static_assert(EventPolicy::enabled, "queue has NoEvents");
+    std::unique_lock<Mutex> lock(_mtx);
+    /* old events are released after unlock -
+       their destructor may still run handlers */
+    _events.swap(events);
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::addListener(
+    IReadyListener* listener) {
+    static_assert(!BARE, "NoLock NoEvents queue has no listeners");
+    assert(listener != nullptr);
+    std::unique_lock<Mutex> lock(_mtx);
+    _listeners.push_back(listener);
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::removeListener(
+    IReadyListener* listener) {
+    std::unique_lock<Mutex> lock(_mtx);
+    _listeners.erase(std::remove(_listeners.begin(), _listeners.end(),
+                                 listener),
+                     _listeners.end());
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::_notifyListeners()
+    const noexcept {
+    /* called under _mtx */
+    for (auto listener : _listeners)
+        listener->on_ready();
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::setWaitStrategy(
+    const WaitStrategy& strategy) {
+    std::unique_lock<Mutex> lock(_mtx);
+    _wait_strategy = strategy;
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+int MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                 EventPolicy>::size() const noexcept {
+    std::unique_lock<Mutex> lock(_mtx);
     return _size();
 }
 
-template<typename MessageType>
-void MessageQueue<MessageType>::_push(const MessageType& message, int priority) {
-    auto& queue_ref = _map_of_queue[priority];
-    queue_ref.push(message);
-    ++_current_size;
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+int MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                 EventPolicy>::used() const noexcept {
+    std::unique_lock<Mutex> lock(_mtx);
+    return _used();
 }
 
-template<typename MessageType>
-void MessageQueue<MessageType>::_pop(MessageType* message) {
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+int MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                 EventPolicy>::topPriority() const noexcept {
+    if constexpr (TRACKS_TOP) {
+        return _top_priority.load(std::memory_order_relaxed);
+    } else {
+        return _size() ? _storage.top() : NO_PRIORITY;
+    }
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::trim() {
+    if constexpr (TRIMS) {
+        auto lock = _lock();
+        _storage.trim();
+    }
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename... Args>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::_push(int priority,
+                                                     int units,
+                                                     long long expires_ns,
+                                                     Args&&... args) {
+    priority = detail::storedPriority<Storage>(priority);
+    if constexpr (EXPIRES) {
+        _storage.setNext(expires_ns, units);
+    }
+    _metrics.push(_storage, priority, std::forward<Args>(args)...);
+    _addSize(1);
+    if constexpr (COUNTS_BYTES) {
+        _used_bytes.store(_used() + units, std::memory_order_relaxed);
+    }
+    if constexpr (!BARE) {
+        /* only empty -> non-empty wakes readers outside */
+        if (_size() == 1 && !_listeners.empty()) {
+            _notifyListeners();
+        }
+    }
+    if constexpr (TRACKS_TOP) {
+        if (priority > _top_priority.load(std::memory_order_relaxed)) {
+            _top_priority.store(priority, std::memory_order_relaxed);
+        }
+    }
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+bool MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::_pop(MessageType* message) {
+    while (true) {
+        bool expired = false;
+        if constexpr (EXPIRES) {
+            _metrics.pop(_storage, message, [this, &expired] {
+                    auto expires_ns = _storage.poppedExpiry();
+                    expired = expires_ns != NEVER_EXPIRES &&
+                        expires_ns <= steadyNowNs();
+                    return !expired;
+                });
+        } else {
+            _metrics.pop(_storage, message, [] { return true; });
+        }
+        _addSize(-1);
+        if constexpr (COUNTS_BYTES) {
+            /* recovered messages weren't counted */
+            _used_bytes.store(std::max(0, _used() - _units(*message)),
+                              std::memory_order_relaxed);
+        }
+        if constexpr (TRACKS_TOP) {
+            _top_priority.store(_size() ? _storage.top() : NO_PRIORITY,
+                                std::memory_order_relaxed);
+        }
+        if (expired) {
+            _metrics.onExpired(1);
+            if (_size()) {
+                continue;
+            }
+            return false;
+        }
+        return true;
+    }
+}
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+void MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                  EventPolicy>::_purgeExpired(
+    int units) {
+    if constexpr (EXPIRES) {
+        /* called under _mtx */
+        if (_used() < _hwm && _fits(units)) {
+            return;
+        }
+        auto purged = _storage.purge(steadyNowNs());
+        if (!purged.messages) {
+            return;
+        }
+        _addSize(-purged.messages);
+        if constexpr (COUNTS_BYTES) {
+            _used_bytes.store(
+                static_cast<int>(std::max(0LL, _used() - purged.units)),
+                std::memory_order_relaxed);
+        }
+        if (TRACKS_TOP && !_size()) {
+            _top_priority.store(NO_PRIORITY, std::memory_order_relaxed);
+        }
+        _metrics.onExpired(purged.messages);
+        _notifyWriters();
+    } else {
+        (void)units;
+    }
+}
+
+#if defined(__cpp_impl_coroutine)
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename Executor>
+class MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                   EventPolicy>::GetAwaiter
+    : private detail::AsyncGetWaiter<MessageType> {
+public:
+    GetAwaiter(MessageQueue* queue, MessageType* message, Executor* executor)
+        : detail::AsyncGetWaiter<MessageType>(message),
+          _queue{queue}, _executor{executor} {
+        this->wake = &GetAwaiter::_wake;
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+    /* false - done without suspension */
+    bool await_suspend(std::coroutine_handle<> handle) {
+        _handle = handle;
+        auto lock = _queue->_lock();
+        if (_queue->_stopped()) {
+            this->ret = RetCode::STOPPED;
+            return false;
+        }
+        auto queue = _queue;
+        bool dropped = false;
+        while (queue->_size()) {
+            if (queue->_pop(this->message)) {
+                this->ret = RetCode::OK;
+                queue->_notifyWriters();
+                queue->_checkLwm(lock);
+                return false;
+            }
+            /* only expired messages were left - their room
+               goes to writers, maybe a message comes back */
+            dropped = true;
+            queue->_notifyWriters();
+        }
+        /* may be resumed on other thread as soon as we
+           unlock - don't touch *this after that */
+        queue->_rd_async.push(this);
+        if (dropped) {
+            queue->_checkLwm(lock);
+        }
+        return true;
+    }
+    RetCode await_resume() const noexcept {
+        return this->ret;
+    }
+
+private:
+    static void _wake(detail::AsyncWaiter* waiter) {
+        auto self = static_cast<GetAwaiter*>(
+            static_cast<detail::AsyncGetWaiter<MessageType>*>(waiter));
+        (*self->_executor)(self->_handle);
+    }
+
+    MessageQueue* _queue;
+    Executor* _executor;
+    std::coroutine_handle<> _handle;
+};
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename Executor>
+class MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                   EventPolicy>::PutAwaiter
+    : private detail::AsyncPutWaiter<MessageType> {
+public:
+    PutAwaiter(MessageQueue* queue, MessageType&& message, int priority,
+               Executor* executor)
+        : detail::AsyncPutWaiter<MessageType>(std::move(message), priority),
+          _queue{queue}, _executor{executor} {
+        this->wake = &PutAwaiter::_wake;
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+    /* false - done without suspension */
+    bool await_suspend(std::coroutine_handle<> handle) {
+        _handle = handle;
+        auto lock = _queue->_lock();
+        if (_queue->_stopped() ||
+            _queue->_checkHwm(lock) == RetCode::STOPPED) {
+            this->ret = RetCode::STOPPED;
+            return false;
+        }
+        int units = _queue->_units(this->message);
+        _queue->_purgeExpired(units);
+        if (!_queue->_fits(units)) {
+            /* may be resumed on other thread as soon as we
+               unlock - don't touch *this after that */
+            _queue->_wr_async.push(this);
+            return true;
+        }
+        _queue->_push(this->priority, units, NEVER_EXPIRES,
+                      std::move(this->message));
+        this->ret = RetCode::OK;
+        _queue->_notifyReaders();
+        return false;
+    }
+    RetCode await_resume() const noexcept {
+        return this->ret;
+    }
+
+private:
+    static void _wake(detail::AsyncWaiter* waiter) {
+        auto self = static_cast<PutAwaiter*>(
+            static_cast<detail::AsyncPutWaiter<MessageType>*>(waiter));
+        (*self->_executor)(self->_handle);
+    }
+
+    MessageQueue* _queue;
+    Executor* _executor;
+    std::coroutine_handle<> _handle;
+};
+
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename Executor>
+typename MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                      EventPolicy>::
+template GetAwaiter<Executor>
+MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+             EventPolicy>::async_get(
+    MessageType* message, Executor& executor) {
+    static_assert(!BARE, "NoLock NoEvents queue has no async calls");
     assert(message != nullptr);
-    auto max_priority_pair_it = _map_of_queue.end();
-    /* max element of map is at the end */
-    --max_priority_pair_it;
-    auto& max_priority_queue = max_priority_pair_it->second;
-    
-    *message = std::move(max_priority_queue.front());
-    max_priority_queue.pop();
+    return GetAwaiter<Executor>(this, message, &executor);
+}
 
-    /* if queue's become empty get rid of unneeded map node */
-    if (!max_priority_queue.size())
-        _map_of_queue.erase(max_priority_pair_it);
-    
-    --_current_size;
+template<typename MessageType, typename StoragePolicy, typename MetricsPolicy,
+         typename LockPolicy, typename EventPolicy>
+template<typename Executor>
+typename MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+                      EventPolicy>::
+template PutAwaiter<Executor>
+MessageQueue<MessageType, StoragePolicy, MetricsPolicy, LockPolicy,
+             EventPolicy>::async_put(
+    MessageType message, int priority, Executor& executor) {
+    static_assert(!BARE, "NoLock NoEvents queue has no async calls");
+    return PutAwaiter<Executor>(this, std::move(message), priority,
+                                &executor);
 }
 
+#endif
+
 } // namespace zodiactest 
@@ -0,0 +1,427 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "platform.hpp"
+
+namespace zodiactest {
+
+/* Metrics policies for MessageQueue.
+   Policy is a class providing
+     static constexpr bool enabled;
+     template<typename M> using Entry;  // what storage holds for message M
+     void push(Storage&, int priority, Args&&... args);
+     // returns storage.pop(), calls delivered() once after it -
+     // false for message dropped unread, counted by onExpired()
+     int pop(Storage&, MessageType* message, Delivered delivered);
+     void onWait(WaitKind kind, long long ticks); // time blocked
+     void onHwm(); void onLwm(); void onContention();
+     void onExpired(int messages);  // dropped unread, see Expiring
+   *
+   NoMetrics is the default, queue opts in with QueueMetrics.
+   Define MQ_METRICS to make QueueMetrics the default. */
+
+enum class WaitKind : int {
+    PUT = 0,
+    GET
+};
+
+/* nothing recorded, storage holds bare messages */
+struct NoMetrics {
+    static constexpr bool enabled = false;
+
+    template<typename MessageType>
+    using Entry = MessageType;
+
+    template<typename Storage, typename... Args>
+    void push(Storage& storage, int priority, Args&&... args) {
+        storage.push(priority, std::forward<Args>(args)...);
+    }
+    template<typename Storage, typename MessageType, typename Delivered>
+    int pop(Storage& storage, MessageType* message, Delivered delivered) {
+        int priority = storage.pop(message);
+        delivered();
+        return priority;
+    }
+    void onWait(WaitKind, long long) noexcept {}
+    void onHwm() noexcept {}
+    void onLwm() noexcept {}
+    void onContention() noexcept {}
+    void onExpired(int) noexcept {}
+};
+
+/* log-linear histogram (HDR style): values below 8 have bucket
+   each, every power of two above is split into 8 buckets, so
+   bucket bounds are within 12.5% of any value in them */
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+    /* up to 2^36 ticks - ~30 s at 2 GHz, larger go to last bucket */
+    static constexpr int MAX_EXPONENT = 36;
+    static constexpr int BUCKETS =
+        (MAX_EXPONENT - SUB_BITS + 1) * SUB_BUCKETS + 1;
+
+    static int bucket(uint64_t value) noexcept {
+        if (value < SUB_BUCKETS)
+            return static_cast<int>(value);
+        int exponent = 63 - __builtin_clzll(value);
+        if (exponent >= MAX_EXPONENT)
+            return BUCKETS - 1;
+        auto sub = static_cast<int>(
+            (value >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1));
+        return (exponent - SUB_BITS + 1) * SUB_BUCKETS + sub;
+    }
+    /* largest value of bucket */
+    static uint64_t bucketMax(int bucket) noexcept {
+        if (bucket < SUB_BUCKETS)
+            return static_cast<uint64_t>(bucket);
+        if (bucket == BUCKETS - 1)
+            return std::numeric_limits<uint64_t>::max();
+        int exponent = bucket / SUB_BUCKETS + SUB_BITS - 1;
+        uint64_t sub = static_cast<uint64_t>(bucket % SUB_BUCKETS);
+        return ((SUB_BUCKETS + sub + 1) << (exponent - SUB_BITS)) - 1;
+    }
+
+    LatencyHistogram() : _counts{}, _ns_per_tick{1} {}
+
+    void add(int bucket, uint64_t count) noexcept {
+        _counts[static_cast<size_t>(bucket)] += count;
+    }
+    void merge(const LatencyHistogram& other) noexcept {
+        for (size_t i = 0; i != _counts.size(); i++)
+            _counts[i] += other._counts[i];
+    }
+    void setNsPerTick(double ns_per_tick) noexcept {
+        _ns_per_tick = ns_per_tick;
+    }
+
+    uint64_t count() const noexcept;
+    /* ns not exceeded by p percent of samples (bucket's upper
+       bound), 0 if histogram is empty */
+    double percentile(double p) const noexcept;
+    double max() const noexcept {
+        return percentile(100);
+    }
+
+private:
+    std::array<uint64_t, BUCKETS> _counts;
+    double _ns_per_tick;
+};
+
+namespace detail {
+
+/* metrics cell index of calling thread, the same in every
+   queue: unique among live threads, SHARED when all are taken */
+class MetricsSlot {
+public:
+    static constexpr size_t SHARED = 64;
+
+    MetricsSlot() : _index{SHARED} {
+        std::lock_guard<std::mutex> lock(_mtx());
+        auto& used = _used();
+        for (size_t i = 0; i != SHARED; i++) {
+            if (!used[i]) {
+                used[i] = true;
+                _index = i;
+                break;
+            }
+        }
+    }
+    ~MetricsSlot() {
+        if (_index == SHARED)
+            return;
+        /* mutex orders our last counts before next owner's */
+        std::lock_guard<std::mutex> lock(_mtx());
+        _used()[_index] = false;
+    }
+
+    MetricsSlot(const MetricsSlot&) = delete;
+    MetricsSlot& operator=(const MetricsSlot&) = delete;
+
+    size_t index() const noexcept {
+        return _index;
+    }
+
+    static MetricsSlot& local() {
+        thread_local MetricsSlot slot;
+        return slot;
+    }
+
+private:
+    static std::mutex& _mtx() {
+        static std::mutex mtx;
+        return mtx;
+    }
+    static std::array<bool, SHARED>& _used() {
+        static std::array<bool, SHARED> used{};
+        return used;
+    }
+
+    size_t _index;
+};
+
+} // namespace detail
+
+/* everything counted so far, summed over threads */
+struct QueueMetricsSnapshot {
+    /* index is priority, last element - priorities
+       outside [0, QueueMetrics::PRIORITY_SLOTS) */
+    std::vector<uint64_t> enqueued;
+    std::vector<uint64_t> dequeued;
+    /* put/get calls that had to wait and total time they waited */
+    uint64_t put_waits = 0;
+    double put_blocked_ns = 0;
+    uint64_t get_waits = 0;
+    double get_blocked_ns = 0;
+    uint64_t hwm_events = 0;
+    uint64_t lwm_events = 0;
+    /* queue lock found taken */
+    uint64_t lock_contentions = 0;
+    /* dropped unread past expiry, not in dequeued or latency */
+    uint64_t expired = 0;
+    /* put to get of each delivered message */
+    LatencyHistogram latency;
+};
+
+/* Every thread counts into its own cache line padded cell,
+   cells are allocated on thread's first use and only summed
+   up by snapshot(), so hot path does no shared writes and no
+   atomic read-modify-writes - counters are plain relaxed
+   loads and stores. Messages carry TSC put time for latency
+   histogram.
+   *
+   Live threads own up to MAX_THREADS cells, a cell is handed
+   to a new thread when its owner exits. Threads beyond that
+   share one more cell and count there with fetch_add */
+class QueueMetrics {
+public:
+    static constexpr bool enabled = true;
+    /* priorities counted separately */
+    static constexpr int PRIORITY_SLOTS = 16;
+    static constexpr int MAX_THREADS = detail::MetricsSlot::SHARED;
+
+    template<typename MessageType>
+    struct Entry {
+        Entry() = default;
+        template<typename... Args>
+        explicit Entry(long long ticks_, Args&&... args)
+            : message(std::forward<Args>(args)...), ticks{ticks_} {}
+
+        MessageType message;
+        long long ticks;
+    };
+
+    QueueMetrics();
+
+    QueueMetrics(const QueueMetrics&) = delete;
+    QueueMetrics& operator=(const QueueMetrics&) = delete;
+
+    ~QueueMetrics();
+
+    template<typename Storage, typename... Args>
+    void push(Storage& storage, int priority, Args&&... args);
+    template<typename Storage, typename MessageType, typename Delivered>
+    int pop(Storage& storage, MessageType* message, Delivered delivered);
+    void onWait(WaitKind kind, long long ticks);
+    void onHwm() {
+        auto& cell = _cell();
+        _add(cell, cell.hwm_events, 1);
+    }
+    void onLwm() {
+        auto& cell = _cell();
+        _add(cell, cell.lwm_events, 1);
+    }
+    void onContention() {
+        auto& cell = _cell();
+        _add(cell, cell.lock_contentions, 1);
+    }
+    void onExpired(int messages) {
+        auto& cell = _cell();
+        _add(cell, cell.expired, static_cast<uint64_t>(messages));
+    }
+
+    QueueMetricsSnapshot snapshot() const;
+
+private:
+    using Counter = std::atomic<uint64_t>;
+
+    struct alignas(CACHE_LINE_SIZE) Cell {
+        /* written before cell is published */
+        bool shared;
+        Counter enqueued[PRIORITY_SLOTS + 1];
+        Counter dequeued[PRIORITY_SLOTS + 1];
+        Counter put_waits;
+        Counter put_wait_ticks;
+        Counter get_waits;
+        Counter get_wait_ticks;
+        Counter hwm_events;
+        Counter lwm_events;
+        Counter lock_contentions;
+        Counter expired;
+        Counter latency[LatencyHistogram::BUCKETS];
+    };
+
+    static void _add(const Cell& cell, Counter& counter,
+                     uint64_t value) noexcept {
+        if (cell.shared) {
+            counter.fetch_add(value, std::memory_order_relaxed);
+        } else {
+            counter.store(counter.load(std::memory_order_relaxed) + value,
+                          std::memory_order_relaxed);
+        }
+    }
+    static size_t _prioritySlot(int priority) noexcept {
+        return priority >= 0 && priority < PRIORITY_SLOTS ?
+            static_cast<size_t>(priority) : PRIORITY_SLOTS;
+    }
+    Cell& _cell() {
+        auto cell = _cells[detail::MetricsSlot::local().index()].load(
+            std::memory_order_acquire);
+        return cell ? *cell : _addCell();
+    }
+    Cell& _addCell();
+
+    const TickClock _clock;
+    std::unique_ptr<std::atomic<Cell*>[]> _cells;
+};
+
+#ifdef MQ_METRICS
+using DefaultMetrics = QueueMetrics;
+#else
+using DefaultMetrics = NoMetrics;
+#endif
+
+inline uint64_t LatencyHistogram::count() const noexcept {
+    uint64_t count = 0;
+    for (auto n : _counts)
+        count += n;
+    return count;
+}
+
+inline double LatencyHistogram::percentile(double p) const noexcept {
+    auto total = count();
+    if (!total)
+        return 0;
+    /* nearest rank */
+    auto rank = static_cast<uint64_t>(p / 100.0 * static_cast<double>(total));
+    rank = std::max<uint64_t>(1, std::min(rank, total));
+    uint64_t seen = 0;
+    for (int i = 0; i != BUCKETS; i++) {
+        seen += _counts[static_cast<size_t>(i)];
+        if (seen >= rank)
+            return static_cast<double>(bucketMax(i)) * _ns_per_tick;
+    }
+    return static_cast<double>(bucketMax(BUCKETS - 1)) * _ns_per_tick;
+}
+
+inline QueueMetrics::QueueMetrics()
+    : _cells{new std::atomic<Cell*>[MAX_THREADS + 1]} {
+    for (int i = 0; i != MAX_THREADS + 1; i++)
+        _cells[static_cast<size_t>(i)].store(nullptr,
+                                             std::memory_order_relaxed);
+}
+
+inline QueueMetrics::~QueueMetrics() {
+    for (int i = 0; i != MAX_THREADS + 1; i++)
+        delete _cells[static_cast<size_t>(i)].load(std::memory_order_relaxed);
+}
+
+template<typename Storage, typename... Args>
+void QueueMetrics::push(Storage& storage, int priority, Args&&... args) {
+    storage.push(priority, cpuTicks(), std::forward<Args>(args)...);
+    auto& cell = _cell();
+    _add(cell, cell.enqueued[_prioritySlot(priority)], 1);
+}
+
+template<typename Storage, typename MessageType, typename Delivered>
+int QueueMetrics::pop(Storage& storage, MessageType* message,
+                      Delivered delivered) {
+    Entry<MessageType> entry;
+    int priority = storage.pop(&entry);
+    *message = std::move(entry.message);
+    if (!delivered())
+        return priority;
+    auto ticks = cpuTicks() - entry.ticks;
+    auto& cell = _cell();
+    _add(cell, cell.dequeued[_prioritySlot(priority)], 1);
+    /* TSC of another core may be slightly behind */
+    _add(cell, cell.latency[LatencyHistogram::bucket(
+                          ticks > 0 ? static_cast<uint64_t>(ticks) : 0)], 1);
+    return priority;
+}
+
+inline void QueueMetrics::onWait(WaitKind kind, long long ticks) {
+    auto& cell = _cell();
+    auto waited = static_cast<uint64_t>(std::max(0LL, ticks));
+    if (kind == WaitKind::PUT) {
+        _add(cell, cell.put_waits, 1);
+        _add(cell, cell.put_wait_ticks, waited);
+    } else {
+        _add(cell, cell.get_waits, 1);
+        _add(cell, cell.get_wait_ticks, waited);
+    }
+}
+
+inline QueueMetrics::Cell& QueueMetrics::_addCell() {
+    auto index = detail::MetricsSlot::local().index();
+    auto& slot = _cells[index];
+    /* value initialized - counters start at zero */
+    auto cell = new Cell();
+    cell->shared = index == detail::MetricsSlot::SHARED;
+    Cell* expected = nullptr;
+    if (!slot.compare_exchange_strong(expected, cell,
+                                      std::memory_order_acq_rel)) {
+        /* thread sharing the cell was first */
+        delete cell;
+        return *expected;
+    }
+    return *cell;
+}
+
+inline QueueMetricsSnapshot QueueMetrics::snapshot() const {
+    QueueMetricsSnapshot snap;
+    snap.enqueued.assign(PRIORITY_SLOTS + 1, 0);
+    snap.dequeued.assign(PRIORITY_SLOTS + 1, 0);
+    uint64_t put_wait_ticks = 0;
+    uint64_t get_wait_ticks = 0;
+    auto load = [](const Counter& counter) {
+        return counter.load(std::memory_order_relaxed);
+    };
+    for (int i = 0; i != MAX_THREADS + 1; i++) {
+        auto cell = _cells[static_cast<size_t>(i)].load(
+            std::memory_order_acquire);
+        if (!cell)
+            continue;
+        for (size_t p = 0; p != PRIORITY_SLOTS + 1; p++) {
+            snap.enqueued[p] += load(cell->enqueued[p]);
+            snap.dequeued[p] += load(cell->dequeued[p]);
+        }
+        snap.put_waits += load(cell->put_waits);
+        put_wait_ticks += load(cell->put_wait_ticks);
+        snap.get_waits += load(cell->get_waits);
+        get_wait_ticks += load(cell->get_wait_ticks);
+        snap.hwm_events += load(cell->hwm_events);
+        snap.lwm_events += load(cell->lwm_events);
+        snap.lock_contentions += load(cell->lock_contentions);
+        snap.expired += load(cell->expired);
+        for (int b = 0; b != LatencyHistogram::BUCKETS; b++)
+            snap.latency.add(b, load(cell->latency[b]));
+    }
+    double ns_per_tick = _clock.nsPerTick();
+    snap.put_blocked_ns = static_cast<double>(put_wait_ticks) * ns_per_tick;
+    snap.get_blocked_ns = static_cast<double>(get_wait_ticks) * ns_per_tick;
+    snap.latency.setNsPerTick(ns_per_tick);
+    return snap;
+}
+
+} // namespace zodiactest
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace zodiactest {
+
+/* std::hardware_destructive_interference_size is not
+   available in every standard library we build with */
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+/* spin loop hint - lets sibling hyperthread run
+   and saves power while polling */
+inline void cpuRelax() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+/* rare slow path kept out of line, so hot function
+   that calls it stays small enough to be inlined */
+#if defined(__GNUC__)
+#define MQ_COLD __attribute__((noinline, cold))
+#else
+#define MQ_COLD
+#endif
+
+/* hint to pull line of p into cache for reading,
+   no-op where compiler has no builtin */
+inline void prefetchRead(const void* p) noexcept {
+#if defined(__GNUC__)
+    __builtin_prefetch(p, 0, 3);
+#else
+    (void)p;
+#endif
+}
+
+inline long long steadyNs(std::chrono::steady_clock::time_point time) noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        time.time_since_epoch()).count();
+}
+
+inline long long steadyNowNs() noexcept {
+    return steadyNs(std::chrono::steady_clock::now());
+}
+
+/* cheap timestamp for hot paths - TSC costs about half of
+   steady_clock::now(), ticks are converted to time by TickClock */
+inline long long cpuTicks() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    return static_cast<long long>(__rdtsc());
+#else
+    return steadyNowNs();
+#endif
+}
+
+/* ticks <-> ns, rate is measured between construction
+   and nsPerTick() call - the longer, the more precise */
+class TickClock {
+public:
+    TickClock() noexcept
+        : _start_ns{steadyNowNs()}, _start_ticks{cpuTicks()} {}
+
+    double nsPerTick() const noexcept {
+        auto ticks = cpuTicks() - _start_ticks;
+        if (ticks <= 0)
+            return 1;
+        return static_cast<double>(steadyNowNs() - _start_ns) /
+            static_cast<double>(ticks);
+    }
+    long long startTicks() const noexcept {
+        return _start_ticks;
+    }
+
+private:
+    const long long _start_ns;
+    const long long _start_ticks;
+};
+
+} // namespace zodiactest
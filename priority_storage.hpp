@@ -0,0 +1,1189 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <new>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "platform.hpp"
+#include "slab_pool.hpp"
+
+namespace zodiactest {
+
+/* Storage policies for MessageQueue.
+   Policy is a tag with nested Storage<MessageType> template providing
+     Storage(int capacity);
+     void push(int priority, Args&&... args);
+     int pop(MessageType* message);  // FIFO inside level, returns its priority
+     int top() const;                 // highest priority, storage not empty
+   and optionally
+     int recovered() const;           // messages it was constructed with
+     static constexpr bool counts_bytes = true;  // see ByteBudget
+     static constexpr bool expires = true;       // see Expiring
+     static constexpr int levels = N;            // priorities [0, N) only
+     static constexpr bool trims = true;         // see ElasticLevels
+     void trim();                                // frees memory unused lately
+     std::chrono::nanoseconds trimPeriod() const;  // 0 - trim() not needed
+     void dropHeads(Drop drop);  // pops level heads while drop(head)
+   Priority of a storage with levels is clamped into [0, levels)
+   by queue and storage both. Storage doesn't count messages -
+   queue does. */
+
+namespace detail {
+
+template<typename Storage>
+auto recoveredMessages(const Storage& storage, int)
+    -> decltype(storage.recovered()) {
+    return storage.recovered();
+}
+template<typename Storage>
+int recoveredMessages(const Storage&, long) {
+    return 0;
+}
+template<typename Storage>
+int recoveredMessages(const Storage& storage) {
+    return recoveredMessages(storage, 0);
+}
+
+template<typename Storage, typename = void>
+struct CountsBytes : std::false_type {};
+template<typename Storage>
+struct CountsBytes<Storage, std::void_t<decltype(Storage::counts_bytes)>>
+    : std::bool_constant<Storage::counts_bytes> {};
+
+template<typename Storage, typename = void>
+struct Expires : std::false_type {};
+template<typename Storage>
+struct Expires<Storage, std::void_t<decltype(Storage::expires)>>
+    : std::bool_constant<Storage::expires> {};
+
+template<typename Storage, typename = void>
+struct Trims : std::false_type {};
+template<typename Storage>
+struct Trims<Storage, std::void_t<decltype(Storage::trims)>>
+    : std::bool_constant<Storage::trims> {};
+
+/* for wrappers, whether inner storage trims or not */
+template<typename Storage>
+void trimStorage(Storage& storage) {
+    if constexpr (Trims<Storage>::value)
+        storage.trim();
+}
+template<typename Storage>
+std::chrono::nanoseconds trimPeriod(const Storage& storage) {
+    if constexpr (Trims<Storage>::value) {
+        return storage.trimPeriod();
+    } else {
+        (void)storage;
+        return std::chrono::nanoseconds::zero();
+    }
+}
+
+/* 0 - any priority */
+template<typename Storage, typename = void>
+struct LevelCount : std::integral_constant<int, 0> {};
+template<typename Storage>
+struct LevelCount<Storage, std::void_t<decltype(Storage::levels)>>
+    : std::integral_constant<int, Storage::levels> {};
+
+constexpr int clampLevel(int priority, int levels) noexcept {
+    return priority < 0 ? 0 : priority >= levels ? levels - 1 : priority;
+}
+
+/* priority that Storage keeps the message under */
+template<typename Storage>
+constexpr int storedPriority(int priority) noexcept {
+    if constexpr (LevelCount<Storage>::value > 0) {
+        return clampLevel(priority, LevelCount<Storage>::value);
+    } else {
+        return priority;
+    }
+}
+
+} // namespace detail
+
+/* bytes message takes of ByteBudget queue - object itself
+   plus payload it owns. Overload it next to message type (found
+   by ADL, see MessageBuffer); result must not change while the
+   message is queued, moves included */
+template<typename MessageType>
+size_t messageBytes(const MessageType&) noexcept {
+    return sizeof(MessageType);
+}
+
+inline size_t messageBytes(const std::string& message) noexcept {
+    return sizeof(message) + message.size();
+}
+
+template<typename T, typename Allocator>
+size_t messageBytes(const std::vector<T, Allocator>& message) noexcept {
+    return sizeof(message) + message.size() * sizeof(T);
+}
+
+/* any priority value, levels are created and erased on demand
+   *
+   would be effective when number of priorities is not high */
+struct PriorityMap {
+    template<typename MessageType>
+    class Storage {
+    public:
+        explicit Storage(int) {}
+
+        template<typename... Args>
+        void push(int priority, Args&&... args) {
+            auto& queue_ref = _map_of_queue[priority];
+            queue_ref.emplace(std::forward<Args>(args)...);
+        }
+
+        int pop(MessageType* message) {
+            assert(message != nullptr);
+            assert(!_map_of_queue.empty());
+            auto max_priority_pair_it = _map_of_queue.end();
+            /* max element of map is at the end */
+            --max_priority_pair_it;
+            int priority = max_priority_pair_it->first;
+            auto& max_priority_queue = max_priority_pair_it->second;
+
+            *message = std::move(max_priority_queue.front());
+            max_priority_queue.pop();
+
+            /* if queue's become empty get rid of unneeded map node */
+            if (!max_priority_queue.size())
+                _map_of_queue.erase(max_priority_pair_it);
+            return priority;
+        }
+
+        int top() const {
+            assert(!_map_of_queue.empty());
+            return _map_of_queue.rbegin()->first;
+        }
+
+        template<typename Drop>
+        void dropHeads(Drop drop) {
+            auto it = _map_of_queue.begin();
+            while (it != _map_of_queue.end()) {
+                auto& queue_ref = it->second;
+                while (!queue_ref.empty() &&
+                       drop(std::as_const(queue_ref.front())))
+                    queue_ref.pop();
+                if (queue_ref.empty())
+                    it = _map_of_queue.erase(it);
+                else
+                    ++it;
+            }
+        }
+
+    private:
+        std::map<int, std::queue<MessageType>> _map_of_queue;
+    };
+};
+
+/* any priority value like PriorityMap, but nothing in
+   push/pop goes to the heap: messages live in intrusive per
+   level FIFO lists of slab nodes, map nodes come from another
+   slab pool.
+   *
+   message slab is carved up front for capacity messages,
+   level slab grows in chunks to the peak number of distinct
+   priorities held at once and is reused afterwards */
+struct PooledPriorityMap {
+    template<typename MessageType>
+    class Storage {
+    public:
+        explicit Storage(int capacity);
+
+        /* containers point into pools */
+        Storage(const Storage&) = delete;
+        Storage& operator=(const Storage&) = delete;
+
+        ~Storage();
+
+        template<typename... Args>
+        void push(int priority, Args&&... args);
+        int pop(MessageType* message);
+        int top() const {
+            assert(!_levels.empty());
+            return _levels.rbegin()->first;
+        }
+        template<typename Drop>
+        void dropHeads(Drop drop);
+
+    private:
+        struct Node {
+            template<typename... Args>
+            explicit Node(Args&&... args)
+                : next{nullptr}, message(std::forward<Args>(args)...) {}
+
+            Node* next;
+            MessageType message;
+        };
+        struct Level {
+            Node* head;
+            Node* tail;
+        };
+        using LevelAllocator = SlabAllocator<std::pair<const int, Level>>;
+        static constexpr size_t LEVEL_CHUNK = 64;
+
+        /* pools outlive containers using them */
+        std::unique_ptr<SlabPool> _node_pool;
+        std::unique_ptr<SlabPool> _level_pool;
+        std::map<int, Level, std::less<int>, LevelAllocator> _levels;
+    };
+};
+
+/* Scheduling across levels of PriorityLevels storage - which
+   non-empty level pop() takes next, each in O(1). */
+
+/* highest level first - lower levels wait while it's non-empty */
+struct StrictPriority {
+    static constexpr bool stamped = false;
+
+    class State {
+    public:
+        template<typename Levels>
+        int pick(const Levels& levels) noexcept {
+            return levels.top();
+        }
+    };
+};
+
+/* weighted round robin: levels are served from the highest
+   down, weight(level) messages in a row each, then again from
+   the highest. Weight of level is level + 1 unless weights are
+   passed to storage:
+     MessageQueue<T, PriorityLevels<4, WeightedFair>>
+         q(size, lwm, hwm, std::vector<int>{1, 1, 4, 16});
+   Level that gets messages in the middle of a round waits for the
+   next one, so every non-empty level is served once per round */
+struct WeightedFair {
+    static constexpr bool stamped = false;
+
+    class State {
+    public:
+        State() = default;
+        explicit State(std::vector<int> weights)
+            : _weights(std::move(weights)) {}
+
+        template<typename Levels>
+        int pick(const Levels& levels) noexcept {
+            if (_credit == 0 || _level < 0 || levels.empty(_level)) {
+                int next = _level < 0 ? -1 : levels.below(_level);
+                _level = next >= 0 ? next : levels.top();
+                _credit = _weight(_level);
+            }
+            --_credit;
+            return _level;
+        }
+
+    private:
+        int _weight(int level) const noexcept {
+            auto index = static_cast<size_t>(level);
+            if (index < _weights.size())
+                return std::max(1, _weights[index]);
+            return level + 1;
+        }
+
+        std::vector<int> _weights;
+        int _level = -1;
+        int _credit = 0;
+    };
+};
+
+/* time based aging: message waiting for t is treated as if it
+   had priority level + t / period, so that a low priority message
+   overtakes higher ones after period per level of difference:
+     MessageQueue<T, PriorityLevels<8, Aging>>
+         q(size, lwm, hwm, std::chrono::milliseconds(5));
+   Inside level messages are in age order, so only level heads
+   compete. pop() compares the highest level's head with the head
+   of one lower level, probing lower levels in turn - a starving
+   level is looked at least once per number of non-empty levels
+   pops. Push time is taken with steady clock */
+struct Aging {
+    static constexpr bool stamped = true;
+
+    class State {
+    public:
+        State() : State(std::chrono::milliseconds(1)) {}
+        template<typename Rep, typename Period>
+        explicit State(const std::chrono::duration<Rep, Period>& period)
+            : _period_ns{std::chrono::duration_cast<
+                  std::chrono::nanoseconds>(period).count()} {
+            assert(_period_ns > 0);
+        }
+
+        template<typename Levels>
+        int pick(const Levels& levels) noexcept {
+            int top = levels.top();
+            int probe = levels.below(std::min(_probe, top));
+            if (probe < 0)
+                probe = levels.below(top);
+            _probe = probe < 0 ? top : probe;
+            if (probe < 0)
+                return top;
+            /* older and lower virtual time wins */
+            return _virtual(levels, probe) < _virtual(levels, top) ?
+                probe : top;
+        }
+
+    private:
+        template<typename Levels>
+        long long _virtual(const Levels& levels, int level) const noexcept {
+            return levels.headStamp(level) - level * _period_ns;
+        }
+
+        long long _period_ns;
+        int _probe = std::numeric_limits<int>::max();
+    };
+};
+
+namespace detail {
+
+template<typename MessageType>
+struct Stamped {
+    template<typename... Args>
+    explicit Stamped(long long ns_, Args&&... args)
+        : ns{ns_}, message(std::forward<Args>(args)...) {}
+
+    long long ns;
+    MessageType message;
+};
+
+} // namespace detail
+
+/* fixed priority range [0, Levels) - ring buffer per level and
+   bitmap of non-empty levels, highest level is found with clz,
+   Scheduler (above) decides which level pop() takes.
+   *
+   rings are preallocated so that all levels together hold
+   queue_size messages, a ring doubles if its level gets more
+   than its share, up to queue_size rounded up to power of two,
+   so after warm up push/pop don't touch allocator. Pushing into
+   a ring at that bound throws std::length_error - queue never
+   does, it holds at most queue_size messages */
+template<int Levels, typename Scheduler = StrictPriority>
+struct PriorityLevels {
+    static_assert(Levels > 0 && Levels <= 64 * 64,
+                  "two-level bitmap holds up to 4096 levels");
+
+    template<typename MessageType>
+    class Storage {
+    public:
+        static constexpr int levels = Levels;
+
+        /* scheduler_args go to Scheduler::State constructor */
+        template<typename... SchedulerArgs>
+        explicit Storage(int capacity, SchedulerArgs&&... scheduler_args);
+
+        Storage(const Storage&) = delete;
+        Storage& operator=(const Storage&) = delete;
+        Storage(Storage&&) = default;
+        Storage& operator=(Storage&&) = default;
+
+        template<typename... Args>
+        void push(int priority, Args&&... args);
+        int pop(MessageType* message);
+        int top() const noexcept {
+            return _topLevel();
+        }
+
+        /* for schedulers */
+        bool empty(int level) const noexcept {
+            return _levels[static_cast<size_t>(level)].empty();
+        }
+        /* highest non-empty level below level, -1 if none */
+        int below(int level) const noexcept;
+        /* push time of level's oldest message, stamped schedulers */
+        long long headStamp(int level) const noexcept {
+            return _levels[static_cast<size_t>(level)].front().ns;
+        }
+
+        template<typename Drop>
+        void dropHeads(Drop drop);
+
+    private:
+        using Item = std::conditional_t<Scheduler::stamped,
+                                        detail::Stamped<MessageType>,
+                                        MessageType>;
+        class Ring;
+
+        static MessageType& _message(Item& item) noexcept {
+            if constexpr (Scheduler::stamped)
+                return item.message;
+            else
+                return item;
+        }
+        static constexpr int WORDS = (Levels + 63) / 64;
+
+        int _topLevel() const noexcept;
+        void _setLevel(int level) noexcept;
+        void _clearLevel(int level) noexcept;
+
+        std::vector<Ring> _levels;
+        uint64_t _summary; // bit per non-empty word of _words
+        uint64_t _words[WORDS]; // bit per non-empty level
+        typename Scheduler::State _scheduler;
+    };
+};
+
+template<int Levels, typename Scheduler>
+template<typename MessageType>
+class PriorityLevels<Levels, Scheduler>::Storage<MessageType>::Ring {
+    using Traits = std::allocator_traits<std::allocator<Item>>;
+public:
+    Ring(size_t capacity, size_t limit)
+        : _buf{nullptr}, _mask{capacity - 1}, _limit{limit},
+          _head{0}, _count{0} {
+        /* power of two so that index wraps with mask */
+        assert(capacity && !(capacity & (capacity - 1)));
+        assert(capacity <= limit);
+        _buf = Traits::allocate(_alloc, capacity);
+    }
+
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+
+    Ring(Ring&& other) noexcept
+        : _buf{other._buf}, _mask{other._mask}, _limit{other._limit},
+          _head{other._head}, _count{other._count} {
+        other._buf = nullptr;
+        other._count = 0;
+    }
+
+    Ring& operator=(Ring&& other) noexcept {
+        std::swap(_buf, other._buf);
+        std::swap(_mask, other._mask);
+        std::swap(_limit, other._limit);
+        std::swap(_head, other._head);
+        std::swap(_count, other._count);
+        return *this;
+    }
+
+    ~Ring() {
+        if (!_buf)
+            return;
+        while (_count)
+            popFront();
+        Traits::deallocate(_alloc, _buf, _mask + 1);
+    }
+
+    bool empty() const noexcept {
+        return _count == 0;
+    }
+
+    template<typename... Args>
+    void push(Args&&... args) {
+        if (_count == _mask + 1)
+            _grow();
+        Traits::construct(_alloc, _buf + ((_head + _count) & _mask),
+                          std::forward<Args>(args)...);
+        ++_count;
+    }
+
+    Item& front() noexcept {
+        return _buf[_head];
+    }
+    const Item& front() const noexcept {
+        return _buf[_head];
+    }
+
+    void popFront() {
+        Traits::destroy(_alloc, _buf + _head);
+        _head = (_head + 1) & _mask;
+        --_count;
+    }
+
+private:
+    MQ_COLD void _grow() {
+        if (_mask + 1 == _limit)
+            throw std::length_error("priority level full");
+        Ring bigger((_mask + 1) * 2, _limit);
+        while (_count) {
+            Traits::construct(bigger._alloc, bigger._buf + bigger._count,
+                              std::move(_buf[_head]));
+            ++bigger._count;
+            popFront();
+        }
+        *this = std::move(bigger);
+    }
+
+    std::allocator<Item> _alloc;
+    Item* _buf;
+    size_t _mask;
+    size_t _limit; // capacity _grow stops at
+    size_t _head;
+    size_t _count;
+};
+
+template<int Levels, typename Scheduler>
+template<typename MessageType>
+template<typename... SchedulerArgs>
+PriorityLevels<Levels, Scheduler>::Storage<MessageType>::Storage(
+    int capacity, SchedulerArgs&&... scheduler_args)
+    : _summary{0},
+      _words{},
+      _scheduler(std::forward<SchedulerArgs>(scheduler_args)...) {
+    assert(capacity > 0);
+    /* fair share of capacity per level rounded up to power of two */
+    size_t share = static_cast<size_t>((capacity + Levels - 1) / Levels);
+    size_t ring_size = 1;
+    while (ring_size < share)
+        ring_size *= 2;
+    size_t limit = ring_size;
+    while (limit < static_cast<size_t>(capacity))
+        limit *= 2;
+    _levels.reserve(Levels);
+    for (int i = 0; i != Levels; i++)
+        _levels.emplace_back(ring_size, limit);
+}
+
+template<int Levels, typename Scheduler>
+template<typename MessageType>
+template<typename... Args>
+inline void PriorityLevels<Levels, Scheduler>::Storage<MessageType>::push(
+    int priority, Args&&... args) {
+    priority = detail::clampLevel(priority, Levels);
+    auto& ring = _levels[static_cast<size_t>(priority)];
+    bool was_empty = ring.empty();
+    if constexpr (Scheduler::stamped)
+        ring.push(steadyNowNs(), std::forward<Args>(args)...);
+    else
+        ring.push(std::forward<Args>(args)...);
+    if (was_empty)
+        _setLevel(priority);
+}
+
+template<int Levels, typename Scheduler>
+template<typename MessageType>
+inline int PriorityLevels<Levels, Scheduler>::Storage<MessageType>::pop(
+    MessageType* message) {
+    assert(message != nullptr);
+    int level = _scheduler.pick(*this);
+    auto& ring = _levels[static_cast<size_t>(level)];
+    *message = std::move(_message(ring.front()));
+    ring.popFront();
+    if (ring.empty())
+        _clearLevel(level);
+    return level;
+}
+
+template<int Levels, typename Scheduler>
+template<typename MessageType>
+template<typename Drop>
+void PriorityLevels<Levels, Scheduler>::Storage<MessageType>::dropHeads(
+    Drop drop) {
+    if (!_summary)
+        return;
+    for (int level = _topLevel(); level >= 0; level = below(level)) {
+        auto& ring = _levels[static_cast<size_t>(level)];
+        while (!ring.empty() && drop(std::as_const(_message(ring.front()))))
+            ring.popFront();
+        if (ring.empty())
+            _clearLevel(level);
+    }
+}
+
+template<int Levels, typename Scheduler>
+template<typename MessageType>
+int PriorityLevels<Levels, Scheduler>::Storage<MessageType>::below(
+    int level) const noexcept {
+    if (level <= 0)
+        return -1;
+    if (level >= Levels)
+        return _topLevel();
+    int word = level / 64;
+    uint64_t bits = _words[word] & ((uint64_t{1} << (level % 64)) - 1);
+    if (bits)
+        return word * 64 + 63 - __builtin_clzll(bits);
+    if constexpr (WORDS == 1) {
+        return -1;
+    } else {
+        uint64_t summary = _summary & ((uint64_t{1} << word) - 1);
+        if (!summary)
+            return -1;
+        word = 63 - __builtin_clzll(summary);
+        return word * 64 + 63 - __builtin_clzll(_words[word]);
+    }
+}
+
+template<int Levels, typename Scheduler>
+template<typename MessageType>
+int PriorityLevels<Levels, Scheduler>::Storage<MessageType>::_topLevel()
+    const noexcept {
+    if constexpr (WORDS == 1) {
+        assert(_words[0] != 0);
+        return 63 - __builtin_clzll(_words[0]);
+    } else {
+        assert(_summary != 0);
+        int word = 63 - __builtin_clzll(_summary);
+        return word * 64 + 63 - __builtin_clzll(_words[word]);
+    }
+}
+
+template<int Levels, typename Scheduler>
+template<typename MessageType>
+void PriorityLevels<Levels, Scheduler>::Storage<MessageType>::_setLevel(
+    int level) noexcept {
+    _words[level / 64] |= uint64_t{1} << (level % 64);
+    _summary |= uint64_t{1} << (level / 64);
+}
+
+template<int Levels, typename Scheduler>
+template<typename MessageType>
+void PriorityLevels<Levels, Scheduler>::Storage<MessageType>::_clearLevel(
+    int level) noexcept {
+    _words[level / 64] &= ~(uint64_t{1} << (level % 64));
+    if (!_words[level / 64])
+        _summary &= ~(uint64_t{1} << (level / 64));
+}
+
+template<typename MessageType>
+PooledPriorityMap::Storage<MessageType>::Storage(int capacity)
+    : _node_pool(new SlabPool(sizeof(Node), static_cast<size_t>(capacity))),
+      _level_pool(new SlabPool(0, std::min(LEVEL_CHUNK,
+                                           static_cast<size_t>(capacity)))),
+      _levels(LevelAllocator(_level_pool.get())) {
+    assert(capacity > 0);
+    static_assert(alignof(Node) <= alignof(std::max_align_t),
+                  "slab blocks are aligned for max_align_t only");
+    _node_pool->reserve();
+}
+
+template<typename MessageType>
+PooledPriorityMap::Storage<MessageType>::~Storage() {
+    for (auto& level : _levels) {
+        Node* node = level.second.head;
+        while (node) {
+            Node* next = node->next;
+            node->~Node();
+            _node_pool->deallocate(node);
+            node = next;
+        }
+    }
+}
+
+template<typename MessageType>
+template<typename... Args>
+void PooledPriorityMap::Storage<MessageType>::push(int priority,
+                                                  Args&&... args) {
+    auto& level = _levels[priority];
+    void* block = nullptr;
+    Node* node;
+    try {
+        block = _node_pool->allocate(sizeof(Node));
+        node = new (block) Node(std::forward<Args>(args)...);
+    } catch (...) {
+        if (block)
+            _node_pool->deallocate(block);
+        /* don't leave empty level behind */
+        if (!level.head)
+            _levels.erase(priority);
+        throw;
+    }
+    if (level.tail)
+        level.tail->next = node;
+    else
+        level.head = node;
+    level.tail = node;
+}
+
+template<typename MessageType>
+int PooledPriorityMap::Storage<MessageType>::pop(MessageType* message) {
+    assert(message != nullptr);
+    assert(!_levels.empty());
+    /* max element of map is at the end */
+    auto max_priority_pair_it = std::prev(_levels.end());
+    int priority = max_priority_pair_it->first;
+    auto& level = max_priority_pair_it->second;
+    Node* node = level.head;
+
+    *message = std::move(node->message);
+    level.head = node->next;
+    node->~Node();
+    _node_pool->deallocate(node);
+
+    /* node goes back to level pool */
+    if (!level.head)
+        _levels.erase(max_priority_pair_it);
+    return priority;
+}
+
+template<typename MessageType>
+template<typename Drop>
+void PooledPriorityMap::Storage<MessageType>::dropHeads(Drop drop) {
+    for (auto it = _levels.begin(); it != _levels.end();) {
+        auto& level = it->second;
+        while (level.head && drop(std::as_const(level.head->message))) {
+            Node* node = level.head;
+            level.head = node->next;
+            node->~Node();
+            _node_pool->deallocate(node);
+        }
+        it = level.head ? std::next(it) : _levels.erase(it);
+    }
+}
+
+/* fixed priority range [0, 64) like PriorityLevels with strict
+   priority, but nothing is preallocated and memory follows load:
+   level is FIFO of chunks of ChunkSize messages taken from a
+   cache of spare chunks. Spare chunks above the peak in use
+   during the last quiet period are freed - checked whenever a
+   chunk is taken or given back, and by trim(). MessageQueue
+   readers parked on empty queue call trim() every quiet period,
+   so memory of a queue that went idle is returned without
+   traffic; call MessageQueue::trim() from a timer if nobody
+   waits in get(). Every level keeps its last chunk while empty:
+     MessageQueue<T, ElasticLevels<8>>
+         q(size, lwm, hwm, std::chrono::seconds(5));
+   capacity is not used - any number of messages fits */
+template<int Levels, size_t ChunkSize = 64>
+struct ElasticLevels {
+    static_assert(Levels > 0 && Levels <= 64,
+                  "one bitmap word of levels");
+    static_assert(ChunkSize > 0, "chunk holds messages");
+
+    template<typename MessageType>
+    class Storage {
+    public:
+        static constexpr int levels = Levels;
+        static constexpr bool trims = true;
+
+        explicit Storage(int capacity)
+            : Storage(capacity, std::chrono::seconds(1)) {}
+        template<typename Rep, typename Period>
+        Storage(int capacity,
+                const std::chrono::duration<Rep, Period>& quiet_period);
+
+        Storage(const Storage&) = delete;
+        Storage& operator=(const Storage&) = delete;
+
+        ~Storage();
+
+        template<typename... Args>
+        void push(int priority, Args&&... args);
+        int pop(MessageType* message);
+        int top() const noexcept {
+            assert(_nonempty != 0);
+            return 63 - __builtin_clzll(_nonempty);
+        }
+
+        /* allocated chunks, in use and spare */
+        size_t chunks() const noexcept {
+            return _in_use + _spare_count;
+        }
+
+        template<typename Drop>
+        void dropHeads(Drop drop);
+        void trim() noexcept {
+            _trim();
+        }
+        std::chrono::nanoseconds trimPeriod() const noexcept {
+            return std::chrono::nanoseconds(_quiet_ns);
+        }
+
+    private:
+        struct alignas(MessageType) Slot {
+            unsigned char bytes[sizeof(MessageType)];
+        };
+        struct Chunk {
+            Chunk* next;
+            Slot slots[ChunkSize];
+        };
+        /* messages [first, end) of chunk list [head, tail] */
+        struct Level {
+            Chunk* head = nullptr;
+            Chunk* tail = nullptr;
+            size_t first = 0;
+            size_t end = 0;
+        };
+
+        static MessageType* _at(Chunk* chunk, size_t index) noexcept {
+            return std::launder(
+                reinterpret_cast<MessageType*>(&chunk->slots[index]));
+        }
+        /* destroys head message of non-empty level */
+        void _popHead(int priority) noexcept;
+        Chunk* _takeChunk();
+        void _giveChunk(Chunk* chunk) noexcept;
+        void _trim() noexcept;
+
+        Level _levels[Levels];
+        uint64_t _nonempty;
+        Chunk* _spare;
+        size_t _spare_count;
+        size_t _in_use;
+        /* most chunks in use since _window_ns */
+        size_t _peak;
+        long long _window_ns;
+        long long _quiet_ns;
+    };
+};
+
+/* capacity, lwm and hwm of queue are bytes of queued messages
+   (messageBytes() above) instead of their number, for payloads
+   from tens of bytes to megabytes. Messages are kept by Inner,
+   which gets capacity in bytes too - pick one that doesn't
+   preallocate by it:
+     MessageQueue<std::string, ByteBudget<ElasticLevels<8>>>
+         q(64 << 20, 16 << 20, 48 << 20);
+   A message bigger than the whole budget still goes into empty
+   queue. Wrap other wrappers (Journaled) with ByteBudget, not the
+   other way round; recovered messages count as 0 bytes */
+template<typename Inner = PriorityMap>
+struct ByteBudget {
+    template<typename MessageType>
+    class Storage {
+        using InnerStorage = typename Inner::template Storage<MessageType>;
+    public:
+        static constexpr bool counts_bytes = true;
+        static constexpr int levels = detail::LevelCount<InnerStorage>::value;
+        static constexpr bool trims = detail::Trims<InnerStorage>::value;
+
+        /* inner_args follow capacity to Inner storage */
+        template<typename... InnerArgs>
+        explicit Storage(int capacity, InnerArgs&&... inner_args)
+            : _inner(capacity, std::forward<InnerArgs>(inner_args)...) {}
+
+        template<typename... Args>
+        void push(int priority, Args&&... args) {
+            _inner.push(priority, std::forward<Args>(args)...);
+        }
+        int pop(MessageType* message) {
+            return _inner.pop(message);
+        }
+        int top() const {
+            return _inner.top();
+        }
+        int recovered() const {
+            return detail::recoveredMessages(_inner);
+        }
+        template<typename Drop>
+        void dropHeads(Drop drop) {
+            _inner.dropHeads(std::move(drop));
+        }
+        void trim() {
+            detail::trimStorage(_inner);
+        }
+        std::chrono::nanoseconds trimPeriod() const {
+            return detail::trimPeriod(_inner);
+        }
+
+    private:
+        InnerStorage _inner;
+    };
+};
+
+/* messages with expiry deadline (MessageQueue::put() taking
+   expires_at): an expired message is never delivered - get()
+   skips it, and a put() that finds queue at hwm or full first
+   purges expired messages, so they stop counting toward
+   watermarks and capacity and their memory is freed.
+   *
+   Expiry and capacity units of a message are kept in the entry
+   Inner stores, so Expiring allocates nothing of its own. Purge
+   drops expired level heads out of Inner (Inner::dropHeads) -
+   a message expiring before older ones of its level is purged
+   when it becomes the head, or skipped by get(). Purge looks at
+   the head of every non-empty level and at messages it drops.
+   Put Expiring outermost:
+     MessageQueue<T, Expiring<ByteBudget<ElasticLevels<8>>>> q(...);
+   Inner must start empty (no Journaled). Expiry is in
+   steadyNowNs() time */
+template<typename Inner = PriorityMap>
+struct Expiring {
+    static constexpr long long NEVER = std::numeric_limits<long long>::max();
+
+    template<typename MessageType>
+    class Storage {
+        struct Entry {
+            Entry() = default;
+            template<typename... Args>
+            explicit Entry(long long expires_ns_, int units_, Args&&... args)
+                : message(std::forward<Args>(args)...),
+                  expires_ns{expires_ns_}, units{units_} {}
+
+            MessageType message;
+            long long expires_ns;
+            int units;
+        };
+        using InnerStorage = typename Inner::template Storage<Entry>;
+    public:
+        static constexpr bool expires = true;
+        static constexpr bool counts_bytes =
+            detail::CountsBytes<InnerStorage>::value;
+        static constexpr int levels = detail::LevelCount<InnerStorage>::value;
+        static constexpr bool trims = detail::Trims<InnerStorage>::value;
+
+        /* what purge() took out of count */
+        struct Purged {
+            int messages = 0;
+            long long units = 0;
+        };
+
+        /* inner_args follow capacity to Inner storage */
+        template<typename... InnerArgs>
+        explicit Storage(int capacity, InnerArgs&&... inner_args)
+            : _inner(capacity, std::forward<InnerArgs>(inner_args)...),
+              _next_expires_ns{NEVER},
+              _next_units{1},
+              _popped_expires_ns{NEVER},
+              _expiring{0} {
+            assert(detail::recoveredMessages(_inner) == 0);
+        }
+
+        /* expiry and capacity units of message next push() stores */
+        void setNext(long long expires_ns, int units) noexcept {
+            _next_expires_ns = expires_ns;
+            _next_units = units;
+        }
+        template<typename... Args>
+        void push(int priority, Args&&... args);
+        int pop(MessageType* message);
+        int top() const {
+            return _inner.top();
+        }
+
+        /* of message last pop() took */
+        long long poppedExpiry() const noexcept {
+            return _popped_expires_ns;
+        }
+        /* drops expired level heads */
+        Purged purge(long long now_ns);
+        void trim() {
+            detail::trimStorage(_inner);
+        }
+        std::chrono::nanoseconds trimPeriod() const {
+            return detail::trimPeriod(_inner);
+        }
+
+    private:
+        InnerStorage _inner;
+        long long _next_expires_ns;
+        int _next_units;
+        long long _popped_expires_ns;
+        /* queued messages that can expire */
+        size_t _expiring;
+    };
+};
+
+template<int Levels, size_t ChunkSize>
+template<typename MessageType>
+template<typename Rep, typename Period>
+ElasticLevels<Levels, ChunkSize>::Storage<MessageType>::Storage(
+    int, const std::chrono::duration<Rep, Period>& quiet_period)
+    : _nonempty{0},
+      _spare{nullptr},
+      _spare_count{0},
+      _in_use{0},
+      _peak{0},
+      _window_ns{steadyNowNs()},
+      _quiet_ns{std::chrono::duration_cast<std::chrono::nanoseconds>(
+              quiet_period).count()} {
+    assert(_quiet_ns >= 0);
+}
+
+template<int Levels, size_t ChunkSize>
+template<typename MessageType>
+ElasticLevels<Levels, ChunkSize>::Storage<MessageType>::~Storage() {
+    for (auto& level : _levels) {
+        while (level.head) {
+            size_t end = level.head == level.tail ? level.end : ChunkSize;
+            for (size_t i = level.first; i != end; i++)
+                _at(level.head, i)->~MessageType();
+            Chunk* next = level.head->next;
+            delete level.head;
+            level.head = next;
+            level.first = 0;
+        }
+    }
+    while (_spare) {
+        Chunk* next = _spare->next;
+        delete _spare;
+        _spare = next;
+    }
+}
+
+template<int Levels, size_t ChunkSize>
+template<typename MessageType>
+template<typename... Args>
+void ElasticLevels<Levels, ChunkSize>::Storage<MessageType>::push(
+    int priority, Args&&... args) {
+    priority = detail::clampLevel(priority, Levels);
+    auto& level = _levels[priority];
+    Chunk* chunk = level.tail;
+    size_t index = level.end;
+    Chunk* fresh = nullptr;
+    if (!chunk || index == ChunkSize) {
+        fresh = _takeChunk();
+        chunk = fresh;
+        index = 0;
+    }
+    try {
+        ::new (&chunk->slots[index]) MessageType(std::forward<Args>(args)...);
+    } catch (...) {
+        if (fresh)
+            _giveChunk(fresh);
+        throw;
+    }
+    if (fresh) {
+        fresh->next = nullptr;
+        if (level.tail) {
+            level.tail->next = fresh;
+        } else {
+            level.head = fresh;
+            level.first = 0;
+        }
+        level.tail = fresh;
+    }
+    level.end = index + 1;
+    _nonempty |= uint64_t{1} << priority;
+}
+
+template<int Levels, size_t ChunkSize>
+template<typename MessageType>
+int ElasticLevels<Levels, ChunkSize>::Storage<MessageType>::pop(
+    MessageType* message) {
+    assert(message != nullptr);
+    int priority = top();
+    auto& level = _levels[priority];
+    *message = std::move(*_at(level.head, level.first));
+    _popHead(priority);
+    return priority;
+}
+
+template<int Levels, size_t ChunkSize>
+template<typename MessageType>
+template<typename Drop>
+void ElasticLevels<Levels, ChunkSize>::Storage<MessageType>::dropHeads(
+    Drop drop) {
+    for (uint64_t bits = _nonempty; bits; bits &= bits - 1) {
+        int priority = __builtin_ctzll(bits);
+        auto& level = _levels[priority];
+        while ((_nonempty >> priority & 1) &&
+               drop(std::as_const(*_at(level.head, level.first))))
+            _popHead(priority);
+    }
+}
+
+template<int Levels, size_t ChunkSize>
+template<typename MessageType>
+void ElasticLevels<Levels, ChunkSize>::Storage<MessageType>::_popHead(
+    int priority) noexcept {
+    auto& level = _levels[priority];
+    _at(level.head, level.first)->~MessageType();
+    ++level.first;
+    if (level.head == level.tail && level.first == level.end) {
+        /* chunk stays for the next push */
+        level.first = 0;
+        level.end = 0;
+        _nonempty &= ~(uint64_t{1} << priority);
+    } else if (level.first == ChunkSize) {
+        Chunk* done = level.head;
+        level.head = done->next;
+        level.first = 0;
+        _giveChunk(done);
+    }
+}
+
+template<int Levels, size_t ChunkSize>
+template<typename MessageType>
+typename ElasticLevels<Levels, ChunkSize>::template Storage<MessageType>::Chunk*
+ElasticLevels<Levels, ChunkSize>::Storage<MessageType>::_takeChunk() {
+    Chunk* chunk;
+    if (_spare) {
+        chunk = _spare;
+        _spare = chunk->next;
+        --_spare_count;
+    } else {
+        chunk = new Chunk;
+    }
+    ++_in_use;
+    _peak = std::max(_peak, _in_use);
+    _trim();
+    return chunk;
+}
+
+template<int Levels, size_t ChunkSize>
+template<typename MessageType>
+void ElasticLevels<Levels, ChunkSize>::Storage<MessageType>::_giveChunk(
+    Chunk* chunk) noexcept {
+    chunk->next = _spare;
+    _spare = chunk;
+    ++_spare_count;
+    --_in_use;
+    _trim();
+}
+
+template<int Levels, size_t ChunkSize>
+template<typename MessageType>
+void ElasticLevels<Levels, ChunkSize>::Storage<MessageType>::_trim()
+    noexcept {
+    auto now = steadyNowNs();
+    if (now - _window_ns < _quiet_ns)
+        return;
+    /* whatever the busiest moment of the period didn't need */
+    while (_spare && _in_use + _spare_count > _peak) {
+        Chunk* next = _spare->next;
+        delete _spare;
+        _spare = next;
+        --_spare_count;
+    }
+    _window_ns = now;
+    _peak = _in_use;
+}
+
+template<typename Inner>
+template<typename MessageType>
+template<typename... Args>
+void Expiring<Inner>::Storage<MessageType>::push(int priority,
+                                                 Args&&... args) {
+    _inner.push(priority, _next_expires_ns, _next_units,
+                std::forward<Args>(args)...);
+    if (_next_expires_ns != NEVER)
+        ++_expiring;
+    _next_expires_ns = NEVER;
+    _next_units = 1;
+}
+
+template<typename Inner>
+template<typename MessageType>
+int Expiring<Inner>::Storage<MessageType>::pop(MessageType* message) {
+    Entry entry;
+    int priority = _inner.pop(&entry);
+    *message = std::move(entry.message);
+    _popped_expires_ns = entry.expires_ns;
+    if (_popped_expires_ns != NEVER)
+        --_expiring;
+    return priority;
+}
+
+template<typename Inner>
+template<typename MessageType>
+typename Expiring<Inner>::template Storage<MessageType>::Purged
+Expiring<Inner>::Storage<MessageType>::purge(long long now_ns) {
+    Purged purged;
+    if (!_expiring)
+        return purged;
+    _inner.dropHeads([this, now_ns, &purged](const Entry& entry) {
+            if (entry.expires_ns > now_ns)
+                return false;
+            ++purged.messages;
+            purged.units += entry.units;
+            --_expiring;
+            return true;
+        });
+    return purged;
+}
+
+} // namespace zodiactest
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <system_error>
+#include <vector>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "messagequeue.hpp"
+#include "wait_strategy.hpp"
+
+namespace zodiactest {
+
+/* One reader thread for many queues.
+   *
+   QueueSet::get() takes a message from whichever queue has one,
+   parking on the set while all of them are empty. Queues tell the
+   set when they become non-empty, run or stop (IReadyListener), so
+   a parked reader wakes on any of them. Non-empty queues are served
+   round robin, weight messages in a row each.
+   *
+   A set belongs to one reader thread, several sets (and other
+   readers) may share queues. Queue is anything with
+   try_get(value_type*) and add/removeListener(), i.e. MessageQueue */
+template<typename Queue>
+class QueueSet {
+public:
+    using value_type = typename Queue::value_type;
+
+    QueueSet();
+
+    QueueSet(const QueueSet&) = delete;
+    QueueSet& operator=(const QueueSet&) = delete;
+
+    ~QueueSet();
+
+    /* returns index of queue in set */
+    int add(std::shared_ptr<Queue> queue, int weight = 1);
+    /* waits for a message from any queue, *index gets its queue;
+       STOPPED when every queue is stopped */
+    RetCode get(value_type* message, int* index = nullptr);
+    /* WOULD_BLOCK when every running queue is empty */
+    RetCode try_get(value_type* message, int* index = nullptr);
+    /* how get() waits on empty queues */
+    void setWaitStrategy(const WaitStrategy& strategy);
+
+private:
+    class Listener : public IReadyListener {
+    public:
+        explicit Listener(QueueSet* set) : _set{set} {}
+        void on_ready() noexcept override {
+            _set->_epoch.fetch_add(1, std::memory_order_release);
+            _set->_parking.wake();
+        }
+    private:
+        QueueSet* _set;
+    };
+
+    struct Entry {
+        std::shared_ptr<Queue> queue;
+        int weight;
+    };
+
+    void _advance() noexcept;
+
+    std::vector<Entry> _queues;
+    size_t _cursor;
+    int _credit;
+    WaitStrategy _wait_strategy;
+    /* bumped by every listener call */
+    std::atomic<uint64_t> _epoch;
+    Parking _parking;
+    Listener _listener;
+};
+
+/* eventfd that becomes readable when queue becomes non-empty,
+   runs or stops - for epoll/poll loops (Linux):
+     on readable fd: clear(), then try_get() until WOULD_BLOCK.
+   clear() goes first, so a put that races with the drain
+   leaves fd readable again */
+template<typename Queue>
+class QueueEventFd : private IReadyListener {
+public:
+    /* throws std::system_error */
+    explicit QueueEventFd(std::shared_ptr<Queue> queue);
+
+    QueueEventFd(const QueueEventFd&) = delete;
+    QueueEventFd& operator=(const QueueEventFd&) = delete;
+
+    ~QueueEventFd();
+
+    int fd() const noexcept {
+        return _fd;
+    }
+    void clear() noexcept;
+
+private:
+    void on_ready() noexcept override;
+
+    std::shared_ptr<Queue> _queue;
+    int _fd;
+};
+
+template<typename Queue>
+QueueSet<Queue>::QueueSet()
+    : _cursor{0},
+      _credit{0},
+      _wait_strategy(WaitStrategy::defaultStrategy()),
+      _epoch{0},
+      _listener{this} {
+}
+
+template<typename Queue>
+QueueSet<Queue>::~QueueSet() {
+    for (auto& entry : _queues)
+        entry.queue->removeListener(&_listener);
+}
+
+template<typename Queue>
+int QueueSet<Queue>::add(std::shared_ptr<Queue> queue, int weight) {
+    assert(queue != nullptr);
+    assert(weight > 0);
+    queue->addListener(&_listener);
+    _queues.push_back(Entry{std::move(queue), weight});
+    if (_queues.size() == 1)
+        _credit = weight;
+    return static_cast<int>(_queues.size() - 1);
+}
+
+template<typename Queue>
+RetCode QueueSet<Queue>::get(value_type* message, int* index) {
+    while (true) {
+        /* read before trying queues - transition after
+           the tries changes it */
+        auto epoch = _epoch.load(std::memory_order_acquire);
+        auto ret = try_get(message, index);
+        if (ret != RetCode::WOULD_BLOCK)
+            return ret;
+        _parking.wait(_wait_strategy, [this, epoch] {
+                return _epoch.load(std::memory_order_acquire) != epoch;
+            });
+    }
+}
+
+template<typename Queue>
+RetCode QueueSet<Queue>::try_get(value_type* message, int* index) {
+    assert(!_queues.empty());
+    size_t stopped = 0;
+    for (size_t i = 0; i != _queues.size(); i++) {
+        auto ret = _queues[_cursor].queue->try_get(message);
+        if (ret == RetCode::OK) {
+            if (index)
+                *index = static_cast<int>(_cursor);
+            if (!--_credit)
+                _advance();
+            return RetCode::OK;
+        }
+        if (ret == RetCode::STOPPED)
+            ++stopped;
+        _advance();
+    }
+    return stopped == _queues.size() ? RetCode::STOPPED :
+        RetCode::WOULD_BLOCK;
+}
+
+template<typename Queue>
+void QueueSet<Queue>::setWaitStrategy(const WaitStrategy& strategy) {
+    _wait_strategy = strategy;
+}
+
+template<typename Queue>
+void QueueSet<Queue>::_advance() noexcept {
+    _cursor = (_cursor + 1) % _queues.size();
+    _credit = _queues[_cursor].weight;
+}
+
+template<typename Queue>
+QueueEventFd<Queue>::QueueEventFd(std::shared_ptr<Queue> queue)
+    : _queue(std::move(queue)),
+      _fd{eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)} {
+    assert(_queue != nullptr);
+    if (_fd < 0)
+        throw std::system_error(errno, std::generic_category(), "eventfd");
+    _queue->addListener(this);
+    /* messages put before us - reader has to look */
+    on_ready();
+}
+
+template<typename Queue>
+QueueEventFd<Queue>::~QueueEventFd() {
+    _queue->removeListener(this);
+    close(_fd);
+}
+
+template<typename Queue>
+void QueueEventFd<Queue>::clear() noexcept {
+    uint64_t count;
+    /* nonblocking - EAGAIN if already clear */
+    (void)!read(_fd, &count, sizeof(count));
+}
+
+template<typename Queue>
+void QueueEventFd<Queue>::on_ready() noexcept {
+    uint64_t one = 1;
+    (void)!write(_fd, &one, sizeof(one));
+}
+
+} // namespace zodiactest
@@ -1,48 +1,27 @@
 
 #include "reader.hpp"
 
-#include <cassert>
-
-#include "console.hpp"
+#include "logger.hpp"
 
 namespace zodiactest {
 
 std::atomic<int> Reader::gmsg_num{0};
 
 Reader::Reader(const std::string& name,
-               std::shared_ptr<Queue> queue_sp)
+               std::shared_ptr<CreditGate> gate_sp)
     : _name(name),
-      _queue_sp(queue_sp) {
-    assert(queue_sp != nullptr);
-}
-
-Reader::~Reader() {
-    if (_thread.joinable()) {
-        _queue_sp->stop();
-        _thread.join();
-    }
-}
-
-void Reader::run() {
-    assert(!_thread.joinable());
-    _thread = std::thread(&Reader::mainFunc, this);
+      _gate_sp(gate_sp) {
 }
 
-void Reader::mainFunc() {
-    RetCode ret;
-    std::string msg;
-    do {
-        ret = _queue_sp->get(&msg);
-        if (ret == RetCode::OK)
-            _handleMessage(msg);
-    } while (ret == RetCode::OK);
-    
-    logConsole(_name + " detected queue stop\n");
+void Reader::operator()(const MessageBuffer& msg) {
+    _handleMessage(msg.view());
+    if (_gate_sp)
+        _gate_sp->release(1);
 }
 
-void Reader::_handleMessage(const std::string& msg) {
+void Reader::_handleMessage(std::string_view msg) {
     ++gmsg_num;
-    logConsole(_name + " read >>> " + msg + "\n");
+    logTrace("{} read >>> {}", _name, msg);
 }
 
 } // namespace zodiactest 
@@ -1,39 +1,32 @@
-
 #pragma once
 
 #include <atomic>
 #include <memory>
-#include <thread>
+#include <string>
+#include <string_view>
 
-#include "messagequeue.hpp"
+#include "flow_control.hpp"
+#include "message_buffer.hpp"
 
 namespace zodiactest {
 
+/* Message handler of app's ReaderPool - counts
+   messages, logs them and gives credits back */
 class Reader {
-    using Queue = MessageQueue<std::string>;
 public:
+    /* credits of handled messages go back to gate_sp (if any) */
     Reader(const std::string & name,
-           std::shared_ptr<Queue> queue_sp);
-
-    Reader(const Reader&) = delete;
-    Reader& operator=(const Reader&) = delete;
-    Reader(Reader&&) = default;
-    Reader& operator=(Reader&&) = default;
-
-    ~Reader();
-    
-    void run();
-    void mainFunc();
-    
-    static std::atomic<int> gmsg_num;
+           std::shared_ptr<CreditGate> gate_sp = nullptr);
 
-protected:
-    void _handleMessage(const std::string& msg);
+    void operator()(const MessageBuffer& msg);
+
+    static std::atomic<int> gmsg_num;
 
 private:
-    const std::string _name;
-    std::shared_ptr<Queue> _queue_sp;
-    std::thread _thread;
+    void _handleMessage(std::string_view msg);
+
+    std::string _name;
+    std::shared_ptr<CreditGate> _gate_sp;
 };
 
 } // namespace zodiactest 
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "affinity.hpp"
+#include "messagequeue.hpp"
+#include "platform.hpp"
+
+namespace zodiactest {
+
+/* payload prefetch hook of pipelined workers - overload it for
+   message types pointing to their payload (see MessageBuffer),
+   the rest is left to hardware prefetcher */
+template<typename MessageType>
+inline void prefetchMessage(const MessageType&) noexcept {}
+
+namespace detail {
+
+/* Two chunks passed between fetch and handle stage of pipelined
+   worker - fetcher fills one while handler works through the
+   other. One lock per chunk, not per message */
+template<typename MessageType>
+class ChunkPipe {
+public:
+    explicit ChunkPipe(int chunk_size)
+        : _filled{0}, _handled{0}, _closed{false} {
+        for (auto& chunk : _chunks)
+            chunk.reserve(static_cast<size_t>(chunk_size));
+    }
+
+    /* fetch stage: empty chunk, waits while both are full */
+    std::vector<MessageType>& toFill() {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _notify.wait(lock, [this] {
+                return _filled - _handled != 2;
+            });
+        auto& chunk = _chunks[_filled % 2];
+        chunk.clear();
+        return chunk;
+    }
+    void filled() {
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            ++_filled;
+        }
+        _notify.notify_one();
+    }
+    /* no chunks after this one */
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            _closed = true;
+        }
+        _notify.notify_one();
+    }
+    /* handle stage: next full chunk, nullptr once
+       closed and every chunk is handled */
+    std::vector<MessageType>* toHandle() {
+        std::unique_lock<std::mutex> lock(_mtx);
+        _notify.wait(lock, [this] {
+                return _filled != _handled || _closed;
+            });
+        if (_filled == _handled)
+            return nullptr;
+        return &_chunks[_handled % 2];
+    }
+    void handled() {
+        {
+            std::lock_guard<std::mutex> lock(_mtx);
+            ++_handled;
+        }
+        _notify.notify_one();
+    }
+
+private:
+    std::mutex _mtx;
+    /* stages never wait at the same time */
+    std::condition_variable _notify;
+    std::vector<MessageType> _chunks[2];
+    unsigned _filled;
+    unsigned _handled;
+    bool _closed;
+};
+
+} // namespace detail
+
+/* Reader threads running handler on every message of queue.
+   *
+   Handler is a template parameter so that the call is inlined -
+   anything callable as handler(const MessageType&). Every worker
+   runs its own copy of handler, shared state is up to handler.
+   *
+   Worker takes up to batch_size messages with one get_bulk(),
+   handles them all and only then re-checks stop. Workers can be
+   pinned to CPUs or NUMA nodes (see affinity.hpp), pinning is
+   done before the first get so worker's memory is first touched
+   on its node.
+   *
+   Pipelined workers (setPipeline()) split in two threads: fetch
+   stage takes chunks with get_bulk() while handle stage runs
+   handler on the previous chunk, prefetching payloads a few
+   messages ahead - queue lock and handler's cache misses overlap
+   instead of taking turns. Every message taken from the queue
+   is handled, stop() included. */
+template<typename Queue, typename Handler>
+class ReaderPool {
+public:
+    using MessageType = typename Queue::value_type;
+
+    ReaderPool(std::shared_ptr<Queue> queue_sp, const Handler& handler,
+               int threads, int batch_size = 1);
+
+    ReaderPool(const ReaderPool&) = delete;
+    ReaderPool& operator=(const ReaderPool&) = delete;
+
+    ~ReaderPool();
+
+    /* before run(): worker i runs only on cpus[i % cpus.size()],
+       e.g. {{0}, {1}} - one CPU each, {numaNodeCpus(1)} - all
+       workers on node 1; empty - no pinning */
+    void setAffinity(std::vector<std::vector<int>> cpus);
+    /* before run(): each worker gets a fetch thread taking up to
+       chunk_size messages at a time (batch_size is not used),
+       handler prefetches message i + prefetch_distance while
+       handling message i; chunk_size 0 - no pipeline */
+    void setPipeline(int chunk_size, int prefetch_distance = 4);
+    void run();
+    /* stops queue too - workers may wait in get_bulk(),
+       then joins them */
+    void stop();
+    int threads() const noexcept {
+        return _threads;
+    }
+
+private:
+    void _mainFunc(int worker);
+    void _pipelinedFunc(int worker);
+    void _handleChunk(Handler& handler,
+                      const std::vector<MessageType>& msgs) const;
+
+    std::shared_ptr<Queue> _queue_sp;
+    const Handler _handler;
+    const int _threads;
+    const int _batch_size;
+    int _chunk_size;
+    int _prefetch_distance;
+    std::vector<std::vector<int>> _cpus;
+    std::atomic<bool> _stopping;
+    std::vector<std::thread> _workers;
+};
+
+template<typename Queue, typename Handler>
+ReaderPool<Queue, Handler>::ReaderPool(std::shared_ptr<Queue> queue_sp,
+                                       const Handler& handler,
+                                       int threads, int batch_size)
+    : _queue_sp(std::move(queue_sp)),
+      _handler(handler),
+      _threads{threads},
+      _batch_size{batch_size},
+      _chunk_size{0},
+      _prefetch_distance{0},
+      _stopping{false} {
+    assert(_queue_sp != nullptr);
+    assert(threads > 0);
+    assert(batch_size > 0);
+}
+
+template<typename Queue, typename Handler>
+ReaderPool<Queue, Handler>::~ReaderPool() {
+    stop();
+}
+
+template<typename Queue, typename Handler>
+void ReaderPool<Queue, Handler>::setAffinity(
+    std::vector<std::vector<int>> cpus) {
+    assert(_workers.empty());
+    _cpus = std::move(cpus);
+}
+
+template<typename Queue, typename Handler>
+void ReaderPool<Queue, Handler>::setPipeline(int chunk_size,
+                                             int prefetch_distance) {
+    assert(_workers.empty());
+    assert(chunk_size >= 0);
+    assert(prefetch_distance >= 0);
+    _chunk_size = chunk_size;
+    _prefetch_distance = prefetch_distance;
+}
+
+template<typename Queue, typename Handler>
+void ReaderPool<Queue, Handler>::run() {
+    assert(_workers.empty());
+    _stopping = false;
+    _workers.reserve(static_cast<size_t>(_threads));
+    for (int i = 0; i != _threads; i++) {
+        if (_chunk_size)
+            _workers.emplace_back(&ReaderPool::_pipelinedFunc, this, i);
+        else
+            _workers.emplace_back(&ReaderPool::_mainFunc, this, i);
+    }
+}
+
+template<typename Queue, typename Handler>
+void ReaderPool<Queue, Handler>::stop() {
+    if (_workers.empty())
+        return;
+    _stopping = true;
+    _queue_sp->stop();
+    for (auto& worker : _workers)
+        worker.join();
+    _workers.clear();
+}
+
+template<typename Queue, typename Handler>
+void ReaderPool<Queue, Handler>::_mainFunc(int worker) {
+    if (!_cpus.empty())
+        pinCurrentThread(_cpus[static_cast<size_t>(worker) % _cpus.size()]);
+
+    Handler handler(_handler);
+    std::vector<MessageType> msgs;
+    msgs.reserve(static_cast<size_t>(_batch_size));
+    while (!_stopping.load(std::memory_order_relaxed)) {
+        msgs.clear();
+        if (_queue_sp->get_bulk(std::back_inserter(msgs),
+                                _batch_size) != RetCode::OK)
+            break;
+        for (const auto& msg : msgs)
+            handler(msg);
+    }
+}
+
+template<typename Queue, typename Handler>
+void ReaderPool<Queue, Handler>::_pipelinedFunc(int worker) {
+    detail::ChunkPipe<MessageType> pipe(_chunk_size);
+    std::thread fetcher([this, worker, &pipe] {
+            if (!_cpus.empty())
+                pinCurrentThread(
+                    _cpus[static_cast<size_t>(worker) % _cpus.size()]);
+            while (!_stopping.load(std::memory_order_relaxed)) {
+                auto& chunk = pipe.toFill();
+                if (_queue_sp->get_bulk(std::back_inserter(chunk),
+                                        _chunk_size) != RetCode::OK)
+                    break;
+                pipe.filled();
+            }
+            pipe.close();
+        });
+    if (!_cpus.empty())
+        pinCurrentThread(_cpus[static_cast<size_t>(worker) % _cpus.size()]);
+
+    Handler handler(_handler);
+    /* drains what fetcher took before it saw stop */
+    while (auto msgs = pipe.toHandle()) {
+        _handleChunk(handler, *msgs);
+        pipe.handled();
+    }
+    fetcher.join();
+}
+
+template<typename Queue, typename Handler>
+void ReaderPool<Queue, Handler>::_handleChunk(
+    Handler& handler, const std::vector<MessageType>& msgs) const {
+    auto size = msgs.size();
+    auto distance = static_cast<size_t>(_prefetch_distance);
+    for (size_t i = 0; i != std::min(distance, size); i++)
+        prefetchMessage(msgs[i]);
+    for (size_t i = 0; i != size; i++) {
+        if (i + distance < size)
+            prefetchMessage(msgs[i + distance]);
+        handler(msgs[i]);
+    }
+}
+
+} // namespace zodiactest
@@ -0,0 +1,357 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "messagequeue.hpp"
+#include "wait_strategy.hpp"
+
+namespace zodiactest {
+
+/* N independent MessageQueue shards behind one put/get interface,
+   so that writers and readers don't serialize on a single mutex.
+   *
+   Writers go round robin to the next shard (spilling to other shards
+   if it's full) or by key hash, messages with equal key keep FIFO
+   order. Every reader has a home shard and steals from the others
+   when home is empty.
+   *
+   Priority across shards is approximate. Reader serves the higher of
+   its home shard's top and one probed shard's top, probing other
+   shards in turn, and takes the highest of all shards when home is
+   empty. So a reader serves at most shards - 1 messages of lower
+   priority before it probes a shard holding a higher one. Inside a
+   shard priority is strict.
+   *
+   queue_size is split evenly between shards, watermarks and
+   events apply to total size across all shards. */
+template<typename MessageType, typename StoragePolicy = PriorityMap>
+class ShardedMessageQueue {
+public:
+    /* storage_args follow shard size to storage constructor
+       of every shard, so they are copied, not forwarded */
+    template<typename... StorageArgs>
+    ShardedMessageQueue(int shards, int queue_size, int lwm, int hwm,
+                        const StorageArgs&... storage_args);
+
+    ShardedMessageQueue(const ShardedMessageQueue&) = delete;
+    ShardedMessageQueue& operator=(const ShardedMessageQueue&) = delete;
+
+    ~ShardedMessageQueue();
+
+    RetCode put(const MessageType& message, int priority);
+    RetCode put(MessageType&& message, int priority);
+    /* key (hash of message source, for example)
+       picks shard as key % shards */
+    RetCode put(const MessageType& message, int priority, size_t key);
+    RetCode put(MessageType&& message, int priority, size_t key);
+    /* home shard is picked per calling thread */
+    RetCode get(MessageType* message);
+    RetCode get(MessageType* message, int home);
+    /* returns once replaced events are called by nobody and
+       releases them, so it must not be called from a handler */
+    void setEvents(std::shared_ptr<IMessageQueueEvents> events);
+    /* not synchronized - set before run() */
+    void setWaitStrategy(const WaitStrategy& strategy);
+
+    void stop();
+    void run();
+    int size() const noexcept;
+    int shards() const noexcept;
+
+private:
+    /* shard metrics aren't reachable, don't pay for them */
+    using Shard = MessageQueue<MessageType, StoragePolicy, NoMetrics>;
+    enum class QueueState : int {
+        RUNNING = 0,
+        STOPPED
+    };
+
+    template<typename Message>
+    RetCode _put(Message&& message, int priority, size_t shard, bool spill);
+    int _pickShard(int home) const;
+    bool _empty() const noexcept;
+    bool _stopped() const noexcept {
+        return _queue_state.load(std::memory_order_acquire) ==
+            QueueState::STOPPED;
+    }
+
+    const int _lwm;
+    const int _hwm;
+    std::atomic<QueueState> _queue_state;
+    std::atomic<bool> _hwm_flag;
+    WaitStrategy _wait_strategy;
+    EpochEvents _events;
+    std::vector<std::unique_ptr<Shard>> _shards;
+    std::atomic<int> _current_size;
+    Parking _readers;
+};
+
+namespace detail {
+
+/* per thread counter starting at different value in every
+   thread, so threads spread over shards without shared writes */
+inline unsigned threadTicket() {
+    static std::atomic<unsigned> next{0};
+    thread_local unsigned ticket = next.fetch_add(1,
+                                                  std::memory_order_relaxed);
+    return ticket++;
+}
+
+inline unsigned threadHome() {
+    static std::atomic<unsigned> next{0};
+    thread_local unsigned home = next.fetch_add(1, std::memory_order_relaxed);
+    return home;
+}
+
+} // namespace detail
+
+template<typename MessageType, typename StoragePolicy>
+template<typename... StorageArgs>
+ShardedMessageQueue<MessageType, StoragePolicy>::ShardedMessageQueue(
+    int shards, int queue_size, int lwm, int hwm,
+    const StorageArgs&... storage_args)
+    : _lwm{lwm},
+      _hwm{hwm},
+      _queue_state{QueueState::STOPPED},
+      _hwm_flag{false},
+      _wait_strategy(WaitStrategy::defaultStrategy()),
+      _current_size{0} {
+    assert(shards > 0);
+    assert(queue_size >= shards);
+    assert(lwm >= 0 && lwm < queue_size);
+    assert(hwm >= 0 && hwm <= queue_size);
+    assert(lwm  < hwm);
+    _shards.reserve(static_cast<size_t>(shards));
+    for (int i = 0; i != shards; i++) {
+        /* first shards take remainder of division */
+        int shard_size = queue_size / shards + (i < queue_size % shards);
+        /* shards have no events, watermarks are checked on total */
+        _shards.emplace_back(new Shard(shard_size, 0, shard_size,
+                                       storage_args...));
+    }
+}
+
+template<typename MessageType, typename StoragePolicy>
+ShardedMessageQueue<MessageType, StoragePolicy>::~ShardedMessageQueue() {
+    stop();
+}
+
+template<typename MessageType, typename StoragePolicy>
+RetCode ShardedMessageQueue<MessageType, StoragePolicy>::put(
+    const MessageType& message, int priority) {
+    return _put(message, priority, detail::threadTicket(), true);
+}
+
+template<typename MessageType, typename StoragePolicy>
+RetCode ShardedMessageQueue<MessageType, StoragePolicy>::put(
+    MessageType&& message, int priority) {
+    return _put(std::move(message), priority, detail::threadTicket(), true);
+}
+
+template<typename MessageType, typename StoragePolicy>
+RetCode ShardedMessageQueue<MessageType, StoragePolicy>::put(
+    const MessageType& message, int priority, size_t key) {
+    return _put(message, priority, key, false);
+}
+
+template<typename MessageType, typename StoragePolicy>
+RetCode ShardedMessageQueue<MessageType, StoragePolicy>::put(
+    MessageType&& message, int priority, size_t key) {
+    return _put(std::move(message), priority, key, false);
+}
+
+template<typename MessageType, typename StoragePolicy>
+template<typename Message>
+RetCode ShardedMessageQueue<MessageType, StoragePolicy>::_put(
+    Message&& message, int priority, size_t shard, bool spill) {
+    if (_stopped()) {
+        return RetCode::STOPPED;
+    }
+
+    if (_current_size.load(std::memory_order_relaxed) >= _hwm) {
+        EpochEvents::Guard events(_events);
+        if (events) {
+            _hwm_flag.store(true, std::memory_order_relaxed);
+            events->on_hwm();
+            /* anything could happen - recheck */
+            if (_stopped()) {
+                return RetCode::STOPPED;
+            }
+        }
+    }
+
+    auto shards = _shards.size();
+    shard %= shards;
+    RetCode ret = RetCode::NO_SPACE;
+    if (spill) {
+        /* try_put doesn't consume message on failure */
+        for (size_t i = 0; i != shards && ret == RetCode::NO_SPACE; i++) {
+            ret = _shards[(shard + i) % shards]->try_put(
+                std::forward<Message>(message), priority);
+        }
+    }
+    if (ret == RetCode::NO_SPACE) {
+        /* every shard is full or message is bound
+           to its shard - wait there */
+        ret = _shards[shard]->put(std::forward<Message>(message), priority);
+    }
+    if (ret != RetCode::OK) {
+        return ret;
+    }
+    _current_size.fetch_add(1, std::memory_order_relaxed);
+
+    /* one message - one reader, no herd of stealers */
+    _readers.wakeOne();
+    return RetCode::OK;
+}
+
+template<typename MessageType, typename StoragePolicy>
+RetCode ShardedMessageQueue<MessageType, StoragePolicy>::get(
+    MessageType* message) {
+    return get(message, static_cast<int>(detail::threadHome() %
+                                         _shards.size()));
+}
+
+template<typename MessageType, typename StoragePolicy>
+RetCode ShardedMessageQueue<MessageType, StoragePolicy>::get(
+    MessageType* message, int home) {
+    assert(home >= 0 && home < shards());
+    while (true) {
+        if (_stopped()) {
+            return RetCode::STOPPED;
+        }
+        int shard = _pickShard(home);
+        if (shard >= 0) {
+            auto ret = _shards[static_cast<size_t>(shard)]->try_get(message);
+            if (ret == RetCode::OK) {
+                break;
+            }
+            if (ret == RetCode::STOPPED) {
+                return ret;
+            }
+            /* other reader was faster */
+            continue;
+        }
+        /* every shard is empty - wait writers */
+        _readers.wait(_wait_strategy, [this] {
+                return _stopped() || !_empty();
+            });
+    }
+    auto size = _current_size.fetch_sub(1, std::memory_order_relaxed) - 1;
+
+    if (size <= _lwm && _hwm_flag.load(std::memory_order_relaxed)) {
+        EpochEvents::Guard events(_events);
+        if (events &&
+            _hwm_flag.exchange(false, std::memory_order_relaxed)) {
+            events->on_lwm();
+        }
+    }
+    return RetCode::OK;
+}
+
+/* shard to take message from or -1 if all look empty */
+template<typename MessageType, typename StoragePolicy>
+int ShardedMessageQueue<MessageType, StoragePolicy>::_pickShard(
+    int home) const {
+    int shards = this->shards();
+    int home_top = _shards[static_cast<size_t>(home)]->topPriority();
+    if (home_top != Shard::NO_PRIORITY) {
+        if (shards == 1) {
+            return home;
+        }
+        /* probe one other shard per get, in turn */
+        thread_local unsigned probe = 0;
+        int other = (home + 1 + static_cast<int>(
+                         probe++ % static_cast<unsigned>(shards - 1))) %
+            shards;
+        if (_shards[static_cast<size_t>(other)]->topPriority() > home_top) {
+            return other;
+        }
+        return home;
+    }
+    /* home is empty - steal highest priority */
+    int best = -1;
+    int best_top = Shard::NO_PRIORITY;
+    for (int i = 1; i != shards; i++) {
+        int shard = (home + i) % shards;
+        int top = _shards[static_cast<size_t>(shard)]->topPriority();
+        if (top > best_top) {
+            best = shard;
+            best_top = top;
+        }
+    }
+    return best;
+}
+
+template<typename MessageType, typename StoragePolicy>
+bool ShardedMessageQueue<MessageType, StoragePolicy>::_empty() const noexcept {
+    for (auto& shard : _shards) {
+        if (shard->topPriority() != Shard::NO_PRIORITY)
+            return false;
+    }
+    return true;
+}
+
+template<typename MessageType, typename StoragePolicy>
+void ShardedMessageQueue<MessageType, StoragePolicy>::run() {
+    for (auto& shard : _shards) {
+        shard->run();
+    }
+    _queue_state.store(QueueState::RUNNING, std::memory_order_release);
+    {
+        EpochEvents::Guard events(_events);
+        if (events) {
+            events->on_start();
+        }
+    }
+    _readers.wake();
+}
+
+template<typename MessageType, typename StoragePolicy>
+void ShardedMessageQueue<MessageType, StoragePolicy>::stop() {
+    _queue_state.store(QueueState::STOPPED, std::memory_order_release);
+    /* releases writers waiting on full shards */
+    for (auto& shard : _shards) {
+        shard->stop();
+    }
+    {
+        EpochEvents::Guard events(_events);
+        if (events) {
+            events->on_stop();
+        }
+    }
+    _readers.wake();
+}
+
+template<typename MessageType, typename StoragePolicy>
+void ShardedMessageQueue<MessageType, StoragePolicy>::setEvents(
+    std::shared_ptr<IMessageQueueEvents> events) {
+    _events.set(std::move(events));
+}
+
+template<typename MessageType, typename StoragePolicy>
+void ShardedMessageQueue<MessageType, StoragePolicy>::setWaitStrategy(
+    const WaitStrategy& strategy) {
+    _wait_strategy = strategy;
+    for (auto& shard : _shards) {
+        shard->setWaitStrategy(strategy);
+    }
+}
+
+template<typename MessageType, typename StoragePolicy>
+int ShardedMessageQueue<MessageType, StoragePolicy>::size() const noexcept {
+    /* reader may decrement before writer increments */
+    return std::max(0, _current_size.load(std::memory_order_relaxed));
+}
+
+template<typename MessageType, typename StoragePolicy>
+int ShardedMessageQueue<MessageType, StoragePolicy>::shards() const noexcept {
+    return static_cast<int>(_shards.size());
+}
+
+} // namespace zodiactest
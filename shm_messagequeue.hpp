@@ -0,0 +1,709 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "messagequeue.hpp"
+#include "platform.hpp"
+
+namespace zodiactest {
+
+/* MessageQueue for writers and readers in different processes
+   (Linux). Whole queue state - slots, per priority FIFO lists,
+   bitmap of non-empty levels, watermark flag and wait words -
+   lives in a POSIX shared memory segment:
+     ShmMessageQueue<Msg, 8> q("/orders", size, lwm, hwm); // creates
+     ShmMessageQueue<Msg, 8> q("/orders");                 // attaches
+   Messages are trivially copyable and copied in and out, priority
+   is in [0, Levels).
+   *
+   Lock is a process-shared robust pthread mutex, threads wait on
+   futex words next to it (no FUTEX_PRIVATE_FLAG, so any process
+   mapping the segment can wake them).
+   *
+   Peer death: a peer that dies holding the lock leaves the queue
+   maybe half updated - whoever takes the lock next marks the queue
+   broken and every call returns PEER_DEAD from then on. Attached
+   processes are registered by pid, blocked callers check them every
+   LIVENESS_PERIOD; when a peer is found dead, calls blocked at that
+   moment return PEER_DEAD - the message or space they wait for may
+   never come, caller decides whether to retry.
+   *
+   run()/stop() state and watermarks are shared, events are not:
+   setEvents() installs handlers of this process, called when a call
+   made in this process crosses a watermark. Only gets cross LWM,
+   mostly in another process than the writers on_hwm() holds - so
+   LWM crossing also bumps a shared futex word, and a process that
+   got on_hwm() gets on_lwm() from its watcher thread, started by
+   first setEvents(). Creator's destructor
+   stops the queue and unlinks the name, processes still attached
+   keep the segment until they detach. */
+template<typename MessageType, int Levels = 1>
+class ShmMessageQueue {
+    static_assert(std::is_trivially_copyable<MessageType>::value,
+                  "messages are memcpy'ed through shared memory");
+    static_assert(Levels > 0 && Levels <= 64,
+                  "one bitmap word holds up to 64 levels");
+public:
+    using value_type = MessageType;
+
+    static constexpr std::chrono::milliseconds LIVENESS_PERIOD{100};
+    static constexpr int MAX_PEERS = 64;
+
+    /* creates segment name, fails if it exists;
+       throws std::system_error */
+    ShmMessageQueue(const std::string& name, int queue_size,
+                    int lwm, int hwm);
+    /* attaches to segment created by another process, waits
+       for its creator to finish initialization;
+       throws std::system_error */
+    explicit ShmMessageQueue(const std::string& name);
+
+    ShmMessageQueue(const ShmMessageQueue&) = delete;
+    ShmMessageQueue& operator=(const ShmMessageQueue&) = delete;
+
+    ~ShmMessageQueue();
+
+    RetCode put(const MessageType& message, int priority);
+    RetCode get(MessageType* message);
+    /* NO_SPACE on full queue */
+    RetCode try_put(const MessageType& message, int priority);
+    /* WOULD_BLOCK on empty queue */
+    RetCode try_get(MessageType* message);
+    void setEvents(std::shared_ptr<IMessageQueueEvents> events);
+
+    void stop();
+    void run();
+    int size() const;
+    /* peers found dead since segment creation */
+    int deadPeers() const;
+
+private:
+    static constexpr uint64_t MAGIC = 0x3230514d4d48535aULL;
+    static constexpr int32_t NIL = -1;
+    static constexpr auto ATTACH_TIMEOUT = std::chrono::seconds(1);
+
+    enum class QueueState : int32_t {
+        RUNNING = 0,
+        STOPPED
+    };
+
+    struct Level {
+        int32_t head;
+        int32_t tail;
+    };
+    struct Slot {
+        int32_t next;
+        MessageType message;
+    };
+    /* fields below ready are written under mtx only,
+       futex words are polled by kernel */
+    struct Shared {
+        uint64_t magic;
+        uint32_t message_size;
+        uint32_t level_count;
+        int32_t queue_size;
+        int32_t lwm;
+        int32_t hwm;
+        std::atomic<uint32_t> ready;
+        pthread_mutex_t mtx;
+        QueueState state;
+        int32_t hwm_flag;
+        int32_t broken;
+        int32_t size;
+        int32_t free_head;
+        int32_t dead_peers;
+        uint64_t nonempty;
+        Level levels[Levels];
+        int32_t peers[MAX_PEERS];
+        int32_t rd_waiters;
+        int32_t wr_waiters;
+        alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> rd_seq;
+        alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> wr_seq;
+        /* bumped on every LWM crossing */
+        alignas(CACHE_LINE_SIZE) std::atomic<uint32_t> lwm_seq;
+    };
+    static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+                  sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+                  "futex word must be a plain 32-bit integer");
+
+    /* BasicLockable over shared robust mutex */
+    class Mutex {
+    public:
+        explicit Mutex(ShmMessageQueue* queue) : _queue{queue} {}
+        void lock();
+        void unlock() noexcept {
+            pthread_mutex_unlock(&_queue->_shared->mtx);
+        }
+    private:
+        ShmMessageQueue* _queue;
+    };
+    using Lock = std::unique_lock<Mutex>;
+
+    static size_t _slotsOffset() noexcept {
+        return (sizeof(Shared) + alignof(Slot) - 1) & ~(alignof(Slot) - 1);
+    }
+    static size_t _segmentSize(int queue_size) noexcept {
+        return _slotsOffset() +
+            static_cast<size_t>(queue_size) * sizeof(Slot);
+    }
+    void _map(int fd, size_t bytes);
+    void _init(int queue_size, int lwm, int hwm);
+    void _attach(int fd);
+    void _register();
+
+    RetCode _put(const MessageType& message, int priority, bool block);
+    RetCode _get(MessageType* message, bool block);
+    RetCode _checkHwm(Lock& lock);
+    void _checkLwm(Lock& lock);
+    template<typename Pred>
+    RetCode _wait(Lock& lock, std::atomic<uint32_t>& seq,
+                  int32_t& waiters, bool block, Pred ready);
+    void _notify(std::atomic<uint32_t>& seq, int32_t waiters) noexcept;
+    void _wakeAll() noexcept;
+    void _ownerDied() noexcept;
+    void _reapPeers() noexcept;
+    /* watcher thread - on_lwm() for LWM crossed elsewhere */
+    void _watchLwm();
+    static bool _alive(int32_t pid);
+    std::shared_ptr<IMessageQueueEvents> _getEvents();
+    void _push(const MessageType& message, int priority) noexcept;
+    void _pop(MessageType* message) noexcept;
+
+    const std::string _name;
+    const bool _owner;
+    size_t _bytes;
+    void* _segment;
+    Shared* _shared;
+    Slot* _slots;
+    int _peer;
+    mutable Mutex _mutex;
+    /* process local */
+    std::mutex _events_mtx;
+    std::shared_ptr<IMessageQueueEvents> _events;
+    /* on_hwm() was called here, on_lwm() wasn't yet */
+    std::atomic<bool> _hwm_pending{false};
+    std::atomic<bool> _watcher_stop{false};
+    std::thread _lwm_watcher;
+};
+
+namespace detail {
+
+/* false if woken by timeout */
+inline bool futexWait(std::atomic<uint32_t>& word, uint32_t seen,
+                      std::chrono::nanoseconds timeout) noexcept {
+    auto secs = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+    timespec ts;
+    ts.tv_sec = static_cast<time_t>(secs.count());
+    ts.tv_nsec = static_cast<long>((timeout - secs).count());
+    auto ret = syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word),
+                       FUTEX_WAIT, seen, &ts, nullptr, 0);
+    return ret == 0 || errno != ETIMEDOUT;
+}
+
+inline void futexWakeAll(std::atomic<uint32_t>& word) noexcept {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word),
+            FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+} // namespace detail
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::Mutex::lock() {
+    int ret = pthread_mutex_lock(&_queue->_shared->mtx);
+    if (ret == EOWNERDEAD) {
+        pthread_mutex_consistent(&_queue->_shared->mtx);
+        _queue->_ownerDied();
+    } else if (ret) {
+        throw std::system_error(ret, std::generic_category(),
+                                "pthread_mutex_lock");
+    }
+}
+
+template<typename MessageType, int Levels>
+ShmMessageQueue<MessageType, Levels>::ShmMessageQueue(
+    const std::string& name, int queue_size, int lwm, int hwm)
+    : _name(name),
+      _owner{true},
+      _bytes{0},
+      _segment{nullptr},
+      _shared{nullptr},
+      _slots{nullptr},
+      _peer{-1},
+      _mutex{this} {
+    assert(queue_size > 0);
+    assert(lwm >= 0 && lwm < queue_size);
+    assert(hwm >= 0 && hwm <= queue_size);
+    assert(lwm < hwm);
+    int fd = shm_open(_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), _name);
+    try {
+        auto bytes = _segmentSize(queue_size);
+        if (ftruncate(fd, static_cast<off_t>(bytes)))
+            throw std::system_error(errno, std::generic_category(), _name);
+        _map(fd, bytes);
+    } catch (...) {
+        close(fd);
+        shm_unlink(_name.c_str());
+        throw;
+    }
+    close(fd);
+    _init(queue_size, lwm, hwm);
+}
+
+template<typename MessageType, int Levels>
+ShmMessageQueue<MessageType, Levels>::ShmMessageQueue(const std::string& name)
+    : _name(name),
+      _owner{false},
+      _bytes{0},
+      _segment{nullptr},
+      _shared{nullptr},
+      _slots{nullptr},
+      _peer{-1},
+      _mutex{this} {
+    int fd = shm_open(_name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), _name);
+    try {
+        _attach(fd);
+    } catch (...) {
+        close(fd);
+        if (_segment)
+            munmap(_segment, _bytes);
+        throw;
+    }
+    close(fd);
+}
+
+template<typename MessageType, int Levels>
+ShmMessageQueue<MessageType, Levels>::~ShmMessageQueue() {
+    if (_lwm_watcher.joinable()) {
+        _watcher_stop = true;
+        /* word doesn't change - other watchers sleep on */
+        detail::futexWakeAll(_shared->lwm_seq);
+        _lwm_watcher.join();
+    }
+    try {
+        if (_owner)
+            stop();
+        Lock lock(_mutex);
+        _shared->peers[_peer] = 0;
+    } catch (const std::system_error&) {
+        /* lock is unusable, peers reap our slot once we exit */
+    }
+    munmap(_segment, _bytes);
+    if (_owner)
+        shm_unlink(_name.c_str());
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::_map(int fd, size_t bytes) {
+    void* segment = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED)
+        throw std::system_error(errno, std::generic_category(), _name);
+    _bytes = bytes;
+    _segment = segment;
+    _shared = static_cast<Shared*>(segment);
+    _slots = reinterpret_cast<Slot*>(static_cast<char*>(segment) +
+                                     _slotsOffset());
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::_init(int queue_size,
+                                                 int lwm, int hwm) {
+    /* ftruncate'd segment is zeroed */
+    auto shared = new (_segment) Shared{};
+    shared->magic = MAGIC;
+    shared->message_size = sizeof(MessageType);
+    shared->level_count = Levels;
+    shared->queue_size = queue_size;
+    shared->lwm = lwm;
+    shared->hwm = hwm;
+    shared->state = QueueState::STOPPED;
+    for (auto& level : shared->levels)
+        level = Level{NIL, NIL};
+    for (int32_t i = 0; i != queue_size; i++)
+        _slots[i].next = i + 1 == queue_size ? NIL : i + 1;
+    shared->free_head = 0;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->mtx, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    _register();
+    shared->ready.store(1, std::memory_order_release);
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::_attach(int fd) {
+    auto deadline = std::chrono::steady_clock::now() + ATTACH_TIMEOUT;
+    /* creator may not have sized or initialized segment yet */
+    while (true) {
+        struct stat st;
+        if (fstat(fd, &st))
+            throw std::system_error(errno, std::generic_category(), _name);
+        if (!_segment && static_cast<size_t>(st.st_size) >= sizeof(Shared))
+            _map(fd, static_cast<size_t>(st.st_size));
+        if (_segment && _shared->ready.load(std::memory_order_acquire))
+            break;
+        if (std::chrono::steady_clock::now() > deadline)
+            throw std::system_error(ETIMEDOUT, std::generic_category(),
+                                    _name);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (_shared->magic != MAGIC ||
+        _shared->message_size != sizeof(MessageType) ||
+        _shared->level_count != Levels ||
+        _bytes != _segmentSize(_shared->queue_size))
+        throw std::system_error(EINVAL, std::generic_category(),
+                                _name + ": queue layout mismatch");
+    _register();
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::_register() {
+    Lock lock(_mutex);
+    for (int i = 0; i != MAX_PEERS; i++) {
+        if (!_shared->peers[i] || !_alive(_shared->peers[i])) {
+            if (_shared->peers[i])
+                ++_shared->dead_peers;
+            _shared->peers[i] = static_cast<int32_t>(getpid());
+            _peer = i;
+            return;
+        }
+    }
+    throw std::system_error(EUSERS, std::generic_category(), _name);
+}
+
+template<typename MessageType, int Levels>
+RetCode ShmMessageQueue<MessageType, Levels>::put(const MessageType& message,
+                                                  int priority) {
+    return _put(message, priority, true);
+}
+
+template<typename MessageType, int Levels>
+RetCode ShmMessageQueue<MessageType, Levels>::try_put(
+    const MessageType& message, int priority) {
+    auto ret = _put(message, priority, false);
+    return ret == RetCode::TIMEOUT ? RetCode::NO_SPACE : ret;
+}
+
+template<typename MessageType, int Levels>
+RetCode ShmMessageQueue<MessageType, Levels>::get(MessageType* message) {
+    return _get(message, true);
+}
+
+template<typename MessageType, int Levels>
+RetCode ShmMessageQueue<MessageType, Levels>::try_get(MessageType* message) {
+    auto ret = _get(message, false);
+    return ret == RetCode::TIMEOUT ? RetCode::WOULD_BLOCK : ret;
+}
+
+template<typename MessageType, int Levels>
+RetCode ShmMessageQueue<MessageType, Levels>::_put(const MessageType& message,
+                                                   int priority, bool block) {
+    assert(priority >= 0 && priority < Levels);
+    Lock lock(_mutex);
+    if (_shared->broken)
+        return RetCode::PEER_DEAD;
+    if (_shared->state == QueueState::STOPPED)
+        return RetCode::STOPPED;
+
+    auto ret = _checkHwm(lock);
+    if (ret != RetCode::OK)
+        return ret;
+    ret = _wait(lock, _shared->wr_seq, _shared->wr_waiters, block, [this] {
+            return _shared->size < _shared->queue_size;
+        });
+    if (ret != RetCode::OK)
+        return ret;
+
+    _push(message, priority);
+    _notify(_shared->rd_seq, _shared->rd_waiters);
+    return RetCode::OK;
+}
+
+template<typename MessageType, int Levels>
+RetCode ShmMessageQueue<MessageType, Levels>::_get(MessageType* message,
+                                                   bool block) {
+    assert(message != nullptr);
+    Lock lock(_mutex);
+    if (_shared->broken)
+        return RetCode::PEER_DEAD;
+    if (_shared->state == QueueState::STOPPED)
+        return RetCode::STOPPED;
+
+    auto ret = _wait(lock, _shared->rd_seq, _shared->rd_waiters, block,
+                     [this] { return _shared->size != 0; });
+    if (ret != RetCode::OK)
+        return ret;
+
+    _pop(message);
+    _notify(_shared->wr_seq, _shared->wr_waiters);
+    _checkLwm(lock);
+    return RetCode::OK;
+}
+
+template<typename MessageType, int Levels>
+RetCode ShmMessageQueue<MessageType, Levels>::_checkHwm(Lock& lock) {
+    if (_shared->size < _shared->hwm)
+        return RetCode::OK;
+    /* set for readers of any process to cross LWM */
+    _shared->hwm_flag = 1;
+    auto events = _getEvents();
+    if (!events)
+        return RetCode::OK;
+    _hwm_pending = true;
+    lock.unlock();
+    events->on_hwm();
+    lock.lock();
+    /* like MessageQueue - writers may race over HWM,
+       on_hwm() is expected to hold them */
+    if (_shared->broken)
+        return RetCode::PEER_DEAD;
+    if (_shared->state == QueueState::STOPPED)
+        return RetCode::STOPPED;
+    return RetCode::OK;
+}
+
+/* leaves lock released if on_lwm() was called */
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::_checkLwm(Lock& lock) {
+    if (!_shared->hwm_flag || _shared->size > _shared->lwm)
+        return;
+    _shared->hwm_flag = 0;
+    /* called here - our watcher must not call it again */
+    _hwm_pending = false;
+    _shared->lwm_seq.fetch_add(1, std::memory_order_release);
+    detail::futexWakeAll(_shared->lwm_seq);
+    auto events = _getEvents();
+    if (!events)
+        return;
+    lock.unlock();
+    events->on_lwm();
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::_watchLwm() {
+    auto seen = _shared->lwm_seq.load(std::memory_order_acquire);
+    while (!_watcher_stop) {
+        /* timeout covers stop flag set right before the wait */
+        detail::futexWait(_shared->lwm_seq, seen, LIVENESS_PERIOD);
+        auto seq = _shared->lwm_seq.load(std::memory_order_acquire);
+        if (seq == seen)
+            continue;
+        seen = seq;
+        if (!_hwm_pending.exchange(false))
+            continue;
+        if (auto events = _getEvents())
+            events->on_lwm();
+    }
+}
+
+/* checks broken, stopped, ready() and peer deaths in this order,
+   parks on seq until one of them changes */
+template<typename MessageType, int Levels>
+template<typename Pred>
+RetCode ShmMessageQueue<MessageType, Levels>::_wait(
+    Lock& lock, std::atomic<uint32_t>& seq, int32_t& waiters,
+    bool block, Pred ready) {
+    auto dead_peers = _shared->dead_peers;
+    while (true) {
+        if (_shared->broken)
+            return RetCode::PEER_DEAD;
+        if (_shared->state == QueueState::STOPPED)
+            return RetCode::STOPPED;
+        if (ready())
+            return RetCode::OK;
+        if (_shared->dead_peers != dead_peers)
+            return RetCode::PEER_DEAD;
+        if (!block)
+            return RetCode::TIMEOUT;
+        /* notifier bumps seq under lock - futex sees
+           the change if it came after unlock */
+        auto seen = seq.load(std::memory_order_relaxed);
+        ++waiters;
+        lock.unlock();
+        bool woken = detail::futexWait(seq, seen, LIVENESS_PERIOD);
+        lock.lock();
+        --waiters;
+        if (!woken)
+            _reapPeers();
+    }
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::_notify(
+    std::atomic<uint32_t>& seq, int32_t waiters) noexcept {
+    /* called under lock */
+    if (waiters) {
+        seq.fetch_add(1, std::memory_order_relaxed);
+        detail::futexWakeAll(seq);
+    }
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::_wakeAll() noexcept {
+    /* waiter counters may belong to dead peers or
+       be in the middle of update - wake everyone */
+    _shared->rd_seq.fetch_add(1, std::memory_order_relaxed);
+    _shared->wr_seq.fetch_add(1, std::memory_order_relaxed);
+    detail::futexWakeAll(_shared->rd_seq);
+    detail::futexWakeAll(_shared->wr_seq);
+}
+
+/* lock is taken, its previous owner died inside put/get */
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::_ownerDied() noexcept {
+    _shared->broken = 1;
+    _reapPeers();
+    _wakeAll();
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::_reapPeers() noexcept {
+    bool reaped = false;
+    for (auto& pid : _shared->peers) {
+        if (pid && !_alive(pid)) {
+            pid = 0;
+            ++_shared->dead_peers;
+            reaped = true;
+        }
+    }
+    if (reaped)
+        _wakeAll();
+}
+
+/* dead or zombie - parent that didn't wait for its child
+   still sees it with kill() */
+template<typename MessageType, int Levels>
+bool ShmMessageQueue<MessageType, Levels>::_alive(int32_t pid) {
+    if (pid == getpid())
+        return true;
+    if (kill(pid, 0) && errno == ESRCH)
+        return false;
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    if (!std::getline(stat, line))
+        return true;
+    /* "pid (comm) state ...", comm may contain ')' */
+    auto comm_end = line.rfind(')');
+    return comm_end == std::string::npos || comm_end + 2 >= line.size() ||
+        line[comm_end + 2] != 'Z';
+}
+
+template<typename MessageType, int Levels>
+std::shared_ptr<IMessageQueueEvents>
+ShmMessageQueue<MessageType, Levels>::_getEvents() {
+    std::lock_guard<std::mutex> lock(_events_mtx);
+    return _events;
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::setEvents(
+    std::shared_ptr<IMessageQueueEvents> events) {
+    std::unique_lock<std::mutex> lock(_events_mtx);
+    _events.swap(events);
+    if (_events && !_lwm_watcher.joinable())
+        _lwm_watcher = std::thread(&ShmMessageQueue::_watchLwm, this);
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::run() {
+    {
+        Lock lock(_mutex);
+        _shared->state = QueueState::RUNNING;
+        _wakeAll();
+    }
+    if (auto events = _getEvents())
+        events->on_start();
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::stop() {
+    {
+        Lock lock(_mutex);
+        _shared->state = QueueState::STOPPED;
+        _wakeAll();
+    }
+    if (auto events = _getEvents())
+        events->on_stop();
+}
+
+template<typename MessageType, int Levels>
+int ShmMessageQueue<MessageType, Levels>::size() const {
+    Lock lock(_mutex);
+    return _shared->size;
+}
+
+template<typename MessageType, int Levels>
+int ShmMessageQueue<MessageType, Levels>::deadPeers() const {
+    Lock lock(_mutex);
+    return _shared->dead_peers;
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::_push(const MessageType& message,
+                                                 int priority) noexcept {
+    auto index = _shared->free_head;
+    auto& slot = _slots[index];
+    _shared->free_head = slot.next;
+    std::memcpy(&slot.message, &message, sizeof(MessageType));
+    slot.next = NIL;
+    auto& level = _shared->levels[priority];
+    if (level.tail == NIL) {
+        level.head = index;
+        _shared->nonempty |= uint64_t{1} << priority;
+    } else {
+        _slots[level.tail].next = index;
+    }
+    level.tail = index;
+    ++_shared->size;
+}
+
+template<typename MessageType, int Levels>
+void ShmMessageQueue<MessageType, Levels>::_pop(MessageType* message) noexcept {
+    int priority = 63 - __builtin_clzll(_shared->nonempty);
+    auto& level = _shared->levels[priority];
+    auto index = level.head;
+    auto& slot = _slots[index];
+    std::memcpy(message, &slot.message, sizeof(MessageType));
+    level.head = slot.next;
+    if (level.head == NIL) {
+        level.tail = NIL;
+        _shared->nonempty &= ~(uint64_t{1} << priority);
+    }
+    slot.next = _shared->free_head;
+    _shared->free_head = index;
+    --_shared->size;
+}
+
+} // namespace zodiactest
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace zodiactest {
+
+/* Fixed size blocks carved from chunks of chunk_blocks blocks.
+   Freed blocks go to intrusive free list and are handed out
+   LIFO, so the next allocation gets a block still hot in cache.
+   *
+   Chunks are returned to the system only on pool destruction -
+   once pool has grown to its peak, allocate/deallocate never
+   touch malloc. Not thread safe - owner serializes access. */
+class SlabPool {
+public:
+    /* block_size 0 - fixed by the first allocation,
+       for users that don't know their node type */
+    SlabPool(size_t block_size, size_t chunk_blocks);
+
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    ~SlabPool();
+
+    /* nullptr if size doesn't fit pool's block */
+    void* allocate(size_t size);
+    void deallocate(void* block) noexcept;
+    /* carves first chunk ahead of time */
+    void reserve();
+
+    size_t blockSize() const noexcept {
+        return _block_size;
+    }
+    /* blocks carved so far, used or free */
+    size_t blocks() const noexcept {
+        return _blocks;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    void _grow();
+    static size_t _roundUp(size_t size) noexcept;
+
+    size_t _block_size;
+    size_t _chunk_blocks;
+    size_t _blocks;
+    FreeBlock* _free;
+    std::vector<void*> _chunks;
+};
+
+/* std allocator on top of SlabPool for node based containers.
+   Single object allocations that fit the pool's block come from
+   the pool, anything else (arrays, bigger rebound types) goes
+   to std::allocator. Copies and rebinds share the pool */
+template<typename T>
+class SlabAllocator {
+public:
+    using value_type = T;
+
+    explicit SlabAllocator(SlabPool* pool) noexcept
+        : _pool{pool} {
+        assert(pool != nullptr);
+    }
+
+    template<typename U>
+    SlabAllocator(const SlabAllocator<U>& other) noexcept
+        : _pool{other.pool()} {}
+
+    T* allocate(size_t n) {
+        if (_fromPool(n)) {
+            if (void* block = _pool->allocate(sizeof(T)))
+                return static_cast<T*>(block);
+        }
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        /* block size is fixed after the first
+           pool allocation, so this is the same
+           decision allocate() made */
+        if (_fromPool(n) && sizeof(T) <= _pool->blockSize()) {
+            _pool->deallocate(p);
+            return;
+        }
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    SlabPool* pool() const noexcept {
+        return _pool;
+    }
+
+private:
+    static bool _fromPool(size_t n) noexcept {
+        return n == 1 && alignof(T) <= alignof(std::max_align_t);
+    }
+
+    SlabPool* _pool;
+};
+
+template<typename T, typename U>
+bool operator==(const SlabAllocator<T>& lhs,
+                const SlabAllocator<U>& rhs) noexcept {
+    return lhs.pool() == rhs.pool();
+}
+
+template<typename T, typename U>
+bool operator!=(const SlabAllocator<T>& lhs,
+                const SlabAllocator<U>& rhs) noexcept {
+    return !(lhs == rhs);
+}
+
+inline SlabPool::SlabPool(size_t block_size, size_t chunk_blocks)
+    : _block_size{block_size ? _roundUp(block_size) : 0},
+      _chunk_blocks{chunk_blocks},
+      _blocks{0},
+      _free{nullptr} {
+    assert(chunk_blocks > 0);
+}
+
+inline SlabPool::~SlabPool() {
+    for (void* chunk : _chunks)
+        ::operator delete(chunk);
+}
+
+inline void* SlabPool::allocate(size_t size) {
+    if (!_block_size)
+        _block_size = _roundUp(size);
+    if (size > _block_size)
+        return nullptr;
+    if (!_free)
+        _grow();
+    FreeBlock* block = _free;
+    _free = block->next;
+    return block;
+}
+
+inline void SlabPool::deallocate(void* block) noexcept {
+    assert(block != nullptr);
+    auto free_block = static_cast<FreeBlock*>(block);
+    free_block->next = _free;
+    _free = free_block;
+}
+
+inline void SlabPool::reserve() {
+    assert(_block_size);
+    if (!_free)
+        _grow();
+}
+
+inline void SlabPool::_grow() {
+    /* operator new returns memory aligned for
+       max_align_t, block size keeps that alignment */
+    _chunks.reserve(_chunks.size() + 1);
+    auto chunk = static_cast<char*>(
+        ::operator new(_block_size * _chunk_blocks));
+    _chunks.push_back(chunk);
+    /* link blocks so that the lowest address goes first */
+    for (size_t i = _chunk_blocks; i != 0; i--) {
+        auto block = reinterpret_cast<FreeBlock*>(
+            chunk + (i - 1) * _block_size);
+        block->next = _free;
+        _free = block;
+    }
+    _blocks += _chunk_blocks;
+}
+
+inline size_t SlabPool::_roundUp(size_t size) noexcept {
+    constexpr size_t ALIGN = alignof(std::max_align_t);
+    if (size < sizeof(FreeBlock))
+        size = sizeof(FreeBlock);
+    return (size + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+} // namespace zodiactest
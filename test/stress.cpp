@@ -0,0 +1,119 @@
+/* Stress and linearizability run of MessageQueue, see stress.hpp.
+   *
+   For every storage: model() check with --ops calls, then run()
+   with --writers x --ops messages. Prints throughput and
+   violations, exits with 1 on any.
+   *
+   $ ./stress --writers 8 --readers 8 --ops 1000000 --seed 7
+   $ make tsan && ./stress_tsan --ops 20000 */
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "stress.hpp"
+
+using namespace zodiactest;
+
+namespace {
+
+constexpr int LEVELS = 16;
+
+struct Options {
+    stress::Config config;
+    std::string storage = "all";
+};
+
+void usage() {
+    std::fprintf(stderr,
+                 "usage: stress [options]\n"
+                 "  --writers N        writer threads (4)\n"
+                 "  --readers N        reader threads (4)\n"
+                 "  --ops N            messages per writer (100000)\n"
+                 "  --priorities N     1..16 (4)\n"
+                 "  --bulk N           largest bulk batch (8)\n"
+                 "  --queue-size N     (64)\n"
+                 "  --seed N           (1)\n"
+                 "  --storage map|levels|pooled|elastic|all\n");
+}
+
+bool parseArgs(int argc, char** argv, Options* options) {
+    auto& config = options->config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 == argc) {
+            return false;
+        }
+        const char* val = argv[++i];
+        if (arg == "--writers") {
+            config.writers = std::atoi(val);
+        } else if (arg == "--readers") {
+            config.readers = std::atoi(val);
+        } else if (arg == "--ops") {
+            config.ops = std::atoi(val);
+        } else if (arg == "--priorities") {
+            config.priorities = std::atoi(val);
+        } else if (arg == "--bulk") {
+            config.bulk = std::atoi(val);
+        } else if (arg == "--queue-size") {
+            config.queue_size = std::atoi(val);
+        } else if (arg == "--seed") {
+            config.seed = static_cast<unsigned>(std::strtoul(val, nullptr, 10));
+        } else if (arg == "--storage") {
+            options->storage = val;
+        } else {
+            return false;
+        }
+    }
+    return config.writers > 0 && config.readers > 0 && config.ops > 0 &&
+        config.priorities > 0 && config.priorities <= LEVELS &&
+        config.bulk > 0 && config.queue_size > 0;
+}
+
+bool print(const char* name, const char* check, const stress::Report& report) {
+    std::printf("%-10s %-6s %12lld ops %8.3f s %12.0f ops/s  %s\n",
+                name, check, report.ops, report.seconds,
+                static_cast<double>(report.ops) / report.seconds,
+                report.violation_count ? "FAILED" : "ok");
+    for (auto& what : report.violations)
+        std::printf("    %s\n", what.c_str());
+    if (report.violation_count > static_cast<long long>(report.violations.size()))
+        std::printf("    ... %lld violations\n", report.violation_count);
+    return !report.violation_count;
+}
+
+template<typename Storage, typename... StorageArgs>
+bool check(const char* name, const Options& options, StorageArgs... args) {
+    if (options.storage != "all" && options.storage != name)
+        return true;
+    auto& config = options.config;
+    using Queue = MessageQueue<uint64_t, Storage>;
+    bool ok;
+    {
+        Queue q(config.queue_size, 0, config.queue_size, args...);
+        ok = print(name, "model", stress::model(q, config));
+    }
+    {
+        Queue q(config.queue_size, 0, config.queue_size, args...);
+        ok = print(name, "run", stress::run(q, config)) && ok;
+    }
+    std::fflush(stdout);
+    return ok;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseArgs(argc, argv, &options)) {
+        usage();
+        return 2;
+    }
+    std::printf("seed %u, %d writers, %d readers\n", options.config.seed,
+                options.config.writers, options.config.readers);
+    bool ok = check<PriorityMap>("map", options);
+    ok = check<PriorityLevels<LEVELS>>("levels", options) && ok;
+    ok = check<PooledPriorityMap>("pooled", options) && ok;
+    ok = check<ElasticLevels<LEVELS>>("elastic", options) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,425 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../messagequeue.hpp"
+#include "../platform.hpp"
+
+namespace zodiactest {
+namespace stress {
+
+/* Stress harness for MessageQueue over strict priority storage
+   (PriorityMap, PriorityLevels, ...).
+   *
+   run(): writers and readers do seeded random mixes of
+   put/try_put/put_bulk and get/try_get/get_bulk, every completed
+   call is recorded with the times it was invoked and returned,
+   then the history is checked. A violation is reported only with
+   a witness no linearization of the calls could explain:
+     - every message is got exactly once, not before its put began
+     - get didn't take priority p while a higher priority message
+       was in queue for the whole get (put returned before get was
+       invoked, its own get invoked after this one returned)
+     - get didn't take b while a of the same priority, put before
+       b's put began, was in queue for the whole get
+     - try_get didn't find queue empty while a message was in it
+   *
+   model(): one thread, random calls compared step by step with
+   a sequential priority queue model.
+   *
+   Call mixes and priorities are deterministic per seed, thread
+   interleavings are not - rerun failing seed with more ops */
+
+struct Config {
+    int writers = 4;
+    int readers = 4;
+    /* messages per writer, model() calls */
+    int ops = 100000;
+    /* 0 .. priorities - 1 */
+    int priorities = 4;
+    /* largest put_bulk/get_bulk batch */
+    int bulk = 8;
+    int queue_size = 64;
+    unsigned seed = 1;
+};
+
+struct Report {
+    /* completed put and get calls, messages of bulk ones */
+    long long ops = 0;
+    double seconds = 0;
+    long long violation_count = 0;
+    /* first few */
+    std::vector<std::string> violations;
+};
+
+namespace detail {
+
+using Id = uint64_t;
+
+struct Op {
+    Id id;
+    long long invoked;
+    long long returned;
+};
+
+struct Interval {
+    long long invoked;
+    long long returned;
+};
+
+/* empty try_gets recorded per reader */
+constexpr size_t MAX_EMPTIES = 1 << 16;
+constexpr size_t MAX_VIOLATIONS = 16;
+
+inline void violation(Report* report, const std::string& what) {
+    if (report->violations.size() < MAX_VIOLATIONS)
+        report->violations.push_back(what);
+    ++report->violation_count;
+}
+
+/* messages of one priority ordered by put return time,
+   with running max of the time their get was invoked */
+class Level {
+public:
+    void add(long long put_returned, long long got_at) {
+        _entries.push_back(Entry{put_returned, got_at});
+    }
+
+    void seal() {
+        std::sort(_entries.begin(), _entries.end(),
+                  [](const Entry& a, const Entry& b) {
+                      return a.put_returned < b.put_returned;
+                  });
+        long long max = std::numeric_limits<long long>::min();
+        for (auto& entry : _entries) {
+            max = std::max(max, entry.got_at);
+            entry.got_at = max;
+        }
+    }
+
+    /* some message was put before from and not taken until after to */
+    bool waited(long long from, long long to) const {
+        auto it = std::lower_bound(_entries.begin(), _entries.end(), from,
+                                   [](const Entry& entry, long long time) {
+                                       return entry.put_returned < time;
+                                   });
+        return it != _entries.begin() && std::prev(it)->got_at > to;
+    }
+
+private:
+    struct Entry {
+        long long put_returned;
+        long long got_at;
+    };
+
+    std::vector<Entry> _entries;
+};
+
+inline std::string describe(const char* what, const Op& op) {
+    return std::string(what) + ": message " + std::to_string(op.id) +
+        " got in [" + std::to_string(op.invoked) + ", " +
+        std::to_string(op.returned) + "]";
+}
+
+/* puts[id] and priorities[id] of every message, all of them are got */
+inline void check(const std::vector<Op>& puts, const std::vector<int>& priorities,
+                  int levels, const std::vector<Op>& gets,
+                  const std::vector<Interval>& empties, Report* report) {
+    constexpr long long NEVER = std::numeric_limits<long long>::max();
+    std::vector<long long> got_at(puts.size(), NEVER);
+    for (auto& get : gets) {
+        if (get.id >= puts.size()) {
+            violation(report, describe("unknown", get));
+            continue;
+        }
+        if (got_at[get.id] != NEVER)
+            violation(report, describe("duplicate", get));
+        got_at[get.id] = get.invoked;
+        if (get.returned < puts[get.id].invoked)
+            violation(report, describe("got before put", get));
+    }
+    std::vector<Level> by_priority(static_cast<size_t>(levels));
+    for (Id id = 0; id != puts.size(); id++) {
+        if (got_at[id] == NEVER)
+            violation(report, "lost: message " + std::to_string(id));
+        by_priority[static_cast<size_t>(priorities[id])]
+            .add(puts[id].returned, got_at[id]);
+    }
+    for (auto& level : by_priority)
+        level.seal();
+
+    for (auto& get : gets) {
+        if (get.id >= puts.size())
+            continue;
+        int priority = priorities[get.id];
+        for (int higher = priority + 1; higher < levels; higher++) {
+            if (by_priority[static_cast<size_t>(higher)]
+                .waited(get.invoked, get.returned)) {
+                violation(report, describe("higher priority waited", get));
+                break;
+            }
+        }
+        if (by_priority[static_cast<size_t>(priority)]
+            .waited(puts[get.id].invoked, get.returned))
+            violation(report, describe("overtook older message", get));
+    }
+    for (auto& empty : empties) {
+        for (auto& level : by_priority) {
+            if (level.waited(empty.invoked, empty.returned)) {
+                violation(report, "empty while not: try_get in [" +
+                          std::to_string(empty.invoked) + ", " +
+                          std::to_string(empty.returned) + "]");
+                break;
+            }
+        }
+    }
+}
+
+inline std::mt19937 rng(unsigned seed, unsigned stream) {
+    std::seed_seq seq{seed, stream};
+    return std::mt19937(seq);
+}
+
+inline int below(std::mt19937& rng, int n) {
+    return static_cast<int>(rng() % static_cast<unsigned>(n));
+}
+
+} // namespace detail
+
+/* q: MessageQueue<uint64_t> over strict priority storage,
+   not running yet - run() starts and stops it */
+template<typename Queue>
+Report run(Queue& q, const Config& config) {
+    using detail::Id;
+    using detail::Op;
+    using detail::Interval;
+    Report report;
+    auto messages = static_cast<size_t>(config.writers) *
+        static_cast<size_t>(config.ops);
+    /* each writer fills its own range */
+    std::vector<Op> puts(messages);
+    std::vector<int> priorities(messages);
+    std::vector<std::vector<Op>> gets(static_cast<size_t>(config.readers));
+    std::vector<std::vector<Interval>> empties(gets.size());
+    std::vector<Report> errors(static_cast<size_t>(config.writers));
+
+    q.run();
+    auto start = steadyNowNs();
+    std::vector<std::thread> threads;
+    for (int w = 0; w != config.writers; w++) {
+        threads.emplace_back([&, w] {
+                auto rng = detail::rng(config.seed, static_cast<unsigned>(w));
+                auto next = static_cast<Id>(w) * static_cast<Id>(config.ops);
+                auto end = next + static_cast<Id>(config.ops);
+                std::vector<Id> batch;
+                while (next != end) {
+                    int priority = detail::below(rng, config.priorities);
+                    int kind = detail::below(rng, 4);
+                    auto invoked = steadyNowNs();
+                    if (kind == 0) {
+                        batch.clear();
+                        auto n = std::min<Id>(
+                            static_cast<Id>(1 + detail::below(rng, config.bulk)),
+                            end - next);
+                        for (Id id = next; id != next + n; id++)
+                            batch.push_back(id);
+                        int put_num = 0;
+                        auto ret = q.put_bulk(batch.begin(), batch.end(),
+                                              priority, &put_num);
+                        auto returned = steadyNowNs();
+                        if (ret != RetCode::OK ||
+                            static_cast<Id>(put_num) != n) {
+                            detail::violation(&errors[static_cast<size_t>(w)],
+                                              "put_bulk failed");
+                            return;
+                        }
+                        for (auto id : batch) {
+                            puts[id] = Op{id, invoked, returned};
+                            priorities[id] = priority;
+                        }
+                        next += n;
+                        continue;
+                    }
+                    Id id = next;
+                    auto ret = kind == 1 ? q.try_put(id, priority) :
+                        q.put(id, priority);
+                    auto returned = steadyNowNs();
+                    if (ret == RetCode::NO_SPACE && kind == 1)
+                        continue;
+                    if (ret != RetCode::OK) {
+                        detail::violation(&errors[static_cast<size_t>(w)],
+                                          "put failed");
+                        return;
+                    }
+                    puts[id] = Op{id, invoked, returned};
+                    priorities[id] = priority;
+                    ++next;
+                }
+            });
+    }
+    for (int r = 0; r != config.readers; r++) {
+        threads.emplace_back([&, r] {
+                auto rng = detail::rng(config.seed, static_cast<unsigned>(
+                                           config.writers + r));
+                auto& mine = gets[static_cast<size_t>(r)];
+                auto& my_empties = empties[static_cast<size_t>(r)];
+                std::vector<Id> batch;
+                while (true) {
+                    int kind = detail::below(rng, 4);
+                    auto invoked = steadyNowNs();
+                    if (kind == 0) {
+                        batch.clear();
+                        int got_num = 0;
+                        auto ret = q.get_bulk(std::back_inserter(batch),
+                                              1 + detail::below(rng, config.bulk),
+                                              &got_num);
+                        auto returned = steadyNowNs();
+                        if (ret != RetCode::OK)
+                            return;
+                        for (auto id : batch)
+                            mine.push_back(Op{id, invoked, returned});
+                        continue;
+                    }
+                    Id id;
+                    auto ret = kind == 1 ? q.try_get(&id) : q.get(&id);
+                    auto returned = steadyNowNs();
+                    if (ret == RetCode::WOULD_BLOCK) {
+                        if (my_empties.size() < detail::MAX_EMPTIES)
+                            my_empties.push_back(Interval{invoked, returned});
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    if (ret != RetCode::OK)
+                        return;
+                    mine.push_back(Op{id, invoked, returned});
+                }
+            });
+    }
+    for (int w = 0; w != config.writers; w++)
+        threads[static_cast<size_t>(w)].join();
+    while (q.size())
+        std::this_thread::yield();
+    report.seconds = static_cast<double>(steadyNowNs() - start) / 1e9;
+    q.stop();
+    for (size_t t = static_cast<size_t>(config.writers); t != threads.size(); t++)
+        threads[t].join();
+
+    for (auto& error : errors) {
+        for (auto& what : error.violations)
+            detail::violation(&report, what);
+    }
+    if (report.violation_count)
+        return report;
+    std::vector<Op> all_gets;
+    std::vector<Interval> all_empties;
+    for (size_t r = 0; r != gets.size(); r++) {
+        all_gets.insert(all_gets.end(), gets[r].begin(), gets[r].end());
+        all_empties.insert(all_empties.end(),
+                           empties[r].begin(), empties[r].end());
+    }
+    report.ops = static_cast<long long>(messages + all_gets.size());
+    detail::check(puts, priorities, config.priorities, all_gets,
+                  all_empties, &report);
+    return report;
+}
+
+/* q as for run(), config.queue_size must be its size */
+template<typename Queue>
+Report model(Queue& q, const Config& config) {
+    using detail::Id;
+    Report report;
+    std::map<int, std::deque<Id>> model;
+    int size = 0;
+    Id next = 0;
+    auto rng = detail::rng(config.seed, 0);
+    auto fail = [&](int step, const std::string& what) {
+        detail::violation(&report, "step " + std::to_string(step) + ": " + what);
+    };
+    auto pop = [&] {
+        auto top = std::prev(model.end());
+        Id id = top->second.front();
+        top->second.pop_front();
+        if (top->second.empty())
+            model.erase(top);
+        --size;
+        return id;
+    };
+
+    q.run();
+    auto start = steadyNowNs();
+    for (int step = 0; step != config.ops && !report.violation_count; step++) {
+        int kind = detail::below(rng, 6);
+        int priority = detail::below(rng, config.priorities);
+        if (kind == 0) {
+            std::vector<Id> batch;
+            int n = std::min(1 + detail::below(rng, config.bulk),
+                             config.queue_size - size);
+            for (int i = 0; i != n; i++)
+                batch.push_back(next++);
+            if (!batch.empty() &&
+                q.put_bulk(batch.begin(), batch.end(), priority) != RetCode::OK)
+                fail(step, "put_bulk failed");
+            for (auto id : batch)
+                model[priority].push_back(id);
+            size += n;
+        } else if (kind == 1 || kind == 2) {
+            Id id = next;
+            auto ret = kind == 1 || size == config.queue_size ?
+                q.try_put(id, priority) : q.put(id, priority);
+            auto expected = size == config.queue_size ?
+                RetCode::NO_SPACE : RetCode::OK;
+            if (ret != expected)
+                fail(step, "put returned " + std::to_string(static_cast<int>(ret)));
+            if (ret == RetCode::OK) {
+                model[priority].push_back(next++);
+                ++size;
+            }
+        } else if (kind == 3 && size) {
+            std::vector<Id> batch;
+            int max_count = 1 + detail::below(rng, config.bulk);
+            if (q.get_bulk(std::back_inserter(batch), max_count) != RetCode::OK)
+                fail(step, "get_bulk failed");
+            if (static_cast<int>(batch.size()) != std::min(max_count, size))
+                fail(step, "get_bulk got " + std::to_string(batch.size()));
+            for (size_t i = 0; i != batch.size() && size; i++) {
+                Id id = pop();
+                if (batch[i] != id)
+                    fail(step, "get_bulk got " + std::to_string(batch[i]) +
+                         " instead of " + std::to_string(id));
+            }
+        } else {
+            Id id = 0;
+            auto ret = q.try_get(&id);
+            if (!size) {
+                if (ret != RetCode::WOULD_BLOCK)
+                    fail(step, "try_get on empty queue didn't block");
+            } else {
+                Id expected = pop();
+                if (ret != RetCode::OK || id != expected)
+                    fail(step, "try_get got " + std::to_string(id) +
+                         " instead of " + std::to_string(expected));
+            }
+        }
+        int top = model.empty() ? Queue::NO_PRIORITY : model.rbegin()->first;
+        if (q.size() != size || q.topPriority() != top)
+            fail(step, "size " + std::to_string(q.size()) + " top " +
+                 std::to_string(q.topPriority()) + ", model size " +
+                 std::to_string(size) + " top " + std::to_string(top));
+        ++report.ops;
+    }
+    report.seconds = static_cast<double>(steadyNowNs() - start) / 1e9;
+    q.stop();
+    return report;
+}
+
+} // namespace stress
+} // namespace zodiactest
@@ -1,13 +1,63 @@
 
+#include "../async_events.hpp"
+#include "../coroutine.hpp"
+#include "../flow_control.hpp"
+#include "../journal.hpp"
+#include "../lockfree_queue.hpp"
+#include "../logger.hpp"
+#include "../message_buffer.hpp"
+#include "../metrics.hpp"
+#include "../reader_pool.hpp"
 #include "../messagequeue.hpp"
+#include "../queue_set.hpp"
+#include "../sharded_messagequeue.hpp"
+#include "../shm_messagequeue.hpp"
+#include "stress.hpp"
 #include "gtest/gtest.h"
 
 #include <atomic>
 #include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <string>
 #include <future>
+#include <new>
+#include <stdexcept>
+#include <iterator>
 #include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* counts heap allocations for allocation-free path tests,
+   frees for memory returning ones */
+static std::atomic<long long> g_allocs{0};
+static std::atomic<long long> g_frees{0};
+
+void* operator new(std::size_t size) {
+    ++g_allocs;
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    if (p)
+        ++g_frees;
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    if (p)
+        ++g_frees;
+    std::free(p);
+}
 
 using ::testing::Test;
 using ::testing::InitGoogleTest;
@@ -95,6 +145,372 @@ protected:
     MessageQueue<int> _q;
 };
 
+class QueueTestPriorityLevels : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 100;
+    static constexpr int LEVELS = 130; // more than one bitmap word
+public:
+    QueueTestPriorityLevels() : _q(QUEUE_SIZE, 0, QUEUE_SIZE)
+    {}
+
+protected:
+    void SetUp() override {
+        _q.run();
+    }
+    /* Test bucketed storage pops higher level first,
+       FIFO inside level, and survives ring growth and wrap */
+    void TestPriority() {
+        for (int round = 0; round != 3; round++) {
+            int seq[LEVELS] = {};
+            for (int i = 0; i != QUEUE_SIZE; i++) {
+                /* most messages land on few levels to force growth */
+                int priority = (i * 7) % (i % 2 ? LEVELS : 3);
+                ASSERT_EQ(_q.put(priority * 1000 + seq[priority]++,
+                                 priority), RetCode::OK);
+            }
+            int prevVal = 1000 * 1000;
+            for (int i = 0; i != QUEUE_SIZE; i++) {
+                int val;
+                ASSERT_EQ(_q.get(&val), RetCode::OK);
+                if (val / 1000 == prevVal / 1000) {
+                    /* same level - FIFO */
+                    ASSERT_EQ(val, prevVal + 1);
+                } else {
+                    ASSERT_LT(val / 1000, prevVal / 1000);
+                    ASSERT_EQ(val % 1000, 0);
+                }
+                prevVal = val;
+            }
+        }
+        _q.stop();
+    }
+    /* Test priorities out of [0, LEVELS) go to the outermost
+       levels instead of past the level array */
+    void TestClamp() {
+        ASSERT_EQ(_q.put(1, -5), RetCode::OK);
+        ASSERT_EQ(_q.put(2, LEVELS / 2), RetCode::OK);
+        ASSERT_EQ(_q.put(3, LEVELS + 10), RetCode::OK);
+        ASSERT_EQ(_q.topPriority(), LEVELS - 1);
+        for (int expected : {3, 2, 1}) {
+            int val;
+            ASSERT_EQ(_q.get(&val), RetCode::OK);
+            ASSERT_EQ(val, expected);
+        }
+        ASSERT_EQ(_q.put(4, std::numeric_limits<int>::min()), RetCode::OK);
+        ASSERT_EQ(_q.topPriority(), 0);
+        _q.stop();
+    }
+    /* Test a level grows up to capacity rounded up to power
+       of two and no further */
+    void TestRingBound() {
+        PriorityLevels<4>::Storage<int> storage(5);
+        for (int i = 0; i != 8; i++)
+            storage.push(2, i);
+        ASSERT_THROW(storage.push(2, 8), std::length_error);
+        for (int i = 0; i != 8; i++) {
+            int val;
+            ASSERT_EQ(storage.pop(&val), 2);
+            ASSERT_EQ(val, i);
+        }
+        _q.stop();
+    }
+
+    MessageQueue<int, PriorityLevels<LEVELS>> _q;
+};
+
+class QueueTestScheduling : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 40;
+    static constexpr int LEVELS = 4;
+
+protected:
+    template<typename Queue>
+    static void fill(Queue& q, int per_level) {
+        for (int i = 0; i != per_level; i++) {
+            for (int priority = 0; priority != LEVELS; priority++)
+                ASSERT_EQ(q.put(priority * 1000 + i, priority), RetCode::OK);
+        }
+    }
+    template<typename Queue>
+    static std::vector<int> drainLevels(Queue& q, int num) {
+        std::vector<int> levels;
+        int prev[LEVELS] = {-1, -1, -1, -1};
+        for (int i = 0; i != num; i++) {
+            int val;
+            EXPECT_EQ(q.get(&val), RetCode::OK);
+            /* FIFO inside level whatever the schedule */
+            EXPECT_EQ(val % 1000, prev[val / 1000] + 1);
+            prev[val / 1000] = val % 1000;
+            levels.push_back(val / 1000);
+        }
+        return levels;
+    }
+    /* Test weighted round robin serves level l weight(l)
+       messages per round, highest level first */
+    void TestWeightedFair() {
+        MessageQueue<int, PriorityLevels<LEVELS, WeightedFair>>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        q.run();
+        fill(q, 10);
+        std::vector<int> expected{3, 3, 3, 3, 2, 2, 2, 1, 1, 0,
+                                  3, 3, 3, 3, 2, 2, 2, 1, 1, 0};
+        ASSERT_EQ(drainLevels(q, 20), expected);
+
+        MessageQueue<int, PriorityLevels<LEVELS, WeightedFair>>
+            equal(QUEUE_SIZE, 0, QUEUE_SIZE, std::vector<int>{1, 1, 1, 1});
+        equal.run();
+        fill(equal, 2);
+        expected = {3, 2, 1, 0, 3, 2, 1, 0};
+        ASSERT_EQ(drainLevels(equal, 8), expected);
+    }
+    /* Test old low priority message overtakes fresh higher
+       ones after period per level of difference */
+    void TestAging() {
+        MessageQueue<int, PriorityLevels<LEVELS, Aging>>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE, std::chrono::milliseconds(1));
+        q.run();
+        ASSERT_EQ(q.put(0, 0), RetCode::OK);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        for (int i = 0; i != 3; i++)
+            ASSERT_EQ(q.put(3000 + i, 3), RetCode::OK);
+        std::vector<int> expected{0, 3, 3, 3};
+        ASSERT_EQ(drainLevels(q, 4), expected);
+
+        MessageQueue<int, PriorityLevels<LEVELS, Aging>>
+            slow(QUEUE_SIZE, 0, QUEUE_SIZE, std::chrono::seconds(10));
+        slow.run();
+        fill(slow, 2);
+        expected = {3, 3, 2, 2, 1, 1, 0, 0};
+        ASSERT_EQ(drainLevels(slow, 8), expected);
+    }
+};
+
+class QueueTestPool : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 100;
+    static constexpr int LEVELS = 70;
+public:
+    QueueTestPool()
+        : _q(QUEUE_SIZE, 0, QUEUE_SIZE),
+          _levels_q(QUEUE_SIZE, 0, QUEUE_SIZE)
+    {}
+
+protected:
+    void SetUp() override {
+        _q.run();
+        _levels_q.run();
+    }
+    /* Test fill/drain keeps priority and FIFO order and
+       doesn't allocate once storage has warmed up */
+    template<typename Queue>
+    void TestNoAllocs(Queue& q) {
+        for (int round = 0; round != 3; round++) {
+            auto allocs = g_allocs.load();
+            int seq[LEVELS] = {};
+            for (int i = 0; i != QUEUE_SIZE; i++) {
+                int priority = (i * 7) % (round ? LEVELS : 3);
+                ASSERT_EQ(q.put(priority * 1000 + seq[priority]++,
+                                priority), RetCode::OK);
+            }
+            int prevVal = 1000 * 1000;
+            for (int i = 0; i != QUEUE_SIZE; i++) {
+                int val;
+                ASSERT_EQ(q.get(&val), RetCode::OK);
+                if (val / 1000 == prevVal / 1000) {
+                    ASSERT_EQ(val, prevVal + 1);
+                } else {
+                    ASSERT_LT(val / 1000, prevVal / 1000);
+                    ASSERT_EQ(val % 1000, 0);
+                }
+                prevVal = val;
+            }
+            /* first round warms up, second one
+               grows to more levels */
+            if (round == 2) {
+                ASSERT_EQ(g_allocs.load() - allocs, 0);
+            }
+        }
+        q.stop();
+    }
+
+    MessageQueue<int, PooledPriorityMap> _q;
+    MessageQueue<int, PriorityLevels<LEVELS>> _levels_q;
+};
+
+class QueueTestMessageBuffer : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 10;
+    static constexpr int BUFFERS = 4;
+    static constexpr int MESSAGES = 10000;
+public:
+    QueueTestMessageBuffer()
+        : _pool(64, BUFFERS),
+          _q(QUEUE_SIZE, 0, QUEUE_SIZE)
+    {}
+
+protected:
+    void SetUp() override {
+        _q.run();
+    }
+    /* Test bytes stay in place from writer to reader
+       and buffer is recycled when last reference drops */
+    void TestZeroCopy() {
+        auto msg = _pool.acquire();
+        ASSERT_EQ(msg.append("hello"), 5u);
+        const char* bytes = msg.data();
+        ASSERT_EQ(_q.put(msg, 0), RetCode::OK);
+        ASSERT_EQ(msg.useCount(), 2);
+        msg.reset();
+
+        MessageBuffer got;
+        ASSERT_EQ(_q.get(&got), RetCode::OK);
+        ASSERT_EQ(got.data(), bytes);
+        ASSERT_EQ(got.view(), "hello");
+        ASSERT_EQ(got.useCount(), 1);
+
+        /* exhaust the pool, then free one buffer */
+        std::vector<MessageBuffer> held;
+        while (auto buf = _pool.tryAcquire())
+            held.push_back(std::move(buf));
+        ASSERT_EQ(held.size(), size_t{BUFFERS - 1});
+        got.reset();
+        auto reused = _pool.tryAcquire();
+        ASSERT_TRUE(reused);
+        ASSERT_EQ(reused.data(), bytes);
+        ASSERT_EQ(reused.size(), 0u);
+        ASSERT_EQ(reused.append(std::string(100, 'x')), 64u);
+        _q.stop();
+    }
+    /* Test writers block in acquire() on exhausted pool
+       and get buffers back from readers, no allocations
+       on put/get once queue storage is warmed up */
+    void TestRecycle() {
+        std::thread reader([this] {
+                MessageBuffer msg;
+                for (int i = 0; i != MESSAGES; i++) {
+                    ASSERT_EQ(_q.get(&msg), RetCode::OK);
+                    ASSERT_EQ(msg.view().size(), sizeof(int));
+                    msg.reset();
+                }
+            });
+        long long allocs = 0;
+        for (int i = 0; i != MESSAGES; i++) {
+            /* first put carves queue's level pool */
+            if (i == 1)
+                allocs = g_allocs.load();
+            auto msg = _pool.acquire();
+            msg.append(std::string_view(reinterpret_cast<char*>(&i),
+                                        sizeof(i)));
+            ASSERT_EQ(_q.put(std::move(msg), i % 3), RetCode::OK);
+        }
+        reader.join();
+        ASSERT_EQ(g_allocs.load() - allocs, 0);
+        _q.stop();
+    }
+
+    BufferPool _pool;
+    MessageQueue<MessageBuffer, PooledPriorityMap> _q;
+};
+
+class QueueTestTimed : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 10;
+    static constexpr int CONTENDERS = 4;
+public:
+    QueueTestTimed() : _q(QUEUE_SIZE, 0, QUEUE_SIZE), _contend{false}
+    {}
+
+protected:
+    void SetUp() override {
+        _q.run();
+    }
+    void TearDown() override {
+        stopContenders();
+        _q.stop();
+    }
+    /* threads hammering queue mutex with non-blocking calls,
+       putters keep full queue full, getters keep empty one empty */
+    void startContenders(bool putters) {
+        _contend = true;
+        for (int i = 0; i != CONTENDERS; i++) {
+            _contenders.emplace_back([this, putters] {
+                    int val;
+                    while (_contend) {
+                        if (putters) {
+                            _q.try_put(1, 0);
+                        } else {
+                            _q.try_get(&val);
+                        }
+                        _q.size();
+                        std::this_thread::yield();
+                    }
+                });
+        }
+    }
+    void stopContenders() {
+        _contend = false;
+        for (auto& thread : _contenders) {
+            thread.join();
+        }
+        _contenders.clear();
+    }
+    /* Test try_put/try_get never wait */
+    void TestTry() {
+        int val;
+        ASSERT_EQ(_q.try_get(&val), RetCode::WOULD_BLOCK);
+        for (int i = 0; i != QUEUE_SIZE; i++) {
+            ASSERT_EQ(_q.try_put(i, 0), RetCode::OK);
+        }
+        ASSERT_EQ(_q.try_put(QUEUE_SIZE, 0), RetCode::NO_SPACE);
+        ASSERT_EQ(_q.try_get(&val), RetCode::OK);
+        ASSERT_EQ(val, 0);
+        _q.stop();
+        ASSERT_EQ(_q.try_get(&val), RetCode::STOPPED);
+        ASSERT_EQ(_q.try_put(0, 0), RetCode::STOPPED);
+    }
+    /* Test deadlines are honoured within 1 ms
+       while other threads contend for the queue */
+    void TestDeadlines() {
+        using namespace std::chrono;
+        const auto timeout = milliseconds(20);
+        const auto slack = milliseconds(1);
+        for (int round = 0; round != 5; round++) {
+            int val;
+            startContenders(false);
+            auto start = steady_clock::now();
+            ASSERT_EQ(_q.get_until(&val, start + timeout), RetCode::TIMEOUT);
+            auto elapsed = steady_clock::now() - start;
+            ASSERT_GE(elapsed, timeout);
+            ASSERT_LE(elapsed, timeout + slack);
+            stopContenders();
+
+            startContenders(true);
+            while (_q.size() != QUEUE_SIZE) {
+                std::this_thread::yield();
+            }
+            start = steady_clock::now();
+            ASSERT_EQ(_q.put_for(0, 0, timeout), RetCode::TIMEOUT);
+            elapsed = steady_clock::now() - start;
+            ASSERT_GE(elapsed, timeout);
+            ASSERT_LE(elapsed, timeout + slack);
+            stopContenders();
+            while (_q.try_get(&val) == RetCode::OK) {
+            }
+        }
+    }
+    /* Test timed get returns as soon as message arrives */
+    void TestWakeBeforeDeadline() {
+        using namespace std::chrono;
+        std::thread writer([this] {
+                std::this_thread::sleep_for(milliseconds(10));
+                _q.put(42, 0);
+            });
+        int val;
+        ASSERT_EQ(_q.get_for(&val, seconds(3)), RetCode::OK);
+        ASSERT_EQ(val, 42);
+        writer.join();
+    }
+
+    MessageQueue<int> _q;
+    std::atomic<bool> _contend;
+    std::vector<std::thread> _contenders;
+};
+
 class TestWriter 
 {
 public:
@@ -252,119 +668,2240 @@ protected:
     TestWriter _tw2;
 };
 
-class QueueTestWaterMarks : public ::testing::Test {
-    static constexpr int QUEUE_SIZE = 10;
-    
-    class QueueTestEvents : public IMessageQueueEvents
-    {
-    public:
-        QueueTestEvents(MessageQueue<int> * q,
-                        TestReader * tr,
-                        TestWriter * tw) :
-            _q{q},
-            _tr1{tr},
-            _tw1{tw} 
-        {}
-        ~QueueTestEvents() final {}
-    
-        void on_start() final
-        {
-            _tw1->run();
-            ++start_flag;
+class QueueTestLockFree : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 16;
+    static constexpr int MESSAGES = 100000;
+    static constexpr int THREADS = 4;
+public:
+    QueueTestLockFree() :
+        _spsc(QUEUE_SIZE, 0, QUEUE_SIZE),
+        _mpmc(QUEUE_SIZE, 0, QUEUE_SIZE)
+    {}
+
+protected:
+    void SetUp() override {
+        _spsc.run();
+        _mpmc.run();
+    }
+    /* Test spsc ring keeps FIFO order while
+       both sides park on full and empty ring */
+    void TestSpsc() {
+        std::thread writer([this] {
+                for (int i = 0; i != MESSAGES; i++) {
+                    ASSERT_EQ(_spsc.put(i, 0), RetCode::OK);
+                }
+            });
+        for (int i = 0; i != MESSAGES; i++) {
+            int val;
+            ASSERT_EQ(_spsc.get(&val), RetCode::OK);
+            ASSERT_EQ(val, i);
         }
-        void on_stop() noexcept final
-        {
-            ++stop_flag;
+        writer.join();
+        _spsc.stop();
+    }
+    /* Test every message put to mpmc queue by several
+       writers on several levels is got exactly once */
+    void TestMpmc() {
+        std::atomic<long long> sum{0};
+        std::atomic<int> got{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t != THREADS; t++) {
+            threads.emplace_back([this, t] {
+                    for (int i = 0; i != MESSAGES; i++) {
+                        ASSERT_EQ(_mpmc.put(i, (i + t) % LEVELS),
+                                  RetCode::OK);
+                    }
+                });
+            threads.emplace_back([this, &sum, &got] {
+                    int val;
+                    while (_mpmc.get(&val) == RetCode::OK) {
+                        sum += val;
+                        ++got;
+                    }
+                });
         }
-        
-        void on_hwm() final
-        {
-            TestWriter::stop_flag = true;
-            _tr1->run();
-            ++hwm_flag;
+        while (got != THREADS * MESSAGES) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
         }
-        
-        void on_lwm() final
-        {
-            TestReader::stop_flag = true;
-            _q->stop();
-            ++lwm_flag;
+        /* readers are parked on empty queue now */
+        _mpmc.stop();
+        for (auto& thread : threads) {
+            thread.join();
         }
-    private:
-        MessageQueue<int> * _q;
-        TestReader * _tr1;
-        TestWriter * _tw1;
-    };
+        ASSERT_EQ(sum, static_cast<long long>(MESSAGES - 1) *
+                  MESSAGES / 2 * THREADS);
+        ASSERT_EQ(_mpmc.size(), 0);
+    }
+    /* Test queue_size bounds all levels together and priorities
+       out of range go to the outermost levels */
+    void TestLevelsBound() {
+        for (int i = 0; i != QUEUE_SIZE; i++) {
+            ASSERT_EQ(_mpmc.put(i, i % LEVELS), RetCode::OK);
+        }
+        std::atomic<bool> put{false};
+        std::thread writer([this, &put] {
+                ASSERT_EQ(_mpmc.put(-1, LEVELS + 5), RetCode::OK);
+                put = true;
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ASSERT_FALSE(put);
+        ASSERT_EQ(_mpmc.size(), QUEUE_SIZE);
+        int val;
+        ASSERT_EQ(_mpmc.get(&val), RetCode::OK);
+        writer.join();
+        ASSERT_EQ(_mpmc.size(), QUEUE_SIZE);
+        /* on top level after QUEUE_SIZE / LEVELS put there
+           before, one of which is got already */
+        int last_top = -1;
+        for (int i = 0; i != QUEUE_SIZE; i++) {
+            ASSERT_EQ(_mpmc.get(&val), RetCode::OK);
+            if (val == -1) {
+                last_top = i;
+            }
+        }
+        ASSERT_EQ(last_top, QUEUE_SIZE / LEVELS - 1);
+        ASSERT_EQ(_mpmc.put(7, -3), RetCode::OK);
+        ASSERT_EQ(_mpmc.get(&val), RetCode::OK);
+        ASSERT_EQ(val, 7);
+        _mpmc.stop();
+    }
+    /* Test handlers replaced under traffic crossing watermarks
+       are released by setEvents(), never while being called */
+    void TestEventsRetired() {
+        class Events : public IMessageQueueEvents {
+        public:
+            ~Events() override {
+                alive = false;
+            }
+            void on_start() override {}
+            void on_hwm() override {
+                EXPECT_TRUE(alive);
+                ++calls;
+            }
+            void on_lwm() override {
+                EXPECT_TRUE(alive);
+                ++calls;
+            }
+            void on_stop() override {}
+
+            std::atomic<bool> alive{true};
+            std::atomic<int> calls{0};
+        };
+        std::thread writer([this] {
+                for (int i = 0; i != MESSAGES; i++) {
+                    ASSERT_EQ(_spsc.put(i, 0), RetCode::OK);
+                }
+            });
+        std::thread reader([this] {
+                int val;
+                for (int i = 0; i != MESSAGES; i++) {
+                    ASSERT_EQ(_spsc.get(&val), RetCode::OK);
+                }
+            });
+        std::weak_ptr<IMessageQueueEvents> replaced;
+        for (int i = 0; i != 200; i++) {
+            auto events = std::make_shared<Events>();
+            std::weak_ptr<IMessageQueueEvents> current = events;
+            _spsc.setEvents(std::move(events));
+            ASSERT_TRUE(replaced.expired());
+            replaced = current;
+            std::this_thread::yield();
+        }
+        writer.join();
+        reader.join();
+        auto events = std::make_shared<Events>();
+        replaced = events;
+        _spsc.setEvents(std::move(events));
+        ASSERT_FALSE(replaced.expired());
+        _spsc.setEvents(nullptr);
+        ASSERT_TRUE(replaced.expired());
+        _spsc.stop();
+    }
+
+    static constexpr int LEVELS = 3;
+    SpscMessageQueue<int> _spsc;
+    LockFreeMessageQueue<int, MpmcRing, LEVELS> _mpmc;
+};
 
+class QueueTestWaitStrategy : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 4;
+    static constexpr int MESSAGES = 20000;
 public:
-    QueueTestWaterMarks() :
-        _q(QUEUE_SIZE, 1, QUEUE_SIZE - 2),
-        _tr1(&_q),
-        _tw1(&_q)
+    QueueTestWaitStrategy() :
+        _q(QUEUE_SIZE, 0, QUEUE_SIZE),
+        _mpmc(QUEUE_SIZE, 0, QUEUE_SIZE)
     {}
 
-    static std::atomic<int> start_flag;
-    static std::atomic<int> stop_flag;
-    static std::atomic<int> hwm_flag;
-    static std::atomic<int> lwm_flag;
-
 protected:
-    void SetUp() override {
-        TestReader::stop_flag = false;
-        TestWriter::stop_flag = false;
-        start_flag = 0;
-        stop_flag = 0;
-        hwm_flag = 0;
-        lwm_flag = 0;
-    }
-    /* Test number of elements pushed
-       is equal to popped in mt environment */
-    void TestWaterMarks()
-    {
-        _q.setEvents(std::make_shared<QueueTestEvents>(
-                          &_q, &_tr1, &_tw1));
-        for (int i = 0; i != 1000; i++)
-        {
-            _q.run();
-            _tw1.join();
-            _tr1.join();
-            TestReader::stop_flag = false;
-            TestWriter::stop_flag = false;
+    /* Test spinning readers and writers still hand over
+       every message and wake up on stop */
+    template<typename Queue>
+    void TestSpinThenPark(Queue* q) {
+        q->setWaitStrategy(WaitStrategy::spinThenPark(100, 10));
+        q->run();
+        std::thread writer([q] {
+                for (int i = 0; i != MESSAGES; i++) {
+                    ASSERT_EQ(q->put(i, 0), RetCode::OK);
+                }
+            });
+        for (int i = 0; i != MESSAGES; i++) {
+            int val;
+            ASSERT_EQ(q->get(&val), RetCode::OK);
+            ASSERT_EQ(val, i);
         }
-        ASSERT_EQ(start_flag, 1000);
-        ASSERT_EQ(stop_flag, 1000);
-        ASSERT_EQ(hwm_flag, 1000);
-        ASSERT_EQ(lwm_flag, 1000);
+        writer.join();
+        std::thread reader([q] {
+                int val;
+                ASSERT_EQ(q->get(&val), RetCode::STOPPED);
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        q->stop();
+        reader.join();
     }
 
     MessageQueue<int> _q;
-    TestReader _tr1;
-    TestWriter _tw1;
+    MpmcMessageQueue<int> _mpmc;
 };
 
-std::atomic<int> QueueTestWaterMarks::start_flag{0};
-std::atomic<int> QueueTestWaterMarks::stop_flag{0};
-std::atomic<int> QueueTestWaterMarks::hwm_flag{0};
-std::atomic<int> QueueTestWaterMarks::lwm_flag{0};
+class QueueTestSharded : public ::testing::Test {
+    static constexpr int SHARDS = 4;
+    static constexpr int QUEUE_SIZE = 40;
+    static constexpr int MESSAGES = 50000;
 
-TEST_F(QueueTestPriority, PriorityTest) {
-    ASSERT_DURATION_LE(5,
-                       TestPriority());
-}
+    class QueueCountEvents : public IMessageQueueEvents
+    {
+    public:
+        QueueCountEvents() {}
+        ~QueueCountEvents() final {}
+    
+        void on_start() final {}
+        void on_stop() noexcept final {}
+        void on_hwm() final { ++hwm_num; }
+        void on_lwm() final { ++lwm_num; }
 
-TEST_F(QueueTestEqualPriority, EqualPriorityTest) {
-    ASSERT_DURATION_LE(5,
-                       TestPriority());
-}
+        std::atomic<int> hwm_num{0};
+        std::atomic<int> lwm_num{0};
+    };
 
-TEST_F(QueueTestThreadSafety, MTSafeTestWithoutEvents) {
-    ASSERT_DURATION_LE(5,
-                       TestThreadSafety(nullptr));
-}
+public:
+    QueueTestSharded() : _q(SHARDS, QUEUE_SIZE, 5, QUEUE_SIZE - 5)
+    {}
 
-TEST_F(QueueTestThreadSafety, MTSafeTestWithEvents) {
-    ASSERT_DURATION_LE(5, TestThreadSafety(
-                           std::make_shared<QueueNopEvents>()));
+protected:
+    void SetUp() override {
+        _q.run();
+    }
+    /* Test keyed messages keep FIFO order, readers steal
+       from other shards and watermarks count all shards */
+    void TestSingleThread() {
+        auto events = std::make_shared<QueueCountEvents>();
+        _q.setEvents(events);
+        const int keyed = QUEUE_SIZE / SHARDS - 2;
+        for (int i = 0; i != keyed; i++) {
+            ASSERT_EQ(_q.put(i, 0, 3), RetCode::OK);
+        }
+        for (int i = keyed; i != QUEUE_SIZE - 5; i++) {
+            ASSERT_EQ(_q.put(1000 + i, 0), RetCode::OK);
+        }
+        ASSERT_EQ(events->hwm_num, 0);
+        ASSERT_EQ(_q.put(1000, 0), RetCode::OK);
+        ASSERT_EQ(events->hwm_num, 1);
+        int val;
+        int next_keyed = 0;
+        for (int i = 0; i != QUEUE_SIZE - 4; i++) {
+            /* home shard gets empty soon - rest is stolen */
+            ASSERT_EQ(_q.get(&val, 3), RetCode::OK);
+            if (val < 1000) {
+                ASSERT_EQ(val, next_keyed++);
+            }
+            ASSERT_EQ(events->lwm_num, _q.size() <= 5 ? 1 : 0);
+        }
+        ASSERT_EQ(next_keyed, keyed);
+        ASSERT_EQ(_q.size(), 0);
+    }
+    /* Test higher priority in other shard is served
+       within shards - 1 gets from home shard */
+    void TestPriorityBound() {
+        for (int i = 0; i != 10; i++) {
+            ASSERT_EQ(_q.put(i, 0, 0), RetCode::OK);
+        }
+        ASSERT_EQ(_q.put(100, 1, 2), RetCode::OK);
+        int val;
+        int gets = 0;
+        do {
+            ASSERT_EQ(_q.get(&val, 0), RetCode::OK);
+            gets++;
+        } while (val != 100);
+        ASSERT_LE(gets, SHARDS);
+    }
+    /* Test every message is got exactly once with
+       several writers and stealing readers */
+    void TestThreadSafety() {
+        std::atomic<long long> sum{0};
+        std::atomic<int> got{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t != SHARDS; t++) {
+            threads.emplace_back([this] {
+                    for (int i = 0; i != MESSAGES; i++) {
+                        ASSERT_EQ(_q.put(i, i % 3), RetCode::OK);
+                    }
+                });
+            threads.emplace_back([this, &sum, &got] {
+                    int val;
+                    while (_q.get(&val) == RetCode::OK) {
+                        sum += val;
+                        ++got;
+                    }
+                });
+        }
+        while (got != SHARDS * MESSAGES) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        _q.stop();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        ASSERT_EQ(sum, static_cast<long long>(MESSAGES - 1) *
+                  MESSAGES / 2 * SHARDS);
+        ASSERT_EQ(_q.size(), 0);
+    }
+    /* Test storage arguments reach every shard - weights
+       1 and 3 instead of default 1 and 2 */
+    void TestStorageArgs() {
+        ShardedMessageQueue<int, PriorityLevels<2, WeightedFair>>
+            q(SHARDS, QUEUE_SIZE, 0, QUEUE_SIZE, std::vector<int>{1, 3});
+        q.run();
+        for (int shard = 0; shard != SHARDS; shard++) {
+            for (int i = 0; i != 4; i++) {
+                ASSERT_EQ(q.put(0, 0, shard), RetCode::OK);
+                ASSERT_EQ(q.put(1, 1, shard), RetCode::OK);
+            }
+            int levels[8];
+            for (int& level : levels) {
+                ASSERT_EQ(q.get(&level, shard), RetCode::OK);
+            }
+            const int expected[8] = {1, 1, 1, 0, 1, 0, 0, 0};
+            for (int i = 0; i != 8; i++) {
+                ASSERT_EQ(levels[i], expected[i]);
+            }
+        }
+        q.stop();
+    }
+    /* Test replaced events are released by setEvents() */
+    void TestEventsRetired() {
+        auto events = std::make_shared<QueueCountEvents>();
+        std::weak_ptr<QueueCountEvents> replaced = events;
+        _q.setEvents(std::move(events));
+        for (int i = 0; i != QUEUE_SIZE; i++) {
+            ASSERT_EQ(_q.put(i, 0), RetCode::OK);
+        }
+        ASSERT_GT(replaced.lock()->hwm_num, 0);
+        _q.setEvents(std::make_shared<QueueCountEvents>());
+        ASSERT_TRUE(replaced.expired());
+        _q.setEvents(nullptr);
+        _q.stop();
+    }
+
+    ShardedMessageQueue<int> _q;
+};
+
+class QueueTestAsyncEvents : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 10;
+
+    class CountingEvents : public IMessageQueueEvents
+    {
+    public:
+        ~CountingEvents() final {}
+
+        void on_start() final { ++start_num; }
+        void on_stop() noexcept final { ++stop_num; }
+        void on_hwm() final {
+            /* slow handler - waits until test lets it go */
+            in_hwm = true;
+            std::unique_lock<std::mutex> lock(mtx);
+            notify.wait(lock, [this] { return !blocked; });
+            ++hwm_num;
+        }
+        void on_lwm() final { ++lwm_num; }
+
+        void unblock() {
+            std::unique_lock<std::mutex> lock(mtx);
+            blocked = false;
+            notify.notify_all();
+        }
+
+        std::atomic<int> start_num{0};
+        std::atomic<int> stop_num{0};
+        std::atomic<int> hwm_num{0};
+        std::atomic<int> lwm_num{0};
+        std::atomic<bool> in_hwm{false};
+        bool blocked = false;
+        std::mutex mtx;
+        std::condition_variable notify;
+    };
+
+public:
+    QueueTestAsyncEvents()
+        : _handlers(std::make_shared<CountingEvents>()),
+          _q(QUEUE_SIZE, 2, QUEUE_SIZE - 2)
+    {}
+
+protected:
+    /* Test transitions not dispatched yet are coalesced */
+    void TestCoalesce() {
+        std::vector<AsyncEvents::Task> tasks;
+        auto events = std::make_shared<AsyncEvents>(
+            _handlers, [&tasks](AsyncEvents::Task task) {
+                tasks.push_back(std::move(task));
+            });
+        events->on_start();
+        events->on_hwm();
+        events->on_hwm();
+        events->on_hwm();
+        events->on_lwm();
+        events->on_hwm();
+        events->on_stop();
+        events->on_start();
+        /* one task for the whole burst */
+        ASSERT_EQ(tasks.size(), 1u);
+        tasks[0]();
+        ASSERT_EQ(_handlers->start_num, 1);
+        ASSERT_EQ(_handlers->hwm_num, 1);
+        ASSERT_EQ(_handlers->lwm_num, 0);
+        ASSERT_EQ(_handlers->stop_num, 0);
+
+        /* same state as delivered - nothing to do */
+        events->on_hwm();
+        ASSERT_EQ(tasks.size(), 1u);
+        events->on_lwm();
+        ASSERT_EQ(tasks.size(), 2u);
+        tasks[1]();
+        ASSERT_EQ(_handlers->lwm_num, 1);
+    }
+    /* Test puts above hwm don't wait for slow on_hwm() */
+    void TestNonBlocking() {
+        auto events = std::make_shared<AsyncEvents>(_handlers);
+        _handlers->blocked = true;
+        _q.setEvents(events);
+        _q.run();
+        for (int i = 0; i != QUEUE_SIZE; i++) {
+            ASSERT_EQ(_q.put(i, 0), RetCode::OK);
+        }
+        /* readers go on while handler is stuck */
+        while (!_handlers->in_hwm) {
+            std::this_thread::yield();
+        }
+        ASSERT_EQ(_handlers->hwm_num, 0);
+        int val;
+        for (int i = 0; i != QUEUE_SIZE; i++) {
+            ASSERT_EQ(_q.get(&val), RetCode::OK);
+        }
+        _handlers->unblock();
+        events->flush();
+        ASSERT_EQ(_handlers->start_num, 1);
+        ASSERT_EQ(_handlers->hwm_num, 1);
+        ASSERT_EQ(_handlers->lwm_num, 1);
+        _q.stop();
+        events->flush();
+        ASSERT_EQ(_handlers->stop_num, 1);
+    }
+
+    std::shared_ptr<CountingEvents> _handlers;
+    MessageQueue<int> _q;
+};
+
+class QueueTestCredits : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 8;
+    static constexpr int MAX_GRANT = 4;
+    static constexpr int MESSAGES = 10000;
+public:
+    QueueTestCredits()
+        : _hot_gate(std::make_shared<CreditGate>(QUEUE_SIZE, MAX_GRANT)),
+          _gate(std::make_shared<CreditGate>(QUEUE_SIZE, MAX_GRANT)),
+          _hot_q(QUEUE_SIZE, 2, QUEUE_SIZE - 2),
+          _q(QUEUE_SIZE, 2, QUEUE_SIZE - 2)
+    {}
+
+protected:
+    void SetUp() override {
+        _hot_q.run();
+        _q.run();
+    }
+    /* Test windows refill in batches of grant, hwm shrinks
+       and lwm restores grant, close refuses producers */
+    void TestGrant() {
+        {
+            CreditWindow window(_gate);
+            ASSERT_EQ(window.take(), 1);
+            ASSERT_EQ(_gate->available(), QUEUE_SIZE - MAX_GRANT);
+            _gate->shrink();
+            ASSERT_EQ(window.take(10), MAX_GRANT - 1);
+            /* window empty - refills with shrunk grant */
+            ASSERT_EQ(window.take(10), MAX_GRANT / 2);
+            ASSERT_EQ(_gate->available(), QUEUE_SIZE - MAX_GRANT * 3 / 2);
+            _gate->release(MAX_GRANT + MAX_GRANT / 2);
+            _gate->restore();
+            ASSERT_EQ(window.take(), 1);
+            ASSERT_EQ(_gate->available(), QUEUE_SIZE - MAX_GRANT);
+        }
+        /* unused credits are back */
+        ASSERT_EQ(_gate->available(), QUEUE_SIZE - 1);
+        _gate->close();
+        ASSERT_EQ(_gate->acquire(1), 0);
+        _gate->open();
+        ASSERT_EQ(_gate->acquire(1), 1);
+    }
+    /* Test producers of a queue stuck at hwm don't
+       slow down producers of another queue */
+    void TestIsolation() {
+        std::thread hot_writer([this] {
+                CreditWindow credits(_hot_gate);
+                int val = 0;
+                /* nobody reads hot queue - blocks on credits */
+                while (credits.take()) {
+                    ASSERT_EQ(_hot_q.put(val++, 0), RetCode::OK);
+                }
+            });
+        std::thread reader([this] {
+                int val;
+                for (int i = 0; i != MESSAGES; i++) {
+                    ASSERT_EQ(_q.get(&val), RetCode::OK);
+                    ASSERT_EQ(val, i);
+                    _gate->release(1);
+                }
+            });
+        CreditWindow credits(_gate);
+        for (int i = 0; i != MESSAGES; i++) {
+            ASSERT_EQ(credits.take(), 1);
+            ASSERT_EQ(_q.put(i, 0), RetCode::OK);
+        }
+        reader.join();
+        /* hot queue is full, never more than its credits */
+        ASSERT_EQ(_hot_q.size(), QUEUE_SIZE);
+        _hot_gate->close();
+        hot_writer.join();
+        _hot_q.stop();
+        _q.stop();
+    }
+
+    std::shared_ptr<CreditGate> _hot_gate;
+    std::shared_ptr<CreditGate> _gate;
+    MessageQueue<int> _hot_q;
+    MessageQueue<int> _q;
+};
+
+class QueueTestReaderPool : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 16;
+    static constexpr int MESSAGES = 10000;
+
+    struct CountingHandler {
+        void operator()(const int& val) {
+            sum->fetch_add(val);
+            count->fetch_add(1);
+            if (cpu >= 0 && currentCpu() != cpu)
+                misplaced->fetch_add(1);
+        }
+
+        std::atomic<long long>* sum;
+        std::atomic<int>* count;
+        std::atomic<int>* misplaced;
+        int cpu;
+    };
+    struct SlowHandler {
+        void operator()(const int&) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            count->fetch_add(1);
+        }
+
+        std::atomic<int>* count;
+    };
+
+public:
+    QueueTestReaderPool()
+        : _q(std::make_shared<MessageQueue<int>>(QUEUE_SIZE, 0, QUEUE_SIZE))
+    {}
+
+protected:
+    void SetUp() override {
+        _q->run();
+    }
+    /* Test every message is handled once by pool workers,
+       pinned workers run on their CPU */
+    void TestPool(int threads, int batch_size, int cpu, int chunk_size = 0) {
+        ReaderPool<MessageQueue<int>, CountingHandler> pool(
+            _q, CountingHandler{&_sum, &_count, &_misplaced, cpu},
+            threads, batch_size);
+        if (cpu >= 0)
+            pool.setAffinity({{cpu}});
+        pool.setPipeline(chunk_size);
+        pool.run();
+        long long expected = 0;
+        for (int i = 0; i != MESSAGES; i++) {
+            ASSERT_EQ(_q->put(i, i % 4), RetCode::OK);
+            expected += i;
+        }
+        while (_count != MESSAGES) {
+            std::this_thread::yield();
+        }
+        pool.stop();
+        ASSERT_EQ(_sum, expected);
+        ASSERT_EQ(_misplaced, 0);
+    }
+    /* Test stop() of pipelined pool loses no message - what
+       fetch stage took is handled, the rest stays queued */
+    void TestPipelineStop() {
+        for (int i = 0; i != QUEUE_SIZE; i++)
+            ASSERT_EQ(_q->put(i, 0), RetCode::OK);
+        ReaderPool<MessageQueue<int>, SlowHandler> pool(
+            _q, SlowHandler{&_count}, 1);
+        pool.setPipeline(3);
+        pool.run();
+        while (_count == 0)
+            std::this_thread::yield();
+        pool.stop();
+        ASSERT_LT(_count, QUEUE_SIZE);
+        ASSERT_EQ(_count + _q->size(), QUEUE_SIZE);
+    }
+    /* Test /sys cpulist format parsing */
+    void TestCpuList() {
+        ASSERT_EQ(parseCpuList("0-3,8,10-11"),
+                  std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+        ASSERT_EQ(parseCpuList("5"), std::vector<int>({5}));
+        ASSERT_TRUE(parseCpuList("").empty());
+    }
+
+    std::shared_ptr<MessageQueue<int>> _q;
+    std::atomic<long long> _sum{0};
+    std::atomic<int> _count{0};
+    std::atomic<int> _misplaced{0};
+};
+
+class QueueTestLogger : public ::testing::Test {
+    static constexpr int THREADS = 4;
+    static constexpr int RECORDS = 1000;
+
+public:
+    QueueTestLogger()
+        : _sink(std::tmpfile())
+    {}
+    ~QueueTestLogger() {
+        std::fclose(_sink);
+    }
+
+protected:
+    void SetUp() override {
+        ASSERT_NE(_sink, nullptr);
+    }
+    std::vector<std::string> _lines(Logger& logger) {
+        logger.flush();
+        std::rewind(_sink);
+        std::vector<std::string> lines;
+        char line[512];
+        while (std::fgets(line, sizeof(line), _sink))
+            lines.emplace_back(line);
+        return lines;
+    }
+    /* Test level filter, argument formatting and truncation */
+    void TestFormat() {
+        Logger logger;
+        logger.setSink(_sink);
+        logger.setLevel(LogLevel::Debug);
+        logger.log(LogLevel::Trace, "filtered {}", 1);
+        std::string name = "Writer0";
+        logger.log(LogLevel::Debug, "{} put #{} {} {} {}{}", name, 42,
+                   true, 0.5, 'x', std::string_view("!"));
+        logger.log(LogLevel::Error, "no args");
+        logger.log(LogLevel::Info, "long {} {}", std::string(300, 'a'), 7);
+        auto lines = _lines(logger);
+        ASSERT_EQ(lines.size(), 3u);
+        ASSERT_NE(lines[0].find("DEBUG Writer0 put #42 true 0.5 x!\n"),
+                  std::string::npos);
+        ASSERT_NE(lines[1].find("ERROR no args\n"), std::string::npos);
+        /* string is cut to what fits, next argument is lost */
+        ASSERT_NE(lines[2].find("INFO  long aaa"), std::string::npos);
+        ASSERT_NE(lines[2].find("a ...\n"), std::string::npos);
+        ASSERT_LT(lines[2].size(), LOG_RECORD_SIZE + 32);
+    }
+    /* Test records of all threads are written in order of each thread */
+    void TestThreads() {
+        Logger logger;
+        logger.setSink(_sink);
+        logger.setLevel(LogLevel::Trace);
+        std::vector<std::thread> threads;
+        for (int t = 0; t != THREADS; t++) {
+            threads.emplace_back([&logger, t] {
+                    for (int i = 0; i != RECORDS; i++)
+                        logger.log(LogLevel::Trace, "{} {}", t, i);
+                });
+        }
+        for (auto& thread : threads)
+            thread.join();
+        auto lines = _lines(logger);
+        ASSERT_EQ(logger.dropped(), 0u);
+        ASSERT_EQ(lines.size(), static_cast<size_t>(THREADS * RECORDS));
+        std::vector<int> next(THREADS, 0);
+        for (const auto& line : lines) {
+            int t, i;
+            ASSERT_EQ(std::sscanf(line.c_str() + line.find("TRACE") + 5,
+                                  "%d %d", &t, &i), 2);
+            ASSERT_EQ(i, next[static_cast<size_t>(t)]++);
+        }
+    }
+
+    FILE* _sink;
+};
+
+class QueueTestMetrics : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 8;
+
+public:
+    QueueTestMetrics()
+        : _q(QUEUE_SIZE, 2, 6)
+    {}
+
+protected:
+    void SetUp() override {
+        _q.setEvents(std::make_shared<QueueNopEvents>());
+        _q.run();
+    }
+    /* Test per priority counts, watermark events and
+       one latency sample per message */
+    void TestCounters() {
+        int val;
+        for (int i = 0; i != 4; i++)
+            ASSERT_EQ(_q.put(i, 1), RetCode::OK);
+        for (int i = 0; i != 2; i++)
+            ASSERT_EQ(_q.put(i, 3), RetCode::OK);
+        /* size is at hwm */
+        ASSERT_EQ(_q.put(0, 100), RetCode::OK);
+        for (int i = 0; i != 7; i++)
+            ASSERT_EQ(_q.get(&val), RetCode::OK);
+        auto snap = _q.metrics().snapshot();
+        ASSERT_EQ(snap.enqueued[1], 4u);
+        ASSERT_EQ(snap.enqueued[3], 2u);
+        ASSERT_EQ(snap.enqueued[QueueMetrics::PRIORITY_SLOTS], 1u);
+        ASSERT_EQ(snap.dequeued, snap.enqueued);
+        ASSERT_EQ(snap.hwm_events, 1u);
+        ASSERT_EQ(snap.lwm_events, 1u);
+        ASSERT_EQ(snap.put_waits + snap.get_waits, 0u);
+        ASSERT_EQ(snap.latency.count(), 7u);
+        ASSERT_GT(snap.latency.max(), 0.0);
+
+        /* compiled out */
+        MessageQueue<int, PriorityMap, NoMetrics> plain(QUEUE_SIZE, 2, 6);
+        plain.run();
+        ASSERT_EQ(plain.put(1, 1), RetCode::OK);
+        ASSERT_EQ(plain.get(&val), RetCode::OK);
+        ASSERT_EQ(val, 1);
+    }
+    /* Test time blocked in get is counted */
+    void TestWaits() {
+        using namespace std::chrono;
+        auto reader = std::async(std::launch::async, [this] {
+                int val;
+                return _q.get(&val);
+            });
+        std::this_thread::sleep_for(milliseconds(20));
+        ASSERT_EQ(_q.put(0, 0), RetCode::OK);
+        ASSERT_EQ(reader.get(), RetCode::OK);
+        auto snap = _q.metrics().snapshot();
+        ASSERT_EQ(snap.get_waits, 1u);
+        ASSERT_GE(snap.get_blocked_ns, 15e6);
+        ASSERT_EQ(snap.put_waits, 0u);
+        /* waited from before put */
+        ASSERT_LE(snap.latency.max(), snap.get_blocked_ns * 1.2);
+    }
+    /* Test histogram buckets are contiguous and ordered */
+    void TestBuckets() {
+        for (int b = 0; b != LatencyHistogram::BUCKETS - 1; b++) {
+            auto last = LatencyHistogram::bucketMax(b);
+            ASSERT_EQ(LatencyHistogram::bucket(last), b);
+            ASSERT_EQ(LatencyHistogram::bucket(last + 1), b + 1);
+            /* bucket is at most 1/8 of its values wide */
+            if (b + 1 != LatencyHistogram::BUCKETS - 1) {
+                ASSERT_LE((LatencyHistogram::bucketMax(b + 1) - last) * 8,
+                          last + 8);
+            }
+        }
+    }
+
+    MessageQueue<int, PriorityMap, QueueMetrics> _q;
+};
+
+class QueueTestJournal : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 8;
+
+public:
+    using Queue = MessageQueue<std::string, Journaled<PriorityMap>>;
+
+protected:
+    void SetUp() override {
+        char dir[] = "/tmp/mq_journal_XXXXXX";
+        ASSERT_NE(mkdtemp(dir), nullptr);
+        _config.dir = dir;
+        _config.segment_size = 64 << 10;
+    }
+    void TearDown() override {
+        std::filesystem::remove_all(_config.dir);
+    }
+    std::unique_ptr<Queue> open() {
+        auto q = std::make_unique<Queue>(QUEUE_SIZE, 2, 6,
+                                         std::make_shared<Journal>(_config));
+        q->run();
+        return q;
+    }
+    /* Test unconsumed messages survive reopen in queue order
+       and torn tail record is dropped */
+    void TestRecovery() {
+        std::string val;
+        auto q = open();
+        for (int i = 0; i != 4; i++) {
+            ASSERT_EQ(q->put("low" + std::to_string(i), 1), RetCode::OK);
+            ASSERT_EQ(q->put("high" + std::to_string(i), 2), RetCode::OK);
+        }
+        for (int i = 0; i != 3; i++)
+            ASSERT_EQ(q->get(&val), RetCode::OK);
+        ASSERT_EQ(val, "high2");
+
+        q.reset();
+        q = open();
+        ASSERT_EQ(q->size(), 5);
+        ASSERT_EQ(q->topPriority(), 2);
+        std::vector<std::string> expected = {"high3", "low0", "low1",
+                                             "low2", "low3"};
+        for (const auto& message : expected) {
+            ASSERT_EQ(q->get(&val), RetCode::OK);
+            ASSERT_EQ(val, message);
+        }
+        ASSERT_EQ(q->put("kept", 1), RetCode::OK);
+        ASSERT_EQ(q->put("torn", 1), RetCode::OK);
+        q.reset();
+
+        /* half written record */
+        std::fstream segment(_config.dir + "/0000000000000001.seg",
+                             std::ios::in | std::ios::out |
+                             std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(segment)),
+                         std::istreambuf_iterator<char>());
+        auto pos = data.rfind("torn");
+        ASSERT_NE(pos, std::string::npos);
+        segment.seekp(static_cast<std::streamoff>(pos));
+        segment.write("XX", 2);
+        segment.close();
+
+        q = open();
+        ASSERT_EQ(q->size(), 1);
+        ASSERT_EQ(q->put("after", 1), RetCode::OK);
+        q.reset();
+        q = open();
+        ASSERT_EQ(q->size(), 2);
+        ASSERT_EQ(q->get(&val), RetCode::OK);
+        ASSERT_EQ(val, "kept");
+        ASSERT_EQ(q->get(&val), RetCode::OK);
+        ASSERT_EQ(val, "after");
+    }
+    /* Test consumed segments go away and a starved low priority
+       message doesn't keep its segment */
+    void TestCompaction() {
+        std::string val;
+        _config.segment_size = 4096;
+        auto journal = std::make_shared<Journal>(_config);
+        auto q = std::make_unique<Queue>(QUEUE_SIZE, 2, 6, journal);
+        q->run();
+        ASSERT_EQ(q->put("starved", 0), RetCode::OK);
+        std::string payload(200, 'x');
+        for (int i = 0; i != 100; i++) {
+            ASSERT_EQ(q->put(payload, 1), RetCode::OK);
+            ASSERT_EQ(q->get(&val), RetCode::OK);
+            ASSERT_EQ(val, payload);
+        }
+        ASSERT_GT(journal->segments(), 1u);
+        journal->compact();
+        ASSERT_EQ(journal->segments(), 1u);
+
+        q.reset();
+        journal.reset();
+        q = open();
+        ASSERT_EQ(q->size(), 1);
+        ASSERT_EQ(q->get(&val), RetCode::OK);
+        ASSERT_EQ(val, "starved");
+    }
+    /* Test appends and rotations racing compaction and
+       background sync lose nothing */
+    void TestCompactionRace() {
+        constexpr int MESSAGES = 20000;
+        _config.segment_size = 4096;
+        _config.sync_interval = std::chrono::milliseconds(1);
+        auto journal = std::make_shared<Journal>(_config);
+        auto q = std::make_unique<Queue>(QUEUE_SIZE, 2, 6, journal);
+        q->run();
+        ASSERT_EQ(q->put("starved", 0), RetCode::OK);
+        std::atomic<bool> done{false};
+        std::thread compactor([&journal, &done] {
+                while (!done) {
+                    journal->compact();
+                    journal->sync();
+                }
+            });
+        std::string payload(200, 'x');
+        std::string val;
+        for (int i = 0; i != MESSAGES; i++) {
+            ASSERT_EQ(q->put(payload, 1), RetCode::OK);
+            ASSERT_EQ(q->get(&val), RetCode::OK);
+        }
+        ASSERT_EQ(q->put("last", 1), RetCode::OK);
+        done = true;
+        compactor.join();
+
+        q.reset();
+        journal.reset();
+        q = open();
+        ASSERT_EQ(q->size(), 2);
+        ASSERT_EQ(q->get(&val), RetCode::OK);
+        ASSERT_EQ(val, "last");
+        ASSERT_EQ(q->get(&val), RetCode::OK);
+        ASSERT_EQ(val, "starved");
+    }
+
+    JournalConfig _config;
+};
+
+class QueueTestShm : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 16;
+    static constexpr int LEVELS = 4;
+
+public:
+    struct Message {
+        int seq;
+        int priority;
+    };
+    using Queue = ShmMessageQueue<Message, LEVELS>;
+
+    /* holds writers in on_hwm() until matching on_lwm(),
+       which may come first - it's called on another thread */
+    struct HoldingEvents : IMessageQueueEvents {
+        void on_start() final {}
+        void on_stop() final {}
+        void on_hwm() final {
+            std::unique_lock<std::mutex> lock(mtx);
+            ++hwm_num;
+            if (timed_out)
+                return;
+            if (!notify.wait_for(lock, std::chrono::seconds(1),
+                                 [this] { return lwm_num >= hwm_num; }))
+                timed_out = true;
+        }
+        void on_lwm() final {
+            std::unique_lock<std::mutex> lock(mtx);
+            ++lwm_num;
+            notify.notify_all();
+        }
+
+        bool timed_out = false;
+        int hwm_num = 0;
+        int lwm_num = 0;
+        std::mutex mtx;
+        std::condition_variable notify;
+    };
+
+protected:
+    void SetUp() override {
+        _name = "/mq_test_" + std::to_string(getpid());
+        _q = std::make_unique<Queue>(_name, QUEUE_SIZE, 2, QUEUE_SIZE - 2);
+        _q->run();
+    }
+    /* Test messages put by another process come out in priority
+       order and FIFO inside priority, writer blocks on full queue */
+    void TestCrossProcess() {
+        constexpr int MESSAGES = 10000;
+        pid_t child = fork();
+        ASSERT_GE(child, 0);
+        if (!child) {
+            Queue q(_name);
+            for (int i = 0; i != MESSAGES; i++) {
+                if (q.put(Message{i, i % LEVELS}, i % LEVELS) != RetCode::OK)
+                    _exit(1);
+            }
+            _exit(0);
+        }
+        int last_seq[LEVELS] = {-1, -1, -1, -1};
+        for (int i = 0; i != MESSAGES; i++) {
+            Message val;
+            ASSERT_EQ(_q->get(&val), RetCode::OK);
+            ASSERT_GT(val.seq, last_seq[val.priority]);
+            last_seq[val.priority] = val.seq;
+        }
+        int status;
+        ASSERT_EQ(waitpid(child, &status, 0), child);
+        ASSERT_TRUE(WIFEXITED(status));
+        ASSERT_EQ(WEXITSTATUS(status), 0);
+        ASSERT_EQ(_q->size(), 0);
+
+        for (int priority = 0; priority != LEVELS; priority++)
+            ASSERT_EQ(_q->put(Message{priority, priority}, priority),
+                      RetCode::OK);
+        for (int priority = LEVELS - 1; priority >= 0; priority--) {
+            Message val;
+            ASSERT_EQ(_q->try_get(&val), RetCode::OK);
+            ASSERT_EQ(val.priority, priority);
+        }
+        Message val;
+        ASSERT_EQ(_q->try_get(&val), RetCode::WOULD_BLOCK);
+        _q->stop();
+        ASSERT_EQ(_q->get(&val), RetCode::STOPPED);
+    }
+    /* Test reader blocked on empty queue learns that the
+       writer process died without detaching */
+    /* Test writers held by on_hwm() are released by on_lwm()
+       when a reader in another process, without events of its
+       own, takes the queue down to LWM */
+    void TestCrossProcessWatermarks() {
+        constexpr int MESSAGES = 1000;
+        auto events = std::make_shared<HoldingEvents>();
+        _q->setEvents(events);
+        pid_t child = fork();
+        ASSERT_GE(child, 0);
+        if (!child) {
+            Queue q(_name);
+            Message val;
+            for (int i = 0; i != MESSAGES; i++) {
+                if (q.get(&val) != RetCode::OK)
+                    _exit(1);
+            }
+            _exit(0);
+        }
+        for (int i = 0; i != MESSAGES; i++)
+            ASSERT_EQ(_q->put(Message{i, 0}, 0), RetCode::OK);
+        int status;
+        ASSERT_EQ(waitpid(child, &status, 0), child);
+        ASSERT_TRUE(WIFEXITED(status));
+        ASSERT_EQ(WEXITSTATUS(status), 0);
+        std::unique_lock<std::mutex> lock(events->mtx);
+        ASSERT_FALSE(events->timed_out);
+        ASSERT_GT(events->lwm_num, 0);
+    }
+    void TestPeerDeath() {
+        pid_t child = fork();
+        ASSERT_GE(child, 0);
+        if (!child) {
+            /* never detached */
+            new Queue(_name);
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            _exit(0);
+        }
+        Message val;
+        ASSERT_EQ(_q->get(&val), RetCode::PEER_DEAD);
+        ASSERT_EQ(_q->deadPeers(), 1);
+        waitpid(child, nullptr, 0);
+
+        /* queue itself is intact */
+        ASSERT_EQ(_q->put(Message{1, 0}, 0), RetCode::OK);
+        ASSERT_EQ(_q->get(&val), RetCode::OK);
+        ASSERT_EQ(val.seq, 1);
+        _q->stop();
+    }
+
+    std::string _name;
+    std::unique_ptr<Queue> _q;
+};
+
+class QueueTestCoroutine : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 8;
+    static constexpr int CONSUMERS = 100;
+    static constexpr int PRODUCERS = 10;
+    static constexpr int MESSAGES = 1000;
+
+public:
+    QueueTestCoroutine() : _q(QUEUE_SIZE, 2, QUEUE_SIZE - 2)
+    {}
+
+protected:
+    void SetUp() override {
+        _q.run();
+    }
+    Task consume(CoroutinePool& pool) {
+        co_await pool.schedule();
+        int val;
+        RetCode ret;
+        while ((ret = co_await _q.async_get(&val, pool)) == RetCode::OK)
+            ++_got;
+        if (ret == RetCode::STOPPED)
+            ++_stopped;
+    }
+    Task produce(CoroutinePool& pool) {
+        co_await pool.schedule();
+        for (int i = 0; i != MESSAGES; i++) {
+            if (co_await _q.async_put(i, i % 4, pool) != RetCode::OK)
+                co_return;
+        }
+        ++_produced;
+    }
+    Task putOne(CoroutinePool& pool, int val, int priority,
+                std::atomic<int>* ret) {
+        *ret = static_cast<int>(co_await _q.async_put(val, priority, pool));
+    }
+    /* Test many consumer and producer coroutines on two threads
+       pass every message, stop() resumes parked consumers */
+    void TestCoroutines() {
+        {
+            CoroutinePool pool(2);
+            for (int i = 0; i != CONSUMERS; i++)
+                consume(pool);
+            for (int i = 0; i != PRODUCERS; i++)
+                produce(pool);
+            while (_got != PRODUCERS * MESSAGES)
+                std::this_thread::yield();
+            _q.stop();
+            while (_stopped != CONSUMERS)
+                std::this_thread::yield();
+        }
+        ASSERT_EQ(_produced, PRODUCERS);
+        ASSERT_EQ(_q.size(), 0);
+    }
+    /* Test async_put parked on full queue is completed by get
+       and cancelled by stop() */
+    void TestParkedPut() {
+        CoroutinePool pool(1);
+        for (int i = 0; i != QUEUE_SIZE; i++)
+            ASSERT_EQ(_q.put(i, 0), RetCode::OK);
+        std::atomic<int> ret{1};
+        putOne(pool, 42, 3, &ret);
+        int val;
+        ASSERT_EQ(_q.get(&val), RetCode::OK);
+        while (ret == 1)
+            std::this_thread::yield();
+        ASSERT_EQ(ret, static_cast<int>(RetCode::OK));
+        ASSERT_EQ(_q.get(&val), RetCode::OK);
+        ASSERT_EQ(val, 42);
+
+        ASSERT_EQ(_q.put(0, 0), RetCode::OK);
+        ret = 1;
+        putOne(pool, 43, 3, &ret);
+        _q.stop();
+        while (ret == 1)
+            std::this_thread::yield();
+        ASSERT_EQ(ret, static_cast<int>(RetCode::STOPPED));
+    }
+
+    MessageQueue<int> _q;
+    std::atomic<int> _got{0};
+    std::atomic<int> _stopped{0};
+    std::atomic<int> _produced{0};
+};
+
+class QueueTestQueueSet : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 16;
+
+protected:
+    using Queue = MessageQueue<int>;
+
+    static std::shared_ptr<Queue> makeQueue() {
+        auto q = std::make_shared<Queue>(QUEUE_SIZE, 0, QUEUE_SIZE);
+        q->run();
+        return q;
+    }
+    static bool readable(int fd) {
+        pollfd pfd{fd, POLLIN, 0};
+        return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+    }
+    /* Test set serves non-empty queues round robin by weight,
+       get() parked on empty set is woken by put to any queue
+       and returns STOPPED once every queue is stopped */
+    void TestQueueSet() {
+        auto a = makeQueue();
+        auto b = makeQueue();
+        auto c = makeQueue();
+        QueueSet<Queue> set;
+        ASSERT_EQ(set.add(a, 2), 0);
+        ASSERT_EQ(set.add(b), 1);
+        ASSERT_EQ(set.add(c), 2);
+        for (int i = 0; i != 4; i++) {
+            ASSERT_EQ(a->put(i, 0), RetCode::OK);
+            ASSERT_EQ(b->put(100 + i, 0), RetCode::OK);
+        }
+        std::vector<int> order;
+        int val;
+        int index;
+        while (set.try_get(&val, &index) == RetCode::OK) {
+            ASSERT_EQ(index, val / 100);
+            order.push_back(val);
+        }
+        std::vector<int> expected{0, 1, 100, 2, 3, 101, 102, 103};
+        ASSERT_EQ(order, expected);
+
+        auto got = std::async(std::launch::async, [&] {
+                int v = -1;
+                int i = -1;
+                EXPECT_EQ(set.get(&v, &i), RetCode::OK);
+                EXPECT_EQ(i, 2);
+                return v;
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ASSERT_EQ(c->put(42, 0), RetCode::OK);
+        ASSERT_EQ(got.get(), 42);
+
+        a->stop();
+        b->stop();
+        ASSERT_EQ(set.try_get(&val), RetCode::WOULD_BLOCK);
+        auto stopped = std::async(std::launch::async, [&] {
+                return set.get(&val);
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        c->stop();
+        ASSERT_EQ(stopped.get(), RetCode::STOPPED);
+    }
+    /* Test eventfd is readable while queue has messages put
+       before or after it, stays readable if a put races with
+       the drain and signals stop() */
+    void TestEventFd() {
+        auto q = makeQueue();
+        ASSERT_EQ(q->put(1, 0), RetCode::OK);
+        QueueEventFd<Queue> efd(q);
+        ASSERT_TRUE(readable(efd.fd()));
+        efd.clear();
+        ASSERT_FALSE(readable(efd.fd()));
+        int val;
+        ASSERT_EQ(q->try_get(&val), RetCode::OK);
+
+        /* non-empty -> non-empty doesn't signal */
+        ASSERT_EQ(q->put(2, 0), RetCode::OK);
+        ASSERT_TRUE(readable(efd.fd()));
+        efd.clear();
+        ASSERT_EQ(q->put(3, 0), RetCode::OK);
+        ASSERT_FALSE(readable(efd.fd()));
+        ASSERT_EQ(q->try_get(&val), RetCode::OK);
+        ASSERT_EQ(q->try_get(&val), RetCode::OK);
+        ASSERT_EQ(q->try_get(&val), RetCode::WOULD_BLOCK);
+
+        auto waiter = std::async(std::launch::async, [&] {
+                pollfd pfd{efd.fd(), POLLIN, 0};
+                return poll(&pfd, 1, 5000);
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ASSERT_EQ(q->put(4, 0), RetCode::OK);
+        ASSERT_EQ(waiter.get(), 1);
+        efd.clear();
+        q->stop();
+        ASSERT_TRUE(readable(efd.fd()));
+    }
+};
+
+class QueueTestByteBudget : public ::testing::Test {
+    static constexpr int BUDGET = 1000;
+    static constexpr size_t PAYLOAD = 200;
+
+    class CountingEvents : public IMessageQueueEvents {
+    public:
+        void on_start() override {}
+        void on_hwm() override {
+            ++hwm;
+        }
+        void on_lwm() override {
+            ++lwm;
+        }
+        void on_stop() override {}
+
+        std::atomic<int> hwm{0};
+        std::atomic<int> lwm{0};
+    };
+
+protected:
+    /* Test capacity and watermarks count bytes of messages,
+       oversized message goes only into empty queue */
+    void TestByteBudget() {
+        MessageQueue<std::string, ByteBudget<ElasticLevels<4, 4>>>
+            q(BUDGET, 300, 700);
+        auto events = std::make_shared<CountingEvents>();
+        q.setEvents(events);
+        q.run();
+        const int units =
+            static_cast<int>(messageBytes(std::string(PAYLOAD, 'x')));
+        for (int i = 0; i != BUDGET / units; i++)
+            ASSERT_EQ(q.try_put(std::string(PAYLOAD, 'a' + i), i % 4),
+                      RetCode::OK);
+        ASSERT_EQ(q.used(), BUDGET / units * units);
+        ASSERT_EQ(q.try_put(std::string(PAYLOAD, 'z'), 0), RetCode::NO_SPACE);
+        /* small one still fits */
+        ASSERT_EQ(q.emplace(0, size_t{8}, 's'), RetCode::OK);
+        ASSERT_GE(events->hwm, 1);
+
+        std::string message;
+        while (q.size()) {
+            ASSERT_EQ(q.get(&message), RetCode::OK);
+        }
+        ASSERT_EQ(q.used(), 0);
+        ASSERT_EQ(events->lwm, 1);
+
+        ASSERT_EQ(q.try_put(std::string(BUDGET * 5, 'b'), 1), RetCode::OK);
+        ASSERT_GT(q.used(), BUDGET);
+        ASSERT_EQ(q.try_put(std::string(8, 'c'), 3), RetCode::NO_SPACE);
+        ASSERT_EQ(q.get(&message), RetCode::OK);
+        ASSERT_EQ(message.size(), BUDGET * 5);
+        ASSERT_EQ(q.used(), 0);
+    }
+    /* Test elastic storage keeps FIFO per level across chunks
+       and frees spare chunks after a quiet period */
+    void TestElasticTrim() {
+        ElasticLevels<2, 4>::Storage<int> storage(
+            0, std::chrono::milliseconds(50));
+        for (int i = 0; i != 40; i++)
+            storage.push(i % 2, i);
+        ASSERT_EQ(storage.chunks(), 10);
+        int val;
+        for (int i = 0; i != 40; i++) {
+            int priority = storage.pop(&val);
+            /* odd ones first, each level in order */
+            ASSERT_EQ(val, i < 20 ? 2 * i + 1 : 2 * (i - 20));
+            ASSERT_EQ(priority, val % 2);
+        }
+        ASSERT_EQ(storage.chunks(), 10);
+
+        /* first turnover after quiet period closes busy one */
+        std::this_thread::sleep_for(std::chrono::milliseconds(60));
+        for (int i = 0; i != 5; i++)
+            storage.push(0, i);
+        std::this_thread::sleep_for(std::chrono::milliseconds(60));
+        for (int i = 0; i != 5; i++) {
+            storage.pop(&val);
+            ASSERT_EQ(val, i);
+        }
+        /* chunk of each level and one spare - peak of last period */
+        ASSERT_EQ(storage.chunks(), 3);
+    }
+    /* Test idle queue returns chunks of a burst with no put/get
+       after it - by reader parked in get(), or by trim() */
+    void TestElasticIdleTrim() {
+        constexpr auto QUIET = std::chrono::milliseconds(20);
+        MessageQueue<int, ElasticLevels<2, 4>> q(100, 0, 100, QUIET);
+        q.run();
+        auto burst = [&q] {
+            for (int i = 0; i != 40; i++) {
+                ASSERT_EQ(q.put(i, i % 2), RetCode::OK);
+            }
+        };
+        /* 10 chunks, 2 stay - one per level */
+        burst();
+        std::thread reader([&q] {
+                int val;
+                while (q.get(&val) == RetCode::OK) {}
+            });
+        while (q.size() != 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        auto frees = g_frees.load();
+        /* first period still saw the burst peak */
+        std::this_thread::sleep_for(QUIET * 5);
+        ASSERT_GE(g_frees.load() - frees, 8);
+        q.stop();
+        reader.join();
+
+        q.run();
+        burst();
+        for (int i = 0; i != 40; i++) {
+            ASSERT_TRUE(q.try_get().has_value());
+        }
+        frees = g_frees.load();
+        for (int i = 0; i != 2; i++) {
+            std::this_thread::sleep_for(QUIET * 2);
+            q.trim();
+        }
+        ASSERT_GE(g_frees.load() - frees, 8);
+        q.stop();
+    }
+};
+
+class QueueTestExpiry : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 4;
+
+protected:
+    static std::chrono::steady_clock::time_point in(int ms) {
+        return std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(ms);
+    }
+    /* Test expired messages are skipped and counted by get(),
+       a reader waiting behind them gets the next live one */
+    void TestSkip() {
+        MessageQueue<int, Expiring<PriorityLevels<4>>, QueueMetrics>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        q.run();
+        ASSERT_EQ(q.put(1, 0, in(20)), RetCode::OK);
+        ASSERT_EQ(q.put(2, 0), RetCode::OK);
+        ASSERT_EQ(q.put(3, 0, in(-1)), RetCode::OK);
+        ASSERT_EQ(q.put(4, 1, in(5000)), RetCode::OK);
+        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+        int val;
+        ASSERT_EQ(q.get(&val), RetCode::OK);
+        ASSERT_EQ(val, 4);
+        ASSERT_EQ(q.get(&val), RetCode::OK);
+        ASSERT_EQ(val, 2);
+        ASSERT_EQ(q.try_get(&val), RetCode::WOULD_BLOCK);
+        ASSERT_EQ(q.size(), 0);
+        ASSERT_EQ(q.metrics().snapshot().expired, 2);
+
+        ASSERT_EQ(q.put(5, 2, in(-1)), RetCode::OK);
+        auto got = std::async(std::launch::async, [&q] {
+                int v = -1;
+                EXPECT_EQ(q.get(&v), RetCode::OK);
+                return v;
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ASSERT_EQ(q.put(6, 0), RetCode::OK);
+        ASSERT_EQ(got.get(), 6);
+    }
+    /* Test put() into full queue purges expired messages - they
+       stop counting toward capacity, bytes included */
+    void TestPurge() {
+        MessageQueue<int, Expiring<PriorityLevels<4>>, QueueMetrics>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        q.run();
+        for (int i = 0; i != QUEUE_SIZE; i++)
+            ASSERT_EQ(q.put(i, i % 2, in(10)), RetCode::OK);
+        ASSERT_EQ(q.try_put(100, 0), RetCode::NO_SPACE);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ASSERT_EQ(q.try_put(100, 0), RetCode::OK);
+        ASSERT_EQ(q.size(), 1);
+        ASSERT_EQ(q.metrics().snapshot().expired, QUEUE_SIZE);
+        int val;
+        ASSERT_EQ(q.get(&val), RetCode::OK);
+        ASSERT_EQ(val, 100);
+
+        MessageQueue<std::string, Expiring<ByteBudget<ElasticLevels<2>>>>
+            bytes(1000, 0, 1000);
+        bytes.run();
+        ASSERT_EQ(bytes.put(std::string(600, 'a'), 0, in(10)), RetCode::OK);
+        ASSERT_EQ(bytes.try_put(std::string(600, 'b'), 1), RetCode::NO_SPACE);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ASSERT_EQ(bytes.try_put(std::string(600, 'b'), 1), RetCode::OK);
+        ASSERT_EQ(bytes.used(),
+                  static_cast<int>(messageBytes(std::string(600, 'b'))));
+        std::string message;
+        ASSERT_EQ(bytes.get(&message), RetCode::OK);
+        ASSERT_EQ(message, std::string(600, 'b'));
+        ASSERT_EQ(bytes.used(), 0);
+    }
+    /* Test purge frees expired messages right away,
+       not when get() reaches them */
+    void TestPurgeFrees() {
+        MessageQueue<std::shared_ptr<int>, Expiring<PriorityLevels<4>>>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        q.run();
+        auto payload = std::make_shared<int>(1);
+        std::weak_ptr<int> expired = payload;
+        ASSERT_EQ(q.put(std::move(payload), 1, in(10)), RetCode::OK);
+        for (int i = 1; i != QUEUE_SIZE; i++)
+            ASSERT_EQ(q.put(std::make_shared<int>(0), 0), RetCode::OK);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ASSERT_FALSE(expired.expired());
+        ASSERT_EQ(q.try_put(std::make_shared<int>(2), 3), RetCode::OK);
+        ASSERT_TRUE(expired.expired());
+        std::shared_ptr<int> val;
+        ASSERT_EQ(q.get(&val), RetCode::OK);
+        ASSERT_EQ(*val, 2);
+    }
+    /* Test expiry and purge don't allocate once storage
+       has warmed up, over many turnovers of every level */
+    template<typename Queue>
+    void TestNoAllocs(Queue& q) {
+        constexpr int ROUNDS = 50;
+        q.run();
+        for (int round = 0; round != ROUNDS; round++) {
+            auto allocs = g_allocs.load();
+            for (int i = 0; i != QUEUE_SIZE; i++)
+                ASSERT_EQ(q.put(i, i % 2, in(-1)), RetCode::OK);
+            /* purges all of them */
+            ASSERT_EQ(q.try_put(100, 3), RetCode::OK);
+            for (int i = 1; i != QUEUE_SIZE; i++)
+                ASSERT_EQ(q.put(i, i % 2, in(5000)), RetCode::OK);
+            int val;
+            ASSERT_EQ(q.get(&val), RetCode::OK);
+            ASSERT_EQ(val, 100);
+            for (int i = 1; i != QUEUE_SIZE; i++)
+                ASSERT_EQ(q.get(&val), RetCode::OK);
+            if (round != 0) {
+                ASSERT_EQ(g_allocs.load() - allocs, 0);
+            }
+        }
+        ASSERT_EQ(q.metrics().snapshot().expired, ROUNDS * QUEUE_SIZE);
+        q.stop();
+    }
+    void TestNoAllocs() {
+        MessageQueue<int, Expiring<PooledPriorityMap>, QueueMetrics>
+            pooled(QUEUE_SIZE, 0, QUEUE_SIZE);
+        TestNoAllocs(pooled);
+        MessageQueue<int, Expiring<PriorityLevels<4>>, QueueMetrics>
+            levels(QUEUE_SIZE, 0, QUEUE_SIZE);
+        TestNoAllocs(levels);
+    }
+    /* Test messages get() drops as expired aren't counted
+       as dequeued nor in latency */
+    void TestMetrics() {
+        MessageQueue<int, Expiring<PriorityLevels<4>>, QueueMetrics>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        q.run();
+        ASSERT_EQ(q.put(1, 1, in(-1)), RetCode::OK);
+        ASSERT_EQ(q.put(2, 0), RetCode::OK);
+        int val;
+        ASSERT_EQ(q.get(&val), RetCode::OK);
+        ASSERT_EQ(val, 2);
+        auto snap = q.metrics().snapshot();
+        ASSERT_EQ(snap.expired, 1);
+        ASSERT_EQ(snap.dequeued[0], 1);
+        ASSERT_EQ(snap.dequeued[1], 0);
+        ASSERT_EQ(snap.latency.count(), 1);
+    }
+
+    using AsyncQueue =
+        MessageQueue<int, Expiring<PriorityLevels<4>>, QueueMetrics>;
+    static Task getOne(AsyncQueue& q, CoroutinePool& pool, int* val,
+                       std::atomic<int>* ret) {
+        *ret = static_cast<int>(co_await q.async_get(val, pool));
+    }
+    /* Test async_get that finds only expired messages hands
+       their room to a writer blocked on full queue */
+    void TestAsyncGet() {
+        AsyncQueue q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        q.run();
+        for (int i = 0; i != QUEUE_SIZE; i++)
+            ASSERT_EQ(q.put(i, 0, in(100)), RetCode::OK);
+        auto put = std::async(std::launch::async, [&q] {
+                return q.put(42, 1);
+            });
+        std::this_thread::sleep_for(std::chrono::milliseconds(150));
+        CoroutinePool pool(1);
+        int val = -1;
+        std::atomic<int> ret{1};
+        getOne(q, pool, &val, &ret);
+        ASSERT_EQ(put.get(), RetCode::OK);
+        while (ret == 1)
+            std::this_thread::yield();
+        ASSERT_EQ(ret, static_cast<int>(RetCode::OK));
+        ASSERT_EQ(val, 42);
+        ASSERT_EQ(q.metrics().snapshot().expired, QUEUE_SIZE);
+    }
+};
+
+class QueueTestStress : public ::testing::Test {
+protected:
+    using Op = stress::detail::Op;
+    using Interval = stress::detail::Interval;
+
+    static long long violations(const std::vector<int>& priorities,
+                                const std::vector<Op>& gets,
+                                const std::vector<Interval>& empties = {}) {
+        /* message i put in [10 * i, 10 * i + 1] */
+        std::vector<Op> puts;
+        for (size_t i = 0; i != priorities.size(); i++) {
+            auto at = static_cast<long long>(10 * i);
+            puts.push_back(Op{i, at, at + 1});
+        }
+        stress::Report report;
+        stress::detail::check(puts, priorities, 2, gets, empties, &report);
+        return report.violation_count;
+    }
+
+    /* Test history checker finds each kind of violation
+       and only when it's certain */
+    void TestChecker() {
+        /* higher priority first */
+        ASSERT_EQ(violations({0, 1}, {{1, 30, 31}, {0, 40, 41}}), 0);
+        ASSERT_EQ(violations({0, 1}, {{0, 30, 31}, {1, 40, 41}}), 1);
+        /* overlapping get could have gone first */
+        ASSERT_EQ(violations({0, 1}, {{0, 30, 35}, {1, 32, 41}}), 0);
+        /* FIFO inside priority */
+        ASSERT_EQ(violations({0, 0}, {{1, 30, 31}, {0, 40, 41}}), 1);
+        /* lost and duplicate */
+        ASSERT_EQ(violations({0, 0}, {{0, 30, 31}, {0, 40, 41}}), 2);
+        /* got before put */
+        ASSERT_EQ(violations({0}, {{0, -5, -1}}), 1);
+        /* try_get saw empty queue with message 0 in it */
+        ASSERT_EQ(violations({0}, {{0, 40, 41}}, {{20, 21}}), 1);
+        ASSERT_EQ(violations({0}, {{0, 20, 41}}, {{20, 21}}), 0);
+    }
+
+    /* Test storages against sequential model */
+    void TestModel() {
+        stress::Config config;
+        config.ops = 20000;
+        config.queue_size = 16;
+        for (unsigned seed = 1; seed != 4; seed++) {
+            config.seed = seed;
+            MessageQueue<uint64_t> map(config.queue_size, 0, config.queue_size);
+            ASSERT_EQ(stress::model(map, config).violations,
+                      std::vector<std::string>{});
+            MessageQueue<uint64_t, PriorityLevels<4>>
+                levels(config.queue_size, 0, config.queue_size);
+            ASSERT_EQ(stress::model(levels, config).violations,
+                      std::vector<std::string>{});
+        }
+    }
+
+    /* Test concurrent histories of small queue are linearizable */
+    void TestLinearizable() {
+        stress::Config config;
+        config.ops = 5000;
+        config.queue_size = 8;
+        MessageQueue<uint64_t> map(config.queue_size, 0, config.queue_size);
+        auto report = stress::run(map, config);
+        ASSERT_EQ(report.violations, std::vector<std::string>{});
+        ASSERT_EQ(report.ops, 2 * config.writers * config.ops);
+        MessageQueue<uint64_t, PriorityLevels<4>>
+            levels(config.queue_size, 0, config.queue_size);
+        ASSERT_EQ(stress::run(levels, config).violations,
+                  std::vector<std::string>{});
+    }
+};
+
+class QueueTestPolicies : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 4;
+
+protected:
+    struct CountingEvents : NoopEvents {
+        void on_hwm() {
+            ++hwm;
+        }
+        void on_lwm() {
+            ++lwm;
+        }
+        int hwm = 0;
+        int lwm = 0;
+    };
+
+    /* Test single thread queue never waits and
+       behaves like the locked one */
+    void TestNoLock() {
+        MessageQueue<int, PriorityLevels<4>, NoMetrics, NoLock, NoEvents>
+            q(QUEUE_SIZE, 0, QUEUE_SIZE);
+        q.run();
+        int val;
+        ASSERT_EQ(q.get(&val), RetCode::TIMEOUT);
+        for (int i = 0; i != QUEUE_SIZE; i++)
+            ASSERT_EQ(q.put(i, i), RetCode::OK);
+        ASSERT_EQ(q.topPriority(), QUEUE_SIZE - 1);
+        ASSERT_EQ(q.put(100, 0), RetCode::TIMEOUT);
+        ASSERT_EQ(q.try_put(100, 0), RetCode::NO_SPACE);
+        ASSERT_EQ(q.get(&val), RetCode::OK);
+        ASSERT_EQ(val, QUEUE_SIZE - 1);
+        /* bulk calls can't wait either */
+        std::vector<int> bulk(3, 100);
+        int num = -1;
+        ASSERT_EQ(q.put_bulk(bulk.begin(), bulk.end(), 0, &num),
+                  RetCode::TIMEOUT);
+        ASSERT_EQ(num, 1);
+        std::vector<int> out(2 * QUEUE_SIZE);
+        ASSERT_EQ(q.get_bulk(out.begin(), 2 * QUEUE_SIZE, &num),
+                  RetCode::OK);
+        ASSERT_EQ(num, QUEUE_SIZE);
+        ASSERT_EQ(q.get_bulk(out.begin(), 2 * QUEUE_SIZE, &num),
+                  RetCode::TIMEOUT);
+        ASSERT_EQ(num, 0);
+        ASSERT_EQ(q.topPriority(), decltype(q)::NO_PRIORITY);
+        q.stop();
+        ASSERT_EQ(q.get(&val), RetCode::STOPPED);
+        ASSERT_EQ(q.get_bulk(out.begin(), 2 * QUEUE_SIZE, &num),
+                  RetCode::STOPPED);
+
+        stress::Config config;
+        config.ops = 20000;
+        config.queue_size = 16;
+        MessageQueue<uint64_t, PriorityMap, NoMetrics, NoLock, NoEvents>
+            single(config.queue_size, 0, config.queue_size);
+        ASSERT_EQ(stress::model(single, config).violations,
+                  std::vector<std::string>{});
+    }
+
+    /* Test StaticEvents calls handler directly
+       until it's replaced */
+    void TestStaticEvents() {
+        MessageQueue<int, PriorityMap, DefaultMetrics, StdLock,
+                     StaticEvents<CountingEvents>> q(QUEUE_SIZE, 1, 3);
+        CountingEvents events;
+        q.setEvents(&events);
+        q.run();
+        int val;
+        for (int round = 0; round != 2; round++) {
+            for (int i = 0; i != QUEUE_SIZE; i++)
+                ASSERT_EQ(q.put(i, 0), RetCode::OK);
+            for (int i = 0; i != QUEUE_SIZE; i++)
+                ASSERT_EQ(q.get(&val), RetCode::OK);
+        }
+        ASSERT_EQ(events.hwm, 2);
+        ASSERT_EQ(events.lwm, 2);
+        q.setEvents(nullptr);
+        for (int i = 0; i != QUEUE_SIZE; i++)
+            ASSERT_EQ(q.put(i, 0), RetCode::OK);
+        ASSERT_EQ(events.hwm, 2);
+    }
+
+    /* Test spin lock keeps concurrent histories linearizable */
+    void TestSpinLock() {
+        stress::Config config;
+        config.ops = 5000;
+        config.queue_size = 8;
+        MessageQueue<uint64_t, PriorityLevels<4>, DefaultMetrics, SpinLock>
+            q(config.queue_size, 0, config.queue_size);
+        ASSERT_EQ(stress::run(q, config).violations,
+                  std::vector<std::string>{});
+    }
+};
+
+class QueueTestWaterMarks : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 10;
+    
+    class QueueTestEvents : public IMessageQueueEvents
+    {
+    public:
+        QueueTestEvents(MessageQueue<int> * q,
+                        TestReader * tr,
+                        TestWriter * tw) :
+            _q{q},
+            _tr1{tr},
+            _tw1{tw} 
+        {}
+        ~QueueTestEvents() final {}
+    
+        void on_start() final
+        {
+            _tw1->run();
+            ++start_flag;
+        }
+        void on_stop() noexcept final
+        {
+            ++stop_flag;
+        }
+        
+        void on_hwm() final
+        {
+            TestWriter::stop_flag = true;
+            _tr1->run();
+            ++hwm_flag;
+        }
+        
+        void on_lwm() final
+        {
+            TestReader::stop_flag = true;
+            _q->stop();
+            ++lwm_flag;
+        }
+    private:
+        MessageQueue<int> * _q;
+        TestReader * _tr1;
+        TestWriter * _tw1;
+    };
+
+public:
+    QueueTestWaterMarks() :
+        _q(QUEUE_SIZE, 1, QUEUE_SIZE - 2),
+        _tr1(&_q),
+        _tw1(&_q)
+    {}
+
+    static std::atomic<int> start_flag;
+    static std::atomic<int> stop_flag;
+    static std::atomic<int> hwm_flag;
+    static std::atomic<int> lwm_flag;
+
+protected:
+    void SetUp() override {
+        TestReader::stop_flag = false;
+        TestWriter::stop_flag = false;
+        start_flag = 0;
+        stop_flag = 0;
+        hwm_flag = 0;
+        lwm_flag = 0;
+    }
+    /* Test number of elements pushed
+       is equal to popped in mt environment */
+    void TestWaterMarks()
+    {
+        _q.setEvents(std::make_shared<QueueTestEvents>(
+                          &_q, &_tr1, &_tw1));
+        for (int i = 0; i != 1000; i++)
+        {
+            _q.run();
+            _tw1.join();
+            _tr1.join();
+            TestReader::stop_flag = false;
+            TestWriter::stop_flag = false;
+        }
+        ASSERT_EQ(start_flag, 1000);
+        ASSERT_EQ(stop_flag, 1000);
+        ASSERT_EQ(hwm_flag, 1000);
+        ASSERT_EQ(lwm_flag, 1000);
+    }
+
+    MessageQueue<int> _q;
+    TestReader _tr1;
+    TestWriter _tw1;
+};
+
+std::atomic<int> QueueTestWaterMarks::start_flag{0};
+std::atomic<int> QueueTestWaterMarks::stop_flag{0};
+std::atomic<int> QueueTestWaterMarks::hwm_flag{0};
+std::atomic<int> QueueTestWaterMarks::lwm_flag{0};
+
+class QueueTestBulk : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 10;
+    
+    class QueueCountEvents : public IMessageQueueEvents
+    {
+    public:
+        QueueCountEvents() {}
+        ~QueueCountEvents() final {}
+    
+        void on_start() final {}
+        void on_stop() noexcept final {}
+        void on_hwm() final { ++hwm_num; }
+        void on_lwm() final { ++lwm_num; }
+
+        std::atomic<int> hwm_num{0};
+        std::atomic<int> lwm_num{0};
+    };
+
+public:
+    QueueTestBulk() : _q(QUEUE_SIZE, 2, QUEUE_SIZE - 2)
+    {}
+
+protected:
+    void SetUp() override {
+        _q.run();
+    }
+    /* Test bulk operations keep priority order and
+       fire watermark events once per batch */
+    void TestBulkPriority() {
+        auto events = std::make_shared<QueueCountEvents>();
+        _q.setEvents(events);
+        std::vector<int> low{0, 1, 2, 3};
+        std::vector<int> high{10, 11, 12, 13, 14, 15};
+        int put_num;
+        ASSERT_EQ(_q.put_bulk(low.begin(), low.end(), 0, &put_num),
+                  RetCode::OK);
+        ASSERT_EQ(put_num, 4);
+        ASSERT_EQ(_q.put_bulk(high.begin(), high.end(), 1, &put_num),
+                  RetCode::OK);
+        ASSERT_EQ(put_num, 6);
+        ASSERT_EQ(_q.size(), int{QUEUE_SIZE});
+        
+        /* queue is above hwm - next batch fires on_hwm once */
+        std::vector<int> out;
+        int got_num;
+        ASSERT_EQ(_q.get_bulk(std::back_inserter(out), 1, &got_num),
+                  RetCode::OK);
+        ASSERT_EQ(_q.put_bulk(low.begin(), low.begin() + 1, 0),
+                  RetCode::OK);
+        ASSERT_EQ(events->hwm_num, 1);
+        
+        ASSERT_EQ(_q.get_bulk(std::back_inserter(out), 100, &got_num),
+                  RetCode::OK);
+        ASSERT_EQ(got_num, int{QUEUE_SIZE});
+        /* bulk get jumped over lwm - still one notification */
+        ASSERT_EQ(events->lwm_num, 1);
+        
+        std::vector<int> expected{10, 11, 12, 13, 14, 15,
+                                  0, 1, 2, 3, 0};
+        ASSERT_EQ(out, expected);
+        _q.stop();
+    }
+    /* Test bulk put of range longer than queue
+       waits for reader in the middle */
+    void TestBulkOverflow() {
+        std::vector<int> in(QUEUE_SIZE * 10);
+        for (size_t i = 0; i != in.size(); i++) {
+            in[i] = static_cast<int>(i);
+        }
+        std::vector<int> out;
+        std::thread reader([this, &out, &in] {
+                while (out.size() != in.size()) {
+                    ASSERT_EQ(_q.get_bulk(std::back_inserter(out), 3),
+                              RetCode::OK);
+                }
+            });
+        ASSERT_EQ(_q.put_bulk(in.begin(), in.end(), 0), RetCode::OK);
+        reader.join();
+        ASSERT_EQ(out, in);
+        _q.stop();
+    }
+
+    MessageQueue<int> _q;
+};
+
+class QueueTestMoveOnly : public ::testing::Test {
+    static constexpr int QUEUE_SIZE = 10;
+public:
+    QueueTestMoveOnly() : _q(QUEUE_SIZE, 0, QUEUE_SIZE)
+    {}
+
+protected:
+    void SetUp() override {
+        _q.run();
+    }
+    /* Test move-only messages go through
+       put(&&), emplace() and try_get() */
+    void TestMoveOnly() {
+        ASSERT_FALSE(_q.try_get());
+        
+        auto msg = std::unique_ptr<int>(new int(1));
+        ASSERT_EQ(_q.put(std::move(msg), 0), RetCode::OK);
+        ASSERT_EQ(msg, nullptr);
+        ASSERT_EQ(_q.emplace(1, new int(2)), RetCode::OK);
+        
+        auto first = _q.try_get();
+        ASSERT_TRUE(first);
+        ASSERT_EQ(**first, 2);
+        std::unique_ptr<int> second;
+        ASSERT_EQ(_q.get(&second), RetCode::OK);
+        ASSERT_EQ(*second, 1);
+        ASSERT_FALSE(_q.try_get());
+        
+        _q.stop();
+        ASSERT_EQ(_q.emplace(0, new int(3)), RetCode::STOPPED);
+    }
+
+    MessageQueue<std::unique_ptr<int>> _q;
+};
+
+TEST_F(QueueTestPriority, PriorityTest) {
+    ASSERT_DURATION_LE(5,
+                       TestPriority());
+}
+
+TEST_F(QueueTestEqualPriority, EqualPriorityTest) {
+    ASSERT_DURATION_LE(5,
+                       TestPriority());
+}
+
+TEST_F(QueueTestPriorityLevels, PriorityLevelsTest) {
+    ASSERT_DURATION_LE(5,
+                       TestPriority());
+}
+
+TEST_F(QueueTestPriorityLevels, ClampTest) {
+    ASSERT_DURATION_LE(5,
+                       TestClamp());
+}
+
+TEST_F(QueueTestPriorityLevels, RingBoundTest) {
+    ASSERT_DURATION_LE(5,
+                       TestRingBound());
+}
+
+TEST_F(QueueTestScheduling, WeightedFairTest) {
+    ASSERT_DURATION_LE(5,
+                       TestWeightedFair());
+}
+
+TEST_F(QueueTestScheduling, AgingTest) {
+    ASSERT_DURATION_LE(5,
+                       TestAging());
+}
+
+TEST_F(QueueTestPool, PooledMapNoAllocTest) {
+    ASSERT_DURATION_LE(5,
+                       TestNoAllocs(_q));
+}
+
+TEST_F(QueueTestPool, PriorityLevelsNoAllocTest) {
+    ASSERT_DURATION_LE(5,
+                       TestNoAllocs(_levels_q));
+}
+
+TEST_F(QueueTestMessageBuffer, ZeroCopyTest) {
+    ASSERT_DURATION_LE(5,
+                       TestZeroCopy());
+}
+
+TEST_F(QueueTestMessageBuffer, RecycleTest) {
+    ASSERT_DURATION_LE(5,
+                       TestRecycle());
+}
+
+TEST_F(QueueTestBulk, BulkPriorityTest) {
+    ASSERT_DURATION_LE(5,
+                       TestBulkPriority());
+}
+
+TEST_F(QueueTestBulk, BulkOverflowTest) {
+    ASSERT_DURATION_LE(5,
+                       TestBulkOverflow());
+}
+
+TEST_F(QueueTestMoveOnly, MoveOnlyTest) {
+    ASSERT_DURATION_LE(5,
+                       TestMoveOnly());
+}
+
+TEST_F(QueueTestTimed, TryTest) {
+    ASSERT_DURATION_LE(5,
+                       TestTry());
+}
+
+TEST_F(QueueTestTimed, DeadlineTest) {
+    ASSERT_DURATION_LE(5,
+                       TestDeadlines());
+}
+
+TEST_F(QueueTestTimed, WakeBeforeDeadlineTest) {
+    ASSERT_DURATION_LE(5,
+                       TestWakeBeforeDeadline());
+}
+
+TEST_F(QueueTestThreadSafety, MTSafeTestWithoutEvents) {
+    ASSERT_DURATION_LE(5,
+                       TestThreadSafety(nullptr));
+}
+
+TEST_F(QueueTestThreadSafety, MTSafeTestWithEvents) {
+    ASSERT_DURATION_LE(5, TestThreadSafety(
+                           std::make_shared<QueueNopEvents>()));
+}
+
+TEST_F(QueueTestLockFree, SpscTest) {
+    ASSERT_DURATION_LE(5,
+                       TestSpsc());
+}
+
+TEST_F(QueueTestLockFree, MpmcTest) {
+    ASSERT_DURATION_LE(5,
+                       TestMpmc());
+}
+
+TEST_F(QueueTestLockFree, LevelsBoundTest) {
+    ASSERT_DURATION_LE(5,
+                       TestLevelsBound());
+}
+
+TEST_F(QueueTestLockFree, EventsRetiredTest) {
+    ASSERT_DURATION_LE(5,
+                       TestEventsRetired());
+}
+
+TEST_F(QueueTestWaitStrategy, MutexSpinThenParkTest) {
+    ASSERT_DURATION_LE(5,
+                       TestSpinThenPark(&_q));
+}
+
+TEST_F(QueueTestWaitStrategy, LockFreeSpinThenParkTest) {
+    ASSERT_DURATION_LE(5,
+                       TestSpinThenPark(&_mpmc));
+}
+
+TEST_F(QueueTestSharded, ShardedSingleThreadTest) {
+    ASSERT_DURATION_LE(5,
+                       TestSingleThread());
+}
+
+TEST_F(QueueTestSharded, ShardedPriorityBoundTest) {
+    ASSERT_DURATION_LE(5,
+                       TestPriorityBound());
+}
+
+TEST_F(QueueTestSharded, ShardedThreadSafetyTest) {
+    ASSERT_DURATION_LE(5,
+                       TestThreadSafety());
+}
+
+TEST_F(QueueTestSharded, ShardedStorageArgsTest) {
+    ASSERT_DURATION_LE(5,
+                       TestStorageArgs());
+}
+
+TEST_F(QueueTestSharded, ShardedEventsRetiredTest) {
+    ASSERT_DURATION_LE(5,
+                       TestEventsRetired());
+}
+
+TEST_F(QueueTestAsyncEvents, CoalesceTest) {
+    ASSERT_DURATION_LE(5,
+                       TestCoalesce());
+}
+
+TEST_F(QueueTestAsyncEvents, NonBlockingTest) {
+    ASSERT_DURATION_LE(5,
+                       TestNonBlocking());
+}
+
+TEST_F(QueueTestCredits, GrantTest) {
+    ASSERT_DURATION_LE(5,
+                       TestGrant());
+}
+
+TEST_F(QueueTestCredits, IsolationTest) {
+    ASSERT_DURATION_LE(5,
+                       TestIsolation());
+}
+
+TEST_F(QueueTestReaderPool, ReaderPoolTest) {
+    ASSERT_DURATION_LE(5,
+                       TestPool(3, 8, -1));
+}
+
+TEST_F(QueueTestReaderPool, PinnedReaderPoolTest) {
+    ASSERT_DURATION_LE(5,
+                       TestPool(2, 1, 0));
+}
+
+TEST_F(QueueTestReaderPool, PipelinedReaderPoolTest) {
+    ASSERT_DURATION_LE(5,
+                       TestPool(2, 1, -1, 8));
+}
+
+TEST_F(QueueTestReaderPool, PipelineStopTest) {
+    ASSERT_DURATION_LE(5,
+                       TestPipelineStop());
+}
+
+TEST_F(QueueTestReaderPool, CpuListTest) {
+    ASSERT_DURATION_LE(5,
+                       TestCpuList());
+}
+
+TEST_F(QueueTestLogger, FormatTest) {
+    ASSERT_DURATION_LE(5,
+                       TestFormat());
+}
+
+TEST_F(QueueTestLogger, ThreadsTest) {
+    ASSERT_DURATION_LE(5,
+                       TestThreads());
+}
+
+TEST_F(QueueTestMetrics, CountersTest) {
+    ASSERT_DURATION_LE(5,
+                       TestCounters());
+}
+
+TEST_F(QueueTestMetrics, WaitsTest) {
+    ASSERT_DURATION_LE(5,
+                       TestWaits());
+}
+
+TEST_F(QueueTestMetrics, BucketsTest) {
+    ASSERT_DURATION_LE(5,
+                       TestBuckets());
+}
+
+TEST_F(QueueTestJournal, RecoveryTest) {
+    ASSERT_DURATION_LE(5,
+                       TestRecovery());
+}
+
+TEST_F(QueueTestJournal, CompactionTest) {
+    ASSERT_DURATION_LE(5,
+                       TestCompaction());
+}
+
+TEST_F(QueueTestJournal, CompactionRaceTest) {
+    ASSERT_DURATION_LE(5,
+                       TestCompactionRace());
+}
+
+TEST_F(QueueTestShm, CrossProcessTest) {
+    ASSERT_DURATION_LE(10,
+                       TestCrossProcess());
+}
+
+TEST_F(QueueTestShm, WatermarksTest) {
+    ASSERT_DURATION_LE(5,
+                       TestCrossProcessWatermarks());
+}
+
+TEST_F(QueueTestShm, PeerDeathTest) {
+    ASSERT_DURATION_LE(5,
+                       TestPeerDeath());
+}
+
+TEST_F(QueueTestCoroutine, CoroutinesTest) {
+    ASSERT_DURATION_LE(5,
+                       TestCoroutines());
+}
+
+TEST_F(QueueTestCoroutine, ParkedPutTest) {
+    ASSERT_DURATION_LE(5,
+                       TestParkedPut());
+}
+
+TEST_F(QueueTestQueueSet, QueueSetTest) {
+    ASSERT_DURATION_LE(5,
+                       TestQueueSet());
+}
+
+TEST_F(QueueTestQueueSet, EventFdTest) {
+    ASSERT_DURATION_LE(5,
+                       TestEventFd());
+}
+
+TEST_F(QueueTestByteBudget, ByteBudgetTest) {
+    ASSERT_DURATION_LE(5,
+                       TestByteBudget());
+}
+
+TEST_F(QueueTestByteBudget, ElasticTrimTest) {
+    ASSERT_DURATION_LE(5,
+                       TestElasticTrim());
+}
+
+TEST_F(QueueTestByteBudget, ElasticIdleTrimTest) {
+    ASSERT_DURATION_LE(5,
+                       TestElasticIdleTrim());
+}
+
+TEST_F(QueueTestExpiry, SkipTest) {
+    ASSERT_DURATION_LE(5,
+                       TestSkip());
+}
+
+TEST_F(QueueTestExpiry, PurgeTest) {
+    ASSERT_DURATION_LE(5,
+                       TestPurge());
+}
+
+TEST_F(QueueTestExpiry, PurgeFreesTest) {
+    ASSERT_DURATION_LE(5,
+                       TestPurgeFrees());
+}
+
+TEST_F(QueueTestExpiry, NoAllocTest) {
+    ASSERT_DURATION_LE(5,
+                       TestNoAllocs());
+}
+
+TEST_F(QueueTestExpiry, MetricsTest) {
+    ASSERT_DURATION_LE(5,
+                       TestMetrics());
+}
+
+TEST_F(QueueTestExpiry, AsyncGetTest) {
+    ASSERT_DURATION_LE(5,
+                       TestAsyncGet());
+}
+
+TEST_F(QueueTestStress, CheckerTest) {
+    ASSERT_DURATION_LE(5,
+                       TestChecker());
+}
+
+TEST_F(QueueTestStress, ModelTest) {
+    ASSERT_DURATION_LE(5,
+                       TestModel());
+}
+
+TEST_F(QueueTestStress, LinearizableTest) {
+    ASSERT_DURATION_LE(5,
+                       TestLinearizable());
+}
+
+TEST_F(QueueTestPolicies, NoLockTest) {
+    ASSERT_DURATION_LE(5,
+                       TestNoLock());
+}
+
+TEST_F(QueueTestPolicies, StaticEventsTest) {
+    ASSERT_DURATION_LE(5,
+                       TestStaticEvents());
+}
+
+TEST_F(QueueTestPolicies, SpinLockTest) {
+    ASSERT_DURATION_LE(5,
+                       TestSpinLock());
 }
 
 TEST_F(QueueTestWaterMarks, TestWaterMarkNotifiers) {
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "platform.hpp"
+
+namespace zodiactest {
+
+/* How a thread waits for queue to become readable or writable:
+   spin_count polls with pause instruction, then yield_count polls
+   with yield, then park on condition variable.
+   *
+   At high rates the awaited message or free slot usually shows up
+   within microseconds, spinning for it is cheaper than sleep and
+   wakeup. Spinning is useless with one CPU - other side can't run
+   while we spin, so defaultStrategy() falls back to parking there. */
+struct WaitStrategy {
+    int spin_count;
+    int yield_count;
+
+    /* always park straight away */
+    static constexpr WaitStrategy park() noexcept {
+        return WaitStrategy{0, 0};
+    }
+
+    static WaitStrategy spinThenPark(int spin_count,
+                                     int yield_count) noexcept {
+        return WaitStrategy{spin_count, yield_count};
+    }
+
+    static WaitStrategy defaultStrategy() noexcept {
+        /* ~5-10 us of pause on current x86 */
+        return std::thread::hardware_concurrency() > 1 ?
+            WaitStrategy{200, 10} : park();
+    }
+
+    bool spins() const noexcept {
+        return spin_count > 0 || yield_count > 0;
+    }
+};
+
+/* polls ready() according to strategy,
+   returns false if caller has to park */
+template<typename Pred>
+bool spinWait(const WaitStrategy& strategy, Pred ready) {
+    for (int i = 0; i < strategy.spin_count; i++) {
+        if (ready())
+            return true;
+        cpuRelax();
+    }
+    for (int i = 0; i < strategy.yield_count; i++) {
+        if (ready())
+            return true;
+        std::this_thread::yield();
+    }
+    return ready();
+}
+
+/* Place to park for threads waiting on lock-free state.
+   Waiter counter lets wake() skip the mutex and notify
+   entirely when nobody is parked */
+class Parking {
+public:
+    template<typename Pred>
+    void wait(const WaitStrategy& strategy, Pred ready);
+    void wake();
+    /* enough when every waiter waits for the same condition
+       and one event satisfies one waiter */
+    void wakeOne();
+
+private:
+    std::mutex _mtx;
+    std::condition_variable _notify;
+    std::atomic<int> _waiters{0};
+};
+
+template<typename Pred>
+void Parking::wait(const WaitStrategy& strategy, Pred ready) {
+    if (spinWait(strategy, ready))
+        return;
+    std::unique_lock<std::mutex> lock(_mtx);
+    _waiters.fetch_add(1, std::memory_order_relaxed);
+    /* pairs with fence in wake() - either waker sees
+       our counter or we see its data */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    _notify.wait(lock, ready);
+    _waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+inline void Parking::wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!_waiters.load(std::memory_order_relaxed))
+        return;
+    {
+        /* waiter is either before predicate check
+           or already sleeping */
+        std::lock_guard<std::mutex> lock(_mtx);
+    }
+    _notify.notify_all();
+}
+
+inline void Parking::wakeOne() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!_waiters.load(std::memory_order_relaxed))
+        return;
+    {
+        std::lock_guard<std::mutex> lock(_mtx);
+    }
+    _notify.notify_one();
+}
+
+} // namespace zodiactest
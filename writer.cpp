@@ -2,70 +2,137 @@
 #include "writer.hpp"
 
 #include <cassert>
+#include <charconv>
+#include <iterator>
+#include <string_view>
 
-#include "console.hpp"
+#include "logger.hpp"
 
 namespace zodiactest {
 
-typename Writer::WriterState Writer::_state = WriterState::SUSPENDED;
-std::mutex Writer::_g_mtx;
-std::condition_variable Writer::_g_notify;
 std::atomic<int> Writer::gmsg_num{0};
 
 Writer::Writer(int priority,
                const std::string& name, 
-               std::shared_ptr<Queue> queue_sp)
+               std::shared_ptr<Queue> queue_sp,
+               std::shared_ptr<BufferPool> pool_sp,
+               std::shared_ptr<CreditGate> gate_sp,
+               int batch_size)
     : _priority{priority},
+      _batch_size{batch_size},
       _name(name),
-      _queue_sp(queue_sp)
+      _queue_sp(queue_sp),
+      _pool_sp(pool_sp),
+      _gate_sp(gate_sp)
 {      
     assert(queue_sp != nullptr);
+    assert(pool_sp != nullptr);
+    assert(gate_sp != nullptr);
+    assert(batch_size > 0);
 }
 
 Writer::~Writer() {
     if (_thread.joinable()) {
         _queue_sp->stop();
+        /* writer may wait for credits */
+        _gate_sp->close();
         _thread.join();
     }
 }
 
 void Writer::run() {
     assert(!_thread.joinable());
-    _state = WriterState::RUNNING;
     _thread = std::thread(&Writer::mainFunc, this);
 }
 
 void Writer::mainFunc() {
+    if (_batch_size > 1) {
+        _mainFuncBulk();
+        return;
+    }
     auto prior = _priority;
     int localMsgNum = 0;
+    CreditWindow credits(_gate_sp);
     while (true) {
-        auto msg = _name + " string #" + std::to_string(localMsgNum++);
+        /* waits while queue has no room - put doesn't */
+        if (!credits.take()) {
+            /* gate closed - queue stopped */
+            break;
+        }
+        auto num = localMsgNum++;
         RetCode ret;
 
-        ret = _queue_sp->put(msg, prior);
+        /* bytes stay where they were written, queue takes the
+           buffer - we keep a reference only to trace it */
+        auto msg = _makeMessage(num);
+        bool trace = Logger::instance().enabled(LogLevel::Trace);
+        ret = trace ? _queue_sp->put(msg, prior) :
+            _queue_sp->put(std::move(msg), prior);
         
         if (ret == RetCode::OK) {
             ++gmsg_num;
-            logConsole(msg + "\n");
-        } else if (ret == RetCode::STOPPED) {
-            break;
+            if (trace) {
+                logTrace("{}", msg.view());
+            }
+        } else {
+            credits.giveBack(1);
+            if (ret == RetCode::STOPPED) {
+                break;
+            }
         }
     }
-    logConsole(_name + " detected queue stop\n");
+    logDebug("{} detected queue stop", _name);
 }
 
-void Writer::wakeAll() {
-    std::unique_lock<std::mutex> lock(_g_mtx);
-    _state = WriterState::RUNNING;
-    _g_notify.notify_all();
+void Writer::_mainFuncBulk() {
+    int localMsgNum = 0;
+    std::vector<MessageBuffer> msgs;
+    msgs.reserve(static_cast<size_t>(_batch_size));
+    CreditWindow credits(_gate_sp);
+    while (true) {
+        msgs.clear();
+        /* batch shrinks with credit grant near hwm */
+        int num = credits.take(_batch_size);
+        if (!num) {
+            break;
+        }
+        for (int i = 0; i != num; i++)
+            msgs.push_back(_makeMessage(localMsgNum++));
+        int put_num;
+        RetCode ret;
+        bool trace = Logger::instance().enabled(LogLevel::Trace);
+        if (trace) {
+            ret = _queue_sp->put_bulk(msgs.begin(), msgs.end(),
+                                      _priority, &put_num);
+        } else {
+            ret = _queue_sp->put_bulk(std::make_move_iterator(msgs.begin()),
+                                      std::make_move_iterator(msgs.end()),
+                                      _priority, &put_num);
+        }
+        gmsg_num += put_num;
+        if (put_num != num) {
+            credits.giveBack(num - put_num);
+        }
+        for (int i = 0; trace && i != put_num; i++)
+            logTrace("{}", msgs[static_cast<size_t>(i)].view());
+        
+        if (ret == RetCode::STOPPED) {
+            break;
+        }
+    }
+    logDebug("{} detected queue stop", _name);
 }
 
-void Writer::suspendAll() {
-    std::unique_lock<std::mutex> lock(_g_mtx);
-    _state = WriterState::SUSPENDED;
-    _g_notify.wait(lock, []() {
-            return _state == WriterState::RUNNING;
-        });
+MessageBuffer Writer::_makeMessage(int num) const {
+    /* written right into pool buffer */
+    auto msg = _pool_sp->acquire();
+    msg.append(_name);
+    msg.append(" string #");
+    char digits[16];
+    auto res = std::to_chars(digits, digits + sizeof(digits), num);
+    msg.append(std::string_view(digits,
+                                static_cast<size_t>(res.ptr - digits)));
+    return msg;
 }
 
 } // namespace zodiactest 
@@ -2,23 +2,34 @@
 #pragma once
 
 #include <atomic>
-#include <condition_variable>
 #include <memory>
-#include <mutex>
 #include <thread>
 #include <string>
 #include <vector>
 
+#include "flow_control.hpp"
+#include "message_buffer.hpp"
 #include "messagequeue.hpp"
 
 namespace zodiactest {
 
 class Writer {
-    using Queue = MessageQueue<std::string>;
 public:
+    /* priority is in [0, PRIORITIES), weighted round robin
+       keeps lower priorities from starving behind the top one */
+    static constexpr int PRIORITIES = 8;
+    using Queue = MessageQueue<MessageBuffer,
+                               PriorityLevels<PRIORITIES, WeightedFair>>;
+
+    /* messages are built in pool_sp buffers, every put takes
+       a credit of gate_sp; batch_size > 1 switches writer
+       to put_bulk() */
     Writer(int priority,
            const std::string& name, 
-           std::shared_ptr<Queue> queue_sp);
+           std::shared_ptr<Queue> queue_sp,
+           std::shared_ptr<BufferPool> pool_sp,
+           std::shared_ptr<CreditGate> gate_sp,
+           int batch_size = 1);
     
     Writer(const Writer&) = delete;
     Writer& operator=(const Writer&) = delete;
@@ -30,24 +41,18 @@ public:
     void run();
     void mainFunc();
 
-    static void wakeAll();
-    static void suspendAll();
-
     static std::atomic<int> gmsg_num;
 
 private:
-    enum class WriterState : int {
-        SUSPENDED = 0,
-        RUNNING
-    };
-    
-    static WriterState _state;
-    static std::mutex _g_mtx;
-    static std::condition_variable _g_notify;
+    void _mainFuncBulk();
+    MessageBuffer _makeMessage(int num) const;
 
     const int _priority;
+    const int _batch_size;
     const std::string _name;
     std::shared_ptr<Queue> _queue_sp;
+    std::shared_ptr<BufferPool> _pool_sp;
+    std::shared_ptr<CreditGate> _gate_sp;
     std::thread _thread;
 };
 